@@ -8,7 +8,23 @@
 
 #include "Api.h"
 #include "Settings.h"
+#include "FocusSearch.h"
+#include "CaptureSequence.h"
+#include "MsgPack.h"
+#include "CameraJobs.h"
+#include "CardIngest.h"
+#include "RawPreview.h"
+#include "ThumbnailIndex.h"
+#include "SpoolRetention.h"
+#include "WebSocketHub.h"
+#include "Spool.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
 
 using namespace CameraControllerApi;
 
@@ -16,54 +32,132 @@ Api::Api(CameraController *cc){
     this->_cc = cc;
 }
 
-bool Api::list_settings(CCA_API_OUTPUT_TYPE type, string &output){
+bool Api::list_settings(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "list_settings");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
    
-    ptree settings;
-    this->_cc->get_settings(settings);
-    Api::buildResponse(settings, type, CCA_API_RESPONSE_SUCCESS, output);
+    boost::shared_ptr<SettingsSnapshot> snapshot = this->_cc->settings_snapshot();
+    if(!snapshot){
+        ptree tree;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    CCA_CONTENT_ENCODING encoding = exchange.encoding;
+    exchange.response_headers["X-Settings-Version"] = boost::lexical_cast<string>(snapshot->version());
+    
+    map<string, string>::const_iterator it = exchange.request_headers.find("If-None-Match");
+    if(it != exchange.request_headers.end() && snapshot->matches(it->second)){
+        exchange.response_headers["ETag"] = snapshot->etag(encoding);
+        exchange.status = 304;
+        output.clear();
+        return true;
+    }
+    
+    if(encoding != CCA_ENCODING_IDENTITY && snapshot->body(type, encoding, output)){
+        exchange.response_headers["Content-Encoding"] = encoding_name(encoding);
+        exchange.response_headers["ETag"] = snapshot->etag(encoding);
+        return true;
+    }
+    
+    string plain;
+    if(!snapshot->body(type, CCA_ENCODING_IDENTITY, plain)){
+        Api::buildResponse(snapshot->tree(), type, CCA_API_RESPONSE_SUCCESS, plain);
+        snapshot->store_body(type, CCA_ENCODING_IDENTITY, plain);
+    }
+    
+    // compressed once per snapshot, so the best ratio is affordable
+    if(encoding != CCA_ENCODING_IDENTITY && compress_body(plain, encoding, 9, output)){
+        snapshot->store_body(type, encoding, output);
+        exchange.response_headers["Content-Encoding"] = encoding_name(encoding);
+        exchange.response_headers["ETag"] = snapshot->etag(encoding);
+    } else {
+        output = plain;
+        exchange.response_headers["ETag"] = snapshot->etag(CCA_ENCODING_IDENTITY);
+    }
+    return true;
+}
+
+bool Api::list_index(CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "list_index");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    
+    ptree index;
+    this->_cc->settings_index(index);
+    Api::buildResponse(index, type, CCA_API_RESPONSE_SUCCESS, output);
     return true;
 }
 
 bool Api::set_focus_point(string focus_point, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_focus_point");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
-    return this->_set_settings_value("d108", focus_point, type, output);
+    return this->_set_settings_value("focus_point", focus_point, type, output);
 }
 
 bool Api::set_aperture(string aperture, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_aperture");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
-    return this->_set_settings_value("f-number", aperture, type, output);
+    return this->_set_settings_value("aperture", aperture, type, output);
 }
 
 bool Api::set_speed(string speed, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_speed");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
-    return this->_set_settings_value("shutterspeed2", speed, type, output);
+    return this->_set_settings_value("speed", speed, type, output);
 }
 
 bool Api::set_iso(string iso, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_iso");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
     return this->_set_settings_value("iso", iso, type, output);
 }
 
+bool Api::set_focus_mode(string mode, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_focus_mode");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    return this->_set_settings_value("focus_mode", mode, type, output);
+}
+
 bool Api::set_whitebalance(string wb, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "set_whitebalance");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
     return this->_set_settings_value("whitebalance", wb, type, output);
 }
 
 bool Api::shot(CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "shot");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
     ptree tree;
     string image;
@@ -80,6 +174,7 @@ bool Api::shot(CCA_API_OUTPUT_TYPE type, string &output){
 }
 
 bool Api::liveview(CCA_API_LIVEVIEW_MODES mode, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "liveview");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
     
@@ -103,7 +198,10 @@ bool Api::liveview(CCA_API_LIVEVIEW_MODES mode, CCA_API_OUTPUT_TYPE type, string
     } else {
         int ret = this->_cc->liveview_stop();
         if(ret){
+            ptree preview;
+            this->_cc->preview_stats(preview);
             tree.put("stop", "success");
+            tree.put_child("preview", preview);
             Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
             
         } else {
@@ -116,9 +214,58 @@ bool Api::liveview(CCA_API_LIVEVIEW_MODES mode, CCA_API_OUTPUT_TYPE type, string
     return true;
 }
 
+bool Api::liveview_analysis(CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "liveview_analysis");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    
+    ptree tree;
+    if(this->_cc->preview_analysis(tree)){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    } else {
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_NOT_AVAILABLE, output);
+    }
+    
+    return true;
+}
+
+/*
+ * Starts or stops recording the liveview to the spool, status returns the
+ * counters. The frames come from the running liveview, start does not
+ * start it.
+ */
+bool Api::record(string action, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "record");
+    ptree tree, stats;
+    if(action == "start"){
+        if(this->_cc->camera_found() == false)
+            return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+        string file;
+        if(!this->_cc->record_start(file)){
+            this->_cc->record_stats(stats);
+            tree.put_child("record", stats);
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_BUSY, output);
+            return false;
+        }
+    } else if(action == "stop"){
+        this->_cc->record_stop();
+    } else if(action != "status" && !action.empty()){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    
+    this->_cc->record_stats(stats);
+    tree.put_child("record", stats);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
 bool Api::burst(int number_of_images, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "burst");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
     
     int ret = 0;
     ptree tree, images;
@@ -143,18 +290,576 @@ bool Api::burst(int number_of_images, CCA_API_OUTPUT_TYPE type, string &output){
     return true;
 }
 
-bool Api::autofocus(CCA_API_OUTPUT_TYPE type, string &output){
+/*
+ * Queues a shot on the camera worker and returns the job id right away,
+ * the result is fetched from /jobs?id=.
+ */
+bool Api::shot_async(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "shot_async");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    
+    return this->_submit_job(new ShotJob(this->_cc), type, exchange, output);
+}
+
+/*
+ * Takes a picture and sends it as the raw image while it is downloaded
+ * (see DownloadStream) instead of waiting for the whole file and answering
+ * with base64.
+ */
+bool Api::shot_stream(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "shot_stream");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    DownloadStream *stream = this->_new_stream();
+    if(!stream->start_capture()){
+        stream->release();
+        ptree tree;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    return this->_stream(stream, type, exchange, output);
+}
+
+/*
+ * Takes a picture and answers with the JPEG the camera embedded in the RAW
+ * instead of the whole file. The RAW is written to the spool, its name is
+ * in X-Spool-File. A JPEG shot is answered as it is.
+ */
+bool Api::shot_preview(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "shot_preview");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    ptree tree;
+    CameraFilePath path;
+    CameraFile *file = NULL;
+    const char *data = NULL;
+    unsigned long size = 0;
+    int ret = this->_cc->capture_file(&path);
+    if(ret == GP_OK)
+        ret = gp_file_new(&file);
+    if(ret == GP_OK)
+        ret = this->_cc->download(path, file, true);
+    if(ret == GP_OK)
+        ret = gp_file_get_data_and_size(file, &data, &size);
+    if(ret < GP_OK){
+        if(file != NULL)
+            gp_file_unref(file);
+        tree.put("error", ret);
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    char name[256];
+    snprintf(name, sizeof(name), "shot-%ld-%s", (long)time(NULL), path.name);
+    string written, jpeg;
+    bool spooled = CaptureSpool::getInstance()->write(name, data, size, written);
+    bool found = RawPreview::getInstance()->extract(name, data, size, jpeg);
+    gp_file_unref(file);
+    
+    if(spooled)
+        exchange.response_headers["X-Spool-File"] = name;
+    if(!found){
+        if(spooled)
+            tree.put("file", written);
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_NOT_SUPPORTED, output);
+        return false;
+    }
+    return this->_preview(name, size, jpeg, exchange, output);
+}
+
+/*
+ * The embedded JPEG of a RAW on the card (with folder) or in the spool
+ * (without). A card file which was ingested is read from the spool copy,
+ * otherwise it is downloaded once; after that the preview comes from the
+ * cache.
+ */
+bool Api::file_preview(string folder, string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "file_preview");
+    ptree tree;
+    CameraFilePath path;
+    if(name.empty() || name[0] == '.' || name.find('/') != string::npos || name.size() >= sizeof(path.name) ||
+       (!folder.empty() && (folder[0] != '/' || folder.size() >= sizeof(path.folder)))){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    
+    RawPreview *preview = RawPreview::getInstance();
+    const string &spool = CaptureSpool::getInstance()->directory();
+    struct stat st;
+    string jpeg;
+    
+    if(folder.empty()){
+        string file = spool + "/" + name;
+        if(stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)){
+            exchange.status = 404;
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+            return false;
+        }
+        SpoolRetention::touched(name);
+        if(preview->cached(name, st.st_size, jpeg) || preview->extract_file(name, file, jpeg))
+            return this->_preview(name, st.st_size, jpeg, exchange, output);
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_NOT_SUPPORTED, output);
+        return false;
+    }
+    
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    strcpy(path.folder, folder.c_str());
+    strcpy(path.name, name.c_str());
+    unsigned long size = 0;
+    time_t mtime = 0;
+    int ret = this->_cc->file_info(path, size, mtime);
+    if(ret < GP_OK){
+        tree.put("error", ret);
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    // the size tells a file apart from the one of the same name on the last card
+    string key = CaptureSpool::card_name(folder, name);
+    if(preview->cached(key, size, jpeg))
+        return this->_preview(name, size, jpeg, exchange, output);
+    
+    string copy = spool + "/" + key;
+    if(stat(copy.c_str(), &st) == 0 && (unsigned long)st.st_size == size){
+        SpoolRetention::touched(key);
+        if(preview->extract_file(key, copy, jpeg))
+            return this->_preview(name, size, jpeg, exchange, output);
+    } else {
+        CameraFile *file = NULL;
+        const char *data = NULL;
+        unsigned long downloaded = 0;
+        ret = gp_file_new(&file);
+        if(ret == GP_OK)
+            ret = this->_cc->download(path, file, false);
+        if(ret == GP_OK)
+            ret = gp_file_get_data_and_size(file, &data, &downloaded);
+        bool found = (ret == GP_OK && preview->extract(key, data, downloaded, jpeg));
+        if(file != NULL)
+            gp_file_unref(file);
+        if(found)
+            return this->_preview(name, downloaded, jpeg, exchange, output);
+        if(ret < GP_OK){
+            tree.put("error", ret);
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+            return false;
+        }
+    }
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_NOT_SUPPORTED, output);
+    return false;
+}
+
+/*
+ * Streams a file from the card, e.g. /fs?action=get&folder=/DCIM/100CANON&value=IMG_0001.JPG
+ */
+bool Api::get_file(string folder, string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "get_file");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    CameraFilePath path;
+    if(folder.empty() || folder[0] != '/' || folder.size() >= sizeof(path.folder) ||
+       name.empty() || name.find('/') != string::npos || name.size() >= sizeof(path.name)){
+        ptree tree;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    strcpy(path.folder, folder.c_str());
+    strcpy(path.name, name.c_str());
+    
+    DownloadStream *stream = this->_new_stream();
+    if(!stream->start(path, false)){
+        stream->release();
+        ptree tree;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    return this->_stream(stream, type, exchange, output);
+}
+
+// "/DCIM/100CANON/" and "/DCIM/100CANON" are the same folder
+static bool card_folder(string &folder){
+    while(folder.size() > 1 && folder[folder.size() - 1] == '/')
+        folder.erase(folder.size() - 1);
+    return folder.empty() || folder[0] == '/';
+}
+
+/*
+ * Lists the files on the card below folder from the card index, e.g.
+ * /fs?action=list&folder=/store_00010001/DCIM. refresh walks the card again.
+ */
+bool Api::list_files(string folder, bool refresh, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "list_files");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    ptree tree;
+    if(!card_folder(folder)){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    
+    vector<CardFile> files;
+    if(this->_cc->card_files(folder, refresh, files) < GP_OK){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    ptree list, card;
+    unsigned long bytes = 0;
+    for(size_t i = 0; i < files.size(); i++){
+        ptree file;
+        file.put("folder", files[i].folder);
+        file.put("name", files[i].name);
+        file.put("size", files[i].size);
+        file.put("mtime", (long)files[i].mtime);
+        list.push_back(std::make_pair("", file));
+        bytes += files[i].size;
+    }
+    this->_cc->card_stats(card);
+    tree.put("folder", folder.empty() ? "/" : folder);
+    tree.put("count", files.size());
+    tree.put("bytes", bytes);
+    tree.add_child("files", list);
+    tree.add_child("index", card);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+/*
+ * The images in the spool with their EXIF basics and thumbnail sizes, from
+ * the thumbnail index. offset and limit page through it.
+ */
+bool Api::list_thumbnails(string offset, string limit, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "list_thumbnails");
+    ptree tree, files, index;
+    unsigned long from = strtoul(offset.c_str(), NULL, 10);
+    ThumbnailIndex *thumbs = ThumbnailIndex::getInstance();
+    unsigned long count = thumbs->list(files, from, strtoul(limit.c_str(), NULL, 10));
+    thumbs->stats(index);
+    tree.put("count", count);
+    tree.put("offset", from);
+    tree.add_child("files", files);
+    tree.add_child("index", index);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+bool Api::get_thumbnail(string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "get_thumbnail");
+    ptree tree;
+    string jpeg;
+    if(!ThumbnailIndex::getInstance()->thumbnail(name, jpeg)){
+        // not in the spool, not an image or not indexed yet
+        exchange.status = 404;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    string base = name.find('.') != string::npos ? name.substr(0, name.rfind('.')) : name;
+    exchange.response_headers["Content-Type"] = "image/jpeg";
+    exchange.response_headers["Content-Disposition"] = "inline;filename=\"" + base + ".jpg\"";
+    output.swap(jpeg);
+    return true;
+}
+
+/*
+ * Copies the card (or folder) to the spool in the background, see
+ * CardIngest. start answers with the progress at once, status and stop
+ * work on the running ingest.
+ */
+bool Api::ingest(string action, string folder, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "ingest");
+    ptree tree;
+    CardIngest *ingest = CardIngest::getInstance();
+    
+    if(action == "start"){
+        if(this->_cc->camera_found() == false)
+            return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+        if(this->_cc->exposing())
+            return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+        if(!card_folder(folder)){
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+            return false;
+        }
+        if(!ingest->start(this->_cc, folder)){
+            exchange.status = 409;
+            ingest->status(tree);
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_BUSY, output);
+            return false;
+        }
+        exchange.status = 202;
+    } else if(action == "stop"){
+        ingest->stop();
+    }
+    
+    exchange.response_headers["Cache-Control"] = "no-store";
+    ingest->status(tree);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+/*
+ * Bulb exposures always run as a job, the HTTP thread only queues them.
+ */
+bool Api::bulb(string seconds, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "bulb");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    
+    double value = atof(seconds.c_str());
+    if(value <= 0 || value > 3600){
+        ptree tree;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+        return false;
+    }
+    
+    return this->_submit_job(new BulbJob(this->_cc, value), type, exchange, output);
+}
+
+bool Api::job_status(string id, string wait_ms, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "job_status");
+    ptree tree;
+    int response = 0;
+    unsigned long job_id = strtoul(id.c_str(), NULL, 10);
+    if(job_id == 0 || !JobQueue::getInstance()->status(job_id, atoi(wait_ms.c_str()), tree, response)){
+        exchange.status = 404;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_UNKNOWN_JOB, output);
+        return false;
+    }
+    
+    if(response < 0){
+        string message;
+        Api::errorMessage((CCA_API_RESPONSE)response, message);
+        tree.put("message", message);
+    }
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+bool Api::job_list(CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "job_list");
+    ptree tree;
+    JobQueue::getInstance()->stats(tree);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+/*
+ * Checks a POSTed script (see CommandScript) and for action=run queues it
+ * as one job. A script which does not pass is answered with 400 and where
+ * it is wrong; action=validate only answers how many steps, captures and
+ * milliseconds of waiting it has.
+ */
+bool Api::script(string action, const string &body, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "script");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    
+    ptree tree;
+    string error;
+    CommandScript *script = new CommandScript();
+    if(!script->parse(body, this->_cc, error)){
+        delete script;
+        exchange.status = 400;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output, error);
+        return false;
+    }
+    
+    if(action.compare("validate") == 0){
+        script->describe(tree);
+        delete script;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+        return true;
+    }
+    return this->_submit_job(new ScriptJob(this->_cc, script), type, exchange, output);
+}
+
+/*
+ * Readiness for load balancers and start scripts: 200 once a camera is
+ * connected, 503 while it is being probed or is gone. The body says which,
+ * with the connection, probe, job and logger counters.
+ */
+bool Api::health(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    TraceSpan span("api", "health");
+    ptree tree, camera, jobs, log, preview, retention, websocket, trace;
+    bool ready = this->_cc->camera_found();
+    this->_cc->connection_stats(camera);
+    JobQueue::getInstance()->stats(jobs);
+    Logger::getInstance()->stats(log);
+    RawPreview::getInstance()->stats(preview);
+    SpoolRetention::getInstance()->stats(retention);
+    WebSocketHub::stats(websocket);
+    Tracer::getInstance()->stats(trace);
+    
+    tree.put("ready", ready);
+    tree.put("uptime_ms", this->_uptime.elapsed_ms());
+    tree.add_child("camera", camera);
+    tree.add_child("jobs", jobs);
+    tree.add_child("log", log);
+    tree.add_child("raw_preview", preview);
+    tree.add_child("retention", retention);
+    tree.add_child("websocket", websocket);
+    tree.add_child("trace", trace);
+    
+    exchange.response_headers["Cache-Control"] = "no-store";
+    if(!ready){
+        exchange.status = 503;
+        exchange.response_headers["Retry-After"] = "1";
+    }
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return ready;
+}
+
+/*
+ * action=dump answers the spans of every thread in the Chrome trace event
+ * format, as JSON whatever the type, for chrome://tracing or Perfetto.
+ * start, stop and clear switch the recording and answer its counters.
+ */
+bool Api::trace(string action, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    Tracer *tracer = Tracer::getInstance();
+    exchange.response_headers["Cache-Control"] = "no-store";
+    if(action.compare("dump") == 0){
+        tracer->dump(output);
+        exchange.response_headers["Content-Type"] = "application/json";
+        exchange.response_headers["Content-Disposition"] = "attachment;filename=\"cca-trace.json\"";
+        return true;
+    }
+    
+    if(action.compare("start") == 0)
+        tracer->start();
+    else if(action.compare("stop") == 0)
+        tracer->stop();
+    else if(action.compare("clear") == 0)
+        tracer->clear();
+    
+    ptree tree;
+    tracer->stats(tree);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+bool Api::autofocus(string mode, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "autofocus");
     if(this->_cc->camera_found() == false)
         return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    if(mode == "search"){
+        string scale, max_steps, settle;
+        Settings *sett = Settings::getInstance();
+        sett->get_value("focus.scale", scale);
+        sett->get_value("focus.max_steps", max_steps);
+        sett->get_value("focus.settle_frames", settle);
+        
+        ptree tree;
+        FocusSearch search(this->_cc, atoi(scale.c_str()), atoi(max_steps.c_str()), atoi(settle.c_str()));
+        if(search.run(tree))
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+        else
+            Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return true;
+    }
     
     string value;
-    this->_cc->get_settings_value("autofocusdrive", (void *)&value);
-    if(value.empty()){
-        int val = atoi(value.c_str());
-        val++;
-        value = boost::lexical_cast<string>(val);
+    this->_cc->get_setting("autofocus", value);
+    this->_set_settings_value("autofocus", value == "1" ? "0" : "1", type, output);
+    return true;
+}
+
+bool Api::manualfocus(string step, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "manualfocus");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    ptree tree;
+    int value = atoi(step.c_str());
+    int ret = this->_cc->focus_begin();
+    if(ret >= GP_OK){
+        ret = this->_cc->focus_step(value);
+        this->_cc->focus_end();
+    }
+    
+    if(ret >= GP_OK){
+        tree.put("step", value);
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    } else {
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
     }
-    this->_set_settings_value("autofocusdrive", value, type, output);
+    return true;
+}
+
+bool Api::focus_stack(int shots, int step, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "focus_stack");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    ptree tree;
+    if(shots < 1 || shots > 200 || step == 0 || step < -3 || step > 3){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    FocusBracketSequence sequence(this->_cc, CaptureSpool::getInstance(), step);
+    if(sequence.run(shots, tree))
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    else
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+    return true;
+}
+
+bool Api::bracket(string offsets, CCA_API_OUTPUT_TYPE type, string &output){
+    TraceSpan span("api", "bracket");
+    if(this->_cc->camera_found() == false)
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_CAMERA_NOT_FOUND,type, output);
+    if(this->_cc->exposing())
+        return this->_buildCameraNotFound(CCA_API_RESPONSE_EXPOSING, type, output);
+    
+    ptree tree;
+    vector<string> parts;
+    vector<double> values;
+    boost::split(parts, offsets, boost::is_any_of(","));
+    for(size_t i = 0; i < parts.size(); i++){
+        try {
+            values.push_back(boost::lexical_cast<double>(boost::trim_copy(parts[i])));
+        } catch (boost::bad_lexical_cast const &e) {
+            values.clear();
+            break;
+        }
+        if(values.back() < -10 || values.back() > 10){
+            values.clear();
+            break;
+        }
+    }
+    
+    if(values.empty() || values.size() > 15){
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    ExposureBracketSequence sequence(this->_cc, CaptureSpool::getInstance(), values);
+    if(sequence.run((int)values.size(), tree))
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    else
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
     return true;
 }
 
@@ -164,7 +869,12 @@ bool Api::_buildCameraNotFound(CCA_API_RESPONSE resp, CCA_API_OUTPUT_TYPE type,
     return false;
 }
 
-void Api::buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE resp, string &output){    
+/*
+ * detail goes with a failure only, for errors a message id can not
+ * describe (where a script is wrong).
+ */
+void Api::buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE resp, string &output, const string &detail){    
+    TraceSpan span("api", "buildResponse");
     try{
         boost::property_tree::ptree root;
         std::stringstream ss;
@@ -173,6 +883,8 @@ void Api::buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE r
             string message;
             Api::errorMessage(resp, message);
             root.put("cca_response.message", message);
+            if(!detail.empty())
+                root.put("cca_response.detail", detail);
         } else {                        
             root.put("cca_response.state", "success");
             string message;
@@ -184,23 +896,99 @@ void Api::buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE r
             boost::property_tree::write_json(ss, root);
         } else if(type == CCA_OUTPUT_TYPE_XML){
             boost::property_tree::write_xml(ss, root);
+        } else if(type == CCA_OUTPUT_TYPE_MSGPACK){
+            output.clear();
+            write_msgpack(output, root);
+            return;
         }
         
         output = ss.str();
     } catch(std::exception &e){
-        std::cout<<"Error: " << e.what();
+        Logger::getInstance()->log(CCA_LOG_ERROR, "api", "op=build_response error=\"%s\"", e.what());
     }
 }
 
 bool Api::_set_settings_value(string key, string value, CCA_API_OUTPUT_TYPE type, string &output){
     ptree tree;
-    int ret = this->_cc->set_settings_value(key.c_str(), value.c_str());
-    if(ret)
+    int ret = this->_cc->set_setting(key, value);
+    if(ret >= GP_OK)
         Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    else if(ret == GP_ERROR_BAD_PARAMETERS)
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID_VALUE, output);
+    else if(ret == GP_ERROR_NOT_SUPPORTED)
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_NOT_SUPPORTED, output);
     else
         Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
     
-    return ret;
+    return ret >= GP_OK;
+}
+
+bool Api::_submit_job(Job *job, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    ptree tree;
+    unsigned long id = JobQueue::getInstance()->submit(job);
+    if(id == 0){
+        exchange.status = 503;
+        exchange.response_headers["Retry-After"] = "1";
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_BUSY, output);
+        return false;
+    }
+    
+    string location = "/jobs?id=" + boost::lexical_cast<string>(id);
+    exchange.status = 202;
+    exchange.response_headers["Location"] = location;
+    tree.put("id", id);
+    tree.put("location", location);
+    Api::buildResponse(tree, type, CCA_API_RESPONSE_SUCCESS, output);
+    return true;
+}
+
+bool Api::_preview(const string &name, unsigned long raw_size, string &jpeg, HttpExchange &exchange, string &output){
+    string base = name.find('.') != string::npos ? name.substr(0, name.rfind('.')) : name;
+    exchange.response_headers["Content-Type"] = "image/jpeg";
+    exchange.response_headers["Content-Disposition"] = "inline;filename=\"" + base + ".jpg\"";
+    exchange.response_headers["X-Raw-Size"] = boost::lexical_cast<string>(raw_size);
+    output.swap(jpeg);
+    return true;
+}
+
+DownloadStream* Api::_new_stream(){
+    string chunks, timeout;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("stream.max_chunks", chunks);
+    sett->get_value("stream.timeout_ms", timeout);
+    return new DownloadStream(this->_cc, atoi(chunks.c_str()), atoi(timeout.c_str()));
+}
+
+/*
+ * Answers with the stream once its first block has arrived. Until then a
+ * failure (no file, camera gone) still gets the normal error response.
+ */
+bool Api::_stream(DownloadStream *stream, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output){
+    int ret = stream->wait_started();
+    if(ret < GP_OK){
+        stream->release();
+        ptree tree;
+        tree.put("error", ret);
+        if(ret == GP_ERROR_TIMEOUT)
+            exchange.status = 504;
+        Api::buildResponse(tree, type, CCA_API_RESPONSE_INVALID, output);
+        return false;
+    }
+    
+    string name = stream->name();
+    string extension = name.find('.') != string::npos ? boost::to_lower_copy(name.substr(name.rfind('.') + 1)) : "";
+    if(extension == "jpg" || extension == "jpeg")
+        exchange.response_headers["Content-Type"] = "image/jpeg";
+    else if(extension == "cr2")
+        exchange.response_headers["Content-Type"] = "image/x-canon-cr2";
+    else if(extension == "nef")
+        exchange.response_headers["Content-Type"] = "image/x-nikon-nef";
+    else
+        exchange.response_headers["Content-Type"] = "application/octet-stream";
+    exchange.response_headers["Content-Disposition"] = "attachment;filename=\"" + name + "\"";
+    exchange.stream = stream;
+    output.clear();
+    return true;
 }
 
 void Api::errorMessage(CCA_API_RESPONSE errnr, string &message){
@@ -221,6 +1009,6 @@ void Api::errorMessage(CCA_API_RESPONSE errnr, string &message){
         }
         message = pt.get<std::string>("CCA.errors", 0);
     } catch (std::exception const &e) {
-        std::cout<<"Error: " << e.what();
+        Logger::getInstance()->log(CCA_LOG_ERROR, "api", "op=error_message id=%d error=\"%s\"", (int)errnr, e.what());
     }
 }
\ No newline at end of file
@@ -10,6 +10,10 @@
 #define __CameraControllerApi__Api__
 
 #include "CameraController.h"
+#include "Compress.h"
+#include "JobQueue.h"
+#include "Stopwatch.h"
+#include "DownloadStream.h"
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -34,6 +38,12 @@ namespace CameraControllerApi {
     } CCA_API_LIVEVIEW_MODES;
     
     typedef enum {
+        CCA_API_RESPONSE_EXPOSING = -8,
+        CCA_API_RESPONSE_UNKNOWN_JOB = -7,
+        CCA_API_RESPONSE_BUSY = -6,
+        CCA_API_RESPONSE_NOT_SUPPORTED = -5,
+        CCA_API_RESPONSE_INVALID_VALUE = -4,
+        CCA_API_RESPONSE_NOT_AVAILABLE = -3,
         CCA_API_RESPONSE_CAMERA_NOT_FOUND = -2,
         CCA_API_RESPONSE_INVALID = -1,
         CCA_API_RESPONSE_SUCCESS = 1
@@ -41,28 +51,75 @@ namespace CameraControllerApi {
     
     typedef enum {
         CCA_OUTPUT_TYPE_XML,
-        CCA_OUTPUT_TYPE_JSON
+        CCA_OUTPUT_TYPE_JSON,
+        CCA_OUTPUT_TYPE_MSGPACK
     } CCA_API_OUTPUT_TYPE;
     
+    /*
+     * The HTTP side of a call: the request headers the server passes in and
+     * the status and headers a command wants on its response. A status of 0
+     * is a plain 200. encoding is what the client accepts; a command which
+     * sets Content-Encoding itself has compressed the body already. A command
+     * which sets stream hands its reference to the server, which sends the
+     * stream instead of the output. request_body is the body of a POST.
+     */
+    struct HttpExchange {
+        map<string, string> request_headers;
+        string request_body;
+        map<string, string> response_headers;
+        unsigned int status;
+        CCA_CONTENT_ENCODING encoding;
+        DownloadStream *stream;
+        
+        HttpExchange() : status(0), encoding(CCA_ENCODING_IDENTITY), stream(NULL) {}
+    };
+    
     class Api {
     private:
         CameraController *_cc;
+        Stopwatch _uptime;
         bool _buildCameraNotFound(CCA_API_RESPONSE resp, CCA_API_OUTPUT_TYPE type, string &output);
         bool _set_settings_value(string key, string value, CCA_API_OUTPUT_TYPE type, string &output);
+        bool _submit_job(Job *job, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool _stream(DownloadStream *stream, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        DownloadStream* _new_stream();
+        bool _preview(const string &name, unsigned long raw_size, string &jpeg, HttpExchange &exchange, string &output);
     public:
         Api(CameraController *cc);
-        static void buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE resp, string &output);
+        static void buildResponse(ptree data, CCA_API_OUTPUT_TYPE type, CCA_API_RESPONSE resp, string &output, const string &detail = string());
         static void errorMessage(CCA_API_RESPONSE errnr, string &message);        
-        bool list_settings(CCA_API_OUTPUT_TYPE type, string &output);
+        bool list_settings(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool list_index(CCA_API_OUTPUT_TYPE type, string &output);
         bool set_focus_point(string focus_point, CCA_API_OUTPUT_TYPE type, string &output);
         bool set_aperture(string aperture, CCA_API_OUTPUT_TYPE type, string &output);
         bool set_speed(string speed, CCA_API_OUTPUT_TYPE type, string &output);
         bool set_iso(string iso, CCA_API_OUTPUT_TYPE type, string &output);
         bool set_whitebalance(string wb, CCA_API_OUTPUT_TYPE type, string &output);
+        bool set_focus_mode(string mode, CCA_API_OUTPUT_TYPE type, string &output);
         bool shot(CCA_API_OUTPUT_TYPE type, string &output);
-        bool autofocus(CCA_API_OUTPUT_TYPE type, string &output);
+        bool shot_async(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool shot_stream(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool shot_preview(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool file_preview(string folder, string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool get_file(string folder, string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool list_files(string folder, bool refresh, CCA_API_OUTPUT_TYPE type, string &output);
+        bool list_thumbnails(string offset, string limit, CCA_API_OUTPUT_TYPE type, string &output);
+        bool get_thumbnail(string name, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool ingest(string action, string folder, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool bulb(string seconds, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool job_status(string id, string wait_ms, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool job_list(CCA_API_OUTPUT_TYPE type, string &output);
+        bool script(string action, const string &body, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool health(CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool trace(string action, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &output);
+        bool autofocus(string mode, CCA_API_OUTPUT_TYPE type, string &output);
+        bool manualfocus(string step, CCA_API_OUTPUT_TYPE type, string &output);
+        bool focus_stack(int shots, int step, CCA_API_OUTPUT_TYPE type, string &output);
+        bool bracket(string offsets, CCA_API_OUTPUT_TYPE type, string &output);
         bool burst(int number_of_images, CCA_API_OUTPUT_TYPE type, string &output);
         bool liveview(CCA_API_LIVEVIEW_MODES mode, CCA_API_OUTPUT_TYPE type, string &output);        
+        bool liveview_analysis(CCA_API_OUTPUT_TYPE type, string &output);
+        bool record(string action, CCA_API_OUTPUT_TYPE type, string &output);
     };
 }
 
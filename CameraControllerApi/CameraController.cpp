@@ -9,12 +9,24 @@
 #include "CameraController.h"
 #include "Settings.h"
 #include "Base64.h"
+#include "FrameHash.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include "Spool.h"
+#include "WebSocketHub.h"
+#include "Tracer.h"
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/asio.hpp>
 
@@ -40,7 +52,6 @@ CameraController* CameraController::getInstance(){
 
 void CameraController::release(){
     if(_instance != NULL){
-        gp_camera_exit(_instance->_camera, _instance->_ctx);
         delete _instance;
     }
     
@@ -50,29 +61,271 @@ void CameraController::release(){
 
 
 CameraController::CameraController(){
-    if(!this->_camera_found){        
-        this->_init_camera();
+    // recursive, a focus search holds the camera across several calls
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&this->_camera_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    this->_camera = NULL;
+    this->_camera_found = false;
+    this->_is_initialized = false;
+    this->_session_config = NULL;
+    this->_session_depth = 0;
+    this->_focus_widget = NULL;
+    this->_snapshot_version = 0;
+    this->_snapshot_dirty = true;
+    this->_running_process = false;
+    this->_exposing = false;
+    this->_liveview_threads = 0;
+    pthread_mutex_init(&this->_liveview_lock, NULL);
+    pthread_cond_init(&this->_liveview_cond, NULL);
+
+    string frames, bytes, dedup;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("preview.pool_frames", frames);
+    sett->get_value("preview.pool_max_bytes", bytes);
+    sett->get_value("preview.deduplicate", dedup);
+    this->_preview_pool = new PreviewPool(atoi(frames.c_str()), strtoul(bytes.c_str(), NULL, 10));
+    this->_deduplicate = (dedup == "true");
+    this->_frames_sent = 0;
+    this->_frames_skipped = 0;
+    this->_bytes_saved = 0;
+
+    string ttl;
+    sett->get_value("snapshot.ttl_ms", ttl);
+    this->_snapshot_ttl_ms = atof(ttl.c_str());
+
+    string analysis, workers, scale, metadata;
+    sett->get_value("preview.analysis.enabled", analysis);
+    sett->get_value("preview.analysis.workers", workers);
+    sett->get_value("preview.analysis.scale", scale);
+    sett->get_value("preview.analysis.metadata", metadata);
+    this->_analyzer = NULL;
+    this->_analysis_metadata = false;
+    if(analysis == "true"){
+        this->_analyzer = new FrameAnalyzer(this->_preview_pool, atoi(workers.c_str()), atoi(scale.c_str()));
+        this->_analysis_metadata = (metadata == "true");
     }
-}
 
-void CameraController::_init_camera(){
-    gp_camera_new(&this->_camera);
+    string shm, shm_name, shm_slots, shm_bytes;
+    sett->get_value("preview.shm.enabled", shm);
+    sett->get_value("preview.shm.name", shm_name);
+    sett->get_value("preview.shm.slots", shm_slots);
+    sett->get_value("preview.shm.slot_bytes", shm_bytes);
+    this->_ring = NULL;
+    if(shm == "true"){
+        this->_ring = new FrameRing(shm_name, atoi(shm_slots.c_str()), strtoul(shm_bytes.c_str(), NULL, 10));
+        if(!this->_ring->open()){
+            Logger::getInstance()->log(CCA_LOG_ERROR, "liveview", "op=shm_open name=%s errno=%d", this->_ring->name().c_str(), errno);
+            delete this->_ring;
+            this->_ring = NULL;
+        }
+    }
+
+    this->_recorder = new LiveviewRecorder(CaptureSpool::getInstance()->directory());
+
+    string min_ms, max_ms;
+    sett->get_value("camera.reconnect_min_ms", min_ms);
+    sett->get_value("camera.reconnect_max_ms", max_ms);
+    this->_reconnect_min_ms = atoi(min_ms.c_str()) > 0 ? atoi(min_ms.c_str()) : 250;
+    this->_reconnect_max_ms = atoi(max_ms.c_str()) > this->_reconnect_min_ms ? atoi(max_ms.c_str()) : this->_reconnect_min_ms * 32;
+    this->_connects = 0;
+    this->_disconnects = 0;
+    this->_attempts = 0;
+    this->_last_error = GP_OK;
+    this->_probed = false;
+
+    string cache_file, probe_threads;
+    sett->get_value("camera.cache_file", cache_file);
+    sett->get_value("camera.probe_threads", probe_threads);
+    this->_probe = new CameraProbe(cache_file, atoi(probe_threads.c_str()));
+
     this->_ctx = gp_context_new();
     gp_context_set_error_func(this->_ctx, (GPContextErrorFunc)CameraController::_error_callback, NULL);
     gp_context_set_message_func(this->_ctx, (GPContextMessageFunc)CameraController::_message_callback, NULL);
-    
-    int ret = gp_camera_init(this->_camera, this->_ctx);
+
+    // the camera is opened by the supervisor's first pass, so the server
+    // can answer (with "Camera not found" and /health) while it is probing
+    this->_is_initialized = true;
+
+    pthread_mutex_init(&this->_supervisor_lock, NULL);
+    pthread_cond_init(&this->_supervisor_cond, NULL);
+    this->_supervising = true;
+    this->_supervisor_started = (0 == pthread_create(&this->_supervisor, NULL, CameraController::_supervise, this));
+}
+
+/*
+ * Connects to the first camera the probe finds. Called from the supervisor
+ * without the camera lock, which is only taken to install the camera once it
+ * is open; until then the other calls fail fast instead of waiting for the
+ * probe.
+ */
+int CameraController::_init_camera(){
+    this->_attempts++;
+    Camera *camera = NULL;
+    int ret = this->_probe->open(this->_ctx, &camera);
+    this->_probed = true;
     if(ret < GP_OK){
-        gp_camera_free(this->_camera);
-    } else {
-        this->_camera_found = true;
+        this->_last_error = ret;
+        return ret;
     }
-    this->_is_initialized = true;
+    
+    ScopedLock lock(&this->_camera_lock);
+    this->_camera = camera;
+    this->_index.build(this->_camera, this->_ctx);
+    this->_snapshot.reset();
+    this->_snapshot_dirty = true;
+    this->_connects++;
+    this->_connected.restart();
+    this->_camera_found = true;
+    Logger::getInstance()->log(CCA_LOG_INFO, "camera", "op=connect attempts=%lu", this->_attempts);
+    WebSocketHub::camera(true);
+    return GP_OK;
+}
+
+void CameraController::_teardown_camera(){
+    this->_camera_found = false;
+    if(this->_camera == NULL)
+        return;
+    
+    {
+        TraceSpan span("gphoto", "gp_camera_exit");
+        gp_camera_exit(this->_camera, this->_ctx);
+    }
+    gp_camera_unref(this->_camera);
+    this->_camera = NULL;
+    // the card may have been swapped while the camera was away
+    this->_card.clear();
+    this->_snapshot.reset();
+    this->_snapshot_dirty = true;
+}
+
+/*
+ * Whether a call may go to the camera, with the camera lock held. While a
+ * bulb exposure has the shutter open (see bulb()) every other call gets
+ * GP_ERROR_CAMERA_BUSY at once: EOS bodies refuse it or end the exposure.
+ */
+int CameraController::_ready(){
+    if(this->_camera == NULL)
+        return GP_ERROR_MODEL_NOT_FOUND;
+    if(this->_exposing)
+        return GP_ERROR_CAMERA_BUSY;
+    return GP_OK;
+}
+
+/*
+ * Errors which mean the camera is gone (unplugged, powered down, USB reset)
+ * rather than a refused command. They hand the camera to the supervisor.
+ */
+int CameraController::_check(int ret){
+    switch (ret) {
+        case GP_ERROR_IO:
+        case GP_ERROR_IO_USB_FIND:
+        case GP_ERROR_IO_USB_CLAIM:
+        case GP_ERROR_IO_LOCK:
+        case GP_ERROR_MODEL_NOT_FOUND:
+            break;
+        default:
+            return ret;
+    }
+    
+    if(this->_camera_found){
+        this->_camera_found = false;
+        this->_disconnects++;
+        this->_last_error = ret;
+        Logger::getInstance()->log(CCA_LOG_WARN, "camera", "op=disconnect error=%d connected_ms=%.0f", ret, this->_connected.elapsed_ms());
+        WebSocketHub::camera(false);
+        
+        pthread_mutex_lock(&this->_supervisor_lock);
+        pthread_cond_signal(&this->_supervisor_cond);
+        pthread_mutex_unlock(&this->_supervisor_lock);
+    }
+    return ret;
+}
+
+/*
+ * Keeps the camera connected. An I/O error (see _check) wakes the
+ * supervisor, which tears the camera down and initializes it again, waiting
+ * camera.reconnect_min_ms doubled up to camera.reconnect_max_ms between
+ * attempts. Without a camera it goes on probing the same way, so a body which
+ * is plugged in later is picked up. The HTTP side keeps answering, with
+ * "Camera not found" until the camera is back.
+ */
+void* CameraController::_supervise(void *context){
+    CameraController *cc = static_cast<CameraController *>(context);
+    int backoff = cc->_reconnect_min_ms;
+    
+    pthread_mutex_lock(&cc->_supervisor_lock);
+    while(cc->_supervising){
+        if(cc->_camera_found){
+            backoff = cc->_reconnect_min_ms;
+            pthread_cond_wait(&cc->_supervisor_cond, &cc->_supervisor_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&cc->_supervisor_lock);
+        
+        // waits for a running capture or config session to give up the camera
+        cc->lock();
+        cc->_teardown_camera();
+        cc->unlock();
+        int ret = cc->_init_camera();
+        
+        pthread_mutex_lock(&cc->_supervisor_lock);
+        if(ret < GP_OK && cc->_supervising){
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += backoff / 1000;
+            deadline.tv_nsec += (backoff % 1000) * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L){
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cc->_supervisor_cond, &cc->_supervisor_lock, &deadline);
+            backoff = backoff * 2 < cc->_reconnect_max_ms ? backoff * 2 : cc->_reconnect_max_ms;
+        }
+    }
+    pthread_mutex_unlock(&cc->_supervisor_lock);
+    return NULL;
+}
+
+void CameraController::connection_stats(ptree &tree){
+    tree.put("state", this->state());
+    tree.put("connected",   (bool)this->_camera_found);
+    tree.put("connects",    this->_connects);
+    tree.put("disconnects", this->_disconnects);
+    tree.put("attempts",    this->_attempts);
+    tree.put("last_error",  this->_last_error);
+    if(this->_camera_found)
+        tree.put("connected_ms", this->_connected.elapsed_ms());
+    
+    ptree probe;
+    this->_probe->stats(probe);
+    tree.add_child("probe", probe);
 }
 
 CameraController::~CameraController(){
-    gp_camera_exit(this->_camera, this->_ctx);
+    pthread_mutex_lock(&this->_supervisor_lock);
+    this->_supervising = false;
+    pthread_cond_signal(&this->_supervisor_cond);
+    pthread_mutex_unlock(&this->_supervisor_lock);
+    if(this->_supervisor_started)
+        pthread_join(this->_supervisor, NULL);
+    
+    this->lock();
+    this->_teardown_camera();
+    this->unlock();
     gp_context_unref(this->_ctx);    
+    delete this->_probe;
+    delete this->_analyzer;
+    delete this->_recorder;
+    delete this->_ring;
+    delete this->_preview_pool;
+    pthread_cond_destroy(&this->_supervisor_cond);
+    pthread_mutex_destroy(&this->_supervisor_lock);
+    pthread_cond_destroy(&this->_liveview_cond);
+    pthread_mutex_destroy(&this->_liveview_lock);
+    pthread_mutex_destroy(&this->_camera_lock);
 }
 
 
@@ -80,11 +333,30 @@ bool CameraController::camera_found(){
     return this->_camera_found;
 }
 
+bool CameraController::exposing(){
+    return this->_exposing;
+}
+
+/*
+ * starting until the first probe is done, then connected or searching.
+ */
+const char* CameraController::state(){
+    if(this->_camera_found)
+        return "connected";
+    if(this->_probed)
+        return "searching";
+    return "starting";
+}
+
 bool CameraController::is_initialized(){
     return this->_is_initialized;
 }
 
 int CameraController::capture(const char *filename, string &data){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
     int ret;
     CameraFile *file;
     CameraFilePath path;
@@ -92,7 +364,10 @@ int CameraController::capture(const char *filename, string &data){
     strcpy(path.folder, "/");
 	strcpy(path.name, filename);
     
-	ret = gp_camera_capture(this->_camera, GP_CAPTURE_IMAGE, &path, this->_ctx);
+    {
+        TraceSpan span("gphoto", "gp_camera_capture");
+        ret = this->_check(gp_camera_capture(this->_camera, GP_CAPTURE_IMAGE, &path, this->_ctx));
+    }
     if (ret != GP_OK)
         return ret;
     
@@ -102,7 +377,10 @@ int CameraController::capture(const char *filename, string &data){
     if (ret != GP_OK)
         return ret;
     
-	ret = gp_camera_file_get(this->_camera, path.folder, path.name, GP_FILE_TYPE_NORMAL, file, this->_ctx);
+    {
+        TraceSpan span("gphoto", "gp_camera_file_get");
+        ret = this->_check(gp_camera_file_get(this->_camera, path.folder, path.name, GP_FILE_TYPE_NORMAL, file, this->_ctx));
+    }
     
     if (ret != GP_OK)
         return ret;
@@ -117,10 +395,16 @@ int CameraController::capture(const char *filename, string &data){
 
     //char *dest = new char[file_size];
     char *dest = (char*)malloc(file_size * sizeof(char*));
-    base64_encode(dest, (char*)file_data, (int)file_size);
+    {
+        TraceSpan span("camera", "base64_encode");
+        base64_encode(dest, (char*)file_data, (int)file_size);
+    }
     data.append(dest);
     
-    ret = gp_camera_file_delete(this->_camera, path.folder, path.name, this->_ctx);
+    {
+        TraceSpan span("gphoto", "gp_camera_file_delete");
+        ret = gp_camera_file_delete(this->_camera, path.folder, path.name, this->_ctx);
+    }
 
     free(dest);
     gp_file_free(file);
@@ -132,10 +416,21 @@ int CameraController::capture(const char *filename, string &data){
     CameraEventType type;
     void *eventdata;
     
-    printf("Wait for events from camera\n");
     while(1) {
         
-        gp_camera_wait_for_event(this->_camera, waittime, &type, &eventdata, this->_ctx);
+        eventdata = NULL;
+        {
+            TraceSpan span("gphoto", "gp_camera_wait_for_event");
+            ret = this->_check(gp_camera_wait_for_event(this->_camera, waittime, &type, &eventdata, this->_ctx));
+        }
+        // a dead camera would never report the timeout
+        if(ret < GP_OK)
+            break;
+        // e.g. the JPEG of a RAW+JPEG shot, it stays on the card
+        if(type == GP_EVENT_FILE_ADDED && eventdata != NULL)
+            this->_card.add(*(CameraFilePath *)eventdata);
+        if(eventdata != NULL)
+            free(eventdata);
         
         if(type == GP_EVENT_TIMEOUT) {
             break;
@@ -144,34 +439,70 @@ int CameraController::capture(const char *filename, string &data){
             waittime = 10;
         }
         else if (type != GP_EVENT_UNKNOWN) {
-            printf("Unexpected event received from camera: %d\n", (int)type);
+            Logger::getInstance()->log(CCA_LOG_DEBUG, "camera", "op=capture unexpected_event=%d", (int)type);
         }
     }
     
     return true;
 }
 
-int CameraController::preview(const char **file_data){
+int CameraController::preview(PreviewFrame *frame){
+    ScopedLock lock(&this->_camera_lock);
+    if(this->_camera == NULL)
+        return GP_ERROR_MODEL_NOT_FOUND;
+    // no preview while a bulb exposure has the shutter open
+    if(this->_exposing)
+        return 0;
     int ret;
-    CameraFile *file;    
-    ret = gp_file_new(&file);
-    if (ret != GP_OK)
-        return ret;
-    
-	ret = gp_camera_capture_preview(this->_camera, file, this->_ctx);
+    // some drivers append to the file, so drop the data of the last round
+    gp_file_clean(frame->file);
+    {
+        TraceSpan span("gphoto", "gp_camera_capture_preview");
+        ret = this->_check(gp_camera_capture_preview(this->_camera, frame->file, this->_ctx));
+    }
     
     if(ret != GP_OK)
         return ret;
     
-    unsigned long int file_size = 0;
-	ret = gp_file_get_data_and_size(file, file_data, &file_size);    
+    ret = gp_file_get_data_and_size(frame->file, &frame->data, &frame->size);
     
     if(ret != GP_OK)
         return ret;
 
-    // FIXME: not working...
-    //gp_file_unref(file);
-    return (int)file_size;
+    gettimeofday(&frame->captured, NULL);
+    return (int)frame->size;
+}
+
+void CameraController::preview_stats(ptree &tree){
+    ptree pool;
+    this->_preview_pool->stats(pool);
+    tree.put_child("pool", pool);
+    tree.put("deduplicate",     this->_deduplicate);
+    tree.put("frames_sent",     this->_frames_sent);
+    tree.put("frames_skipped",  this->_frames_skipped);
+    tree.put("bytes_saved",     this->_bytes_saved);
+
+    if(this->_ring != NULL){
+        tree.put("shm.name",      this->_ring->name());
+        tree.put("shm.published", this->_ring->published());
+        tree.put("shm.oversize",  this->_ring->oversize());
+        tree.put("shm.wakeups",   this->_ring->wakeups());
+    }
+
+    if(this->_analyzer != NULL){
+        ptree analysis;
+        this->_analyzer->stats(analysis);
+        tree.put_child("analysis", analysis);
+    }
+}
+
+bool CameraController::preview_analysis(ptree &tree){
+    FrameAnalysis result;
+    if(this->_analyzer == NULL || !this->_analyzer->latest(result))
+        return false;
+
+    FrameAnalyzer::to_ptree(result, true, tree);
+    return true;
 }
 
 int CameraController::liveview_stop(){
@@ -180,40 +511,395 @@ int CameraController::liveview_stop(){
 }
 
 int CameraController::liveview_start(){
+    if(!this->_camera_found)
+        return false;
+    
+    // set here, a stop which comes before the thread runs must not be lost
+    this->_running_process = true;
+    pthread_mutex_lock(&this->_liveview_lock);
     pthread_t tLiveServer;
     if (0 != pthread_create(&tLiveServer, NULL, CameraController::start_liveview_server, this)) {
+        pthread_mutex_unlock(&this->_liveview_lock);
         return false;
     }    
+    pthread_detach(tLiveServer);
+    this->_liveview_threads++;
+    pthread_mutex_unlock(&this->_liveview_lock);
     return true;
 }
 
+/*
+ * Stops the liveview and waits up to timeout_ms for its threads to give up
+ * the camera and the client socket. Returns false if one is still running.
+ */
+bool CameraController::liveview_drain(int timeout_ms){
+    this->_running_process = false;
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    ScopedLock lock(&this->_liveview_lock);
+    while(this->_liveview_threads > 0){
+        if(pthread_cond_timedwait(&this->_liveview_cond, &this->_liveview_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    return this->_liveview_threads == 0;
+}
+
+/*
+ * Records the liveview frames to the spool while the liveview runs, see
+ * LiveviewRecorder. file is the name of the first AVI.
+ */
+bool CameraController::record_start(string &file){
+    return this->_recorder->start(file);
+}
+
+void CameraController::record_stop(){
+    this->_recorder->stop();
+}
+
+void CameraController::record_stats(ptree &tree){
+    this->_recorder->stats(tree);
+}
+
 int CameraController::trigger(){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    TraceSpan span("gphoto", "gp_camera_trigger_capture");
+    return this->_check(gp_camera_trigger_capture(this->_camera, this->_ctx));
+}
+
+int CameraController::capture_file(CameraFilePath *path){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_capture");
+        ret = this->_check(gp_camera_capture(this->_camera, GP_CAPTURE_IMAGE, path, this->_ctx));
+    }
+    if(ret == GP_OK)
+        this->_card.add(*path);
+    return ret;
+}
+
+/*
+ * Waits for the files of one shot, a RAW+JPEG body adds two. The first file
+ * is waited for up to timeout_ms, files already in paths (from
+ * capture_file) count as the first. After it the shot is complete with
+ * GP_EVENT_CAPTURE_COMPLETE or once settle_ms pass without another file,
+ * so no file is left over for the next shot. Other events are dropped.
+ */
+int CameraController::wait_for_files(int timeout_ms, int settle_ms, vector<CameraFilePath> &paths){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    Stopwatch watch, quiet;
     
-    return true;
+    while(true){
+        int left = paths.empty() ? timeout_ms - (int)watch.elapsed_ms() : settle_ms - (int)quiet.elapsed_ms();
+        if(left <= 0)
+            break;
+        
+        CameraEventType type;
+        void *eventdata = NULL;
+        int ret;
+        {
+            TraceSpan span("gphoto", "gp_camera_wait_for_event");
+            ret = this->_check(gp_camera_wait_for_event(this->_camera, left, &type, &eventdata, this->_ctx));
+        }
+        if(ret < GP_OK)
+            return ret;
+        
+        if(type == GP_EVENT_FILE_ADDED && eventdata != NULL){
+            paths.push_back(*(CameraFilePath *)eventdata);
+            this->_card.add(paths.back());
+            quiet.restart();
+        }
+        
+        if(eventdata != NULL)
+            free(eventdata);
+        
+        // some bodies report the end of the shot before its files
+        if(type == GP_EVENT_TIMEOUT || (type == GP_EVENT_CAPTURE_COMPLETE && !paths.empty()))
+            break;
+    }
+    return paths.empty() ? GP_ERROR_TIMEOUT : GP_OK;
+}
+
+int CameraController::download(const CameraFilePath &path, CameraFile *file, bool remove){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_file_get");
+        ret = this->_check(gp_camera_file_get(this->_camera, path.folder, path.name, GP_FILE_TYPE_NORMAL, file, this->_ctx));
+    }
+    if(ret < GP_OK || !remove)
+        return ret;
+    
+    return this->delete_file(path);
+}
+
+int CameraController::delete_file(const CameraFilePath &path){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_file_delete");
+        ret = gp_camera_file_delete(this->_camera, path.folder, path.name, this->_ctx);
+    }
+    if(ret == GP_OK)
+        this->_card.remove(path);
+    return ret;
+}
+
+int CameraController::file_info(const CameraFilePath &path, unsigned long &size, time_t &mtime){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    
+    CameraFileInfo info;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_file_get_info");
+        ret = this->_check(gp_camera_file_get_info(this->_camera, path.folder, path.name, &info, this->_ctx));
+    }
+    if(ret < GP_OK)
+        return ret;
+    size = (info.file.fields & GP_FILE_INFO_SIZE) ? info.file.size : 0;
+    mtime = (info.file.fields & GP_FILE_INFO_MTIME) ? info.file.mtime : 0;
+    return GP_OK;
+}
+
+/*
+ * The files on the card below folder, from the card index. The card is
+ * walked on the first call and with refresh, otherwise only files added
+ * since are asked for.
+ */
+int CameraController::card_files(const string &folder, bool refresh, vector<CardFile> &files){
+    ScopedLock lock(&this->_camera_lock);
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    
+    int ret = GP_OK;
+    if(refresh || !this->_card.built())
+        ret = this->_check(this->_card.build(this->_camera, this->_ctx));
+    else
+        ret = this->_check(this->_card.fill_info(this->_camera, this->_ctx));
+    if(ret < GP_OK)
+        return ret;
+    
+    this->_card.files(folder, files);
+    return GP_OK;
+}
+
+void CameraController::card_stats(ptree &tree){
+    this->_card.stats(tree);
+}
+
+static double ms_between(const struct timespec &from, const struct timespec &to){
+    return (to.tv_sec - from.tv_sec) * 1000.0 + (to.tv_nsec - from.tv_nsec) / 1000000.0;
+}
+
+/*
+ * A bulb exposure of the given length. The shutter speed is switched to bulb
+ * if the camera offers it and restored afterwards; the shutter is opened and
+ * closed with eosremoterelease where the camera has it and with the bulb
+ * toggle otherwise.
+ *
+ * Opening and closing are a USB round trip each. The close is started
+ * exactly the exposure time after the open was started, so with similar
+ * latencies of both the shutter is open for the requested time. timing gets
+ * the latencies, how late the timer woke up and the estimated exposure,
+ * middle of the open call to middle of the close call.
+ *
+ * The camera lock is not held while the shutter is open, an exposure can
+ * take up to an hour. Every other call gets GP_ERROR_CAMERA_BUSY meanwhile
+ * (see _ready()) and the liveview skips its frames. The widget for the
+ * close is fetched and set before the open, so the close is a single call.
+ */
+int CameraController::bulb(double seconds, ptree &timing){
+    string release, speed;
+    bool remote = this->setting_name("remoterelease", release);
+    if(!remote && !this->setting_name("bulb", release))
+        return GP_ERROR_NOT_SUPPORTED;
+    
+    int ret = this->config_begin();
+    if(ret < GP_OK)
+        return ret;
+    
+    string original;
+    if(this->setting_name("speed", speed)){
+        vector<string> choices;
+        string current;
+        if(this->config_choices(speed.c_str(), choices, current) >= GP_OK){
+            for(size_t i = 0; i < choices.size(); i++){
+                if(strcasecmp(choices[i].c_str(), "bulb") == 0){
+                    if(current != choices[i] && this->config_set(speed.c_str(), choices[i].c_str()) >= GP_OK)
+                        original = current;
+                    break;
+                }
+            }
+        }
+    }
+    
+    const char *press = remote ? "Press Full" : "1";
+    const char *unpress = remote ? "Release Full" : "0";
+    struct timespec open_start, open_end, close_start, close_end, deadline;
+    CameraWidget *closer = NULL;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_single_config");
+        ret = this->_check(gp_camera_get_single_config(this->_camera, release.c_str(), &closer, this->_ctx));
+    }
+    if(ret >= GP_OK){
+        ret = this->_set_widget_value(closer, unpress);
+        // the toggle may read as released already
+        gp_widget_set_changed(closer, 1);
+    }
+    
+    if(ret >= GP_OK){
+        clock_gettime(CLOCK_MONOTONIC, &open_start);
+        ret = this->config_set(release.c_str(), press);
+        clock_gettime(CLOCK_MONOTONIC, &open_end);
+    }
+    if(ret >= GP_OK)
+        this->_exposing = true;
+    this->config_end();
+    
+    if(ret >= GP_OK){
+        long long ns = (long long)(seconds * 1000000000.0);
+        deadline.tv_sec = open_start.tv_sec + (time_t)(ns / 1000000000LL);
+        deadline.tv_nsec = open_start.tv_nsec + (long)(ns % 1000000000LL);
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+        
+        this->lock();
+        // the lock keeps everybody else out until the shutter is closed
+        this->_exposing = false;
+        clock_gettime(CLOCK_MONOTONIC, &close_start);
+        if(this->_camera == NULL){
+            ret = GP_ERROR_MODEL_NOT_FOUND;
+        } else {
+            TraceSpan span("gphoto", "gp_camera_set_single_config");
+            ret = this->_check(gp_camera_set_single_config(this->_camera, release.c_str(), closer, this->_ctx));
+            // a failed close leaves the shutter open, one more try
+            if(ret < GP_OK && this->_camera != NULL)
+                ret = this->_check(gp_camera_set_single_config(this->_camera, release.c_str(), closer, this->_ctx));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &close_end);
+        if(ret >= GP_OK)
+            this->_changed(release.c_str(), unpress);
+        this->_snapshot_dirty = true;
+        
+        double open_ms = ms_between(open_start, open_end);
+        double close_ms = ms_between(close_start, close_end);
+        double exposure_ms = ms_between(open_start, close_start) + (close_ms - open_ms) / 2;
+        timing.put("requested_ms", seconds * 1000.0);
+        timing.put("exposure_ms",  exposure_ms);
+        timing.put("error_ms",     exposure_ms - seconds * 1000.0);
+        timing.put("open_ms",      open_ms);
+        timing.put("close_ms",     close_ms);
+        timing.put("timer_late_ms", ms_between(deadline, close_start));
+        timing.put("release",      release);
+        this->unlock();
+    }
+    if(closer != NULL)
+        gp_widget_free(closer);
+    
+    if(!original.empty() && this->config_begin() >= GP_OK){
+        this->config_set(speed.c_str(), original.c_str());
+        this->config_end();
+    }
+    return ret;
 }
 
 int CameraController::get_settings(ptree &sett){
+    ScopedLock lock(&this->_camera_lock);
     CameraWidget *w, *children;
     int ret;
-    ret = gp_camera_get_config(this->_camera, &w, this->_ctx);
+    if(this->_ready() < GP_OK)
+        return false;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_config");
+        ret = this->_check(gp_camera_get_config(this->_camera, &w, this->_ctx));
+    }
     if(ret < GP_OK){
         return false;
     }
     
     ret = gp_widget_get_child_by_name(w, "main", &children);
-    if(ret < GP_OK)
+    if(ret < GP_OK){
+        gp_widget_free(w);
         return false;
+    }
 
     this->_read_widget(children, sett, "settings");
+    gp_widget_free(w);
     return true;
 }
 
+/*
+ * The settings tree as of the last change. Our own changes mark it dirty, a
+ * change on the camera body is picked up when snapshot.ttl_ms is over. A
+ * re-read with the same content keeps the old snapshot, so its etag and the
+ * responses built from it stay valid.
+ */
+boost::shared_ptr<SettingsSnapshot> CameraController::settings_snapshot(){
+    ScopedLock lock(&this->_camera_lock);
+    if(this->_snapshot && !this->_snapshot_dirty && this->_snapshot_age.elapsed_ms() < this->_snapshot_ttl_ms)
+        return this->_snapshot;
+    
+    ptree settings;
+    if(!this->get_settings(settings))
+        return boost::shared_ptr<SettingsSnapshot>();
+    
+    if(!this->_snapshot || this->_snapshot->tree() != settings)
+        this->_snapshot.reset(new SettingsSnapshot(settings, ++this->_snapshot_version));
+    
+    this->_snapshot_dirty = false;
+    this->_snapshot_age.restart();
+    return this->_snapshot;
+}
+
+void CameraController::settings_changed(){
+    ScopedLock lock(&this->_camera_lock);
+    this->_snapshot_dirty = true;
+}
+
 
 int CameraController::get_settings_value(const char *key, void *val){
+    ScopedLock lock(&this->_camera_lock);
     CameraWidget *w, *child;
     int ret;
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
     
-    ret = gp_camera_get_config(this->_camera, &w, this->_ctx);
+    {
+        TraceSpan span("gphoto", "gp_camera_get_config");
+        ret = this->_check(gp_camera_get_config(this->_camera, &w, this->_ctx));
+    }
     if(ret < GP_OK){
         return ret;
     }
@@ -230,9 +916,15 @@ int CameraController::get_settings_value(const char *key, void *val){
 }
 
 int CameraController::set_settings_value(const char *key, const char *val){
-
+    ScopedLock lock(&this->_camera_lock);
     CameraWidget *w, *child;
-    int ret = gp_camera_get_config(this->_camera, &w, this->_ctx);
+    if(this->_ready() < GP_OK)
+        return false;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_config");
+        ret = this->_check(gp_camera_get_config(this->_camera, &w, this->_ctx));
+    }
     if(ret < GP_OK)
         return false;
     
@@ -240,24 +932,356 @@ int CameraController::set_settings_value(const char *key, const char *val){
     if(ret < GP_OK)
         return false;
     
-    ret = gp_widget_set_value(child, val);
+    ret = this->_set_widget_value(child, val);
     if(ret < GP_OK)
         return false;
     
     
-    ret = gp_camera_set_config(this->_camera, w, this->_ctx);
+    {
+        TraceSpan span("gphoto", "gp_camera_set_config");
+        ret = this->_check(gp_camera_set_config(this->_camera, w, this->_ctx));
+    }
+    this->_snapshot_dirty = true;
+    if(ret == GP_OK)
+        this->_changed(key, val);
     
     gp_widget_free(w);
     return (ret == GP_OK);
 }
 
 
+/*
+ * Reads the current value of a logical setting (see WidgetIndex) from the
+ * camera. Only the widget the index resolved at connect time is fetched,
+ * not the whole config tree.
+ */
+int CameraController::get_setting(const string &logical, string &value){
+    ScopedLock lock(&this->_camera_lock);
+    const WidgetEntry *entry = this->_index.find(logical);
+    if(entry == NULL)
+        return GP_ERROR_NOT_SUPPORTED;
+    
+    CameraWidget *child;
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_single_config");
+        ret = this->_check(gp_camera_get_single_config(this->_camera, entry->name.c_str(), &child, this->_ctx));
+    }
+    if(ret < GP_OK)
+        return ret;
+    
+    switch (entry->type) {
+        case GP_WIDGET_TOGGLE: {
+            int val = 0;
+            ret = gp_widget_get_value(child, &val);
+            value = boost::lexical_cast<string>(val);
+            break;
+        }
+        case GP_WIDGET_RANGE: {
+            float val = 0;
+            ret = gp_widget_get_value(child, &val);
+            value = boost::lexical_cast<string>(val);
+            break;
+        }
+        default: {
+            const char *val = NULL;
+            ret = gp_widget_get_value(child, &val);
+            value = val != NULL ? val : "";
+            break;
+        }
+    }
+    gp_widget_free(child);
+    
+    if(ret >= GP_OK)
+        this->_index.update(logical, value);
+    return ret;
+}
+
+/*
+ * Sets a logical setting. Values the widget can not take are rejected
+ * with GP_ERROR_BAD_PARAMETERS before anything is written. Like
+ * get_setting() it only fetches and writes the one widget.
+ */
+int CameraController::set_setting(const string &logical, const string &value){
+    ScopedLock lock(&this->_camera_lock);
+    const WidgetEntry *entry = this->_index.find(logical);
+    if(entry == NULL)
+        return GP_ERROR_NOT_SUPPORTED;
+    
+    CameraWidget *child;
+    int ready = this->_ready();
+    if(ready < GP_OK)
+        return ready;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_single_config");
+        ret = this->_check(gp_camera_get_single_config(this->_camera, entry->name.c_str(), &child, this->_ctx));
+    }
+    if(ret < GP_OK)
+        return ret;
+    
+    // checked against the choices the camera offers now, not at connect time
+    this->_index.refresh(logical, child);
+    if(!entry->accepts(value)){
+        gp_widget_free(child);
+        return GP_ERROR_BAD_PARAMETERS;
+    }
+    
+    ret = this->_set_widget_value(child, value.c_str());
+    if(ret >= GP_OK){
+        // the same choice twice in a row would not be marked as changed
+        gp_widget_set_changed(child, 1);
+        TraceSpan span("gphoto", "gp_camera_set_single_config");
+        ret = this->_check(gp_camera_set_single_config(this->_camera, entry->name.c_str(), child, this->_ctx));
+    }
+    gp_widget_free(child);
+    
+    this->_snapshot_dirty = true;
+    if(ret >= GP_OK){
+        WebSocketHub::changed(logical.c_str(), value.c_str());
+        this->_index.update(logical, value);
+    }
+    return ret;
+}
+
+bool CameraController::setting_name(const string &logical, string &name){
+    ScopedLock lock(&this->_camera_lock);
+    const WidgetEntry *entry = this->_index.find(logical);
+    if(entry == NULL)
+        return false;
+    
+    name = entry->name;
+    return true;
+}
+
+/*
+ * A value missing from the choices known so far is checked once more
+ * against the widget of the camera, the lens or the mode may have changed.
+ */
+bool CameraController::setting_accepts(const string &logical, const string &value){
+    ScopedLock lock(&this->_camera_lock);
+    const WidgetEntry *entry = this->_index.find(logical);
+    if(entry == NULL)
+        return false;
+    if(entry->accepts(value))
+        return true;
+    
+    CameraWidget *child;
+    if(this->_ready() < GP_OK)
+        return false;
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_single_config");
+        ret = this->_check(gp_camera_get_single_config(this->_camera, entry->name.c_str(), &child, this->_ctx));
+    }
+    if(ret < GP_OK)
+        return false;
+    
+    this->_index.refresh(logical, child);
+    gp_widget_free(child);
+    return entry->accepts(value);
+}
+
+void CameraController::settings_index(ptree &tree){
+    ScopedLock lock(&this->_camera_lock);
+    this->_index.to_ptree(tree);
+}
+
+void CameraController::lock(){
+    pthread_mutex_lock(&this->_camera_lock);
+}
+
+void CameraController::unlock(){
+    pthread_mutex_unlock(&this->_camera_lock);
+}
+
+PreviewPool* CameraController::preview_pool(){
+    return this->_preview_pool;
+}
+
+/*
+ * A config session keeps the camera locked and the config tree around until
+ * config_end(), so a run of changes costs one get_config in total and a
+ * single set_config per change instead of a get_config/set_config pair.
+ * Sessions nest, only the outermost one reads and frees the tree.
+ */
+int CameraController::config_begin(){
+    this->lock();
+    if(this->_session_depth++ > 0)
+        return GP_OK;
+    
+    int ret = this->_ready();
+    if(ret >= GP_OK){
+        TraceSpan span("gphoto", "gp_camera_get_config");
+        ret = this->_check(gp_camera_get_config(this->_camera, &this->_session_config, this->_ctx));
+    }
+    if(ret < GP_OK){
+        this->_session_config = NULL;
+        this->_session_depth = 0;
+        this->unlock();
+        return ret;
+    }
+    return GP_OK;
+}
+
+int CameraController::config_set(const char *key, const char *val){
+    CameraWidget *child;
+    if(this->_session_config == NULL)
+        return GP_ERROR_BAD_PARAMETERS;
+    
+    int ret = gp_widget_get_child_by_name(this->_session_config, key, &child);
+    if(ret < GP_OK)
+        return ret;
+    
+    ret = this->_set_widget_value(child, val);
+    if(ret < GP_OK)
+        return ret;
+    
+    gp_widget_set_changed(child, 1);
+    this->_snapshot_dirty = true;
+    {
+        TraceSpan span("gphoto", "gp_camera_set_config");
+        ret = this->_check(gp_camera_set_config(this->_camera, this->_session_config, this->_ctx));
+    }
+    if(ret >= GP_OK)
+        this->_changed(key, val);
+    return ret;
+}
+
+int CameraController::config_choices(const char *key, vector<string> &choices, string &current){
+    CameraWidget *child;
+    if(this->_session_config == NULL)
+        return GP_ERROR_BAD_PARAMETERS;
+    
+    int ret = gp_widget_get_child_by_name(this->_session_config, key, &child);
+    if(ret < GP_OK)
+        return ret;
+    
+    const char *value = NULL;
+    ret = gp_widget_get_value(child, &value);
+    if(ret < GP_OK)
+        return ret;
+    current = value != NULL ? value : "";
+    
+    choices.clear();
+    int count = gp_widget_count_choices(child);
+    for(int i = 0; i < count; i++){
+        const char *choice;
+        if(gp_widget_get_choice(child, i, &choice) >= GP_OK)
+            choices.push_back(choice);
+    }
+    return GP_OK;
+}
+
+void CameraController::config_end(){
+    if(this->_session_depth > 0 && --this->_session_depth == 0){
+        if(this->_session_config != NULL)
+            gp_widget_free(this->_session_config);
+        this->_session_config = NULL;
+    }
+    this->unlock();
+}
+
+int CameraController::focus_begin(){
+    string name;
+    if(!this->setting_name("manualfocus", name))
+        return GP_ERROR_NOT_SUPPORTED;
+    
+    int ret = this->config_begin();
+    if(ret < GP_OK)
+        return ret;
+    
+    ret = gp_widget_get_child_by_name(this->_session_config, name.c_str(), &this->_focus_widget);
+    if(ret < GP_OK){
+        this->_focus_widget = NULL;
+        this->config_end();
+        return ret;
+    }
+    return GP_OK;
+}
+
+/*
+ * Moves the focus by step, negative is nearer, positive is farther and the
+ * magnitude 1..3 is the step size. Canon bodies take "Near n"/"Far n" choices,
+ * Nikon bodies take a signed motor step count from a range.
+ */
+int CameraController::focus_step(int step){
+    if(this->_focus_widget == NULL)
+        return GP_ERROR_BAD_PARAMETERS;
+    
+    if(step == 0 || step < -3 || step > 3)
+        return GP_ERROR_BAD_PARAMETERS;
+    
+    CameraWidgetType type;
+    int ret;
+    gp_widget_get_type(this->_focus_widget, &type);
+    
+    if(type == GP_WIDGET_RANGE){
+        static const float motor_steps[] = {0, 25, 150, 750};
+        float value = step < 0 ? -motor_steps[-step] : motor_steps[step];
+        ret = gp_widget_set_value(this->_focus_widget, &value);
+    } else {
+        char value[16];
+        snprintf(value, sizeof(value), "%s %d", step < 0 ? "Near" : "Far", step < 0 ? -step : step);
+        ret = gp_widget_set_value(this->_focus_widget, value);
+    }
+    if(ret < GP_OK)
+        return ret;
+    
+    // the same choice twice in a row would not be marked as changed
+    gp_widget_set_changed(this->_focus_widget, 1);
+    TraceSpan span("gphoto", "gp_camera_set_config");
+    return this->_check(gp_camera_set_config(this->_camera, this->_session_config, this->_ctx));
+}
+
+void CameraController::focus_end(){
+    this->_focus_widget = NULL;
+    this->config_end();
+}
+
+/*
+ * Events name the logical setting, whichever body is connected; a widget
+ * outside the index keeps its own name.
+ */
+void CameraController::_changed(const char *widget, const char *val){
+    const WidgetEntry *entry = this->_index.find_widget(widget);
+    WebSocketHub::changed(entry != NULL ? entry->logical.c_str() : widget, val);
+}
+
+int CameraController::_set_widget_value(CameraWidget *w, const char *val){
+    CameraWidgetType type;
+    int ret = gp_widget_get_type(w, &type);
+    if(ret < GP_OK)
+        return ret;
+    
+    // gphoto2 expects the native type of the widget, not its text form
+    switch (type) {
+        case GP_WIDGET_TOGGLE:
+        case GP_WIDGET_DATE: {
+            int value = atoi(val);
+            return gp_widget_set_value(w, &value);
+        }
+        case GP_WIDGET_RANGE: {
+            float value = (float)atof(val);
+            return gp_widget_set_value(w, &value);
+        }
+        default:
+            return gp_widget_set_value(w, val);
+    }
+}
+
 void CameraController::_read_widget(CameraWidget *w,  ptree &tree, string node){
     const char  *name;
-    ptree subtree;
     gp_widget_get_name(w, &name);
     string nodename = node + "." + name;
     
+    // filled in place, copying every subtree into its parent costs as much
+    // as reading the tree from the camera
+    ptree &subtree = tree.push_back(std::make_pair(name, ptree()))->second;
+    
     int items = gp_widget_count_children(w);
     if(items > 0){
         for(int i = 0; i < items; i++){
@@ -269,8 +1293,6 @@ void CameraController::_read_widget(CameraWidget *w,  ptree &tree, string node){
     } else {
         this->_get_item_value(w, subtree);
     }
-    
-    tree.put_child(name, subtree);
 }
 
 
@@ -329,9 +1351,24 @@ void CameraController::_get_item_value(CameraWidget *w, ptree &tree){
     }
 }
 
+/*
+ * The TCP client of the liveview went away. Without the shared memory ring
+ * or a WebSocket subscriber that ends the liveview, with them the frames go
+ * on and the next client is accepted. Returns whether the client is still
+ * connected.
+ */
+static bool liveview_client_lost(bool shm, ip::tcp::socket &sock, const boost::system::error_code &ec){
+    if(!shm && !WebSocketHub::watching())
+        throw boost::system::system_error(ec);
+    
+    Logger::getInstance()->log(CCA_LOG_INFO, "liveview", "op=client_lost error=\"%s\"", ec.message().c_str());
+    boost::system::error_code ignored;
+    sock.close(ignored);
+    return false;
+}
+
 void* CameraController::start_liveview_server(void *context){
     CameraController *cc = (CameraController *)context;
-    cc->_running_process = true;
     
     string port;
     string host;
@@ -347,42 +1384,147 @@ void* CameraController::start_liveview_server(void *context){
     ip::tcp::endpoint endpoint(ip::tcp::v4(), atoi(port.c_str()));
     endpoint.address(target);
     
-    ip::tcp::acceptor acceptor(io_s, endpoint);
+    ip::tcp::acceptor acceptor(io_s);
     ip::tcp::socket sock(io_s);
+    PreviewFrame *frame = NULL;
+    uint64_t last_hash = 0;
+    unsigned long last_size = 0;
+    const int keepalive = 0;
+    unsigned long last_analysis = 0;
+    Logger *logger = Logger::getInstance();
     
     try{
-        acceptor.accept(sock);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        
+        // polled, so a stop (or shutdown) before the client connects ends the thread
+        boost::system::error_code ec = error::would_block;
+        acceptor.non_blocking(true);
+        // with the shared memory ring or a WebSocket subscriber the frames
+        // flow without a TCP client, one is picked up whenever it connects
+        bool connected = false;
+        while(cc->_ring == NULL && !WebSocketHub::watching() && cc->_running_process && ec == error::would_block){
+            acceptor.accept(sock, ec);
+            if(ec == error::would_block)
+                usleep(10000);
+        }
+        if(ec && ec != error::would_block && cc->_running_process)
+            throw boost::system::system_error(ec);
+        connected = !ec;
+        
         while(cc->_running_process){
-            const char *data = NULL;
-            int size = cc->preview(&data);
+            if(!connected){
+                acceptor.accept(sock, ec);
+                connected = !ec;
+            }
+            
+            frame = cc->_preview_pool->acquire();
+            if(frame == NULL){
+                // every frame is still held by a consumer
+                usleep(1000);
+                continue;
+            }
+            TraceSpan span("liveview", "frame");
 
-            if(size == 0) continue;
-            else if(size < 0)break;
+            int size = cc->preview(frame);
+
+            if(size == 0){
+                cc->_preview_pool->release(frame);
+                frame = NULL;
+                // e.g. a bulb exposure, no need to ask again right away
+                usleep(10000);
+                continue;
+            } else if(size < 0){
+                break;
+            }
+            
+            // every frame, a duplicate still takes its time in the recording
+            cc->_recorder->submit(frame);
+
+            if(cc->_deduplicate){
+                frame->hash = frame_hash(frame->data, frame->size);
+                if(frame->hash == last_hash && frame->size == last_size){
+                    // same picture as before, only tell the client we are alive
+                    if(connected)
+                        write(sock, buffer(&keepalive, 4), ec);
+                    if(connected && ec)
+                        connected = liveview_client_lost(cc->_ring != NULL, sock, ec);
+                    cc->_frames_skipped++;
+                    cc->_bytes_saved += frame->size;
+                    cc->_preview_pool->release(frame);
+                    frame = NULL;
+                    continue;
+                }
+                last_hash = frame->hash;
+                last_size = frame->size;
+            }
             
-            printf("--------------------------------------\n");
-            printf("\n%d --- %u\n", size, sizeof(size));
-            printf("--------------------------------------\n");            
+            if(logger->enabled(CCA_LOG_DEBUG))
+                logger->log(CCA_LOG_DEBUG, "liveview", "frame=%lu bytes=%d", frame->sequence, size);
+            
+            // before the socket, local readers should not wait for a slow client
+            if(cc->_ring != NULL)
+                cc->_ring->publish(frame->data, frame->size, frame->sequence,
+                                   frame->captured.tv_sec * (int64_t)1000000 + frame->captured.tv_usec, frame->hash);
+            WebSocketHub::frame(frame);
         
-            write(sock, buffer(&size, 4));
-            write(sock, buffer(data, size));
+            if(connected){
+                write(sock, buffer(&size, 4), ec);
+                if(!ec)
+                    write(sock, buffer(frame->data, size), ec);
+                if(ec)
+                    connected = liveview_client_lost(cc->_ring != NULL, sock, ec);
+            }
+            cc->_frames_sent++;
+
+            if(cc->_analyzer != NULL){
+                cc->_analyzer->submit(frame);
+
+                FrameAnalysis result;
+                if(connected && cc->_analysis_metadata && cc->_analyzer->latest(result) && result.sequence != last_analysis){
+                    // metadata records carry a negative length followed by compact json
+                    ptree meta;
+                    std::stringstream ss;
+                    FrameAnalyzer::to_ptree(result, true, meta);
+                    boost::property_tree::write_json(ss, meta, false);
+                    string json = ss.str();
+                    int meta_size = -(int)json.size();
+                    write(sock, buffer(&meta_size, 4), ec);
+                    if(!ec)
+                        write(sock, buffer(json.data(), json.size()), ec);
+                    if(ec)
+                        connected = liveview_client_lost(cc->_ring != NULL, sock, ec);
+                    last_analysis = result.sequence;
+                }
+            }
+
+            cc->_preview_pool->release(frame);
+            frame = NULL;
         }
     } catch(std::exception& e){
-        printf("error %s:",e.what());
+        logger->log(CCA_LOG_ERROR, "liveview", "frames=%lu error=\"%s\"", cc->_frames_sent, e.what());
         cc->_running_process = false;
     }
     
+    // the camera stays open, it is shared with every other request
+    cc->_preview_pool->release(frame);
     sock.close();    
-    gp_camera_exit(cc->_camera, cc->_ctx);
     
+    pthread_mutex_lock(&cc->_liveview_lock);
+    cc->_liveview_threads--;
+    pthread_cond_broadcast(&cc->_liveview_cond);
+    pthread_mutex_unlock(&cc->_liveview_lock);
     return NULL;
 }
 
 GPContextErrorFunc CameraController::_error_callback(GPContext *context, const char *text, void *data){
-    
+    Logger::getInstance()->log(CCA_LOG_ERROR, "gphoto", "msg=\"%s\"", text);
     return 0;
 }
 
 GPContextMessageFunc CameraController::_message_callback(GPContext *context, const char *text, void *data){
-    
+    Logger::getInstance()->log(CCA_LOG_INFO, "gphoto", "msg=\"%s\"", text);
     return 0;
 }
@@ -15,10 +15,21 @@
 #include <exception>
 #include <gphoto2/gphoto2-camera.h>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/shared_ptr.hpp>
+#include "PreviewPool.h"
+#include "FrameAnalyzer.h"
+#include "WidgetIndex.h"
+#include "SettingsSnapshot.h"
+#include "Stopwatch.h"
+#include "CameraProbe.h"
+#include "CardIndex.h"
+#include "FrameRing.h"
+#include "LiveviewRecorder.h"
 
 
 
 using std::string;
+using std::vector;
 using boost::property_tree::ptree;
 
 namespace CameraControllerApi {
@@ -31,38 +42,119 @@ namespace CameraControllerApi {
         
     public:
         bool camera_found();
+        bool exposing();
+        const char* state();
         bool is_initialized();
         
         static CameraController* getInstance();
         static void release();
         
         int capture(const char *filename, string &data);
-        int preview(const char **file_data);
+        int preview(PreviewFrame *frame);
+        void preview_stats(ptree &tree);
+        bool preview_analysis(ptree &tree);
         int liveview_start();
         int liveview_stop();
+        bool liveview_drain(int timeout_ms);
+        bool record_start(string &file);
+        void record_stop();
+        void record_stats(ptree &tree);
         int trigger();
+        int capture_file(CameraFilePath *path);
+        int wait_for_files(int timeout_ms, int settle_ms, vector<CameraFilePath> &paths);
+        int download(const CameraFilePath &path, CameraFile *file, bool remove);
+        int delete_file(const CameraFilePath &path);
+        int bulb(double seconds, ptree &timing);
         int get_settings(ptree &sett);
+        boost::shared_ptr<SettingsSnapshot> settings_snapshot();
+        void settings_changed();
         int get_settings_value(const char *key, void *val);
         int set_settings_value(const char *key, const char *val);
+        int get_setting(const string &logical, string &value);
+        int set_setting(const string &logical, const string &value);
+        bool setting_name(const string &logical, string &name);
+        bool setting_accepts(const string &logical, const string &value);
+        void settings_index(ptree &tree);
+        void connection_stats(ptree &tree);
+        int file_info(const CameraFilePath &path, unsigned long &size, time_t &mtime);
+        int card_files(const string &folder, bool refresh, vector<CardFile> &files);
+        void card_stats(ptree &tree);
+        
+        void lock();
+        void unlock();
+        PreviewPool* preview_pool();
+        int config_begin();
+        int config_set(const char *key, const char *val);
+        int config_choices(const char *key, vector<string> &choices, string &current);
+        void config_end();
+        int focus_begin();
+        int focus_step(int step);
+        void focus_end();
                 
     private:
         static CameraController *_instance;        
         Camera *_camera;
         GPContext *_ctx;
-        bool _running_process;
-        bool _camera_found;
+        pthread_mutex_t _camera_lock;
+        CameraWidget *_session_config;
+        int _session_depth;
+        CameraWidget *_focus_widget;
+        WidgetIndex _index;
+        CardIndex _card;
+        boost::shared_ptr<SettingsSnapshot> _snapshot;
+        unsigned long _snapshot_version;
+        bool _snapshot_dirty;
+        double _snapshot_ttl_ms;
+        Stopwatch _snapshot_age;
+        PreviewPool *_preview_pool;
+        bool _deduplicate;
+        unsigned long _frames_sent;
+        unsigned long _frames_skipped;
+        unsigned long _bytes_saved;
+        FrameAnalyzer *_analyzer;
+        bool _analysis_metadata;
+        FrameRing *_ring;
+        LiveviewRecorder *_recorder;
+        volatile bool _running_process;
+        // a bulb exposure has the shutter open, without the camera lock
+        volatile bool _exposing;
+        int _liveview_threads;
+        pthread_mutex_t _liveview_lock;
+        pthread_cond_t _liveview_cond;
+        volatile bool _camera_found;
         bool _is_initialized;
         
+        pthread_t _supervisor;
+        bool _supervisor_started;
+        bool _supervising;
+        pthread_mutex_t _supervisor_lock;
+        pthread_cond_t _supervisor_cond;
+        int _reconnect_min_ms;
+        int _reconnect_max_ms;
+        unsigned long _connects;
+        unsigned long _disconnects;
+        unsigned long _attempts;
+        int _last_error;
+        Stopwatch _connected;
+        CameraProbe *_probe;
+        volatile bool _probed;
+        
         CameraController();
         ~CameraController();
         
-        void _init_camera();
+        int _init_camera();
+        int _ready();
+        void _teardown_camera();
+        int _check(int ret);
+        static void* _supervise(void *context);
         int _wait_event_and_download (Camera *camera, int waittime, GPContext *context);
         
         
         void _build_settings_tree(CameraWidget *w);
         void _read_widget(CameraWidget *w, ptree &tree, string node);
         void _get_item_value(CameraWidget *w, ptree &tree);                
+        int _set_widget_value(CameraWidget *w, const char *val);
+        void _changed(const char *widget, const char *val);
     };
 }
 
@@ -0,0 +1,282 @@
+//
+//  CameraJobs.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CameraJobs.h"
+#include "Api.h"
+#include "Settings.h"
+#include "Stopwatch.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+
+using std::map;
+
+using namespace CameraControllerApi;
+
+ShotJob::ShotJob(CameraController *cc){
+    this->_cc = cc;
+}
+
+const char* ShotJob::kind() const {
+    return "shot";
+}
+
+int ShotJob::run(ptree &result){
+    if(this->_cc->camera_found() == false)
+        return CCA_API_RESPONSE_CAMERA_NOT_FOUND;
+    
+    string image;
+    int ret = this->_cc->capture("image.jpg", image);
+    if(ret < GP_OK)
+        return CCA_API_RESPONSE_INVALID;
+    
+    result.put("image", image);
+    return CCA_API_RESPONSE_SUCCESS;
+}
+
+BulbJob::BulbJob(CameraController *cc, double seconds){
+    this->_cc = cc;
+    this->_seconds = seconds;
+}
+
+const char* BulbJob::kind() const {
+    return "bulb";
+}
+
+int BulbJob::run(ptree &result){
+    if(this->_cc->camera_found() == false)
+        return CCA_API_RESPONSE_CAMERA_NOT_FOUND;
+    
+    ptree timing;
+    int ret = this->_cc->bulb(this->_seconds, timing);
+    if(ret == GP_ERROR_NOT_SUPPORTED)
+        return CCA_API_RESPONSE_NOT_SUPPORTED;
+    if(ret < GP_OK)
+        return CCA_API_RESPONSE_INVALID;
+    result.put_child("timing", timing);
+    
+    string timeout, settle;
+    Settings::getInstance()->get_value("sequence.timeout_ms", timeout);
+    Settings::getInstance()->get_value("sequence.settle_ms", settle);
+    int timeout_ms = atoi(timeout.c_str()) > 0 ? atoi(timeout.c_str()) : 30000;
+    int settle_ms = atoi(settle.c_str()) > 0 ? atoi(settle.c_str()) : 200;
+    
+    // long exposures are followed by a dark frame of the same length
+    vector<CameraFilePath> paths;
+    ret = this->_cc->wait_for_files(timeout_ms + (int)(this->_seconds * 1000), settle_ms, paths);
+    if(ret < GP_OK)
+        return CCA_API_RESPONSE_INVALID;
+    
+    // RAW+JPEG are two files, all of them go to the spool
+    ptree files;
+    Stopwatch watch;
+    double download_ms = 0, write_ms = 0;
+    for(size_t f = 0; f < paths.size() && ret >= GP_OK; f++){
+        CameraFile *file;
+        if(gp_file_new(&file) < GP_OK)
+            return CCA_API_RESPONSE_INVALID;
+        
+        watch.restart();
+        ret = this->_cc->download(paths[f], file, true);
+        download_ms += watch.lap_ms();
+        
+        const char *data = NULL;
+        unsigned long size = 0;
+        if(ret >= GP_OK)
+            ret = gp_file_get_data_and_size(file, &data, &size);
+        
+        string written;
+        if(ret >= GP_OK){
+            char name[256];
+            snprintf(name, sizeof(name), "bulb-%ld-%s", (long)time(NULL), paths[f].name);
+            if(CaptureSpool::getInstance()->write(name, data, size, written)){
+                ptree entry;
+                entry.put("file", written);
+                entry.put("size", size);
+                files.push_back(std::make_pair("", entry));
+                write_ms += watch.lap_ms();
+            } else {
+                ret = GP_ERROR_IO;
+            }
+        }
+        gp_file_unref(file);
+    }
+    result.put("download_ms", download_ms);
+    result.put("write_ms", write_ms);
+    result.put_child("files", files);
+    
+    return ret >= GP_OK ? CCA_API_RESPONSE_SUCCESS : CCA_API_RESPONSE_INVALID;
+}
+
+ScriptJob::ScriptJob(CameraController *cc, CommandScript *script){
+    this->_cc = cc;
+    this->_script = script;
+    this->_writer = NULL;
+    this->_run_id = 0;
+    this->_steps = 0;
+}
+
+ScriptJob::~ScriptJob(){
+    delete this->_script;
+}
+
+const char* ScriptJob::kind() const {
+    return "script";
+}
+
+int ScriptJob::run(ptree &result){
+    if(this->_cc->camera_found() == false)
+        return CCA_API_RESPONSE_CAMERA_NOT_FOUND;
+    
+    Stopwatch total;
+    SpoolWriter writer(CaptureSpool::getInstance(), 4);
+    this->_writer = &writer;
+    this->_run_id = (long)time(NULL);
+    int ret = this->_run(this->_script->steps());
+    
+    vector<SpoolResult> results;
+    writer.finish(results);
+    this->_writer = NULL;
+    
+    map<string, const SpoolResult *> written;
+    for(size_t i = 0; i < results.size(); i++)
+        written[results[i].name] = &results[i];
+    
+    ptree files;
+    bool all_written = true;
+    for(size_t i = 0; i < this->_captures.size(); i++){
+        ptree file;
+        file.put("step",        this->_captures[i].step);
+        file.put("camera_file", this->_captures[i].camera_file);
+        map<string, const SpoolResult *>::iterator it = written.find(this->_captures[i].name);
+        if(it != written.end()){
+            file.put("file",    it->second->path);
+            file.put("size",    it->second->size);
+            file.put("written", it->second->ok);
+            all_written = all_written && it->second->ok;
+        }
+        files.push_back(std::make_pair("", file));
+    }
+    
+    ptree planned;
+    this->_script->describe(planned);
+    result.put_child("planned",  planned);
+    result.put("steps",          this->_steps);
+    result.put("captures",       this->_captures.size());
+    result.put("total_ms",       total.elapsed_ms());
+    result.put_child("files",    files);
+    if(ret < GP_OK){
+        result.put("error",       ret);
+        result.put("failed_step", this->_failed);
+        result.put("stopped",     ret == GP_ERROR_CANCEL);
+    }
+    
+    if(ret == GP_ERROR_NOT_SUPPORTED)
+        return CCA_API_RESPONSE_NOT_SUPPORTED;
+    return ret >= GP_OK && all_written ? CCA_API_RESPONSE_SUCCESS : CCA_API_RESPONSE_INVALID;
+}
+
+int ScriptJob::_run(const vector<ScriptStep> &steps){
+    JobQueue *queue = JobQueue::getInstance();
+    for(size_t i = 0; i < steps.size(); i++){
+        const ScriptStep &step = steps[i];
+        int ret;
+        if(step.op == CCA_SCRIPT_LOOP){
+            ret = GP_OK;
+            for(unsigned long n = 0; n < step.count && ret >= GP_OK; n++)
+                ret = this->_run(step.steps);
+            if(ret < GP_OK)
+                return ret;
+            continue;
+        }
+        
+        if(queue->stopping()){
+            this->_failed = step.path;
+            return GP_ERROR_CANCEL;
+        }
+        ret = this->_step(step);
+        this->_steps++;
+        if(ret < GP_OK){
+            this->_failed = step.path;
+            return ret;
+        }
+    }
+    return GP_OK;
+}
+
+int ScriptJob::_step(const ScriptStep &step){
+    int ret = GP_OK;
+    switch(step.op){
+        case CCA_SCRIPT_SET:
+            ret = this->_cc->set_setting(step.setting, step.value);
+            break;
+        case CCA_SCRIPT_WAIT:
+            ret = this->_wait(step.ms);
+            break;
+        case CCA_SCRIPT_CAPTURE:
+            ret = this->_capture(step);
+            break;
+        case CCA_SCRIPT_FOCUS:
+            this->_cc->lock();
+            ret = this->_cc->focus_begin();
+            if(ret >= GP_OK){
+                ret = this->_cc->focus_step(step.step);
+                this->_cc->focus_end();
+            }
+            this->_cc->unlock();
+            break;
+        case CCA_SCRIPT_LOOP:
+            break;
+    }
+    return ret;
+}
+
+int ScriptJob::_capture(const ScriptStep &step){
+    CameraFilePath path;
+    int ret = this->_cc->capture_file(&path);
+    if(ret < GP_OK)
+        return ret;
+    
+    CameraFile *file;
+    ret = gp_file_new(&file);
+    if(ret < GP_OK)
+        return ret;
+    ret = this->_cc->download(path, file, true);
+    if(ret < GP_OK){
+        gp_file_unref(file);
+        return ret;
+    }
+    
+    char name[512];
+    snprintf(name, sizeof(name), "script-%ld-%05lu-%s", this->_run_id, (unsigned long)this->_captures.size(), path.name);
+    Capture capture;
+    capture.name = name;
+    capture.camera_file = string(path.folder) + "/" + path.name;
+    capture.step = step.path;
+    this->_captures.push_back(capture);
+    // the writer takes the file over
+    this->_writer->submit(capture.name, file);
+    return GP_OK;
+}
+
+/*
+ * Sleeps without the camera lock, in slices so a shutdown does not wait
+ * for the whole time.
+ */
+int ScriptJob::_wait(int ms){
+    JobQueue *queue = JobQueue::getInstance();
+    Stopwatch watch;
+    while(true){
+        double left = ms - watch.elapsed_ms();
+        if(left <= 0)
+            return GP_OK;
+        if(queue->stopping())
+            return GP_ERROR_CANCEL;
+        usleep((useconds_t)((left < 100 ? left : 100) * 1000));
+    }
+}
@@ -0,0 +1,83 @@
+//
+//  CameraJobs.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CameraJobs__
+#define __CameraControllerApi__CameraJobs__
+
+#include "JobQueue.h"
+#include "CameraController.h"
+#include "Spool.h"
+#include "CommandScript.h"
+
+namespace CameraControllerApi {
+
+    /*
+     * A single shot, the result is the same as for the synchronous
+     * /capture?action=shot.
+     */
+    class ShotJob : public Job {
+    public:
+        ShotJob(CameraController *cc);
+        const char* kind() const;
+        int run(ptree &result);
+
+    private:
+        CameraController *_cc;
+    };
+
+    /*
+     * A bulb exposure, timed on the camera worker, followed by the download
+     * of the file to the spool.
+     */
+    class BulbJob : public Job {
+    public:
+        BulbJob(CameraController *cc, double seconds);
+        const char* kind() const;
+        int run(ptree &result);
+
+    private:
+        CameraController *_cc;
+        double _seconds;
+    };
+
+    /*
+     * A script (see CommandScript), run step by step on the camera worker.
+     * The camera is only locked for a step, a wait leaves it to the liveview
+     * and the other requests. Captured files go to the spool on a
+     * SpoolWriter while the script goes on. The script stops at the first
+     * step which fails, and between steps when the server shuts down.
+     */
+    class ScriptJob : public Job {
+    public:
+        ScriptJob(CameraController *cc, CommandScript *script);
+        ~ScriptJob();
+        const char* kind() const;
+        int run(ptree &result);
+
+    private:
+        struct Capture {
+            string name;
+            string camera_file;
+            string step;
+        };
+
+        CameraController *_cc;
+        CommandScript *_script;
+        SpoolWriter *_writer;
+        long _run_id;
+        unsigned long _steps;
+        vector<Capture> _captures;
+        string _failed;
+
+        int _run(const vector<ScriptStep> &steps);
+        int _step(const ScriptStep &step);
+        int _capture(const ScriptStep &step);
+        int _wait(int ms);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CameraJobs__) */
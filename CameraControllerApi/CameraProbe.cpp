@@ -0,0 +1,314 @@
+//
+//  CameraProbe.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CameraProbe.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define CCA_PROBE_CACHE_MAGIC "CCAPROBE"
+
+using namespace CameraControllerApi;
+using std::vector;
+
+struct ProbeCandidate {
+    CameraProbe *probe;
+    CameraAbilities abilities;
+    GPPortInfoList *ports;
+    string path;
+    Camera *camera;
+    int ret;
+    bool started;
+    pthread_t thread;
+};
+
+CameraProbe::CameraProbe(const string &cache_file, int threads){
+    this->_cache_file = cache_file;
+    this->_threads = threads > 0 ? threads : 1;
+    this->_abilities = NULL;
+    this->_probes = 0;
+    this->_cache_hits = 0;
+    this->_detections = 0;
+    this->_candidates = 0;
+    this->_abilities_ms = 0;
+    this->_last_probe_ms = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+}
+
+CameraProbe::~CameraProbe(){
+    if(this->_abilities != NULL)
+        gp_abilities_list_free(this->_abilities);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+int CameraProbe::open(GPContext *ctx, Camera **camera){
+    Stopwatch watch;
+    *camera = NULL;
+
+    int ret = this->_open_cached(ctx, camera);
+    bool cached = (ret == GP_OK);
+    if(!cached)
+        ret = this->_open_detected(ctx, camera);
+
+    ScopedLock lock(&this->_lock);
+    this->_probes++;
+    if(cached)
+        this->_cache_hits++;
+    this->_last_probe_ms = watch.elapsed_ms();
+    return ret;
+}
+
+int CameraProbe::_open_port(const CameraAbilities &abilities, GPPortInfoList *ports, const string &path, GPContext *ctx, Camera **camera){
+    int index = gp_port_info_list_lookup_path(ports, path.c_str());
+    if(index < GP_OK)
+        return index;
+
+    GPPortInfo info;
+    int ret = gp_port_info_list_get_info(ports, index, &info);
+    if(ret < GP_OK)
+        return ret;
+
+    Camera *cam;
+    ret = gp_camera_new(&cam);
+    if(ret < GP_OK)
+        return ret;
+
+    ret = gp_camera_set_abilities(cam, abilities);
+    if(ret >= GP_OK)
+        ret = gp_camera_set_port_info(cam, info);
+    if(ret >= GP_OK)
+        ret = gp_camera_init(cam, ctx);
+
+    if(ret < GP_OK){
+        gp_camera_unref(cam);
+        return ret;
+    }
+    *camera = cam;
+    return GP_OK;
+}
+
+/*
+ * The cached port is exact for serial and PTP/IP cameras. A USB body gets a
+ * new device number when it is plugged in again, so "usb:" (any matching
+ * device) is tried after the stored one.
+ */
+int CameraProbe::_open_cached(GPContext *ctx, Camera **camera){
+    CameraAbilities abilities;
+    string path;
+    if(!this->_read_cache(abilities, path))
+        return GP_ERROR_MODEL_NOT_FOUND;
+
+    GPPortInfoList *ports;
+    int ret = gp_port_info_list_new(&ports);
+    if(ret < GP_OK)
+        return ret;
+
+    ret = gp_port_info_list_load(ports);
+    if(ret >= GP_OK){
+        ret = this->_open_port(abilities, ports, path, ctx, camera);
+        if(ret < GP_OK && path.compare(0, 4, "usb:") == 0 && path != "usb:")
+            ret = this->_open_port(abilities, ports, "usb:", ctx, camera);
+    }
+    gp_port_info_list_free(ports);
+
+    if(ret == GP_OK){
+        ScopedLock lock(&this->_lock);
+        this->_last_model = abilities.model;
+        this->_last_path = path;
+    }
+    return ret;
+}
+
+int CameraProbe::_load_abilities(GPContext *ctx){
+    if(this->_abilities != NULL)
+        return GP_OK;
+
+    Stopwatch watch;
+    CameraAbilitiesList *list;
+    int ret = gp_abilities_list_new(&list);
+    if(ret < GP_OK)
+        return ret;
+
+    ret = gp_abilities_list_load(list, ctx);
+    if(ret < GP_OK){
+        gp_abilities_list_free(list);
+        return ret;
+    }
+
+    this->_abilities = list;
+    ScopedLock lock(&this->_lock);
+    this->_abilities_ms = watch.elapsed_ms();
+    return GP_OK;
+}
+
+void* CameraProbe::_probe_candidate(void *context){
+    ProbeCandidate *candidate = static_cast<ProbeCandidate *>(context);
+    GPContext *ctx = gp_context_new();
+    candidate->ret = candidate->probe->_open_port(candidate->abilities, candidate->ports, candidate->path, ctx, &candidate->camera);
+    gp_context_unref(ctx);
+    return NULL;
+}
+
+int CameraProbe::_open_detected(GPContext *ctx, Camera **camera){
+    int ret = this->_load_abilities(ctx);
+    if(ret < GP_OK)
+        return ret;
+
+    GPPortInfoList *ports;
+    ret = gp_port_info_list_new(&ports);
+    if(ret < GP_OK)
+        return ret;
+
+    CameraList *detected;
+    ret = gp_port_info_list_load(ports);
+    if(ret >= GP_OK)
+        ret = gp_list_new(&detected);
+    if(ret < GP_OK){
+        gp_port_info_list_free(ports);
+        return ret;
+    }
+
+    ret = gp_abilities_list_detect(this->_abilities, ports, detected, ctx);
+
+    vector<ProbeCandidate> candidates;
+    for(int i = 0; ret >= GP_OK && i < gp_list_count(detected); i++){
+        const char *model, *path;
+        gp_list_get_name(detected, i, &model);
+        gp_list_get_value(detected, i, &path);
+
+        int index = gp_abilities_list_lookup_model(this->_abilities, model);
+        if(index < GP_OK)
+            continue;
+
+        ProbeCandidate candidate;
+        candidate.probe = this;
+        candidate.ports = ports;
+        candidate.path = path;
+        candidate.camera = NULL;
+        candidate.ret = GP_ERROR_MODEL_NOT_FOUND;
+        candidate.started = false;
+        if(gp_abilities_list_get_abilities(this->_abilities, index, &candidate.abilities) >= GP_OK)
+            candidates.push_back(candidate);
+    }
+    gp_list_free(detected);
+
+    // in batches of _threads, the first batch with a working camera ends the search
+    int winner = -1;
+    for(size_t first = 0; winner < 0 && first < candidates.size(); first += this->_threads){
+        size_t last = first + this->_threads < candidates.size() ? first + this->_threads : candidates.size();
+        for(size_t i = first; i < last; i++){
+            // a single candidate (the usual case) is opened on this thread
+            if(last - first > 1)
+                candidates[i].started = (0 == pthread_create(&candidates[i].thread, NULL, CameraProbe::_probe_candidate, &candidates[i]));
+            if(!candidates[i].started)
+                candidates[i].ret = this->_open_port(candidates[i].abilities, ports, candidates[i].path, ctx, &candidates[i].camera);
+        }
+        for(size_t i = first; i < last; i++){
+            if(candidates[i].started)
+                pthread_join(candidates[i].thread, NULL);
+            if(candidates[i].ret < GP_OK)
+                continue;
+            if(winner < 0){
+                winner = (int)i;
+            } else {
+                gp_camera_exit(candidates[i].camera, ctx);
+                gp_camera_unref(candidates[i].camera);
+            }
+        }
+    }
+    gp_port_info_list_free(ports);
+
+    {
+        ScopedLock lock(&this->_lock);
+        this->_detections++;
+        this->_candidates += candidates.size();
+        if(winner >= 0){
+            this->_last_model = candidates[winner].abilities.model;
+            this->_last_path = candidates[winner].path;
+        }
+    }
+
+    if(winner < 0)
+        return ret < GP_OK ? ret : GP_ERROR_MODEL_NOT_FOUND;
+
+    this->_write_cache(candidates[winner].abilities, candidates[winner].path);
+    Logger::getInstance()->log(CCA_LOG_INFO, "probe", "op=detect model=\"%s\" port=%s candidates=%lu", candidates[winner].abilities.model, candidates[winner].path.c_str(), (unsigned long)candidates.size());
+    *camera = candidates[winner].camera;
+    return GP_OK;
+}
+
+/*
+ * The cache holds the raw CameraAbilities. Its size is stored with it, so a
+ * cache written by a different libgphoto2 build is ignored instead of read
+ * into the wrong layout.
+ */
+bool CameraProbe::_read_cache(CameraAbilities &abilities, string &path){
+    if(this->_cache_file.empty())
+        return false;
+
+    FILE *fd = fopen(this->_cache_file.c_str(), "rb");
+    if(fd == NULL)
+        return false;
+
+    char magic[8];
+    unsigned int size = 0, path_size = 0;
+    char buf[256];
+    bool ok = fread(magic, 1, sizeof(magic), fd) == sizeof(magic)
+        && memcmp(magic, CCA_PROBE_CACHE_MAGIC, sizeof(magic)) == 0
+        && fread(&size, sizeof(size), 1, fd) == 1
+        && size == sizeof(CameraAbilities)
+        && fread(&abilities, sizeof(CameraAbilities), 1, fd) == 1
+        && fread(&path_size, sizeof(path_size), 1, fd) == 1
+        && path_size > 0 && path_size < sizeof(buf)
+        && fread(buf, 1, path_size, fd) == path_size;
+    fclose(fd);
+
+    if(ok)
+        path.assign(buf, path_size);
+    return ok;
+}
+
+void CameraProbe::_write_cache(const CameraAbilities &abilities, const string &path){
+    if(this->_cache_file.empty())
+        return;
+
+    string tmp = this->_cache_file + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if(fd == NULL){
+        Logger::getInstance()->log(CCA_LOG_WARN, "probe", "op=write_cache file=%s error=open", tmp.c_str());
+        return;
+    }
+
+    unsigned int size = sizeof(CameraAbilities);
+    unsigned int path_size = (unsigned int)path.size();
+    bool ok = fwrite(CCA_PROBE_CACHE_MAGIC, 1, 8, fd) == 8
+        && fwrite(&size, sizeof(size), 1, fd) == 1
+        && fwrite(&abilities, sizeof(CameraAbilities), 1, fd) == 1
+        && fwrite(&path_size, sizeof(path_size), 1, fd) == 1
+        && fwrite(path.data(), 1, path_size, fd) == path_size;
+    ok = (fclose(fd) == 0) && ok;
+
+    if(!ok || rename(tmp.c_str(), this->_cache_file.c_str()) != 0){
+        remove(tmp.c_str());
+        Logger::getInstance()->log(CCA_LOG_WARN, "probe", "op=write_cache file=%s error=write", this->_cache_file.c_str());
+    }
+}
+
+void CameraProbe::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("probes",        this->_probes);
+    tree.put("cache_hits",    this->_cache_hits);
+    tree.put("detections",    this->_detections);
+    tree.put("candidates",    this->_candidates);
+    tree.put("abilities_ms",  this->_abilities_ms);
+    tree.put("last_probe_ms", this->_last_probe_ms);
+    tree.put("model",         this->_last_model);
+    tree.put("port",          this->_last_path);
+}
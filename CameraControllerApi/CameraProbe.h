@@ -0,0 +1,69 @@
+//
+//  CameraProbe.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CameraProbe__
+#define __CameraControllerApi__CameraProbe__
+
+#include <iostream>
+#include <string>
+#include <pthread.h>
+#include <gphoto2/gphoto2-camera.h>
+#include <gphoto2/gphoto2-abilities-list.h>
+#include <gphoto2/gphoto2-port-info-list.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Finds and opens a camera without the cost of gp_camera_init's
+     * autodetection, which loads every camera driver on each call.
+     *
+     * open() first tries the body from the cache file (its abilities and
+     * port, written after the last successful probe), which needs no driver
+     * list at all. If that fails the abilities list is loaded once and kept
+     * for later reconnects, the ports are scanned with
+     * gp_abilities_list_detect and the candidates are initialized in
+     * parallel, at most `threads` at a time. The first one in detection order
+     * which comes up is kept, the others are closed again.
+     */
+    class CameraProbe {
+    public:
+        CameraProbe(const string &cache_file, int threads);
+        ~CameraProbe();
+
+        int open(GPContext *ctx, Camera **camera);
+        void stats(ptree &tree);
+
+    private:
+        pthread_mutex_t _lock;
+        string _cache_file;
+        int _threads;
+        CameraAbilitiesList *_abilities;
+
+        unsigned long _probes;
+        unsigned long _cache_hits;
+        unsigned long _detections;
+        unsigned long _candidates;
+        double _abilities_ms;
+        double _last_probe_ms;
+        string _last_model;
+        string _last_path;
+
+        int _open_port(const CameraAbilities &abilities, GPPortInfoList *ports, const string &path, GPContext *ctx, Camera **camera);
+        int _open_cached(GPContext *ctx, Camera **camera);
+        int _open_detected(GPContext *ctx, Camera **camera);
+        int _load_abilities(GPContext *ctx);
+        bool _read_cache(CameraAbilities &abilities, string &path);
+        void _write_cache(const CameraAbilities &abilities, const string &path);
+        static void* _probe_candidate(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CameraProbe__) */
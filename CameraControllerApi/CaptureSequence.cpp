@@ -0,0 +1,333 @@
+//
+//  CaptureSequence.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CaptureSequence.h"
+#include "Settings.h"
+#include "Stopwatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+
+using namespace CameraControllerApi;
+using std::vector;
+
+struct shot_timing {
+    vector<CameraFilePath> paths;
+    Stopwatch since_trigger;
+    double prepare_ms;
+    double capture_ms;
+    double download_ms;
+    int result;
+};
+
+CaptureSequence::CaptureSequence(CameraController *cc, CaptureSpool *spool, const string &prefix){
+    this->_cc = cc;
+    this->_spool = spool;
+    this->_prefix = prefix;
+    
+    string timeout;
+    Settings::getInstance()->get_value("sequence.timeout_ms", timeout);
+    this->_timeout_ms = atoi(timeout.c_str());
+    if(this->_timeout_ms <= 0)
+        this->_timeout_ms = 30000;
+    
+    string settle;
+    Settings::getInstance()->get_value("sequence.settle_ms", settle);
+    this->_settle_ms = atoi(settle.c_str()) > 0 ? atoi(settle.c_str()) : 200;
+}
+
+bool CaptureSequence::run(int shots, ptree &report){
+    Stopwatch total, watch;
+    SpoolWriter writer(this->_spool, 4);
+    shot_timing empty = shot_timing();
+    vector<shot_timing> timings(shots, empty);
+    vector<vector<string> > names(shots);
+    char name[512];
+    long run_id = (long)time(NULL);
+    bool pipelined = true;
+    // a shot was triggered and its files not collected yet
+    bool outstanding = false;
+    int ret = GP_OK;
+    int done = 0;
+    
+    this->_cc->lock();
+    ret = this->begin();
+    bool begun = (ret >= GP_OK);
+    
+    if(begun && shots > 0){
+        watch.restart();
+        ret = this->prepare(0);
+        timings[0].prepare_ms = watch.lap_ms();
+        if(ret >= GP_OK){
+            timings[0].since_trigger.restart();
+            ret = this->_cc->trigger();
+            outstanding = (ret >= GP_OK);
+            if(ret == GP_ERROR_NOT_SUPPORTED){
+                pipelined = false;
+                ret = GP_OK;
+            }
+        }
+    }
+    
+    for(int i = 0; i < shots && ret >= GP_OK; i++){
+        shot_timing &t = timings[i];
+        
+        if(pipelined){
+            // the trigger of this shot was issued last round, all of its
+            // files are in before the next one is triggered
+            ret = this->_cc->wait_for_files(this->_timeout_ms, this->_settle_ms, t.paths);
+            t.capture_ms = t.since_trigger.elapsed_ms();
+            outstanding = false;
+            if(ret < GP_OK)
+                break;
+            
+            if(i + 1 < shots){
+                watch.restart();
+                ret = this->prepare(i + 1);
+                timings[i + 1].prepare_ms = watch.lap_ms();
+                if(ret < GP_OK)
+                    break;
+                timings[i + 1].since_trigger.restart();
+                ret = this->_cc->trigger();
+                if(ret < GP_OK)
+                    break;
+                outstanding = true;
+            }
+        } else {
+            watch.restart();
+            if(i > 0){
+                ret = this->prepare(i);
+                t.prepare_ms = watch.lap_ms();
+                if(ret < GP_OK)
+                    break;
+            }
+            CameraFilePath path;
+            ret = this->_cc->capture_file(&path);
+            if(ret >= GP_OK){
+                // the capture returns one file, a second one comes as an event
+                t.paths.push_back(path);
+                ret = this->_cc->wait_for_files(this->_timeout_ms, this->_settle_ms, t.paths);
+            }
+            t.capture_ms = watch.lap_ms();
+            if(ret < GP_OK)
+                break;
+        }
+        
+        Stopwatch download;
+        for(size_t f = 0; f < t.paths.size() && ret >= GP_OK; f++){
+            CameraFile *file;
+            ret = gp_file_new(&file);
+            if(ret < GP_OK)
+                break;
+            ret = this->_cc->download(t.paths[f], file, true);
+            if(ret < GP_OK){
+                gp_file_unref(file);
+                break;
+            }
+            
+            snprintf(name, sizeof(name), "%s-%ld-%03d-%s", this->_prefix.c_str(), run_id, i, t.paths[f].name);
+            names[i].push_back(name);
+            writer.submit(names[i].back(), file);
+        }
+        t.download_ms = download.elapsed_ms();
+        if(ret < GP_OK)
+            break;
+        done++;
+    }
+    
+    // the run stopped with the next shot already taken, it is not kept
+    int discarded = 0;
+    if(outstanding){
+        vector<CameraFilePath> paths;
+        if(this->_cc->wait_for_files(this->_timeout_ms, this->_settle_ms, paths) >= GP_OK){
+            for(size_t f = 0; f < paths.size(); f++){
+                if(this->_cc->delete_file(paths[f]) >= GP_OK)
+                    discarded++;
+            }
+        }
+    }
+    
+    if(begun)
+        this->end();
+    this->_cc->unlock();
+    
+    vector<SpoolResult> results;
+    writer.finish(results);
+    
+    ptree list;
+    double serial = 0;
+    for(int i = 0; i < done; i++){
+        ptree shot, files;
+        shot.put("index",       i);
+        shot.put("prepare_ms",  timings[i].prepare_ms);
+        shot.put("capture_ms",  timings[i].capture_ms);
+        shot.put("download_ms", timings[i].download_ms);
+        serial += timings[i].prepare_ms + timings[i].capture_ms + timings[i].download_ms;
+        
+        for(size_t f = 0; f < names[i].size(); f++){
+            ptree entry;
+            entry.put("camera_file", string(timings[i].paths[f].folder) + "/" + timings[i].paths[f].name);
+            for(size_t r = 0; r < results.size(); r++){
+                if(results[r].name != names[i][f])
+                    continue;
+                entry.put("file",       results[r].path);
+                entry.put("size",       results[r].size);
+                entry.put("write_ms",   results[r].write_ms);
+                entry.put("written",    results[r].ok);
+                serial += results[r].write_ms;
+                if(!results[r].ok)
+                    ret = GP_ERROR_OS_FAILURE;
+            }
+            files.push_back(std::make_pair("", entry));
+        }
+        shot.put_child("files", files);
+        this->describe(i, shot);
+        list.push_back(std::make_pair("", shot));
+    }
+    
+    report.put("shots",         shots);
+    report.put("completed",     done);
+    report.put("pipelined",     pipelined);
+    report.put("total_ms",      total.elapsed_ms());
+    report.put("serial_ms",     serial);
+    report.put_child("files",   list);
+    if(discarded > 0)
+        report.put("discarded", discarded);
+    if(ret < GP_OK)
+        report.put("error", ret);
+    
+    return ret >= GP_OK && done == shots;
+}
+
+FocusBracketSequence::FocusBracketSequence(CameraController *cc, CaptureSpool *spool, int step)
+    : CaptureSequence(cc, spool, "focus"){
+    this->_step = step;
+}
+
+int FocusBracketSequence::begin(){
+    return this->_cc->focus_begin();
+}
+
+int FocusBracketSequence::prepare(int index){
+    if(index == 0)
+        return GP_OK;
+    return this->_cc->focus_step(this->_step);
+}
+
+void FocusBracketSequence::end(){
+    this->_cc->focus_end();
+}
+
+void FocusBracketSequence::describe(int index, ptree &shot){
+    shot.put("focus_offset", index * this->_step);
+}
+
+ExposureBracketSequence::ExposureBracketSequence(CameraController *cc, CaptureSpool *spool, const vector<double> &offsets)
+    : CaptureSequence(cc, spool, "bracket"){
+    this->_offsets = offsets;
+}
+
+/*
+ * Exposure time in seconds of a shutter speed choice ("1/250", "0.5", "30",
+ * "2.5s", "1\"3"), or -1 for bulb and anything else without a fixed time.
+ */
+double ExposureBracketSequence::shutter_seconds(const string &choice){
+    string value = choice;
+    size_t quote = value.find('"');
+    if(quote != string::npos)
+        value[quote] = '.';
+    
+    char *end = NULL;
+    double seconds = strtod(value.c_str(), &end);
+    if(end == value.c_str() || seconds <= 0)
+        return -1;
+    
+    if(*end == '/'){
+        double denominator = strtod(end + 1, &end);
+        if(denominator <= 0)
+            return -1;
+        seconds /= denominator;
+    }
+    
+    if(*end != '\0' && *end != 's')
+        return -1;
+    return seconds;
+}
+
+int ExposureBracketSequence::begin(){
+    vector<string> choices;
+    
+    if(!this->_cc->setting_name("speed", this->_key))
+        return GP_ERROR_NOT_SUPPORTED;
+    
+    int ret = this->_cc->config_begin();
+    if(ret < GP_OK)
+        return ret;
+    
+    ret = this->_cc->config_choices(this->_key.c_str(), choices, this->_original);
+    
+    double base = ExposureBracketSequence::shutter_seconds(this->_original);
+    if(ret >= GP_OK && base <= 0)
+        ret = GP_ERROR_BAD_PARAMETERS;
+    
+    if(ret < GP_OK){
+        this->_cc->config_end();
+        return ret;
+    }
+    
+    // parse the choices once, then pick the nearest one in EV per offset
+    vector<double> seconds(choices.size());
+    for(size_t c = 0; c < choices.size(); c++)
+        seconds[c] = ExposureBracketSequence::shutter_seconds(choices[c]);
+    
+    this->_speeds.clear();
+    this->_actual.clear();
+    for(size_t i = 0; i < this->_offsets.size(); i++){
+        double target = log2(base) + this->_offsets[i];
+        int best = -1;
+        for(size_t c = 0; c < choices.size(); c++){
+            if(seconds[c] <= 0)
+                continue;
+            if(best < 0 || fabs(log2(seconds[c]) - target) < fabs(log2(seconds[best]) - target))
+                best = (int)c;
+        }
+        
+        if(best < 0){
+            this->_cc->config_end();
+            return GP_ERROR_BAD_PARAMETERS;
+        }
+        this->_speeds.push_back(choices[best]);
+        this->_actual.push_back(log2(seconds[best]) - log2(base));
+    }
+    
+    this->_current = this->_original;
+    return GP_OK;
+}
+
+int ExposureBracketSequence::prepare(int index){
+    if(this->_speeds[index] == this->_current)
+        return GP_OK;
+    
+    int ret = this->_cc->config_set(this->_key.c_str(), this->_speeds[index].c_str());
+    if(ret >= GP_OK)
+        this->_current = this->_speeds[index];
+    return ret;
+}
+
+void ExposureBracketSequence::end(){
+    if(this->_current != this->_original)
+        this->_cc->config_set(this->_key.c_str(), this->_original.c_str());
+    this->_cc->config_end();
+}
+
+void ExposureBracketSequence::describe(int index, ptree &shot){
+    shot.put("offset",          this->_offsets[index]);
+    shot.put("actual_offset",   this->_actual[index]);
+    shot.put("shutterspeed",    this->_speeds[index]);
+}
@@ -0,0 +1,113 @@
+//
+//  CaptureSequence.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CaptureSequence__
+#define __CameraControllerApi__CaptureSequence__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include "CameraController.h"
+#include "Spool.h"
+
+using std::string;
+using std::vector;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * A run of shots with a camera change before every shot, written to the
+     * spool. When the body supports trigger_capture the run is pipelined:
+     *
+     *   prepare 0, trigger 0
+     *   wait for file 0, prepare 1, trigger 1, download 0 -> writer
+     *   wait for file 1, prepare 2, trigger 2, download 1 -> writer
+     *   ...
+     *
+     * so the download of shot N runs while the camera exposes and processes
+     * shot N+1, and the disk write runs on the spool writer thread. Without
+     * trigger_capture every shot is a blocking capture and download. A shot
+     * is every file the camera adds for it (RAW+JPEG are two), all of them
+     * are collected before the next trigger and spooled.
+     *
+     * The report has the timings of every stage; serial_ms is the sum of
+     * all stages, i.e. what the same run would have taken one step after the
+     * other. capture_ms runs from the trigger until the file is seen, so a
+     * camera that was done before the previous download finished is counted
+     * with the whole window and serial_ms is an upper bound.
+     */
+    class CaptureSequence {
+    public:
+        CaptureSequence(CameraController *cc, CaptureSpool *spool, const string &prefix);
+        virtual ~CaptureSequence(){};
+        bool run(int shots, ptree &report);
+
+    protected:
+        CameraController *_cc;
+
+        // called with the camera locked
+        virtual int begin(){ return GP_OK; }
+        virtual int prepare(int index) = 0;
+        virtual void end(){}
+        virtual void describe(int index, ptree &shot){}
+
+    private:
+        CaptureSpool *_spool;
+        string _prefix;
+        int _timeout_ms;
+        int _settle_ms;
+    };
+
+    /*
+     * Focus stacking: every shot after the first moves the focus by step
+     * (see CameraController::focus_step).
+     */
+    class FocusBracketSequence : public CaptureSequence {
+    public:
+        FocusBracketSequence(CameraController *cc, CaptureSpool *spool, int step);
+
+    protected:
+        int begin();
+        int prepare(int index);
+        void end();
+        void describe(int index, ptree &shot);
+
+    private:
+        int _step;
+    };
+
+    /*
+     * Exposure bracketing (AEB/HDR): one shot per offset in EV from the
+     * current shutter speed. The shutter choices are read once in begin()
+     * and the nearest choice for every offset is picked before the first
+     * shot, so a shot only costs one set_config (none if the speed does not
+     * change). The original speed is restored at the end.
+     */
+    class ExposureBracketSequence : public CaptureSequence {
+    public:
+        ExposureBracketSequence(CameraController *cc, CaptureSpool *spool, const vector<double> &offsets);
+        static double shutter_seconds(const string &choice);
+
+    protected:
+        int begin();
+        int prepare(int index);
+        void end();
+        void describe(int index, ptree &shot);
+
+    private:
+        vector<double> _offsets;
+        vector<string> _speeds;
+        vector<double> _actual;
+        string _key;
+        string _original;
+        string _current;
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CaptureSequence__) */
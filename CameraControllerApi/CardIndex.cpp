@@ -0,0 +1,219 @@
+//
+//  CardIndex.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CardIndex.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include <string.h>
+
+// DCIM trees are three or four levels deep, this only stops a broken driver
+#define CCA_CARD_MAX_DEPTH 16
+
+using namespace CameraControllerApi;
+
+CardIndex::CardIndex(){
+    this->_built = false;
+    this->_walks = 0;
+    this->_added = 0;
+    this->_removed = 0;
+    this->_walk_ms = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+}
+
+CardIndex::~CardIndex(){
+    pthread_mutex_destroy(&this->_lock);
+}
+
+static string join_path(const string &folder, const string &name){
+    return folder == "/" ? "/" + name : folder + "/" + name;
+}
+
+int CardIndex::_walk(Camera *camera, GPContext *ctx, const string &folder, map<string, Folder> &folders, int depth){
+    if(depth > CCA_CARD_MAX_DEPTH)
+        return GP_OK;
+
+    CameraList *list;
+    int ret = gp_list_new(&list);
+    if(ret < GP_OK)
+        return ret;
+
+    {
+        TraceSpan span("gphoto", "gp_camera_folder_list_files", folder.c_str());
+        ret = gp_camera_folder_list_files(camera, folder.c_str(), list, ctx);
+    }
+    if(ret >= GP_OK){
+        Folder &files = folders[folder];
+        for(int i = 0; i < gp_list_count(list); i++){
+            const char *name;
+            gp_list_get_name(list, i, &name);
+
+            CardFile file;
+            file.folder = folder;
+            file.name = name;
+            file.size = 0;
+            file.mtime = 0;
+            file.info = false;
+
+            CameraFileInfo info;
+            int got;
+            {
+                TraceSpan span("gphoto", "gp_camera_file_get_info", name);
+                got = gp_camera_file_get_info(camera, folder.c_str(), name, &info, ctx);
+            }
+            if(got >= GP_OK){
+                file.size = (info.file.fields & GP_FILE_INFO_SIZE) ? info.file.size : 0;
+                file.mtime = (info.file.fields & GP_FILE_INFO_MTIME) ? info.file.mtime : 0;
+                file.info = true;
+            }
+            files[file.name] = file;
+        }
+
+        gp_list_reset(list);
+        TraceSpan span("gphoto", "gp_camera_folder_list_folders", folder.c_str());
+        ret = gp_camera_folder_list_folders(camera, folder.c_str(), list, ctx);
+    }
+
+    vector<string> children;
+    for(int i = 0; ret >= GP_OK && i < gp_list_count(list); i++){
+        const char *name;
+        gp_list_get_name(list, i, &name);
+        children.push_back(join_path(folder, name));
+    }
+    gp_list_free(list);
+
+    for(size_t i = 0; ret >= GP_OK && i < children.size(); i++)
+        ret = this->_walk(camera, ctx, children[i], folders, depth + 1);
+    return ret;
+}
+
+int CardIndex::build(Camera *camera, GPContext *ctx){
+    Stopwatch watch;
+    map<string, Folder> folders;
+    int ret = this->_walk(camera, ctx, "/", folders, 0);
+    if(ret < GP_OK)
+        return ret;
+
+    ScopedLock lock(&this->_lock);
+    this->_folders.swap(folders);
+    this->_built = true;
+    this->_walks++;
+    this->_walk_ms = watch.elapsed_ms();
+    Logger::getInstance()->log(CCA_LOG_INFO, "card", "op=walk folders=%lu ms=%.0f", (unsigned long)this->_folders.size(), this->_walk_ms);
+    return GP_OK;
+}
+
+/*
+ * Asks the camera for the size and date of the files which were added
+ * since the walk.
+ */
+int CardIndex::fill_info(Camera *camera, GPContext *ctx){
+    vector<CameraFilePath> missing;
+    {
+        ScopedLock lock(&this->_lock);
+        for(map<string, Folder>::iterator folder = this->_folders.begin(); folder != this->_folders.end(); folder++){
+            for(Folder::iterator file = folder->second.begin(); file != folder->second.end(); file++){
+                if(file->second.info)
+                    continue;
+                CameraFilePath path;
+                strncpy(path.folder, folder->first.c_str(), sizeof(path.folder) - 1);
+                path.folder[sizeof(path.folder) - 1] = '\0';
+                strncpy(path.name, file->first.c_str(), sizeof(path.name) - 1);
+                path.name[sizeof(path.name) - 1] = '\0';
+                missing.push_back(path);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < missing.size(); i++){
+        CameraFileInfo info;
+        int ret;
+        {
+            TraceSpan span("gphoto", "gp_camera_file_get_info", missing[i].name);
+            ret = gp_camera_file_get_info(camera, missing[i].folder, missing[i].name, &info, ctx);
+        }
+        if(ret < GP_OK)
+            return ret;
+
+        // the index may have changed while the camera was asked
+        ScopedLock lock(&this->_lock);
+        map<string, Folder>::iterator folder = this->_folders.find(missing[i].folder);
+        if(folder == this->_folders.end())
+            continue;
+        Folder::iterator file = folder->second.find(missing[i].name);
+        if(file == folder->second.end())
+            continue;
+        file->second.size = (info.file.fields & GP_FILE_INFO_SIZE) ? info.file.size : 0;
+        file->second.mtime = (info.file.fields & GP_FILE_INFO_MTIME) ? info.file.mtime : 0;
+        file->second.info = true;
+    }
+    return GP_OK;
+}
+
+bool CardIndex::built(){
+    ScopedLock lock(&this->_lock);
+    return this->_built;
+}
+
+void CardIndex::clear(){
+    ScopedLock lock(&this->_lock);
+    this->_folders.clear();
+    this->_built = false;
+}
+
+void CardIndex::add(const CameraFilePath &path){
+    ScopedLock lock(&this->_lock);
+    // not walked yet, the walk will find it
+    if(!this->_built)
+        return;
+
+    CardFile &file = this->_folders[path.folder][path.name];
+    file.folder = path.folder;
+    file.name = path.name;
+    file.size = 0;
+    file.mtime = 0;
+    file.info = false;
+    this->_added++;
+}
+
+void CardIndex::remove(const CameraFilePath &path){
+    ScopedLock lock(&this->_lock);
+    map<string, Folder>::iterator folder = this->_folders.find(path.folder);
+    if(folder != this->_folders.end() && folder->second.erase(path.name) > 0)
+        this->_removed++;
+}
+
+/*
+ * The files in prefix and its subfolders, by folder and name.
+ */
+void CardIndex::files(const string &prefix, vector<CardFile> &out){
+    ScopedLock lock(&this->_lock);
+    for(map<string, Folder>::iterator folder = this->_folders.begin(); folder != this->_folders.end(); folder++){
+        const string &name = folder->first;
+        bool inside = prefix.empty() || prefix == "/" || name == prefix ||
+            (name.compare(0, prefix.size(), prefix) == 0 && name[prefix.size()] == '/');
+        if(!inside)
+            continue;
+        for(Folder::iterator file = folder->second.begin(); file != folder->second.end(); file++)
+            out.push_back(file->second);
+    }
+}
+
+void CardIndex::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    unsigned long files = 0;
+    for(map<string, Folder>::iterator folder = this->_folders.begin(); folder != this->_folders.end(); folder++)
+        files += folder->second.size();
+    tree.put("built",   this->_built);
+    tree.put("folders", this->_folders.size());
+    tree.put("files",   files);
+    tree.put("walks",   this->_walks);
+    tree.put("walk_ms", this->_walk_ms);
+    tree.put("added",   this->_added);
+    tree.put("removed", this->_removed);
+}
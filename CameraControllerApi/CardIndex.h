@@ -0,0 +1,75 @@
+//
+//  CardIndex.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CardIndex__
+#define __CameraControllerApi__CardIndex__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+#include <pthread.h>
+#include <gphoto2/gphoto2-camera.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using std::vector;
+using std::map;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    struct CardFile {
+        string folder;
+        string name;
+        unsigned long size;
+        time_t mtime;
+        bool info;
+    };
+
+    /*
+     * The folders and files on the memory card. build() walks the card once
+     * with gp_camera_folder_list_folders/files, after that the controller
+     * keeps it up to date with what it sees anyway: files from a capture or
+     * a FILE_ADDED event are added, files downloaded with remove are dropped.
+     * Added files get their size and date (one round trip each) only when
+     * they are listed. A reconnect clears the index.
+     *
+     * build(), fill_info() and the updates are called with the camera lock
+     * held; the index has its own lock for the readers.
+     */
+    class CardIndex {
+    public:
+        CardIndex();
+        ~CardIndex();
+
+        int build(Camera *camera, GPContext *ctx);
+        int fill_info(Camera *camera, GPContext *ctx);
+        bool built();
+        void clear();
+        void add(const CameraFilePath &path);
+        void remove(const CameraFilePath &path);
+        void files(const string &prefix, vector<CardFile> &out);
+        void stats(ptree &tree);
+
+    private:
+        typedef map<string, CardFile> Folder;
+
+        pthread_mutex_t _lock;
+        map<string, Folder> _folders;
+        bool _built;
+        unsigned long _walks;
+        unsigned long _added;
+        unsigned long _removed;
+        double _walk_ms;
+
+        int _walk(Camera *camera, GPContext *ctx, const string &folder, map<string, Folder> &folders, int depth);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CardIndex__) */
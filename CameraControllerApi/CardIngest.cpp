@@ -0,0 +1,347 @@
+//
+//  CardIngest.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CardIngest.h"
+#include "CameraController.h"
+#include "Spool.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "FrameHash.h"
+#include "Logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace CameraControllerApi;
+
+CardIngest* CardIngest::_instance = NULL;
+pthread_mutex_t CardIngest::_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+CardIngest* CardIngest::getInstance(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        _instance = new CardIngest();
+
+    return _instance;
+}
+
+void CardIngest::release(){
+    pthread_mutex_lock(&_instance_lock);
+    CardIngest *ingest = _instance;
+    _instance = NULL;
+    pthread_mutex_unlock(&_instance_lock);
+
+    if(ingest != NULL)
+        delete ingest;
+}
+
+CardIngest::CardIngest(){
+    string manifest, pipeline, verify;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("ingest.manifest", manifest);
+    sett->get_value("ingest.pipeline", pipeline);
+    sett->get_value("ingest.verify", verify);
+    this->_manifest = CaptureSpool::getInstance()->directory() + "/" + (manifest.empty() ? "ingest.manifest" : manifest);
+    this->_pipeline = atoi(pipeline.c_str()) > 0 ? atoi(pipeline.c_str()) : 2;
+    this->_verify = (verify == "true");
+
+    this->_cc = NULL;
+    this->_started = false;
+    this->_state = "idle";
+    this->_stop = false;
+    this->_error = GP_OK;
+    this->_files_total = 0;
+    this->_files_done = 0;
+    this->_files_skipped = 0;
+    this->_files_failed = 0;
+    this->_bytes_total = 0;
+    this->_bytes_done = 0;
+    this->_bytes_copied = 0;
+    this->_download_ms = 0;
+    this->_elapsed_ms = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+}
+
+/*
+ * A running ingest stops after the file it is downloading.
+ */
+CardIngest::~CardIngest(){
+    this->stop();
+    if(this->_started)
+        pthread_join(this->_thread, NULL);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Starts an ingest of folder and its subfolders, the whole card if folder
+ * is empty. False if one is running already.
+ */
+bool CardIngest::start(CameraController *cc, const string &folder){
+    ScopedLock lock(&this->_lock);
+    if(this->_state == "listing" || this->_state == "running")
+        return false;
+
+    // the last run is over, its thread only has to be collected
+    if(this->_started){
+        pthread_join(this->_thread, NULL);
+        this->_started = false;
+    }
+
+    this->_cc = cc;
+    this->_folder = folder;
+    this->_state = "listing";
+    this->_stop = false;
+    this->_error = GP_OK;
+    this->_current.clear();
+    this->_files_total = 0;
+    this->_files_done = 0;
+    this->_files_skipped = 0;
+    this->_files_failed = 0;
+    this->_bytes_total = 0;
+    this->_bytes_done = 0;
+    this->_bytes_copied = 0;
+    this->_download_ms = 0;
+    this->_elapsed_ms = 0;
+    this->_watch.restart();
+
+    this->_started = (0 == pthread_create(&this->_thread, NULL, CardIngest::_worker, this));
+    if(!this->_started)
+        this->_state = "failed";
+    return this->_started;
+}
+
+bool CardIngest::stop(){
+    ScopedLock lock(&this->_lock);
+    if(this->_state != "listing" && this->_state != "running")
+        return false;
+    this->_stop = true;
+    return true;
+}
+
+bool CardIngest::_stopping(){
+    ScopedLock lock(&this->_lock);
+    return this->_stop;
+}
+
+void CardIngest::status(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    bool active = (this->_state == "listing" || this->_state == "running");
+    double elapsed = active ? this->_watch.elapsed_ms() : this->_elapsed_ms;
+
+    tree.put("state", this->_state);
+    tree.put("folder", this->_folder.empty() ? "/" : this->_folder);
+    if(!this->_current.empty())
+        tree.put("current", this->_current);
+    tree.put("files.total", this->_files_total);
+    tree.put("files.done", this->_files_done);
+    tree.put("files.skipped", this->_files_skipped);
+    tree.put("files.failed", this->_files_failed);
+    tree.put("bytes.total", this->_bytes_total);
+    tree.put("bytes.done", this->_bytes_done);
+    tree.put("bytes.copied", this->_bytes_copied);
+    tree.put("elapsed_ms", elapsed);
+    // MB/s of the downloads alone, skipped files do not count
+    tree.put("mb_s", this->_download_ms > 0 ? this->_bytes_copied / 1048.576 / this->_download_ms : 0.0);
+    if(this->_error != GP_OK)
+        tree.put("error", this->_error);
+}
+
+/*
+ * One line per written file: folder, name, size, mtime, checksum and the
+ * name in the spool, separated by tabs. A later line for the same file
+ * replaces the earlier one.
+ */
+void CardIngest::_load_manifest(){
+    this->_entries.clear();
+    FILE *fd = fopen(this->_manifest.c_str(), "r");
+    if(fd == NULL)
+        return;
+
+    char line[1024];
+    while(fgets(line, sizeof(line), fd) != NULL){
+        char *fields[6];
+        int count = 0;
+        char *save = NULL;
+        for(char *field = strtok_r(line, "\t\n", &save); field != NULL && count < 6; field = strtok_r(NULL, "\t\n", &save))
+            fields[count++] = field;
+        if(count != 6)
+            continue;
+
+        ManifestEntry entry;
+        entry.size = strtoul(fields[2], NULL, 10);
+        entry.mtime = (time_t)strtol(fields[3], NULL, 10);
+        entry.checksum = strtoull(fields[4], NULL, 16);
+        entry.spool_name = fields[5];
+        this->_entries[string(fields[0]) + "/" + fields[1]] = entry;
+    }
+    fclose(fd);
+}
+
+/*
+ * True if the manifest has the file with the same size and date and the
+ * spool still has it.
+ */
+bool CardIngest::_ingested(const CardFile &file, const string &spool_name){
+    map<string, ManifestEntry>::iterator it = this->_entries.find(file.folder + "/" + file.name);
+    if(it == this->_entries.end())
+        return false;
+
+    const ManifestEntry &entry = it->second;
+    if(entry.spool_name != spool_name || entry.size != file.size || entry.mtime != file.mtime)
+        return false;
+
+    string path = CaptureSpool::getInstance()->directory() + "/" + spool_name;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0 || (unsigned long)st.st_size != entry.size)
+        return false;
+    if(!this->_verify)
+        return true;
+
+    FILE *fd = fopen(path.c_str(), "rb");
+    if(fd == NULL)
+        return false;
+    string data(entry.size, '\0');
+    bool read = entry.size == 0 || fread(&data[0], 1, entry.size, fd) == entry.size;
+    fclose(fd);
+    return read && frame_hash(data.data(), data.size()) == entry.checksum;
+}
+
+void CardIngest::_run(){
+    Logger *log = Logger::getInstance();
+    vector<CardFile> files;
+    int ret = this->_cc->card_files(this->_folder, false, files);
+    if(ret < GP_OK){
+        ScopedLock lock(&this->_lock);
+        this->_error = ret;
+        this->_state = "failed";
+        this->_elapsed_ms = this->_watch.elapsed_ms();
+        log->log(CCA_LOG_WARN, "ingest", "op=list folder=%s error=%d", this->_folder.c_str(), ret);
+        return;
+    }
+
+    this->_load_manifest();
+    {
+        ScopedLock lock(&this->_lock);
+        this->_state = "running";
+        this->_files_total = files.size();
+        for(size_t i = 0; i < files.size(); i++)
+            this->_bytes_total += files[i].size;
+    }
+
+    FILE *manifest = fopen(this->_manifest.c_str(), "a");
+    if(manifest == NULL)
+        log->log(CCA_LOG_WARN, "ingest", "op=manifest file=%s errno=%d", this->_manifest.c_str(), errno);
+
+    SpoolWriter writer(CaptureSpool::getInstance(), this->_pipeline);
+    map<string, CardFile> writing;
+    vector<SpoolResult> results;
+    bool last = false;
+
+    for(size_t i = 0; !last; i++){
+        last = (i >= files.size() || this->_stopping());
+
+        if(!last){
+            const CardFile &file = files[i];
+            string name = CaptureSpool::card_name(file.folder, file.name);
+            if(this->_ingested(file, name)){
+                ScopedLock lock(&this->_lock);
+                this->_files_skipped++;
+                this->_bytes_done += file.size;
+                continue;
+            }
+
+            {
+                ScopedLock lock(&this->_lock);
+                this->_current = file.folder + "/" + file.name;
+            }
+
+            CameraFilePath path;
+            strncpy(path.folder, file.folder.c_str(), sizeof(path.folder) - 1);
+            path.folder[sizeof(path.folder) - 1] = '\0';
+            strncpy(path.name, file.name.c_str(), sizeof(path.name) - 1);
+            path.name[sizeof(path.name) - 1] = '\0';
+
+            // a bulb exposure keeps the camera busy, the ingest goes on after it
+            while(this->_cc->exposing() && !this->_stopping())
+                usleep(100000);
+
+            Stopwatch watch;
+            CameraFile *data = NULL;
+            ret = gp_file_new(&data);
+            if(ret == GP_OK)
+                ret = this->_cc->download(path, data, false);
+
+            if(ret < GP_OK){
+                if(data != NULL)
+                    gp_file_unref(data);
+                ScopedLock lock(&this->_lock);
+                this->_files_failed++;
+                this->_error = ret;
+                log->log(CCA_LOG_WARN, "ingest", "op=download file=%s error=%d", this->_current.c_str(), ret);
+                continue;
+            }
+
+            const char *bytes;
+            unsigned long size = 0;
+            gp_file_get_data_and_size(data, &bytes, &size);
+            {
+                ScopedLock lock(&this->_lock);
+                this->_download_ms += watch.elapsed_ms();
+                this->_bytes_done += size;
+                this->_bytes_copied += size;
+            }
+            writing[name] = file;
+            // blocks while the writer is pipeline files behind
+            writer.submit(name, data);
+            writer.collect(results);
+        } else {
+            writer.finish(results);
+        }
+
+        for(size_t r = 0; r < results.size(); r++){
+            const SpoolResult &result = results[r];
+            map<string, CardFile>::iterator it = writing.find(result.name);
+            if(it == writing.end())
+                continue;
+
+            ScopedLock lock(&this->_lock);
+            if(!result.ok){
+                this->_files_failed++;
+                log->log(CCA_LOG_WARN, "ingest", "op=write file=%s", result.name.c_str());
+            } else {
+                this->_files_done++;
+                if(manifest != NULL){
+                    fprintf(manifest, "%s\t%s\t%lu\t%ld\t%016llx\t%s\n", it->second.folder.c_str(), it->second.name.c_str(),
+                            result.size, (long)it->second.mtime, (unsigned long long)result.checksum, result.name.c_str());
+                    // a crash loses at most the files which are being written
+                    fflush(manifest);
+                }
+            }
+            writing.erase(it);
+        }
+        results.clear();
+    }
+
+    if(manifest != NULL)
+        fclose(manifest);
+
+    ScopedLock lock(&this->_lock);
+    this->_current.clear();
+    this->_elapsed_ms = this->_watch.elapsed_ms();
+    this->_state = this->_stop ? "stopped" : "done";
+    log->log(CCA_LOG_INFO, "ingest", "op=done state=%s files=%lu done=%lu skipped=%lu failed=%lu bytes_copied=%lu ms=%.0f mb_s=%.2f",
+             this->_state.c_str(), this->_files_total, this->_files_done, this->_files_skipped, this->_files_failed,
+             this->_bytes_copied, this->_elapsed_ms, this->_download_ms > 0 ? this->_bytes_copied / 1048.576 / this->_download_ms : 0.0);
+}
+
+void* CardIngest::_worker(void *context){
+    static_cast<CardIngest *>(context)->_run();
+    return NULL;
+}
@@ -0,0 +1,99 @@
+//
+//  CardIngest.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CardIngest__
+#define __CameraControllerApi__CardIngest__
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+#include "CardIndex.h"
+#include "Stopwatch.h"
+
+using std::string;
+using std::map;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    class CameraController;
+
+    /*
+     * Copies the files of the card (or of one folder) to the spool on its
+     * own thread. The file list comes from the card index, the download of
+     * the next file runs while the SpoolWriter writes the last one, at most
+     * ingest.pipeline files are waiting for the disk.
+     *
+     * Every written file gets a line in the manifest (ingest.manifest in the
+     * spool directory) with its size, date and checksum. A run after a
+     * restart or a new card skips the files the manifest already has and
+     * whose spool file is still there, with ingest.verify the spool file is
+     * checked against the checksum as well.
+     *
+     * The camera lock is only held per file, captures and settings go on
+     * between two downloads.
+     */
+    class CardIngest {
+
+        static CardIngest *_instance;
+        static pthread_mutex_t _instance_lock;
+    public:
+        static CardIngest* getInstance();
+        static void release();
+
+        bool start(CameraController *cc, const string &folder);
+        bool stop();
+        void status(ptree &tree);
+
+    private:
+        struct ManifestEntry {
+            unsigned long size;
+            time_t mtime;
+            uint64_t checksum;
+            string spool_name;
+        };
+
+        CardIngest();
+        ~CardIngest();
+
+        CameraController *_cc;
+        string _folder;
+        string _manifest;
+        unsigned int _pipeline;
+        bool _verify;
+        map<string, ManifestEntry> _entries;
+
+        pthread_t _thread;
+        bool _started;
+        pthread_mutex_t _lock;
+        string _state;
+        bool _stop;
+        int _error;
+        string _current;
+        unsigned long _files_total;
+        unsigned long _files_done;
+        unsigned long _files_skipped;
+        unsigned long _files_failed;
+        unsigned long _bytes_total;
+        unsigned long _bytes_done;
+        unsigned long _bytes_copied;
+        double _download_ms;
+        Stopwatch _watch;
+        double _elapsed_ms;
+
+        void _run();
+        bool _stopping();
+        void _load_manifest();
+        bool _ingested(const CardFile &file, const string &spool_name);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CardIngest__) */
@@ -8,6 +8,7 @@
 
 #include "Command.h"
 #include "Api.h"
+#include "Tracer.h"
 #include <algorithm>
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string.hpp>
@@ -24,15 +25,31 @@ struct validate_data {
 Command::Command(Api *api){
     this->_api = api;
     set<string> params;
-    string param_camera_settings[] = {"list", "aperture", "speed", "iso", "whitebalance","focus_point","focus_mode"};
-    string param_execute[] = {"shot", "bulb", "time_lapse","autofocus", "manualfocus", "live"};
-    string param_files[] = {"list", "get", "delete"};
-    _valid_commands["/settings"] = set<string>(param_camera_settings, param_camera_settings + 7);
-    _valid_commands["/capture"] = set<string>(param_execute, param_execute + 6);
-    _valid_commands["/fs"] = set<string>(param_files, param_execute + 3);
+    string param_camera_settings[] = {"list", "aperture", "speed", "iso", "whitebalance","focus_point","focus_mode", "index"};
+    string param_execute[] = {"shot", "bulb", "time_lapse","autofocus", "manualfocus", "live", "analysis", "focus_stack", "bracket", "record"};
+    string param_files[] = {"list", "get", "delete", "preview", "thumbs", "thumb"};
+    string param_jobs[] = {"status", "list"};
+    string param_health[] = {"status"};
+    string param_ingest[] = {"start", "status", "stop"};
+    string param_script[] = {"run", "validate"};
+    string param_trace[] = {"dump", "start", "stop", "clear"};
+    _valid_commands["/settings"] = set<string>(param_camera_settings, param_camera_settings + 8);
+    _valid_commands["/capture"] = set<string>(param_execute, param_execute + 10);
+    _valid_commands["/fs"] = set<string>(param_files, param_files + 6);
+    _valid_commands["/jobs"] = set<string>(param_jobs, param_jobs + 2);
+    _valid_commands["/health"] = set<string>(param_health, param_health + 1);
+    _valid_commands["/ingest"] = set<string>(param_ingest, param_ingest + 3);
+    _valid_commands["/script"] = set<string>(param_script, param_script + 2);
+    _valid_commands["/trace"] = set<string>(param_trace, param_trace + 4);
 }
 
 int Command::execute(const string &url, const map<string, string> &argvals, string &response){
+    HttpExchange exchange;
+    return this->execute(url, argvals, exchange, response);
+}
+
+int Command::execute(const string &url, const map<string, string> &argvals, HttpExchange &exchange, string &response){
+    TraceSpan span("command", "execute", url.c_str());
     string param;
     CCA_API_OUTPUT_TYPE type = CCA_OUTPUT_TYPE_JSON;
     validate_data vdata;
@@ -44,12 +61,30 @@ int Command::execute(const string &url, const map<string, string> &argvals, stri
         boost::trim(param);
     }
     
+    // /jobs?id=12 is short for /jobs?action=status&id=12, /health for /health?action=status
+    if((url == "/jobs" || url == "/health" || url == "/ingest") && param.empty())
+        param = "status";
+    // a POST to /script runs it
+    if(url == "/script" && param.empty())
+        param = "run";
+    if(url == "/trace" && param.empty())
+        param = "dump";
+    
     iterator = argvals.find("type");
     if(iterator != argvals.end()){
         const string out_type = iterator->second;
         if(strcasecmp(out_type.c_str(), "xml") == 0)
             type = CCA_OUTPUT_TYPE_XML;
+        else if(strcasecmp(out_type.c_str(), "msgpack") == 0)
+            type = CCA_OUTPUT_TYPE_MSGPACK;
     }
+    
+    if(type == CCA_OUTPUT_TYPE_XML)
+        exchange.response_headers["Content-Type"] = "application/xml";
+    else if(type == CCA_OUTPUT_TYPE_MSGPACK)
+        exchange.response_headers["Content-Type"] = "application/x-msgpack";
+    else
+        exchange.response_headers["Content-Type"] = "application/json";
 
     vdata.action = param;
         
@@ -60,10 +95,10 @@ int Command::execute(const string &url, const map<string, string> &argvals, stri
         return ret;
     }    
     
-    return this->_executeAPI(url, param, argvals, type, response);
+    return this->_executeAPI(url, param, argvals, type, exchange, response);
 }
 
-bool Command::_executeAPI(const string &url, string action, const map<string, string> &urlparams, CCA_API_OUTPUT_TYPE type, string &response){
+bool Command::_executeAPI(const string &url, string action, const map<string, string> &urlparams, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &response){
     bool ret = CCA_CMD_SUCCESS;
 
     
@@ -77,7 +112,9 @@ bool Command::_executeAPI(const string &url, string action, const map<string, st
     
     if(url == "/settings"){
         if(action.compare("list") == 0){
-            ret = this->_api->list_settings(type, response);
+            ret = this->_api->list_settings(type, exchange, response);
+        } else if(action.compare("index") == 0){
+            ret = this->_api->list_index(type, response);
         } else if(action.compare("focus_point") == 0){
             ret = this->_api->set_focus_point(value, type, response);
         } else if(action.compare("aperture") == 0){
@@ -88,20 +125,101 @@ bool Command::_executeAPI(const string &url, string action, const map<string, st
             ret = this->_api->set_iso(value, type, response);
         } else if(action.compare("whitebalance") == 0){
             ret = this->_api->set_whitebalance(value, type, response);
+        } else if(action.compare("focus_mode") == 0){
+            ret = this->_api->set_focus_mode(value, type, response);
         }
         
     } else if(url == "/capture"){
         if(action.compare("shot") == 0){
-           ret = this->_api->shot(type, response); 
+            iterator = urlparams.find("mode");
+            if(iterator != urlparams.end() && iterator->second.compare("async") == 0)
+                ret = this->_api->shot_async(type, exchange, response);
+            else if(iterator != urlparams.end() && iterator->second.compare("stream") == 0)
+                ret = this->_api->shot_stream(type, exchange, response);
+            else if(iterator != urlparams.end() && iterator->second.compare("preview") == 0)
+                ret = this->_api->shot_preview(type, exchange, response);
+            else
+                ret = this->_api->shot(type, response); 
+        } else if(action.compare("bulb") == 0){
+            ret = this->_api->bulb(value, type, exchange, response);
         } else if(action.compare("live") == 0){
             if(value.compare("start") == 0)
                 ret = this->_api->liveview(CCA_API_LIVEVIEW_START, type, response);
             else
                 ret = this->_api->liveview(CCA_API_LIVEVIEW_STOP, type, response);
         } else if(action.compare("autofocus") == 0){
-            ret = this->_api->autofocus(type, response);
+            ret = this->_api->autofocus(value, type, response);
+        } else if(action.compare("manualfocus") == 0){
+            ret = this->_api->manualfocus(value, type, response);
+        } else if(action.compare("analysis") == 0){
+            ret = this->_api->liveview_analysis(type, response);
+        } else if(action.compare("focus_stack") == 0){
+            string step = "1";
+            iterator = urlparams.find("step");
+            if(iterator != urlparams.end())
+                step = iterator->second;
+            ret = this->_api->focus_stack(atoi(value.c_str()), atoi(step.c_str()), type, response);
+        } else if(action.compare("bracket") == 0){
+            ret = this->_api->bracket(value, type, response);
+        } else if(action.compare("record") == 0){
+            ret = this->_api->record(value, type, response);
+        }
+        
+    } else if(url == "/fs"){
+        string folder;
+        iterator = urlparams.find("folder");
+        if(iterator != urlparams.end())
+            folder = iterator->second;
+        if(action.compare("get") == 0){
+            ret = this->_api->get_file(folder, value, type, exchange, response);
+        } else if(action.compare("preview") == 0){
+            ret = this->_api->file_preview(folder, value, type, exchange, response);
+        } else if(action.compare("list") == 0){
+            iterator = urlparams.find("refresh");
+            bool refresh = (iterator != urlparams.end() && iterator->second == "true");
+            ret = this->_api->list_files(folder, refresh, type, response);
+        } else if(action.compare("thumbs") == 0){
+            string offset, limit;
+            iterator = urlparams.find("offset");
+            if(iterator != urlparams.end())
+                offset = iterator->second;
+            iterator = urlparams.find("limit");
+            if(iterator != urlparams.end())
+                limit = iterator->second;
+            ret = this->_api->list_thumbnails(offset, limit, type, response);
+        } else if(action.compare("thumb") == 0){
+            ret = this->_api->get_thumbnail(value, type, exchange, response);
+        }
+        
+    } else if(url == "/ingest"){
+        string folder;
+        iterator = urlparams.find("folder");
+        if(iterator != urlparams.end())
+            folder = iterator->second;
+        ret = this->_api->ingest(action, folder, type, exchange, response);
+        
+    } else if(url == "/jobs"){
+        if(action.compare("status") == 0){
+            string id, wait;
+            iterator = urlparams.find("id");
+            if(iterator != urlparams.end())
+                id = iterator->second;
+            iterator = urlparams.find("wait");
+            if(iterator != urlparams.end())
+                wait = iterator->second;
+            ret = this->_api->job_status(id, wait, type, exchange, response);
+        } else if(action.compare("list") == 0){
+            ret = this->_api->job_list(type, response);
         }
         
+    } else if(url == "/health"){
+        ret = this->_api->health(type, exchange, response);
+        
+    } else if(url == "/script"){
+        ret = this->_api->script(action, exchange.request_body, type, exchange, response);
+        
+    } else if(url == "/trace"){
+        ret = this->_api->trace(action, type, exchange, response);
     }
     return ret;
 }
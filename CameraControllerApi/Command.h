@@ -29,10 +29,11 @@ namespace CameraControllerApi {
     public:
         Command(Api *api);
         int execute(const string& url, const map<string, string>& argvals, string& response);
+        int execute(const string& url, const map<string, string>& argvals, HttpExchange& exchange, string& response);
     private:
         Api *_api;
         map<string, set<string> > _valid_commands;
-        bool _executeAPI(const string &url, string action, const map<string, string> &urlparams, CCA_API_OUTPUT_TYPE type, string &response);
+        bool _executeAPI(const string &url, string action, const map<string, string> &urlparams, CCA_API_OUTPUT_TYPE type, HttpExchange &exchange, string &response);
         bool _validate(const void *data);
         void _getInvalidResponse(string &response);
     };
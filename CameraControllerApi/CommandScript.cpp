@@ -0,0 +1,171 @@
+//
+//  CommandScript.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "CommandScript.h"
+#include <sstream>
+#include <stdlib.h>
+#include <errno.h>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include "Settings.h"
+
+using namespace CameraControllerApi;
+
+// JSON numbers and strings both arrive as text in the ptree
+static bool script_number(const ptree &step, const char *key, long min, long max, long &value){
+    boost::optional<string> text = step.get_optional<string>(key);
+    if(!text || text->empty())
+        return false;
+
+    char *end = NULL;
+    errno = 0;
+    long parsed = strtol(text->c_str(), &end, 10);
+    if(errno != 0 || *end != '\0' || parsed < min || parsed > max)
+        return false;
+    value = parsed;
+    return true;
+}
+
+// a JSON array, boost keeps its elements under empty keys
+static bool script_list(const ptree &list){
+    if(list.empty() || !list.data().empty())
+        return false;
+    for(ptree::const_iterator it = list.begin(); it != list.end(); it++){
+        if(!it->first.empty())
+            return false;
+    }
+    return true;
+}
+
+CommandScript::CommandScript(){
+    string max_steps;
+    Settings::getInstance()->get_value("script.max_steps", max_steps);
+    this->_max_steps = strtoul(max_steps.c_str(), NULL, 10) > 0 ? strtoul(max_steps.c_str(), NULL, 10) : 10000;
+    this->_total_steps = 0;
+    this->_captures = 0;
+    this->_wait_ms = 0;
+}
+
+bool CommandScript::parse(const string &json, CameraController *cc, string &error){
+    ptree root;
+    std::istringstream ss(json);
+    try {
+        boost::property_tree::read_json(ss, root);
+    } catch(std::exception &e){
+        error = "no json";
+        return false;
+    }
+
+    boost::optional<ptree &> steps = root.get_child_optional("steps");
+    if(!steps || !script_list(*steps)){
+        error = "steps: no list of steps";
+        return false;
+    }
+
+    this->_steps.clear();
+    return this->_parse(*steps, "steps", 1, cc, this->_steps, this->_total_steps, this->_captures, this->_wait_ms, error);
+}
+
+const vector<ScriptStep>& CommandScript::steps() const {
+    return this->_steps;
+}
+
+void CommandScript::describe(ptree &tree) const {
+    tree.put("steps",    this->_total_steps);
+    tree.put("captures", this->_captures);
+    tree.put("wait_ms",  this->_wait_ms);
+}
+
+bool CommandScript::_parse(const ptree &list, const string &path, int depth, CameraController *cc, vector<ScriptStep> &steps,
+                           unsigned long long &total, unsigned long long &captures, unsigned long long &wait_ms, string &error){
+    total = 0;
+    captures = 0;
+    wait_ms = 0;
+    int index = 0;
+    for(ptree::const_iterator it = list.begin(); it != list.end(); it++, index++){
+        const ptree &node = it->second;
+        ScriptStep step;
+        step.path = path + "." + boost::lexical_cast<string>(index);
+        step.ms = 0;
+        step.step = 0;
+        step.count = 0;
+        string op = node.get<string>("op", "");
+        long number = 0;
+
+        if(op == "set"){
+            step.op = CCA_SCRIPT_SET;
+            step.setting = node.get<string>("setting", "");
+            step.value = node.get<string>("value", "");
+            string name;
+            if(!cc->setting_name(step.setting, name)){
+                error = step.path + ": unknown setting \"" + step.setting + "\"";
+                return false;
+            }
+            if(!cc->setting_accepts(step.setting, step.value)){
+                error = step.path + ": " + step.setting + " does not take \"" + step.value + "\"";
+                return false;
+            }
+            total++;
+        } else if(op == "wait"){
+            step.op = CCA_SCRIPT_WAIT;
+            if(!script_number(node, "ms", 0, CCA_SCRIPT_MAX_WAIT_MS, number)){
+                error = step.path + ": ms has to be 0 to " + boost::lexical_cast<string>(CCA_SCRIPT_MAX_WAIT_MS);
+                return false;
+            }
+            step.ms = (int)number;
+            wait_ms += step.ms;
+            total++;
+        } else if(op == "capture"){
+            step.op = CCA_SCRIPT_CAPTURE;
+            captures++;
+            total++;
+        } else if(op == "focus"){
+            step.op = CCA_SCRIPT_FOCUS;
+            // see CameraController::focus_step
+            if(!script_number(node, "step", -3, 3, number) || number == 0){
+                error = step.path + ": step has to be -3 to 3 and not 0";
+                return false;
+            }
+            step.step = (int)number;
+            total++;
+        } else if(op == "loop"){
+            step.op = CCA_SCRIPT_LOOP;
+            if(!script_number(node, "count", 1, (long)this->_max_steps, number)){
+                error = step.path + ": count has to be 1 to " + boost::lexical_cast<string>(this->_max_steps);
+                return false;
+            }
+            step.count = number;
+            if(depth >= CCA_SCRIPT_MAX_DEPTH){
+                error = step.path + ": loops are nested too deep";
+                return false;
+            }
+            boost::optional<const ptree &> inner = node.get_child_optional("steps");
+            if(!inner || !script_list(*inner)){
+                error = step.path + ".steps: no list of steps";
+                return false;
+            }
+
+            unsigned long long inner_total, inner_captures, inner_wait;
+            if(!this->_parse(*inner, step.path + ".steps", depth + 1, cc, step.steps, inner_total, inner_captures, inner_wait, error))
+                return false;
+            // both are at most max_steps, the product does not overflow
+            total += inner_total * step.count;
+            captures += inner_captures * step.count;
+            wait_ms += inner_wait * step.count;
+        } else {
+            error = step.path + ": unknown op \"" + op + "\"";
+            return false;
+        }
+
+        if(total > this->_max_steps){
+            error = step.path + ": the script runs more than " + boost::lexical_cast<string>(this->_max_steps) + " steps";
+            return false;
+        }
+        steps.push_back(step);
+    }
+    return true;
+}
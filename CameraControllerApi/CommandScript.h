@@ -0,0 +1,86 @@
+//
+//  CommandScript.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__CommandScript__
+#define __CameraControllerApi__CommandScript__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include "CameraController.h"
+
+#define CCA_SCRIPT_MAX_DEPTH 8
+#define CCA_SCRIPT_MAX_WAIT_MS 3600000
+
+using std::string;
+using std::vector;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    typedef enum {
+        CCA_SCRIPT_SET,
+        CCA_SCRIPT_WAIT,
+        CCA_SCRIPT_CAPTURE,
+        CCA_SCRIPT_FOCUS,
+        CCA_SCRIPT_LOOP
+    } CCA_SCRIPT_OP;
+
+    /*
+     * One step of a script. path says where it is in the script
+     * ("steps.1.steps.0"), for errors.
+     */
+    struct ScriptStep {
+        CCA_SCRIPT_OP op;
+        string path;
+        string setting;
+        string value;
+        int ms;
+        int step;
+        unsigned long count;
+        vector<ScriptStep> steps;
+    };
+
+    /*
+     * A list of camera steps POSTed as JSON:
+     *
+     *   {"steps": [
+     *       {"op": "set", "setting": "iso", "value": "400"},
+     *       {"op": "loop", "count": 10, "steps": [
+     *           {"op": "capture"},
+     *           {"op": "focus", "step": 2},
+     *           {"op": "wait", "ms": 500}
+     *       ]}
+     *   ]}
+     *
+     * parse() checks everything that can be checked without the camera
+     * doing anything: the ops and their arguments, the setting names and
+     * values against the widget index, the loop depth and the number of
+     * steps the script runs (script.max_steps). A script which parsed only
+     * fails on what the camera does.
+     */
+    class CommandScript {
+    public:
+        CommandScript();
+        bool parse(const string &json, CameraController *cc, string &error);
+        const vector<ScriptStep>& steps() const;
+        void describe(ptree &tree) const;
+
+    private:
+        vector<ScriptStep> _steps;
+        unsigned long _max_steps;
+        unsigned long long _total_steps;
+        unsigned long long _captures;
+        unsigned long long _wait_ms;
+
+        bool _parse(const ptree &list, const string &path, int depth, CameraController *cc, vector<ScriptStep> &steps,
+                    unsigned long long &total, unsigned long long &captures, unsigned long long &wait_ms, string &error);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__CommandScript__) */
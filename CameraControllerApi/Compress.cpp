@@ -0,0 +1,98 @@
+//
+//  Compress.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "Compress.h"
+#include <stdlib.h>
+#include <strings.h>
+#include <zlib.h>
+
+using namespace CameraControllerApi;
+
+static string trim(const string &value){
+    size_t first = value.find_first_not_of(" \t");
+    if(first == string::npos)
+        return "";
+    size_t last = value.find_last_not_of(" \t");
+    return value.substr(first, last - first + 1);
+}
+
+CCA_CONTENT_ENCODING CameraControllerApi::negotiate_encoding(const string &accept_encoding){
+    CCA_CONTENT_ENCODING best = CCA_ENCODING_IDENTITY;
+    double best_q = 0;
+    
+    size_t start = 0;
+    while(start < accept_encoding.size()){
+        size_t end = accept_encoding.find(',', start);
+        if(end == string::npos)
+            end = accept_encoding.size();
+        
+        string token = accept_encoding.substr(start, end - start);
+        start = end + 1;
+        
+        double q = 1;
+        size_t params = token.find(';');
+        if(params != string::npos){
+            string param = trim(token.substr(params + 1));
+            if(param.compare(0, 2, "q=") == 0)
+                q = atof(param.c_str() + 2);
+            token = token.substr(0, params);
+        }
+        token = trim(token);
+        
+        CCA_CONTENT_ENCODING encoding;
+        if(strcasecmp(token.c_str(), "gzip") == 0 || strcasecmp(token.c_str(), "x-gzip") == 0 || token == "*")
+            encoding = CCA_ENCODING_GZIP;
+        else if(strcasecmp(token.c_str(), "deflate") == 0)
+            encoding = CCA_ENCODING_DEFLATE;
+        else
+            continue;
+        
+        if(q > best_q || (q == best_q && q > 0 && encoding == CCA_ENCODING_GZIP)){
+            best = encoding;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+const char* CameraControllerApi::encoding_name(CCA_CONTENT_ENCODING encoding){
+    switch (encoding) {
+        case CCA_ENCODING_GZIP:
+            return "gzip";
+        case CCA_ENCODING_DEFLATE:
+            return "deflate";
+        default:
+            return "identity";
+    }
+}
+
+bool CameraControllerApi::compress_body(const string &input, CCA_CONTENT_ENCODING encoding, int level, string &output){
+    if(encoding == CCA_ENCODING_IDENTITY)
+        return false;
+    
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    
+    // 16 added to the window bits selects the gzip wrapper
+    int window_bits = encoding == CCA_ENCODING_GZIP ? 15 + 16 : 15;
+    if(deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    
+    output.resize(deflateBound(&stream, input.size()) + 32);
+    stream.next_in = (Bytef *)input.data();
+    stream.avail_in = input.size();
+    stream.next_out = (Bytef *)&output[0];
+    stream.avail_out = output.size();
+    
+    int ret = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    
+    return ret == Z_STREAM_END;
+}
@@ -0,0 +1,37 @@
+//
+//  Compress.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__Compress__
+#define __CameraControllerApi__Compress__
+
+#include <string>
+
+using std::string;
+
+namespace CameraControllerApi {
+
+    typedef enum {
+        CCA_ENCODING_IDENTITY,
+        CCA_ENCODING_GZIP,
+        CCA_ENCODING_DEFLATE
+    } CCA_CONTENT_ENCODING;
+
+    /*
+     * Picks the encoding with the highest q value from an Accept-Encoding
+     * header, gzip wins a tie. Anything else is sent uncompressed.
+     */
+    CCA_CONTENT_ENCODING negotiate_encoding(const string &accept_encoding);
+    const char* encoding_name(CCA_CONTENT_ENCODING encoding);
+
+    /*
+     * Compresses a response body with zlib. "deflate" is the zlib format as
+     * HTTP defines it, not a raw deflate stream.
+     */
+    bool compress_body(const string &input, CCA_CONTENT_ENCODING encoding, int level, string &output);
+}
+
+#endif /* defined(__CameraControllerApi__Compress__) */
@@ -0,0 +1,237 @@
+//
+//  DownloadStream.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "DownloadStream.h"
+#include "CameraController.h"
+#include "ScopedLock.h"
+#include "Logger.h"
+#include "microhttpd.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+using namespace CameraControllerApi;
+
+CameraFileHandler DownloadStream::_handler = {
+    DownloadStream::_handler_size,
+    DownloadStream::_handler_read,
+    DownloadStream::_handler_write
+};
+
+DownloadStream::DownloadStream(CameraController *cc, unsigned int max_chunks, int timeout_ms){
+    this->_cc = cc;
+    this->_capture = false;
+    this->_remove = false;
+    this->_max_chunks = max_chunks > 0 ? max_chunks : 1;
+    this->_timeout_ms = timeout_ms > 0 ? timeout_ms : 30000;
+    this->_offset = 0;
+    this->_done = false;
+    this->_cancelled = false;
+    this->_error = GP_OK;
+    this->_refs = 1;
+    this->_bytes = 0;
+    this->_first_chunk_ms = 0;
+    memset(&this->_path, 0, sizeof(this->_path));
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+}
+
+DownloadStream::~DownloadStream(){
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Streams a file which is on the card. With remove it is deleted from the
+ * card once it has been read completely.
+ */
+bool DownloadStream::start(const CameraFilePath &path, bool remove){
+    this->_path = path;
+    this->_remove = remove;
+    this->_name = path.name;
+    return this->_start();
+}
+
+/*
+ * Takes a picture and streams it, the file is removed from the card
+ * afterwards like with a plain shot.
+ */
+bool DownloadStream::start_capture(){
+    this->_capture = true;
+    this->_remove = true;
+    return this->_start();
+}
+
+bool DownloadStream::_start(){
+    ScopedLock lock(&this->_lock);
+    this->_refs++;
+    pthread_t thread;
+    if(0 != pthread_create(&thread, NULL, DownloadStream::_worker, this)){
+        this->_refs--;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void DownloadStream::_deadline(struct timespec &deadline){
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += this->_timeout_ms / 1000;
+    deadline.tv_nsec += (this->_timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+// called with the lock held, false once the deadline has passed
+bool DownloadStream::_wait(const struct timespec &deadline){
+    return pthread_cond_timedwait(&this->_cond, &this->_lock, &deadline) != ETIMEDOUT;
+}
+
+/*
+ * Waits until the first block is there or the download failed, so an error
+ * can still be answered with a status code instead of a broken body.
+ * Returns GP_OK or the gphoto2 error.
+ */
+int DownloadStream::wait_started(){
+    struct timespec deadline;
+    this->_deadline(deadline);
+
+    ScopedLock lock(&this->_lock);
+    while(this->_chunks.empty() && !this->_done){
+        if(!this->_wait(deadline)){
+            this->_cancelled = true;
+            pthread_cond_broadcast(&this->_cond);
+            return GP_ERROR_TIMEOUT;
+        }
+    }
+    return this->_error;
+}
+
+// valid once wait_started() returned GP_OK
+const string& DownloadStream::name(){
+    return this->_name;
+}
+
+void DownloadStream::release(){
+    pthread_mutex_lock(&this->_lock);
+    // whoever lets go first, the other side does not need to go on
+    this->_cancelled = true;
+    pthread_cond_broadcast(&this->_cond);
+    bool last = (--this->_refs == 0);
+    pthread_mutex_unlock(&this->_lock);
+
+    if(last)
+        delete this;
+}
+
+ssize_t DownloadStream::read_callback(void *cls, uint64_t pos, char *buf, size_t max){
+    return static_cast<DownloadStream *>(cls)->_read(buf, max);
+}
+
+void DownloadStream::free_callback(void *cls){
+    static_cast<DownloadStream *>(cls)->release();
+}
+
+ssize_t DownloadStream::_read(char *buf, size_t max){
+    struct timespec deadline;
+    this->_deadline(deadline);
+
+    ScopedLock lock(&this->_lock);
+    while(this->_chunks.empty() && !this->_done){
+        if(!this->_wait(deadline)){
+            this->_cancelled = true;
+            pthread_cond_broadcast(&this->_cond);
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+    }
+
+    if(this->_chunks.empty())
+        return this->_error == GP_OK ? MHD_CONTENT_READER_END_OF_STREAM : MHD_CONTENT_READER_END_WITH_ERROR;
+
+    string &chunk = this->_chunks.front();
+    size_t size = chunk.size() - this->_offset < max ? chunk.size() - this->_offset : max;
+    memcpy(buf, chunk.data() + this->_offset, size);
+    this->_offset += size;
+    if(this->_offset == chunk.size()){
+        this->_chunks.pop_front();
+        this->_offset = 0;
+        pthread_cond_broadcast(&this->_cond);
+    }
+    return size;
+}
+
+int DownloadStream::_write(const unsigned char *data, unsigned long len){
+    struct timespec deadline;
+    this->_deadline(deadline);
+
+    ScopedLock lock(&this->_lock);
+    while(this->_chunks.size() >= this->_max_chunks && !this->_cancelled){
+        if(!this->_wait(deadline)){
+            this->_cancelled = true;
+            return GP_ERROR_TIMEOUT;
+        }
+    }
+    if(this->_cancelled)
+        return GP_ERROR_CANCEL;
+
+    if(this->_bytes == 0)
+        this->_first_chunk_ms = this->_watch.elapsed_ms();
+    this->_chunks.push_back(string((const char *)data, len));
+    this->_bytes += len;
+    pthread_cond_broadcast(&this->_cond);
+    return GP_OK;
+}
+
+int DownloadStream::_handler_size(void *priv, uint64_t *size){
+    DownloadStream *stream = static_cast<DownloadStream *>(priv);
+    ScopedLock lock(&stream->_lock);
+    *size = stream->_bytes;
+    return GP_OK;
+}
+
+// nothing is read back, the blocks are gone once they have been sent
+int DownloadStream::_handler_read(void *priv, unsigned char *data, uint64_t *len){
+    return GP_ERROR_NOT_SUPPORTED;
+}
+
+int DownloadStream::_handler_write(void *priv, unsigned char *data, uint64_t *len){
+    return static_cast<DownloadStream *>(priv)->_write(data, *len);
+}
+
+void* DownloadStream::_worker(void *context){
+    DownloadStream *stream = static_cast<DownloadStream *>(context);
+    CameraFile *file = NULL;
+
+    int ret = gp_file_new_from_handler(&file, &DownloadStream::_handler, stream);
+    if(ret == GP_OK && stream->_capture){
+        ret = stream->_cc->capture_file(&stream->_path);
+        if(ret == GP_OK){
+            ScopedLock lock(&stream->_lock);
+            stream->_name = stream->_path.name;
+        }
+    }
+    if(ret == GP_OK)
+        ret = stream->_cc->download(stream->_path, file, stream->_remove);
+    if(file != NULL)
+        gp_file_unref(file);
+
+    pthread_mutex_lock(&stream->_lock);
+    stream->_done = true;
+    stream->_error = ret < GP_OK ? ret : GP_OK;
+    pthread_cond_broadcast(&stream->_cond);
+    double ms = stream->_watch.elapsed_ms();
+    Logger::getInstance()->log(ret < GP_OK ? CCA_LOG_WARN : CCA_LOG_INFO, "stream",
+                               "op=download file=%s bytes=%lu first_chunk_ms=%.1f ms=%.1f mb_s=%.2f error=%d",
+                               stream->_name.c_str(), stream->_bytes, stream->_first_chunk_ms, ms,
+                               ms > 0 ? stream->_bytes / 1048.576 / ms : 0.0, ret < GP_OK ? ret : 0);
+    pthread_mutex_unlock(&stream->_lock);
+
+    stream->release();
+    return NULL;
+}
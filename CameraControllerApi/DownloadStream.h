@@ -0,0 +1,94 @@
+//
+//  DownloadStream.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__DownloadStream__
+#define __CameraControllerApi__DownloadStream__
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <gphoto2/gphoto2-camera.h>
+#include "Stopwatch.h"
+
+#define CCA_STREAM_BLOCK_SIZE 65536
+
+using std::string;
+using std::deque;
+
+namespace CameraControllerApi {
+
+    class CameraController;
+
+    /*
+     * Hands a file to the HTTP client while it is still coming from the
+     * camera. The download runs on its own thread into a CameraFile backed by
+     * a handler, every block the camera sends is queued and read() gives it
+     * to libmicrohttpd as the body of a chunked response.
+     *
+     * At most max_chunks blocks are queued. A slow client holds the download
+     * back (and with it the camera) for up to timeout_ms, then the download
+     * is cancelled. A client which goes away cancels it as well.
+     *
+     * The stream is shared by the download thread and its reader, release()
+     * drops one reference. The creator owns the first one and either passes
+     * it on to the response (MHD calls free_callback) or releases it.
+     */
+    class DownloadStream {
+    public:
+        DownloadStream(CameraController *cc, unsigned int max_chunks, int timeout_ms);
+
+        bool start(const CameraFilePath &path, bool remove);
+        bool start_capture();
+        int wait_started();
+        const string& name();
+
+        void release();
+        static ssize_t read_callback(void *cls, uint64_t pos, char *buf, size_t max);
+        static void free_callback(void *cls);
+
+    private:
+        ~DownloadStream();
+
+        CameraController *_cc;
+        CameraFilePath _path;
+        bool _capture;
+        bool _remove;
+        string _name;
+        unsigned int _max_chunks;
+        int _timeout_ms;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        deque<string> _chunks;
+        size_t _offset;
+        bool _done;
+        bool _cancelled;
+        int _error;
+        int _refs;
+
+        unsigned long _bytes;
+        double _first_chunk_ms;
+        Stopwatch _watch;
+
+        bool _start();
+        ssize_t _read(char *buf, size_t max);
+        int _write(const unsigned char *data, unsigned long len);
+        bool _wait(const struct timespec &deadline);
+        void _deadline(struct timespec &deadline);
+
+        static CameraFileHandler _handler;
+        static int _handler_size(void *priv, uint64_t *size);
+        static int _handler_read(void *priv, unsigned char *data, uint64_t *len);
+        static int _handler_write(void *priv, unsigned char *data, uint64_t *len);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__DownloadStream__) */
@@ -0,0 +1,138 @@
+//
+//  FocusSearch.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "FocusSearch.h"
+#include "FrameAnalyzer.h"
+#include <sys/time.h>
+
+using namespace CameraControllerApi;
+
+FocusSearch::FocusSearch(CameraController *cc, int scale, int max_steps, int settle_frames){
+    this->_cc = cc;
+    this->_scale = (scale == 1 || scale == 2 || scale == 8) ? scale : 4;
+    this->_max_steps = max_steps > 0 ? max_steps : 40;
+    this->_settle_frames = settle_frames >= 0 ? settle_frames : 1;
+    this->_steps = 0;
+    this->_previews = 0;
+}
+
+int FocusSearch::_step(int step){
+    this->_steps++;
+    return this->_cc->focus_step(step);
+}
+
+/*
+ * Sharpness of the center half of the next liveview frame, or -1 if no frame
+ * could be taken. The frames right after a lens move may still show the old
+ * position, those are skipped.
+ */
+double FocusSearch::_score(){
+    PreviewPool *pool = this->_cc->preview_pool();
+    double score = -1;
+
+    for(int i = 0; i <= this->_settle_frames; i++){
+        PreviewFrame *frame = pool->acquire();
+        if(frame == NULL)
+            return -1;
+
+        int size = this->_cc->preview(frame);
+        this->_previews++;
+
+        if(size > 0 && i == this->_settle_frames){
+            int width, height;
+            if(FrameAnalyzer::decode_luma(frame->data, frame->size, this->_scale, this->_luma, width, height)){
+                int x0 = width / 4, y0 = height / 4;
+                score = FrameAnalyzer::gradient_energy(&this->_luma[(size_t)y0 * width + x0], width / 2, height / 2, width);
+            }
+        }
+        pool->release(frame);
+
+        if(size <= 0)
+            return -1;
+    }
+    return score;
+}
+
+bool FocusSearch::run(ptree &report){
+    static const int sizes[] = {3, 2, 1};
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    this->_steps = 0;
+    this->_previews = 0;
+
+    if(this->_cc->focus_begin() < GP_OK)
+        return false;
+
+    bool ok = true;
+    bool overshoot = false;
+    bool reversed = false;
+    int dir = 1;
+    double current = this->_score();
+    double best = current;
+    if(current < 0)
+        ok = false;
+
+    for(int level = 0; level < 3 && ok; level++){
+        int size = sizes[level];
+        bool improved = false;
+        overshoot = false;
+
+        while(this->_steps < this->_max_steps){
+            if(this->_step(dir * size) < GP_OK){
+                ok = false;
+                break;
+            }
+
+            double score = this->_score();
+            if(score < 0){
+                ok = false;
+                break;
+            }
+
+            if(score > current){
+                current = score;
+                improved = true;
+                if(score > best)
+                    best = score;
+                continue;
+            }
+
+            if(level == 0 && !improved && !reversed){
+                // wrong direction from the start, go back and try the other side
+                reversed = true;
+                dir = -dir;
+                if(this->_step(dir * size) < GP_OK){
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+
+            // passed the peak, the next level climbs back with a finer step
+            current = score;
+            overshoot = true;
+            break;
+        }
+        dir = -dir;
+    }
+
+    // the fine pass stopped one step behind the peak
+    if(ok && overshoot)
+        ok = (this->_step(dir) >= GP_OK);
+
+    this->_cc->focus_end();
+    gettimeofday(&end, NULL);
+
+    report.put("converged",     ok && overshoot);
+    report.put("sharpness",     best);
+    report.put("steps",         this->_steps);
+    report.put("previews",      this->_previews);
+    report.put("round_trips",   1 + this->_steps + this->_previews);
+    report.put("elapsed_ms",    (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0);
+    return ok;
+}
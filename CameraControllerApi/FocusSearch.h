@@ -0,0 +1,50 @@
+//
+//  FocusSearch.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__FocusSearch__
+#define __CameraControllerApi__FocusSearch__
+
+#include <iostream>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include "CameraController.h"
+
+using std::vector;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Contrast detect autofocus in software. The lens is driven with
+     * manualfocusdrive and every position is scored by the gradient energy of
+     * the center of a liveview frame. The search climbs with the coarse step
+     * until the score drops, then turns around with the next finer step, and
+     * ends one fine step back on the peak.
+     *
+     * Every step costs one set_config and (settle_frames + 1) previews, the
+     * config tree is only read once per search.
+     */
+    class FocusSearch {
+    public:
+        FocusSearch(CameraController *cc, int scale, int max_steps, int settle_frames);
+        bool run(ptree &report);
+
+    private:
+        CameraController *_cc;
+        int _scale;
+        int _max_steps;
+        int _settle_frames;
+        int _steps;
+        int _previews;
+        vector<unsigned char> _luma;
+
+        int _step(int step);
+        double _score();
+    };
+}
+
+#endif /* defined(__CameraControllerApi__FocusSearch__) */
@@ -0,0 +1,415 @@
+//
+//  FrameAnalyzer.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "FrameAnalyzer.h"
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/time.h>
+#include <jpeglib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace CameraControllerApi;
+
+struct analyzer_jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+// libjpeg exits the process on errors by default, a broken frame must not do that
+static void analyzer_error_exit(j_common_ptr cinfo){
+    analyzer_jpeg_error *err = (analyzer_jpeg_error *)cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+static double elapsed_ms(const struct timeval &start){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+/*
+ * Decodes the JPEG at 1/scale, tells the row handler the output size and
+ * calls it per RGB scanline. Returns false if the data is not a decodable
+ * JPEG.
+ */
+template <typename RowFunc>
+static bool decode_rows(const char *jpeg, unsigned long size, int scale, RowFunc &row_func, int &width, int &height){
+    struct jpeg_decompress_struct cinfo;
+    analyzer_jpeg_error err;
+    JSAMPARRAY row = NULL;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = analyzer_error_exit;
+    if(setjmp(err.jump)){
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, size);
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK){
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    row_func.begin(width, height);
+    row = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, width * cinfo.output_components, 1);
+
+    while(cinfo.output_scanline < cinfo.output_height){
+        int y = cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, row, 1);
+        row_func(row[0], y, width);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+struct histogram_rows {
+    FrameAnalysis *result;
+    vector<unsigned char> *luma;
+    unsigned long long luma_sum;
+
+    void begin(int width, int height){
+        luma->resize((size_t)width * height);
+    }
+
+    void operator()(const unsigned char *rgb, int y, int width){
+        unsigned char *out = &(*luma)[(size_t)y * width];
+        unsigned int *r = result->red, *g = result->green, *b = result->blue, *l = result->luma;
+
+        // BT.601 weights in 8 bit fixed point, written as a plain loop so the
+        // compiler can vectorize the conversion
+        for(int x = 0; x < width; x++){
+            const unsigned char *p = rgb + x * 3;
+            out[x] = (unsigned char)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+        }
+
+        for(int x = 0; x < width; x++){
+            const unsigned char *p = rgb + x * 3;
+            r[p[0]]++;
+            g[p[1]]++;
+            b[p[2]]++;
+            l[out[x]]++;
+            luma_sum += out[x];
+        }
+    }
+};
+
+struct luma_rows {
+    vector<unsigned char> *luma;
+
+    void begin(int width, int height){
+        luma->resize((size_t)width * height);
+    }
+
+    void operator()(const unsigned char *rgb, int y, int width){
+        unsigned char *out = &(*luma)[(size_t)y * width];
+        for(int x = 0; x < width; x++){
+            const unsigned char *p = rgb + x * 3;
+            out[x] = (unsigned char)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+        }
+    }
+};
+
+bool FrameAnalyzer::analyze(const char *jpeg, unsigned long size, int scale, FrameAnalysis &result){
+    struct timeval start;
+    vector<unsigned char> luma;
+    histogram_rows rows;
+    int width = 0, height = 0;
+
+    memset(&result, 0, sizeof(result));
+    gettimeofday(&start, NULL);
+
+    rows.result = &result;
+    rows.luma = &luma;
+    rows.luma_sum = 0;
+    if(!decode_rows(jpeg, size, scale, rows, width, height) || width == 0 || height == 0)
+        return false;
+
+    result.width = width;
+    result.height = height;
+    result.decode_ms = elapsed_ms(start);
+
+    gettimeofday(&start, NULL);
+    result.mean_luma = (double)rows.luma_sum / ((double)width * height);
+    result.sharpness = FrameAnalyzer::laplacian_variance(&luma[0], width, height);
+    result.analyze_ms = elapsed_ms(start);
+    return true;
+}
+
+bool FrameAnalyzer::decode_luma(const char *jpeg, unsigned long size, int scale, vector<unsigned char> &luma, int &width, int &height){
+    luma_rows rows;
+    rows.luma = &luma;
+    return decode_rows(jpeg, size, scale, rows, width, height) && width > 2 && height > 2;
+}
+
+/*
+ * Variance of the 4-neighbour laplacian over the inner pixels. The SSE2 path
+ * does 8 pixels per step in 16 bit lanes, |laplacian| <= 1020 so it fits, and
+ * _mm_madd_epi16 gives the sums and the squares in 32 bit lanes. The lanes
+ * are flushed into 64 bit once per row.
+ */
+double FrameAnalyzer::laplacian_variance(const unsigned char *luma, int width, int height){
+    if(width < 3 || height < 3)
+        return 0.0;
+
+    long long sum = 0;
+    long long sum_sq = 0;
+
+    for(int y = 1; y < height - 1; y++){
+        const unsigned char *up = luma + (size_t)(y - 1) * width;
+        const unsigned char *mid = luma + (size_t)y * width;
+        const unsigned char *down = luma + (size_t)(y + 1) * width;
+        int x = 1;
+
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i ones = _mm_set1_epi16(1);
+        __m128i row_sum = _mm_setzero_si128();
+        __m128i row_sq = _mm_setzero_si128();
+
+        for(; x + 8 < width; x += 8){
+            __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x)), zero);
+            __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x - 1)), zero);
+            __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x + 1)), zero);
+            __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+            __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+
+            __m128i lap = _mm_slli_epi16(c, 2);
+            lap = _mm_sub_epi16(lap, _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+
+            row_sum = _mm_add_epi32(row_sum, _mm_madd_epi16(lap, ones));
+            row_sq = _mm_add_epi32(row_sq, _mm_madd_epi16(lap, lap));
+        }
+
+        int lanes_sum[4], lanes_sq[4];
+        _mm_storeu_si128((__m128i *)lanes_sum, row_sum);
+        _mm_storeu_si128((__m128i *)lanes_sq, row_sq);
+        for(int i = 0; i < 4; i++){
+            sum += lanes_sum[i];
+            sum_sq += (unsigned int)lanes_sq[i];
+        }
+#endif
+
+        for(; x < width - 1; x++){
+            int lap = 4 * mid[x] - mid[x - 1] - mid[x + 1] - up[x] - down[x];
+            sum += lap;
+            sum_sq += lap * lap;
+        }
+    }
+
+    double n = (double)(width - 2) * (height - 2);
+    double mean = sum / n;
+    return sum_sq / n - mean * mean;
+}
+
+/*
+ * Mean squared central difference in x and y (Tenengrad without the Sobel
+ * weights) over a width x height window of a plane with the given stride.
+ * It is cheaper than the laplacian variance and more monotonic around the
+ * focus peak, so the focus search uses it. Same SSE2 layout as above, the
+ * differences are <= 255 in magnitude.
+ */
+double FrameAnalyzer::gradient_energy(const unsigned char *luma, int width, int height, int stride){
+    if(width < 3 || height < 3)
+        return 0.0;
+
+    unsigned long long energy = 0;
+
+    for(int y = 1; y < height - 1; y++){
+        const unsigned char *up = luma + (size_t)(y - 1) * stride;
+        const unsigned char *mid = luma + (size_t)y * stride;
+        const unsigned char *down = luma + (size_t)(y + 1) * stride;
+        int x = 1;
+
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i row_energy = _mm_setzero_si128();
+
+        for(; x + 8 < width; x += 8){
+            __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x - 1)), zero);
+            __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x + 1)), zero);
+            __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+            __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+
+            __m128i dx = _mm_sub_epi16(r, l);
+            __m128i dy = _mm_sub_epi16(d, u);
+
+            row_energy = _mm_add_epi32(row_energy, _mm_madd_epi16(dx, dx));
+            row_energy = _mm_add_epi32(row_energy, _mm_madd_epi16(dy, dy));
+        }
+
+        unsigned int lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, row_energy);
+        energy += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+        for(; x < width - 1; x++){
+            int dx = mid[x + 1] - mid[x - 1];
+            int dy = down[x] - up[x];
+            energy += dx * dx + dy * dy;
+        }
+    }
+
+    return (double)energy / ((double)(width - 2) * (height - 2));
+}
+
+void FrameAnalyzer::to_ptree(const FrameAnalysis &result, bool histograms, ptree &tree){
+    tree.put("sequence",    result.sequence);
+    tree.put("width",       result.width);
+    tree.put("height",      result.height);
+    tree.put("mean_luma",   result.mean_luma);
+    tree.put("sharpness",   result.sharpness);
+    tree.put("decode_ms",   result.decode_ms);
+    tree.put("analyze_ms",  result.analyze_ms);
+
+    if(!histograms)
+        return;
+
+    const char *names[] = {"luma", "red", "green", "blue"};
+    const unsigned int *values[] = {result.luma, result.red, result.green, result.blue};
+    ptree hist;
+    for(int h = 0; h < 4; h++){
+        ptree bins;
+        for(int i = 0; i < 256; i++){
+            ptree bin;
+            bin.put_value(values[h][i]);
+            bins.push_back(std::make_pair("", bin));
+        }
+        hist.put_child(names[h], bins);
+    }
+    tree.put_child("histogram", hist);
+}
+
+FrameAnalyzer::FrameAnalyzer(PreviewPool *pool, int workers, int scale){
+    this->_pool = pool;
+    this->_scale = (scale == 1 || scale == 2 || scale == 4) ? scale : 8;
+    this->_running = true;
+    this->_pending = NULL;
+    this->_has_latest = false;
+    this->_submitted = 0;
+    this->_analyzed = 0;
+    this->_replaced = 0;
+    this->_failed = 0;
+    memset(&this->_latest, 0, sizeof(this->_latest));
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+
+    if(workers < 1)
+        workers = 1;
+    for(int i = 0; i < workers; i++){
+        pthread_t t;
+        if(0 == pthread_create(&t, NULL, FrameAnalyzer::_worker, this))
+            this->_workers.push_back(t);
+    }
+}
+
+FrameAnalyzer::~FrameAnalyzer(){
+    pthread_mutex_lock(&this->_lock);
+    this->_running = false;
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    for(size_t i = 0; i < this->_workers.size(); i++)
+        pthread_join(this->_workers[i], NULL);
+
+    this->_pool->release(this->_pending);
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+void FrameAnalyzer::submit(PreviewFrame *frame){
+    this->_pool->retain(frame);
+
+    pthread_mutex_lock(&this->_lock);
+    PreviewFrame *replaced = this->_pending;
+    this->_pending = frame;
+    this->_submitted++;
+    if(replaced != NULL)
+        this->_replaced++;
+    pthread_cond_signal(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    this->_pool->release(replaced);
+}
+
+bool FrameAnalyzer::latest(FrameAnalysis &result){
+    pthread_mutex_lock(&this->_lock);
+    bool ret = this->_has_latest;
+    if(ret)
+        result = this->_latest;
+    pthread_mutex_unlock(&this->_lock);
+    return ret;
+}
+
+unsigned long FrameAnalyzer::latest_sequence(){
+    pthread_mutex_lock(&this->_lock);
+    unsigned long seq = this->_has_latest ? this->_latest.sequence : 0;
+    pthread_mutex_unlock(&this->_lock);
+    return seq;
+}
+
+void FrameAnalyzer::stats(ptree &tree){
+    pthread_mutex_lock(&this->_lock);
+    tree.put("workers",     this->_workers.size());
+    tree.put("scale",       this->_scale);
+    tree.put("submitted",   this->_submitted);
+    tree.put("analyzed",    this->_analyzed);
+    tree.put("replaced",    this->_replaced);
+    tree.put("failed",      this->_failed);
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void* FrameAnalyzer::_worker(void *context){
+    FrameAnalyzer *fa = (FrameAnalyzer *)context;
+    FrameAnalysis result;
+
+    pthread_mutex_lock(&fa->_lock);
+    while(fa->_running){
+        if(fa->_pending == NULL){
+            pthread_cond_wait(&fa->_cond, &fa->_lock);
+            continue;
+        }
+
+        PreviewFrame *frame = fa->_pending;
+        fa->_pending = NULL;
+        pthread_mutex_unlock(&fa->_lock);
+
+        bool ok = FrameAnalyzer::analyze(frame->data, frame->size, fa->_scale, result);
+        result.sequence = frame->sequence;
+        fa->_pool->release(frame);
+
+        pthread_mutex_lock(&fa->_lock);
+        if(!ok){
+            fa->_failed++;
+        } else {
+            fa->_analyzed++;
+            // workers can finish out of order, keep the newest frame
+            if(!fa->_has_latest || result.sequence > fa->_latest.sequence){
+                fa->_latest = result;
+                fa->_has_latest = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fa->_lock);
+    return NULL;
+}
@@ -0,0 +1,85 @@
+//
+//  FrameAnalyzer.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__FrameAnalyzer__
+#define __CameraControllerApi__FrameAnalyzer__
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+#include "PreviewPool.h"
+
+using std::vector;
+using std::deque;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    struct FrameAnalysis {
+        unsigned long sequence;
+        int width;
+        int height;
+        unsigned int luma[256];
+        unsigned int red[256];
+        unsigned int green[256];
+        unsigned int blue[256];
+        double mean_luma;
+        double sharpness;
+        double decode_ms;
+        double analyze_ms;
+    };
+
+    /*
+     * Exposure histograms and a focus score for liveview frames. The preview
+     * JPEG is decoded with DCT scaling (1/2, 1/4 or 1/8) so only a fraction
+     * of the pixels has to be looked at. The sharpness is the variance of the
+     * laplacian of the luminance, higher is sharper.
+     *
+     * submit() hands a frame to the worker threads and never blocks; if the
+     * workers are busy the pending frame is replaced by the newer one, so the
+     * liveview loop always runs at camera speed.
+     */
+    class FrameAnalyzer {
+    public:
+        FrameAnalyzer(PreviewPool *pool, int workers, int scale);
+        ~FrameAnalyzer();
+
+        void submit(PreviewFrame *frame);
+        bool latest(FrameAnalysis &result);
+        unsigned long latest_sequence();
+        void stats(ptree &tree);
+
+        static bool analyze(const char *jpeg, unsigned long size, int scale, FrameAnalysis &result);
+        static bool decode_luma(const char *jpeg, unsigned long size, int scale, vector<unsigned char> &luma, int &width, int &height);
+        static double laplacian_variance(const unsigned char *luma, int width, int height);
+        static double gradient_energy(const unsigned char *luma, int width, int height, int stride);
+        static void to_ptree(const FrameAnalysis &result, bool histograms, ptree &tree);
+
+    private:
+        PreviewPool *_pool;
+        int _scale;
+        bool _running;
+        vector<pthread_t> _workers;
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        PreviewFrame *_pending;
+
+        FrameAnalysis _latest;
+        bool _has_latest;
+
+        unsigned long _submitted;
+        unsigned long _analyzed;
+        unsigned long _replaced;
+        unsigned long _failed;
+
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__FrameAnalyzer__) */
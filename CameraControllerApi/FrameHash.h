@@ -0,0 +1,24 @@
+//
+//  FrameHash.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__FrameHash__
+#define __CameraControllerApi__FrameHash__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace CameraControllerApi {
+
+    /*
+     * xxHash64 over a memory block. It is not a cryptographic hash, but it is
+     * fast enough to run over every liveview frame and it spreads well enough
+     * to tell two JPEGs apart.
+     */
+    uint64_t frame_hash(const void *data, size_t len, uint64_t seed = 0);
+}
+
+#endif /* defined(__CameraControllerApi__FrameHash__) */
@@ -0,0 +1,149 @@
+//
+//  FrameRing.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "FrameRing.h"
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace CameraControllerApi;
+
+// not FUTEX_PRIVATE, the word lives in memory shared between processes
+static int futex_wake(volatile uint32_t *addr){
+    return syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+FrameRing::FrameRing(const string &name, unsigned int slots, unsigned int slot_bytes){
+    this->_name = name.empty() ? "/cca_liveview" : name;
+    if(this->_name[0] != '/')
+        this->_name = "/" + this->_name;
+    // a reader needs a slot to read while the server writes the next ones
+    this->_slots = slots >= 2 ? slots : 4;
+    this->_slot_bytes = slot_bytes > 0 ? slot_bytes : 1048576;
+    this->_size = 0;
+    this->_map = NULL;
+    this->_header = NULL;
+    this->_oversize = 0;
+    this->_wakeups = 0;
+}
+
+/*
+ * Readers which still have the ring mapped see the writer gone and are
+ * woken up, the name is removed at once.
+ */
+FrameRing::~FrameRing(){
+    if(this->_map == NULL)
+        return;
+
+    this->_header->writer_pid = 0;
+    __sync_synchronize();
+    futex_wake(&this->_header->published);
+    munmap(this->_map, this->_size);
+    shm_unlink(this->_name.c_str());
+}
+
+/*
+ * Creates the shared memory. A ring left behind by an earlier run is
+ * unlinked first, its readers keep their old mapping until they open the
+ * name again.
+ */
+bool FrameRing::open(){
+    uint32_t stride = (sizeof(FrameRingSlot) + this->_slot_bytes + 63) & ~63U;
+    this->_size = sizeof(FrameRingHeader) + (size_t)stride * this->_slots;
+
+    shm_unlink(this->_name.c_str());
+    int fd = shm_open(this->_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+    if(fd < 0)
+        return false;
+
+    if(ftruncate(fd, this->_size) != 0){
+        ::close(fd);
+        shm_unlink(this->_name.c_str());
+        return false;
+    }
+
+    void *map = mmap(NULL, this->_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED){
+        shm_unlink(this->_name.c_str());
+        return false;
+    }
+
+    this->_map = (char *)map;
+    this->_header = (FrameRingHeader *)map;
+    this->_header->version = CCA_RING_VERSION;
+    this->_header->slots = this->_slots;
+    this->_header->slot_bytes = this->_slot_bytes;
+    this->_header->slot_stride = stride;
+    this->_header->published = 0;
+    this->_header->waiters = 0;
+    this->_header->writer_pid = getpid();
+    // the magic goes last, a reader which sees it sees the whole header
+    __sync_synchronize();
+    memcpy(this->_header->magic, CCA_RING_MAGIC, sizeof(this->_header->magic));
+    return true;
+}
+
+/*
+ * Copies a frame into the next slot and wakes sleeping readers. Only called
+ * from the liveview thread. Frames larger than a slot are dropped.
+ */
+bool FrameRing::publish(const char *data, unsigned long size, unsigned long frame, int64_t captured_us, uint64_t hash){
+    if(this->_map == NULL)
+        return false;
+    if(size > this->_slot_bytes){
+        this->_oversize++;
+        return false;
+    }
+
+    uint32_t number = this->_header->published + 1;
+    if(number == 0)
+        number = 1;
+    FrameRingSlot *slot = frame_ring_slot(this->_map, this->_header, number);
+
+    slot->lock++;
+    __sync_synchronize();
+    memcpy((char *)(slot + 1), data, size);
+    slot->size = (uint32_t)size;
+    slot->number = number;
+    slot->frame = (uint32_t)frame;
+    slot->captured_us = captured_us;
+    slot->hash = hash;
+    __sync_synchronize();
+    slot->lock++;
+
+    __sync_synchronize();
+    this->_header->published = number;
+    __sync_synchronize();
+    // no syscall per frame while every reader is busy with the last one
+    if(this->_header->waiters > 0){
+        futex_wake(&this->_header->published);
+        this->_wakeups++;
+    }
+    return true;
+}
+
+const string& FrameRing::name(){
+    return this->_name;
+}
+
+unsigned long FrameRing::published(){
+    return this->_map != NULL ? this->_header->published : 0;
+}
+
+unsigned long FrameRing::oversize(){
+    return this->_oversize;
+}
+
+unsigned long FrameRing::wakeups(){
+    return this->_wakeups;
+}
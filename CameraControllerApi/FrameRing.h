@@ -0,0 +1,54 @@
+//
+//  FrameRing.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__FrameRing__
+#define __CameraControllerApi__FrameRing__
+
+#include "FrameRingReader.h"
+#include <iostream>
+#include <string>
+#include <sys/types.h>
+
+using std::string;
+
+namespace CameraControllerApi {
+
+    /*
+     * The server side: a POSIX shared memory object (preview.shm.name) the
+     * liveview writes every frame to. Readers on the same host map it and
+     * get the frames without a copy and without a syscall per frame; a
+     * reader which waits for the next frame sleeps on a futex, which the
+     * server only wakes if somebody sleeps on it.
+     *
+     * There is one writer and no backpressure, a reader which is more than
+     * slots - 1 frames behind loses frames instead of slowing the camera.
+     */
+    class FrameRing {
+    public:
+        FrameRing(const string &name, unsigned int slots, unsigned int slot_bytes);
+        ~FrameRing();
+
+        bool open();
+        bool publish(const char *data, unsigned long size, unsigned long frame, int64_t captured_us, uint64_t hash);
+        const string& name();
+        unsigned long published();
+        unsigned long oversize();
+        unsigned long wakeups();
+
+    private:
+        string _name;
+        unsigned int _slots;
+        unsigned int _slot_bytes;
+        size_t _size;
+        char *_map;
+        FrameRingHeader *_header;
+        unsigned long _oversize;
+        unsigned long _wakeups;
+    };
+}
+
+#endif /* defined(__CameraControllerApi__FrameRing__) */
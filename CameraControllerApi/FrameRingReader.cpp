@@ -0,0 +1,177 @@
+//
+//  FrameRingReader.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "FrameRingReader.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace CameraControllerApi;
+
+// not FUTEX_PRIVATE, the word lives in memory shared between processes
+static int futex_wait(volatile uint32_t *addr, uint32_t value, const struct timespec *timeout){
+    return syscall(SYS_futex, addr, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+FrameRingReader::FrameRingReader(){
+    this->_size = 0;
+    this->_map = NULL;
+    this->_header = NULL;
+    this->_last = 0;
+    this->_missed = 0;
+}
+
+FrameRingReader::~FrameRingReader(){
+    this->close();
+}
+
+bool FrameRingReader::open(const char *name){
+    this->close();
+
+    // read and write, a sleeping reader registers itself in the header
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FrameRingHeader)){
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    FrameRingHeader *header = (FrameRingHeader *)map;
+    __sync_synchronize();
+    if(memcmp(header->magic, CCA_RING_MAGIC, sizeof(header->magic)) != 0 || header->version != CCA_RING_VERSION ||
+       header->slots == 0 || sizeof(FrameRingHeader) + (size_t)header->slot_stride * header->slots > (size_t)st.st_size){
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    this->_size = st.st_size;
+    this->_map = (char *)map;
+    this->_header = header;
+    // the newest frame which is there already is the first one next() returns
+    uint32_t published = header->published;
+    this->_last = published > 0 ? published - 1 : 0;
+    this->_missed = 0;
+    return true;
+}
+
+void FrameRingReader::close(){
+    if(this->_map != NULL)
+        munmap(this->_map, this->_size);
+    this->_map = NULL;
+    this->_header = NULL;
+}
+
+// the opening half of the seqlock, valid() is the closing one
+bool FrameRingReader::_read(uint32_t number, FrameView &view){
+    FrameRingSlot *slot = frame_ring_slot(this->_map, this->_header, number);
+    uint32_t lock = slot->lock;
+    __sync_synchronize();
+    if((lock & 1) != 0 || slot->number != number)
+        return false;
+
+    view.data = (const char *)(slot + 1);
+    view.size = slot->size;
+    view.number = slot->number;
+    view.frame = slot->frame;
+    view.captured_us = slot->captured_us;
+    view.hash = slot->hash;
+    view.slot = (number - 1) % this->_header->slots;
+    view.lock = lock;
+    __sync_synchronize();
+    return slot->lock == lock && view.size <= this->_header->slot_bytes;
+}
+
+bool FrameRingReader::next(FrameView &view, int timeout_ms){
+    if(this->_map == NULL)
+        return false;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while(true){
+        uint32_t published = this->_header->published;
+        __sync_synchronize();
+        if(published != this->_last){
+            // a frame which was overwritten while it was read is skipped for a newer one
+            if(!this->_read(published, view))
+                continue;
+            this->_missed += published - this->_last - 1;
+            this->_last = published;
+            return true;
+        }
+
+        if(timeout_ms == 0 || this->_header->writer_pid == 0)
+            return false;
+
+        struct timespec remaining, *timeout = NULL;
+        if(timeout_ms > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if(remaining.tv_nsec < 0){
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000L;
+            }
+            if(remaining.tv_sec < 0)
+                return false;
+            timeout = &remaining;
+        }
+
+        // the server checks waiters after it has published, the futex
+        // returns at once if published moved in between
+        __sync_fetch_and_add(&this->_header->waiters, 1);
+        int ret = futex_wait(&this->_header->published, published, timeout);
+        __sync_fetch_and_sub(&this->_header->waiters, 1);
+        if(ret != 0 && errno == ETIMEDOUT)
+            return false;
+    }
+}
+
+bool FrameRingReader::valid(const FrameView &view){
+    if(this->_map == NULL)
+        return false;
+    FrameRingSlot *slot = frame_ring_slot(this->_map, this->_header, view.number);
+    __sync_synchronize();
+    return slot->lock == view.lock;
+}
+
+/*
+ * False once the server has closed the ring or died, the reader has to
+ * open the name again to follow a new server.
+ */
+bool FrameRingReader::writer_alive(){
+    if(this->_map == NULL)
+        return false;
+    pid_t pid = this->_header->writer_pid;
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+unsigned long FrameRingReader::missed(){
+    return this->_missed;
+}
@@ -0,0 +1,112 @@
+//
+//  FrameRingReader.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__FrameRingReader__
+#define __CameraControllerApi__FrameRingReader__
+
+// libccaring.a is built from this alone, readers link it with libc only
+#include <stddef.h>
+#include <stdint.h>
+
+#define CCA_RING_MAGIC "CCARING1"
+#define CCA_RING_VERSION 1
+
+namespace CameraControllerApi {
+
+    /*
+     * The layout of the shared memory, the same for the server and every
+     * reader. The header is followed by slots of slot_stride bytes, each a
+     * FrameRingSlot and up to slot_bytes of JPEG.
+     *
+     * published counts the frames written so far, frame n (counting from 1)
+     * is in slot (n - 1) % slots. It is also the futex readers sleep on.
+     * A slot's lock is odd while the server writes it (a seqlock): a reader
+     * which sees the same even value before and after it looked at the data
+     * has read a whole frame.
+     */
+    struct FrameRingHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t slots;
+        uint32_t slot_bytes;
+        uint32_t slot_stride;
+        volatile uint32_t published;
+        volatile uint32_t waiters;
+        volatile int32_t writer_pid;
+        uint32_t reserved[7];
+    };
+
+    struct FrameRingSlot {
+        volatile uint32_t lock;
+        uint32_t size;
+        uint32_t number;
+        uint32_t frame;
+        int64_t captured_us;
+        uint64_t hash;
+        uint64_t reserved[4];
+    };
+
+    inline FrameRingSlot* frame_ring_slot(char *map, const FrameRingHeader *header, uint32_t number){
+        return (FrameRingSlot *)(map + sizeof(FrameRingHeader) + (size_t)((number - 1) % header->slots) * header->slot_stride);
+    }
+
+    /*
+     * A frame as a reader sees it. data points into the shared memory, it is
+     * only valid while FrameRingReader::valid() says so.
+     */
+    struct FrameView {
+        const char *data;
+        uint32_t size;
+        uint32_t number;
+        uint32_t frame;
+        int64_t captured_us;
+        uint64_t hash;
+        uint32_t slot;
+        uint32_t lock;
+    };
+
+    /*
+     * The reader library. next() returns the newest frame the reader has not
+     * seen yet, waiting up to timeout_ms for one (forever if negative). The
+     * frame stays in the shared memory; after it has been used, valid() has
+     * to be true, otherwise the server has overwritten it meanwhile and the
+     * result has to be thrown away.
+     *
+     *     FrameRingReader reader;
+     *     reader.open("/cca_liveview");
+     *     FrameView view;
+     *     while(reader.next(view, 1000)){
+     *         decode(view.data, view.size);
+     *         if(!reader.valid(view))
+     *             continue;
+     *         ...
+     *     }
+     */
+    class FrameRingReader {
+    public:
+        FrameRingReader();
+        ~FrameRingReader();
+
+        bool open(const char *name);
+        void close();
+        bool next(FrameView &view, int timeout_ms);
+        bool valid(const FrameView &view);
+        bool writer_alive();
+        unsigned long missed();
+
+    private:
+        size_t _size;
+        char *_map;
+        FrameRingHeader *_header;
+        uint32_t _last;
+        unsigned long _missed;
+
+        bool _read(uint32_t number, FrameView &view);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__FrameRingReader__) */
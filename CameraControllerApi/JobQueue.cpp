@@ -0,0 +1,311 @@
+//
+//  JobQueue.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "JobQueue.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "Tracer.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+using namespace CameraControllerApi;
+
+JobQueue* JobQueue::_instance = NULL;
+pthread_mutex_t JobQueue::_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+JobQueue* JobQueue::getInstance(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        _instance = new JobQueue();
+    
+    return _instance;
+}
+
+void JobQueue::release(){
+    pthread_mutex_lock(&_instance_lock);
+    JobQueue *queue = _instance;
+    _instance = NULL;
+    pthread_mutex_unlock(&_instance_lock);
+
+    if(queue != NULL)
+        delete queue;
+}
+
+JobQueue::JobQueue(){
+    string pending, keep, wait;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("jobs.max_pending", pending);
+    sett->get_value("jobs.keep_finished", keep);
+    sett->get_value("jobs.max_wait_ms", wait);
+    this->_max_pending = atoi(pending.c_str()) > 0 ? atoi(pending.c_str()) : 16;
+    this->_keep_finished = atoi(keep.c_str()) > 0 ? atoi(keep.c_str()) : 64;
+    this->_max_wait_ms = atoi(wait.c_str()) > 0 ? atoi(wait.c_str()) : 30000;
+    
+    this->_next_id = 1;
+    this->_submitted = 0;
+    this->_rejected = 0;
+    this->_completed = 0;
+    this->_failed = 0;
+    this->_cancelled = 0;
+    this->_running = true;
+    this->_accepting = true;
+    this->_busy = false;
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_work, NULL);
+    pthread_cond_init(&this->_finished_cond, NULL);
+    this->_started = (0 == pthread_create(&this->_thread, NULL, JobQueue::_worker, this));
+}
+
+JobQueue::~JobQueue(){
+    pthread_mutex_lock(&this->_lock);
+    this->_running = false;
+    pthread_cond_broadcast(&this->_work);
+    pthread_mutex_unlock(&this->_lock);
+    
+    if(this->_started)
+        pthread_join(this->_thread, NULL);
+    
+    for(map<unsigned long, Entry *>::iterator it = this->_entries.begin(); it != this->_entries.end(); it++){
+        delete it->second->job;
+        delete it->second;
+    }
+    
+    pthread_cond_destroy(&this->_finished_cond);
+    pthread_cond_destroy(&this->_work);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Takes over the job. Returns the job id or 0 if the queue is full or
+ * draining, in which case the job is deleted.
+ */
+unsigned long JobQueue::submit(Job *job){
+    ScopedLock lock(&this->_lock);
+    if(!this->_started || !this->_accepting || this->_pending.size() >= this->_max_pending){
+        this->_rejected++;
+        delete job;
+        return 0;
+    }
+    
+    Entry *entry = new Entry;
+    entry->id = this->_next_id++;
+    entry->kind = job->kind();
+    entry->job = job;
+    entry->state = CCA_JOB_QUEUED;
+    entry->response = 0;
+    entry->queued_ms = 0;
+    entry->run_ms = 0;
+    
+    this->_entries[entry->id] = entry;
+    this->_pending.push_back(entry);
+    this->_submitted++;
+    pthread_cond_signal(&this->_work);
+    return entry->id;
+}
+
+/*
+ * Describes a job, waiting up to wait_ms (capped by jobs.max_wait_ms) for it
+ * to finish. Returns false for an unknown or expired id.
+ */
+bool JobQueue::status(unsigned long id, int wait_ms, ptree &tree, int &response){
+    ScopedLock lock(&this->_lock);
+    map<unsigned long, Entry *>::iterator it = this->_entries.find(id);
+    if(it == this->_entries.end())
+        return false;
+    
+    if(wait_ms > this->_max_wait_ms)
+        wait_ms = this->_max_wait_ms;
+    
+    if(wait_ms > 0){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        
+        while(it->second->state == CCA_JOB_QUEUED || it->second->state == CCA_JOB_RUNNING){
+            if(pthread_cond_timedwait(&this->_finished_cond, &this->_lock, &deadline) == ETIMEDOUT)
+                break;
+            
+            // the entry may have been pushed out while we slept
+            it = this->_entries.find(id);
+            if(it == this->_entries.end())
+                return false;
+        }
+    }
+    
+    this->_to_ptree(it->second, tree);
+    response = it->second->response;
+    return true;
+}
+
+/*
+ * For shutdown: takes no more jobs and waits up to timeout_ms for the queued
+ * ones to run. Jobs still queued then are cancelled. A job which is already
+ * running can not be interrupted, release() waits for it. Returns true if
+ * nothing had to be cancelled.
+ */
+bool JobQueue::drain(int timeout_ms){
+    ScopedLock lock(&this->_lock);
+    this->_accepting = false;
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    while(this->_started && !this->_pending.empty()){
+        if(pthread_cond_timedwait(&this->_finished_cond, &this->_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    
+    bool drained = this->_pending.empty();
+    while(!this->_pending.empty()){
+        Entry *entry = this->_pending.front();
+        this->_pending.pop_front();
+        entry->state = CCA_JOB_CANCELLED;
+        entry->queued_ms = entry->created.elapsed_ms();
+        this->_cancelled++;
+        this->_finish(entry);
+    }
+    pthread_cond_broadcast(&this->_finished_cond);
+    return drained;
+}
+
+/*
+ * True once drain() was called. A job which runs for long (a script) ends
+ * at its next step instead of holding the shutdown up.
+ */
+bool JobQueue::stopping(){
+    ScopedLock lock(&this->_lock);
+    return !this->_accepting;
+}
+
+void JobQueue::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("pending",     this->_pending.size());
+    tree.put("running",     this->_busy);
+    tree.put("kept",        this->_entries.size());
+    tree.put("max_pending", this->_max_pending);
+    tree.put("submitted",   this->_submitted);
+    tree.put("rejected",    this->_rejected);
+    tree.put("completed",   this->_completed);
+    tree.put("failed",      this->_failed);
+    tree.put("cancelled",   this->_cancelled);
+    tree.put("accepting",   this->_accepting);
+    
+    ptree jobs;
+    for(map<unsigned long, Entry *>::iterator it = this->_entries.begin(); it != this->_entries.end(); it++){
+        ptree job;
+        job.put("id",    it->second->id);
+        job.put("kind",  it->second->kind);
+        job.put("state", it->second->state == CCA_JOB_QUEUED ? "queued" :
+                         it->second->state == CCA_JOB_RUNNING ? "running" :
+                         it->second->state == CCA_JOB_DONE ? "done" :
+                         it->second->state == CCA_JOB_FAILED ? "failed" : "cancelled");
+        jobs.push_back(std::make_pair("", job));
+    }
+    tree.put_child("jobs", jobs);
+}
+
+void JobQueue::_to_ptree(const Entry *entry, ptree &tree){
+    tree.put("id",   entry->id);
+    tree.put("kind", entry->kind);
+    switch (entry->state) {
+        case CCA_JOB_QUEUED:
+            tree.put("state", "queued");
+            tree.put("queued_ms", entry->created.elapsed_ms());
+            break;
+        case CCA_JOB_RUNNING:
+            tree.put("state", "running");
+            tree.put("queued_ms", entry->queued_ms);
+            break;
+        case CCA_JOB_CANCELLED:
+            tree.put("state", "cancelled");
+            tree.put("queued_ms", entry->queued_ms);
+            break;
+        default:
+            tree.put("state", entry->state == CCA_JOB_DONE ? "done" : "failed");
+            tree.put("queued_ms", entry->queued_ms);
+            tree.put("run_ms", entry->run_ms);
+            if(!entry->result.empty())
+                tree.put_child("result", entry->result);
+            break;
+    }
+}
+
+/*
+ * Called with the lock held once an entry will not run (anymore). Its job
+ * is deleted, the entry is kept for status() among the last keep_finished.
+ */
+void JobQueue::_finish(Entry *entry){
+    delete entry->job;
+    entry->job = NULL;
+    
+    this->_finished.push_back(entry->id);
+    while(this->_finished.size() > this->_keep_finished){
+        map<unsigned long, Entry *>::iterator it = this->_entries.find(this->_finished.front());
+        if(it != this->_entries.end()){
+            delete it->second;
+            this->_entries.erase(it);
+        }
+        this->_finished.pop_front();
+    }
+}
+
+void* JobQueue::_worker(void *context){
+    JobQueue *queue = static_cast<JobQueue *>(context);
+    
+    pthread_mutex_lock(&queue->_lock);
+    while(true){
+        while(queue->_running && queue->_pending.empty())
+            pthread_cond_wait(&queue->_work, &queue->_lock);
+        
+        if(queue->_pending.empty())
+            break;
+        
+        Entry *entry = queue->_pending.front();
+        queue->_pending.pop_front();
+        entry->state = CCA_JOB_RUNNING;
+        entry->queued_ms = entry->created.elapsed_ms();
+        queue->_busy = true;
+        pthread_mutex_unlock(&queue->_lock);
+        
+        Stopwatch watch;
+        ptree result;
+        int response;
+        {
+            TraceSpan span("job", entry->job->kind());
+            response = entry->job->run(result);
+        }
+        double run_ms = watch.elapsed_ms();
+        
+        pthread_mutex_lock(&queue->_lock);
+        entry->result.swap(result);
+        entry->response = response;
+        entry->run_ms = run_ms;
+        entry->state = response > 0 ? CCA_JOB_DONE : CCA_JOB_FAILED;
+        if(entry->state == CCA_JOB_DONE)
+            queue->_completed++;
+        else
+            queue->_failed++;
+        queue->_busy = false;
+        queue->_finish(entry);
+        pthread_cond_broadcast(&queue->_finished_cond);
+    }
+    pthread_mutex_unlock(&queue->_lock);
+    
+    return NULL;
+}
@@ -0,0 +1,109 @@
+//
+//  JobQueue.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__JobQueue__
+#define __CameraControllerApi__JobQueue__
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <deque>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+#include "Stopwatch.h"
+
+using std::map;
+using std::deque;
+using std::string;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    typedef enum {
+        CCA_JOB_QUEUED,
+        CCA_JOB_RUNNING,
+        CCA_JOB_DONE,
+        CCA_JOB_FAILED,
+        CCA_JOB_CANCELLED
+    } CCA_JOB_STATE;
+
+    /*
+     * A piece of camera work which runs on the job worker. run() fills the
+     * result tree and returns a CCA_API_RESPONSE code, negative on failure.
+     */
+    class Job {
+    public:
+        virtual ~Job(){}
+        virtual const char* kind() const = 0;
+        virtual int run(ptree &result) = 0;
+    };
+
+    /*
+     * Runs jobs one after another on a single camera worker thread, so an
+     * HTTP thread only has to queue the work and return the job id. Finished
+     * jobs are kept (jobs.keep_finished) until their result is fetched or
+     * newer jobs push them out.
+     */
+    class JobQueue {
+
+        static JobQueue *_instance;
+        static pthread_mutex_t _instance_lock;
+    public:
+        static JobQueue* getInstance();
+        static void release();
+
+        unsigned long submit(Job *job);
+        bool status(unsigned long id, int wait_ms, ptree &tree, int &response);
+        bool drain(int timeout_ms);
+        bool stopping();
+        void stats(ptree &tree);
+
+    private:
+        struct Entry {
+            unsigned long id;
+            string kind;
+            Job *job;
+            CCA_JOB_STATE state;
+            int response;
+            ptree result;
+            Stopwatch created;
+            double queued_ms;
+            double run_ms;
+        };
+
+        JobQueue();
+        ~JobQueue();
+
+        pthread_t _thread;
+        bool _started;
+        bool _running;
+        bool _accepting;
+        bool _busy;
+        pthread_mutex_t _lock;
+        pthread_cond_t _work;
+        pthread_cond_t _finished_cond;
+        map<unsigned long, Entry *> _entries;
+        deque<Entry *> _pending;
+        deque<unsigned long> _finished;
+        unsigned long _next_id;
+        unsigned int _max_pending;
+        unsigned int _keep_finished;
+        int _max_wait_ms;
+
+        unsigned long _submitted;
+        unsigned long _rejected;
+        unsigned long _completed;
+        unsigned long _failed;
+        unsigned long _cancelled;
+
+        void _finish(Entry *entry);
+        void _to_ptree(const Entry *entry, ptree &tree);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__JobQueue__) */
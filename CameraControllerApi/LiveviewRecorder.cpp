@@ -0,0 +1,496 @@
+//
+//  LiveviewRecorder.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "LiveviewRecorder.h"
+#include "SpoolRetention.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "Logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// RIFF, hdrl with avih, strl, strh and strf, and the head of the movi list
+#define CCA_AVI_HEADER_BYTES 224
+// idx1 offsets count from the "movi" fourcc
+#define CCA_AVI_MOVI_OFFSET 220
+#define CCA_AVI_FLUSH_MS 200
+
+using namespace CameraControllerApi;
+
+static void le16(string &out, uint16_t value){
+    out += (char)(value & 0xFF);
+    out += (char)(value >> 8);
+}
+
+static void le32(string &out, uint32_t value){
+    le16(out, value & 0xFFFF);
+    le16(out, value >> 16);
+}
+
+static void fourcc(string &out, const char *code){
+    out.append(code, 4);
+}
+
+/*
+ * Width and height from the SOF marker of a JPEG, the AVI header needs them
+ * and the liveview size differs from camera to camera.
+ */
+static bool jpeg_dimensions(const string &jpeg, int &width, int &height){
+    const unsigned char *data = (const unsigned char *)jpeg.data();
+    size_t size = jpeg.size();
+    size_t pos = 2;
+    while(pos + 9 < size){
+        if(data[pos] != 0xFF)
+            return false;
+        unsigned char marker = data[pos + 1];
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC){
+            height = (data[pos + 5] << 8) | data[pos + 6];
+            width = (data[pos + 7] << 8) | data[pos + 8];
+            return true;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+LiveviewRecorder::LiveviewRecorder(const string &directory){
+    string batch, queue, segment;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("record.batch_bytes", batch);
+    sett->get_value("record.max_queue_bytes", queue);
+    sett->get_value("record.segment_bytes", segment);
+    this->_directory = directory;
+    this->_batch_bytes = strtoul(batch.c_str(), NULL, 10) > 0 ? strtoul(batch.c_str(), NULL, 10) : 4194304;
+    this->_max_queue_bytes = strtoul(queue.c_str(), NULL, 10) > 0 ? strtoul(queue.c_str(), NULL, 10) : 16777216;
+    this->_segment_bytes = strtoul(segment.c_str(), NULL, 10);
+    // the idx1 offsets are 32 bit and AVI 1.0 readers give up at 2GB
+    if(this->_segment_bytes == 0 || this->_segment_bytes > 2000000000UL)
+        this->_segment_bytes = 1073741824UL;
+
+    this->_started = false;
+    this->_running = false;
+    this->_queued_bytes = 0;
+    this->_fd = -1;
+    this->_timestamps = NULL;
+    this->_segment = 0;
+    this->_frames = 0;
+    this->_dropped = 0;
+    this->_bytes = 0;
+    this->_writes = 0;
+    this->_segments = 0;
+    this->_write_ms = 0;
+    this->_max_write_ms = 0;
+    this->_failed = false;
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+}
+
+LiveviewRecorder::~LiveviewRecorder(){
+    this->stop();
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Opens a new recording named after the local time, file is the name of
+ * its first AVI in the spool. False if one is running already or the file
+ * can not be created.
+ */
+bool LiveviewRecorder::start(string &file){
+    ScopedLock lock(&this->_lock);
+    if(this->_started)
+        return false;
+
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "liveview_%Y%m%d_%H%M%S", &tm);
+    this->_base = this->_directory + "/" + stamp;
+    this->_segment = 0;
+    this->_frames = 0;
+    this->_dropped = 0;
+    this->_bytes = 0;
+    this->_writes = 0;
+    this->_segments = 0;
+    this->_write_ms = 0;
+    this->_max_write_ms = 0;
+    this->_failed = false;
+    this->_watch.restart();
+    if(!this->_open_segment())
+        return false;
+
+    this->_running = true;
+    this->_started = (0 == pthread_create(&this->_thread, NULL, LiveviewRecorder::_writer, this));
+    if(!this->_started){
+        // nothing written yet, the empty files stay behind
+        this->_running = false;
+        close(this->_fd);
+        this->_fd = -1;
+        if(this->_timestamps != NULL)
+            fclose(this->_timestamps);
+        this->_timestamps = NULL;
+        return false;
+    }
+    file = this->_file;
+    return true;
+}
+
+/*
+ * Writes what is queued, closes the file and waits for the writer.
+ */
+void LiveviewRecorder::stop(){
+    pthread_mutex_lock(&this->_lock);
+    bool started = this->_started;
+    this->_running = false;
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    if(!started)
+        return;
+    pthread_join(this->_thread, NULL);
+
+    ScopedLock lock(&this->_lock);
+    this->_started = false;
+}
+
+bool LiveviewRecorder::recording(){
+    ScopedLock lock(&this->_lock);
+    return this->_running;
+}
+
+/*
+ * Called from the liveview loop, only copies the frame.
+ */
+void LiveviewRecorder::submit(const PreviewFrame *frame){
+    if(!this->recording())
+        return;
+
+    Frame *copy = new Frame();
+    copy->data.assign(frame->data, frame->size);
+    copy->sequence = frame->sequence;
+    copy->captured_us = frame->captured.tv_sec * (int64_t)1000000 + frame->captured.tv_usec;
+
+    pthread_mutex_lock(&this->_lock);
+    if(!this->_running || this->_queued_bytes + frame->size > this->_max_queue_bytes){
+        if(this->_running)
+            this->_dropped++;
+        pthread_mutex_unlock(&this->_lock);
+        delete copy;
+        return;
+    }
+    this->_queue.push_back(copy);
+    this->_queued_bytes += frame->size;
+    pthread_cond_signal(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void LiveviewRecorder::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("recording",    this->_running);
+    if(!this->_file.empty())
+        tree.put("file",     this->_file);
+    tree.put("segments",     this->_segments);
+    tree.put("frames",       this->_frames);
+    tree.put("dropped",      this->_dropped);
+    tree.put("bytes",        this->_bytes);
+    tree.put("queued_bytes", this->_queued_bytes);
+    tree.put("writes",       this->_writes);
+    tree.put("write_kb",     this->_writes > 0 ? this->_bytes / 1024.0 / this->_writes : 0.0);
+    tree.put("write_ms",     this->_writes > 0 ? this->_write_ms / this->_writes : 0.0);
+    tree.put("max_write_ms", this->_max_write_ms);
+    tree.put("failed",       this->_failed);
+}
+
+bool LiveviewRecorder::_open_segment(){
+    char suffix[16] = "";
+    if(this->_segment > 0)
+        snprintf(suffix, sizeof(suffix), "_%03d", this->_segment);
+    string path = this->_base + suffix + ".avi";
+    string ts = this->_base + suffix + ".ts";
+
+    this->_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(this->_fd < 0){
+        Logger::getInstance()->log(CCA_LOG_ERROR, "record", "op=open file=%s errno=%d", path.c_str(), errno);
+        return false;
+    }
+    this->_timestamps = fopen(ts.c_str(), "w");
+    if(this->_timestamps != NULL){
+        // the writer flushes it in large blocks like the AVI
+        setvbuf(this->_timestamps, NULL, _IOFBF, 65536);
+        fprintf(this->_timestamps, "# frame\tcaptured_us\toffset\tsize\n");
+    }
+
+    this->_width = 0;
+    this->_height = 0;
+    this->_first_us = 0;
+    this->_last_us = 0;
+    this->_max_frame = 0;
+    this->_index.clear();
+    this->_batch.clear();
+    // a placeholder until the segment is closed and the counts are known
+    this->_header(this->_batch);
+    this->_file_bytes = this->_batch.size();
+    this->_file = path.substr(path.rfind('/') + 1);
+    this->_segments++;
+    return true;
+}
+
+/*
+ * Appends the index and writes the final header over the placeholder. A
+ * segment which was never closed (the process died) still has its frames
+ * and the .ts file with their offsets.
+ */
+void LiveviewRecorder::_close_segment(){
+    if(this->_fd < 0)
+        return;
+
+    this->_batch.reserve(this->_batch.size() + 8 + this->_index.size() * 16);
+    fourcc(this->_batch, "idx1");
+    le32(this->_batch, this->_index.size() * 16);
+    for(size_t i = 0; i < this->_index.size(); i++){
+        fourcc(this->_batch, "00dc");
+        le32(this->_batch, 0x10); // AVIIF_KEYFRAME, every MJPEG frame is one
+        le32(this->_batch, this->_index[i].offset);
+        le32(this->_batch, this->_index[i].size);
+    }
+    unsigned long movi_end = this->_file_bytes;
+    this->_file_bytes += 8 + this->_index.size() * 16;
+    this->_flush();
+
+    string header;
+    this->_header(header);
+    // the sizes of RIFF and movi are only known now
+    string riff;
+    le32(riff, this->_file_bytes - 8);
+    header.replace(4, 4, riff);
+    string movi;
+    le32(movi, movi_end - CCA_AVI_MOVI_OFFSET);
+    header.replace(CCA_AVI_HEADER_BYTES - 8, 4, movi);
+    if(pwrite(this->_fd, header.data(), header.size(), 0) != (ssize_t)header.size())
+        this->_failed = true;
+
+    close(this->_fd);
+    this->_fd = -1;
+    long ts_bytes = 0;
+    if(this->_timestamps != NULL){
+        ts_bytes = ftell(this->_timestamps);
+        fclose(this->_timestamps);
+    }
+    this->_timestamps = NULL;
+
+    // a segment can only be evicted once it is closed
+    string base = this->_file.substr(0, this->_file.size() - 4);
+    SpoolRetention::spooled(this->_file, this->_file_bytes);
+    if(ts_bytes > 0)
+        SpoolRetention::spooled(base + ".ts", ts_bytes);
+}
+
+void LiveviewRecorder::_header(string &out){
+    uint32_t frames = this->_index.size();
+    // the average over the segment, the .ts file has the real times
+    uint32_t us_per_frame = 33333;
+    if(frames > 1 && this->_last_us > this->_first_us)
+        us_per_frame = (uint32_t)((this->_last_us - this->_first_us) / (frames - 1));
+    if(us_per_frame == 0)
+        us_per_frame = 1;
+    uint32_t buffer = this->_max_frame + 8;
+
+    fourcc(out, "RIFF");
+    le32(out, 0);
+    fourcc(out, "AVI ");
+    fourcc(out, "LIST");
+    le32(out, 192);
+    fourcc(out, "hdrl");
+
+    fourcc(out, "avih");
+    le32(out, 56);
+    le32(out, us_per_frame);
+    le32(out, 0);
+    le32(out, 0);
+    le32(out, 0x10); // AVIF_HASINDEX
+    le32(out, frames);
+    le32(out, 0);
+    le32(out, 1);
+    le32(out, buffer);
+    le32(out, this->_width);
+    le32(out, this->_height);
+    for(int i = 0; i < 4; i++)
+        le32(out, 0);
+
+    fourcc(out, "LIST");
+    le32(out, 116);
+    fourcc(out, "strl");
+    fourcc(out, "strh");
+    le32(out, 56);
+    fourcc(out, "vids");
+    fourcc(out, "MJPG");
+    le32(out, 0);
+    le32(out, 0);
+    le32(out, 0);
+    le32(out, 1000);
+    le32(out, (uint32_t)(1000000000.0 / us_per_frame + 0.5));
+    le32(out, 0);
+    le32(out, frames);
+    le32(out, buffer);
+    le32(out, 0xFFFFFFFF);
+    le32(out, 0);
+    le16(out, 0);
+    le16(out, 0);
+    le16(out, this->_width);
+    le16(out, this->_height);
+
+    fourcc(out, "strf");
+    le32(out, 40);
+    le32(out, 40);
+    le32(out, this->_width);
+    le32(out, this->_height);
+    le16(out, 1);
+    le16(out, 24);
+    fourcc(out, "MJPG");
+    le32(out, this->_width * this->_height * 3);
+    for(int i = 0; i < 4; i++)
+        le32(out, 0);
+
+    fourcc(out, "LIST");
+    le32(out, 4);
+    fourcc(out, "movi");
+}
+
+void LiveviewRecorder::_append(const Frame &frame){
+    unsigned long padded = frame.data.size() + (frame.data.size() & 1);
+    if(!this->_index.empty() && this->_file_bytes + 8 + padded + 16 * (this->_index.size() + 1) > this->_segment_bytes){
+        this->_close_segment();
+        this->_segment++;
+        // start() opens the first one with the lock held as well, stats() reads the name
+        ScopedLock lock(&this->_lock);
+        if(!this->_open_segment()){
+            this->_failed = true;
+            this->_running = false;
+            return;
+        }
+    }
+
+    if(this->_width == 0)
+        jpeg_dimensions(frame.data, this->_width, this->_height);
+    if(this->_index.empty())
+        this->_first_us = frame.captured_us;
+    this->_last_us = frame.captured_us;
+    if(frame.data.size() > this->_max_frame)
+        this->_max_frame = frame.data.size();
+
+    IndexEntry entry;
+    entry.offset = this->_file_bytes - CCA_AVI_MOVI_OFFSET;
+    entry.size = frame.data.size();
+    this->_index.push_back(entry);
+
+    fourcc(this->_batch, "00dc");
+    le32(this->_batch, frame.data.size());
+    this->_batch += frame.data;
+    if(padded != frame.data.size())
+        this->_batch += '\0';
+
+    if(this->_timestamps != NULL)
+        fprintf(this->_timestamps, "%lu\t%lld\t%lu\t%lu\n", frame.sequence, (long long)frame.captured_us,
+                this->_file_bytes + 8, (unsigned long)frame.data.size());
+    this->_file_bytes += 8 + padded;
+
+    ScopedLock lock(&this->_lock);
+    this->_frames++;
+}
+
+bool LiveviewRecorder::_flush(){
+    if(this->_batch.empty() || this->_fd < 0)
+        return true;
+
+    Stopwatch watch;
+    const char *data = this->_batch.data();
+    size_t left = this->_batch.size();
+    while(left > 0){
+        ssize_t written = write(this->_fd, data, left);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            break;
+        data += written;
+        left -= written;
+    }
+    if(this->_timestamps != NULL)
+        fflush(this->_timestamps);
+    double ms = watch.elapsed_ms();
+
+    ScopedLock lock(&this->_lock);
+    this->_writes++;
+    this->_bytes += this->_batch.size() - left;
+    this->_write_ms += ms;
+    if(ms > this->_max_write_ms)
+        this->_max_write_ms = ms;
+    this->_batch.clear();
+    if(left > 0){
+        Logger::getInstance()->log(CCA_LOG_ERROR, "record", "op=write file=%s errno=%d", this->_file.c_str(), errno);
+        this->_failed = true;
+        this->_running = false;
+        return false;
+    }
+    return true;
+}
+
+void LiveviewRecorder::_run(){
+    deque<Frame *> frames;
+    bool running = true;
+    while(running){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CCA_AVI_FLUSH_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&this->_lock);
+        bool timeout = false;
+        while(this->_queue.empty() && this->_running && !timeout)
+            timeout = (pthread_cond_timedwait(&this->_cond, &this->_lock, &deadline) == ETIMEDOUT);
+        frames.swap(this->_queue);
+        this->_queued_bytes = 0;
+        running = this->_running;
+        pthread_mutex_unlock(&this->_lock);
+
+        for(size_t i = 0; i < frames.size(); i++){
+            this->_append(*frames[i]);
+            delete frames[i];
+        }
+        frames.clear();
+
+        // large writes while frames come in, whatever there is when it gets quiet
+        if(this->_batch.size() >= this->_batch_bytes || timeout)
+            this->_flush();
+    }
+
+    this->_close_segment();
+    pthread_mutex_lock(&this->_lock);
+    for(size_t i = 0; i < this->_queue.size(); i++)
+        delete this->_queue[i];
+    this->_queue.clear();
+    this->_queued_bytes = 0;
+    double ms = this->_watch.elapsed_ms();
+    Logger::getInstance()->log(this->_failed ? CCA_LOG_WARN : CCA_LOG_INFO, "record",
+                               "op=stop file=%s segments=%lu frames=%lu dropped=%lu bytes=%lu writes=%lu ms=%.0f failed=%d",
+                               this->_file.c_str(), this->_segments, this->_frames, this->_dropped, this->_bytes,
+                               this->_writes, ms, this->_failed);
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void* LiveviewRecorder::_writer(void *context){
+    static_cast<LiveviewRecorder *>(context)->_run();
+    return NULL;
+}
@@ -0,0 +1,112 @@
+//
+//  LiveviewRecorder.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__LiveviewRecorder__
+#define __CameraControllerApi__LiveviewRecorder__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+#include "PreviewPool.h"
+#include "Stopwatch.h"
+
+using std::string;
+using std::vector;
+using std::deque;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Records the liveview into MJPEG AVI files in the spool. The liveview
+     * loop only copies the frame into a queue (submit() never waits), a
+     * writer thread puts the frames into AVI chunks and writes them in
+     * batches of record.batch_bytes. If the disk falls behind by more than
+     * record.max_queue_bytes, frames are dropped and counted.
+     *
+     * Every file gets the idx1 index of AVI when it is closed and a .ts file
+     * next to it with the capture time, offset and size of every frame, the
+     * AVI itself only knows the average frame rate. A file is closed and a
+     * new one started at record.segment_bytes, AVI 1.0 readers stop at 2GB.
+     */
+    class LiveviewRecorder {
+    public:
+        LiveviewRecorder(const string &directory);
+        ~LiveviewRecorder();
+
+        bool start(string &file);
+        void stop();
+        bool recording();
+        void submit(const PreviewFrame *frame);
+        void stats(ptree &tree);
+
+    private:
+        struct Frame {
+            string data;
+            unsigned long sequence;
+            int64_t captured_us;
+        };
+
+        struct IndexEntry {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        string _directory;
+        unsigned long _batch_bytes;
+        unsigned long _max_queue_bytes;
+        unsigned long _segment_bytes;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        pthread_t _thread;
+        bool _started;
+        bool _running;
+        deque<Frame *> _queue;
+        unsigned long _queued_bytes;
+
+        // writer thread only
+        string _base;
+        int _segment;
+        int _fd;
+        FILE *_timestamps;
+        string _batch;
+        unsigned long _file_bytes;
+        vector<IndexEntry> _index;
+        int _width;
+        int _height;
+        int64_t _first_us;
+        int64_t _last_us;
+        unsigned long _max_frame;
+
+        string _file;
+        unsigned long _frames;
+        unsigned long _dropped;
+        unsigned long _bytes;
+        unsigned long _writes;
+        unsigned long _segments;
+        double _write_ms;
+        double _max_write_ms;
+        bool _failed;
+        Stopwatch _watch;
+
+        bool _open_segment();
+        void _close_segment();
+        void _append(const Frame &frame);
+        bool _flush();
+        void _header(string &header);
+        void _run();
+        static void* _writer(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__LiveviewRecorder__) */
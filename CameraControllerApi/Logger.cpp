@@ -0,0 +1,190 @@
+//
+//  Logger.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "Logger.h"
+#include "Settings.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+using namespace CameraControllerApi;
+
+static const char *level_names[] = {"debug", "info", "warn", "error", "off"};
+
+Logger* Logger::_instance = NULL;
+
+Logger* Logger::getInstance(){
+    if(_instance == NULL)
+        _instance = new Logger();
+    
+    return _instance;
+}
+
+void Logger::release(){
+    if(_instance != NULL)
+        delete _instance;
+    
+    _instance = NULL;
+}
+
+Logger::Logger(){
+    // lookup() does not log, so this can not come back here
+    string level, file, size, flush;
+    Settings *sett = Settings::getInstance();
+    sett->lookup("log.level", level);
+    sett->lookup("log.file", file);
+    sett->lookup("log.buffer", size);
+    sett->lookup("log.flush_ms", flush);
+    
+    this->_level = CCA_LOG_INFO;
+    for(int i = CCA_LOG_DEBUG; i <= CCA_LOG_OFF; i++){
+        if(strcasecmp(level.c_str(), level_names[i]) == 0)
+            this->_level = i;
+    }
+    this->_flush_ms = atoi(flush.c_str()) > 0 ? atoi(flush.c_str()) : 100;
+    
+    this->_out = stderr;
+    this->_close_out = false;
+    if(!file.empty()){
+        FILE *out = fopen(file.c_str(), "a");
+        if(out != NULL){
+            this->_out = out;
+            this->_close_out = true;
+        }
+    }
+    
+    unsigned long slots = 64;
+    while(slots < strtoul(size.c_str(), NULL, 10) && slots < (1UL << 20))
+        slots <<= 1;
+    this->_mask = slots - 1;
+    this->_slots = new Slot[slots];
+    for(unsigned long i = 0; i < slots; i++)
+        this->_slots[i].sequence = i;
+    this->_head = 0;
+    this->_tail = 0;
+    this->_written = 0;
+    this->_dropped = 0;
+    
+    this->_running = true;
+    this->_started = (0 == pthread_create(&this->_thread, NULL, Logger::_flusher, this));
+}
+
+Logger::~Logger(){
+    this->_running = false;
+    if(this->_started)
+        pthread_join(this->_thread, NULL);
+    this->_drain();
+    
+    if(this->_close_out)
+        fclose(this->_out);
+    delete[] this->_slots;
+}
+
+bool Logger::enabled(CCA_LOG_LEVEL level) const {
+    return level >= this->_level;
+}
+
+/*
+ * Multi producer side of the ring (the bounded queue by D. Vyukov): a slot
+ * whose sequence equals the position is free, a producer claims it by moving
+ * the head and publishes it by setting the sequence to position + 1.
+ */
+void Logger::log(CCA_LOG_LEVEL level, const char *component, const char *format, ...){
+    if(level < this->_level)
+        return;
+    
+    Slot *slot;
+    unsigned long pos = this->_head;
+    while(true){
+        slot = &this->_slots[pos & this->_mask];
+        long diff = (long)(slot->sequence - pos);
+        if(diff == 0){
+            if(__sync_bool_compare_and_swap(&this->_head, pos, pos + 1))
+                break;
+            pos = this->_head;
+        } else if(diff < 0){
+            __sync_fetch_and_add(&this->_dropped, 1);
+            return;
+        } else {
+            pos = this->_head;
+        }
+    }
+    
+    slot->level = level;
+    gettimeofday(&slot->time, NULL);
+    strncpy(slot->component, component, sizeof(slot->component) - 1);
+    slot->component[sizeof(slot->component) - 1] = '\0';
+    
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    
+    __sync_synchronize();
+    slot->sequence = pos + 1;
+}
+
+void Logger::stats(ptree &tree){
+    tree.put("level",   level_names[this->_level]);
+    tree.put("slots",   this->_mask + 1);
+    tree.put("written", this->_written);
+    tree.put("dropped", this->_dropped);
+}
+
+/*
+ * Single consumer side, only the flush thread (or the owner before it runs
+ * and after it stopped) calls this.
+ */
+bool Logger::_drain(){
+    bool wrote = false;
+    while(true){
+        Slot *slot = &this->_slots[this->_tail & this->_mask];
+        if((long)(slot->sequence - (this->_tail + 1)) != 0)
+            break;
+        __sync_synchronize();
+        
+        char stamp[32];
+        struct tm tm;
+        time_t seconds = slot->time.tv_sec;
+        gmtime_r(&seconds, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        
+        // one record per line, whatever the text contains
+        for(char *c = slot->text; *c != '\0'; c++){
+            if(*c == '\n' || *c == '\r' || *c == '\t')
+                *c = ' ';
+        }
+        
+        fprintf(this->_out, "time=%s.%03dZ level=%s component=%s %s\n", stamp, (int)(slot->time.tv_usec / 1000),
+                level_names[slot->level], slot->component, slot->text);
+        this->_written++;
+        wrote = true;
+        
+        __sync_synchronize();
+        slot->sequence = this->_tail + this->_mask + 1;
+        this->_tail++;
+    }
+    
+    if(wrote)
+        fflush(this->_out);
+    return wrote;
+}
+
+void* Logger::_flusher(void *context){
+    Logger *logger = static_cast<Logger *>(context);
+    struct timespec pause;
+    pause.tv_sec = logger->_flush_ms / 1000;
+    pause.tv_nsec = (logger->_flush_ms % 1000) * 1000000L;
+    
+    while(logger->_running){
+        logger->_drain();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
@@ -0,0 +1,85 @@
+//
+//  Logger.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__Logger__
+#define __CameraControllerApi__Logger__
+
+#include <iostream>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <boost/property_tree/ptree.hpp>
+
+#define CCA_LOG_LINE 240
+
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    typedef enum {
+        CCA_LOG_DEBUG,
+        CCA_LOG_INFO,
+        CCA_LOG_WARN,
+        CCA_LOG_ERROR,
+        CCA_LOG_OFF
+    } CCA_LOG_LEVEL;
+
+    /*
+     * Asynchronous logger. log() formats into a slot of a bounded lock free
+     * ring and returns; a background thread writes the slots out every
+     * log.flush_ms. A full ring drops the line instead of blocking, the drops
+     * are counted. Messages below log.level are not even formatted.
+     *
+     * Lines are logfmt: "time=... level=info component=http" followed by the
+     * key=value fields of the caller, e.g. "url=/settings status=200 ms=3.1".
+     */
+    class Logger {
+
+        static Logger *_instance;
+    public:
+        static Logger* getInstance();
+        static void release();
+
+        bool enabled(CCA_LOG_LEVEL level) const;
+        void log(CCA_LOG_LEVEL level, const char *component, const char *format, ...)
+            __attribute__((format(printf, 4, 5)));
+        void stats(ptree &tree);
+
+    private:
+        struct Slot {
+            volatile unsigned long sequence;
+            CCA_LOG_LEVEL level;
+            struct timeval time;
+            char component[16];
+            char text[CCA_LOG_LINE];
+        };
+
+        Logger();
+        ~Logger();
+
+        Slot *_slots;
+        unsigned long _mask;
+        volatile unsigned long _head;
+        unsigned long _tail;
+        volatile int _level;
+        int _flush_ms;
+        FILE *_out;
+        bool _close_out;
+
+        volatile bool _running;
+        bool _started;
+        pthread_t _thread;
+
+        volatile unsigned long _written;
+        volatile unsigned long _dropped;
+
+        bool _drain();
+        static void* _flusher(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__Logger__) */
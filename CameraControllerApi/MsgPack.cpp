@@ -0,0 +1,63 @@
+//
+//  MsgPack.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "MsgPack.h"
+#include <stdint.h>
+
+using namespace CameraControllerApi;
+
+static void put_be(string &out, uint64_t value, int bytes){
+    for(int i = bytes - 1; i >= 0; i--)
+        out.push_back((char)((value >> (i * 8)) & 0xff));
+}
+
+static void put_header(string &out, size_t len, unsigned char fix, int fix_max, unsigned char c8, unsigned char c16, unsigned char c32){
+    if((int)len <= fix_max){
+        out.push_back((char)(fix | len));
+    } else if(c8 != 0 && len <= 0xff){
+        out.push_back((char)c8);
+        put_be(out, len, 1);
+    } else if(len <= 0xffff){
+        out.push_back((char)c16);
+        put_be(out, len, 2);
+    } else {
+        out.push_back((char)c32);
+        put_be(out, len, 4);
+    }
+}
+
+static void put_string(string &out, const string &value){
+    put_header(out, value.size(), 0xa0, 31, 0xd9, 0xda, 0xdb);
+    out.append(value);
+}
+
+void CameraControllerApi::write_msgpack(string &out, const ptree &tree){
+    if(tree.empty()){
+        put_string(out, tree.data());
+        return;
+    }
+    
+    bool array = true;
+    for(ptree::const_iterator it = tree.begin(); it != tree.end(); ++it){
+        if(!it->first.empty()){
+            array = false;
+            break;
+        }
+    }
+    
+    if(array){
+        put_header(out, tree.size(), 0x90, 15, 0, 0xdc, 0xdd);
+    } else {
+        put_header(out, tree.size(), 0x80, 15, 0, 0xde, 0xdf);
+    }
+    
+    for(ptree::const_iterator it = tree.begin(); it != tree.end(); ++it){
+        if(!array)
+            put_string(out, it->first);
+        write_msgpack(out, it->second);
+    }
+}
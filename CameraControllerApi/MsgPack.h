@@ -0,0 +1,27 @@
+//
+//  MsgPack.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__MsgPack__
+#define __CameraControllerApi__MsgPack__
+
+#include <string>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Writes a ptree as MessagePack: nodes whose children all have empty
+     * keys become arrays, other nodes with children become maps and leafs
+     * become strings, the same shape write_json produces.
+     */
+    void write_msgpack(string &out, const ptree &tree);
+}
+
+#endif /* defined(__CameraControllerApi__MsgPack__) */
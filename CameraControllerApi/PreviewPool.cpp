@@ -0,0 +1,117 @@
+//
+//  PreviewPool.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "PreviewPool.h"
+
+using namespace CameraControllerApi;
+
+PreviewPool::PreviewPool(unsigned int max_frames, unsigned long max_bytes){
+    this->_max_frames = max_frames > 0 ? max_frames : 1;
+    this->_max_bytes = max_bytes;
+    this->_bytes_idle = 0;
+    this->_sequence = 0;
+    this->_acquired = 0;
+    this->_released = 0;
+    this->_exhausted = 0;
+    this->_trimmed = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+}
+
+PreviewPool::~PreviewPool(){
+    for(size_t i = 0; i < this->_frames.size(); i++){
+        gp_file_unref(this->_frames[i]->file);
+        delete this->_frames[i];
+    }
+    pthread_mutex_destroy(&this->_lock);
+}
+
+PreviewFrame* PreviewPool::_new_frame(){
+    CameraFile *file;
+    if(gp_file_new(&file) != GP_OK)
+        return NULL;
+
+    PreviewFrame *frame = new PreviewFrame;
+    frame->file = file;
+    frame->data = NULL;
+    frame->size = 0;
+    frame->sequence = 0;
+    frame->hash = 0;
+    frame->refs = 0;
+    this->_frames.push_back(frame);
+    return frame;
+}
+
+PreviewFrame* PreviewPool::acquire(){
+    PreviewFrame *frame = NULL;
+    pthread_mutex_lock(&this->_lock);
+
+    if(!this->_free.empty()){
+        frame = this->_free.back();
+        this->_free.pop_back();
+        this->_bytes_idle -= frame->size;
+    } else if(this->_frames.size() < this->_max_frames){
+        frame = this->_new_frame();
+    }
+
+    if(frame == NULL){
+        this->_exhausted++;
+    } else {
+        frame->data = NULL;
+        frame->size = 0;
+        frame->sequence = ++this->_sequence;
+        frame->hash = 0;
+        frame->refs = 1;
+        gettimeofday(&frame->captured, NULL);
+        this->_acquired++;
+    }
+
+    pthread_mutex_unlock(&this->_lock);
+    return frame;
+}
+
+void PreviewPool::retain(PreviewFrame *frame){
+    pthread_mutex_lock(&this->_lock);
+    frame->refs++;
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void PreviewPool::release(PreviewFrame *frame){
+    if(frame == NULL)
+        return;
+
+    pthread_mutex_lock(&this->_lock);
+    if(--frame->refs > 0){
+        pthread_mutex_unlock(&this->_lock);
+        return;
+    }
+
+    this->_released++;
+    if(this->_bytes_idle + frame->size > this->_max_bytes){
+        // over the ceiling, keep the CameraFile but give its buffer back
+        gp_file_clean(frame->file);
+        frame->data = NULL;
+        frame->size = 0;
+        this->_trimmed++;
+    }
+    this->_bytes_idle += frame->size;
+    this->_free.push_back(frame);
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void PreviewPool::stats(ptree &tree){
+    pthread_mutex_lock(&this->_lock);
+    tree.put("frames",      this->_frames.size());
+    tree.put("frames_free", this->_free.size());
+    tree.put("max_frames",  this->_max_frames);
+    tree.put("bytes_idle",  this->_bytes_idle);
+    tree.put("max_bytes",   this->_max_bytes);
+    tree.put("acquired",    this->_acquired);
+    tree.put("released",    this->_released);
+    tree.put("exhausted",   this->_exhausted);
+    tree.put("trimmed",     this->_trimmed);
+    pthread_mutex_unlock(&this->_lock);
+}
@@ -0,0 +1,76 @@
+//
+//  PreviewPool.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__PreviewPool__
+#define __CameraControllerApi__PreviewPool__
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <gphoto2/gphoto2-camera.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::vector;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * One liveview frame. The data pointer is owned by the CameraFile and is
+     * only valid until the frame is handed back to the pool.
+     */
+    struct PreviewFrame {
+        CameraFile *file;
+        const char *data;
+        unsigned long size;
+        unsigned long sequence;
+        uint64_t hash;
+        struct timeval captured;
+        int refs;
+    };
+
+    /*
+     * Recycles the CameraFile objects used for liveview instead of creating
+     * a new one per frame. A consumer gets a frame from acquire() and has to
+     * give it back with release(); additional consumers (e.g. a worker which
+     * looks at the frame later) take their own reference with retain().
+     *
+     * max_frames bounds the number of frames in flight, max_bytes bounds the
+     * memory kept by idle frames. Frames above that ceiling drop their buffer
+     * when they are released.
+     */
+    class PreviewPool {
+    public:
+        PreviewPool(unsigned int max_frames, unsigned long max_bytes);
+        ~PreviewPool();
+
+        PreviewFrame* acquire();
+        void retain(PreviewFrame *frame);
+        void release(PreviewFrame *frame);
+        void stats(ptree &tree);
+
+    private:
+        pthread_mutex_t _lock;
+        vector<PreviewFrame *> _frames;
+        vector<PreviewFrame *> _free;
+        unsigned int _max_frames;
+        unsigned long _max_bytes;
+        unsigned long _bytes_idle;
+        unsigned long _sequence;
+
+        unsigned long _acquired;
+        unsigned long _released;
+        unsigned long _exhausted;
+        unsigned long _trimmed;
+
+        PreviewFrame* _new_frame();
+    };
+}
+
+#endif /* defined(__CameraControllerApi__PreviewPool__) */
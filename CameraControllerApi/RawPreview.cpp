@@ -0,0 +1,461 @@
+//
+//  RawPreview.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "RawPreview.h"
+#include "Spool.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include <vector>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// a TIFF of a camera has a handful of IFDs, more is a broken or hostile file
+#define CCA_TIFF_MAX_IFDS 32
+#define CCA_TIFF_MAX_ENTRIES 1024
+
+#define CCA_TIFF_COMPRESSION 0x0103
+#define CCA_TIFF_MAKE 0x010F
+#define CCA_TIFF_MODEL 0x0110
+#define CCA_TIFF_ORIENTATION 0x0112
+#define CCA_TIFF_DATE_TIME 0x0132
+#define CCA_TIFF_STRIP_OFFSETS 0x0111
+#define CCA_TIFF_STRIP_BYTES 0x0117
+#define CCA_TIFF_SUB_IFDS 0x014A
+#define CCA_TIFF_JPEG_OFFSET 0x0201
+#define CCA_TIFF_JPEG_LENGTH 0x0202
+#define CCA_TIFF_EXIF_IFD 0x8769
+#define CCA_EXIF_EXPOSURE_TIME 0x829A
+#define CCA_EXIF_FNUMBER 0x829D
+#define CCA_EXIF_ISO 0x8827
+#define CCA_EXIF_DATE_ORIGINAL 0x9003
+#define CCA_EXIF_FOCAL_LENGTH 0x920A
+
+using std::vector;
+using std::set;
+using namespace CameraControllerApi;
+
+struct tiff_reader {
+    const unsigned char *data;
+    size_t size;
+    bool big_endian;
+
+    bool open(const unsigned char *data, size_t size){
+        this->data = data;
+        this->size = size;
+        if(size < 8)
+            return false;
+        if(data[0] == 'I' && data[1] == 'I')
+            this->big_endian = false;
+        else if(data[0] == 'M' && data[1] == 'M')
+            this->big_endian = true;
+        else
+            return false;
+        return this->u16(2) == 42;
+    }
+
+    bool inside(size_t offset, size_t length) const {
+        return offset <= this->size && length <= this->size - offset;
+    }
+
+    unsigned int u16(size_t offset) const {
+        if(!this->inside(offset, 2))
+            return 0;
+        const unsigned char *p = this->data + offset;
+        return this->big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+    }
+
+    unsigned long u32(size_t offset) const {
+        if(!this->inside(offset, 4))
+            return 0;
+        const unsigned char *p = this->data + offset;
+        return this->big_endian ? ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+                                : ((unsigned long)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+    }
+
+    // the index-th value of an entry, SHORT, LONG or IFD
+    unsigned long value(size_t entry, unsigned long index) const {
+        unsigned int type = this->u16(entry + 2);
+        unsigned long count = this->u32(entry + 4);
+        size_t width = (type == 3) ? 2 : 4;
+        if(type != 3 && type != 4 && type != 13)
+            return 0;
+        // four bytes or less are stored in the entry itself
+        size_t base = (count * width <= 4) ? entry + 8 : this->u32(entry + 8);
+        return width == 2 ? this->u16(base + index * 2) : this->u32(base + index * 4);
+    }
+
+    // the first RATIONAL of an entry, 0 for anything else
+    double rational(size_t entry) const {
+        if(this->u16(entry + 2) != 5)
+            return 0.0;
+        size_t base = this->u32(entry + 8);
+        unsigned long denominator = this->u32(base + 4);
+        return denominator != 0 ? (double)this->u32(base) / denominator : 0.0;
+    }
+
+    string ascii(size_t entry) const {
+        unsigned long count = this->u32(entry + 4);
+        if(this->u16(entry + 2) != 2 || count > 256)
+            return "";
+        size_t base = (count <= 4) ? entry + 8 : this->u32(entry + 8);
+        if(!this->inside(base, count))
+            return "";
+        string text((const char *)this->data + base, count);
+        // NUL terminated and often padded with blanks
+        size_t end = text.find('\0');
+        if(end != string::npos)
+            text.erase(end);
+        end = text.find_last_not_of(' ');
+        text.erase(end == string::npos ? 0 : end + 1);
+        return text;
+    }
+};
+
+/*
+ * True for a JPEG whose frame header is baseline or progressive. The RAW
+ * data of a CR2 is a lossless JPEG (SOF3) as well, it must not be taken
+ * for the preview.
+ */
+static bool baseline_jpeg(const unsigned char *data, size_t size){
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+
+    size_t pos = 2;
+    while(pos + 4 <= size){
+        if(data[pos] != 0xFF)
+            return false;
+        unsigned char marker = data[pos + 1];
+        if(marker == 0xFF){
+            pos++;
+            continue;
+        }
+        if(marker == 0xC0 || marker == 0xC1 || marker == 0xC2)
+            return true;
+        if((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) || marker == 0xDA)
+            return false;
+        pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+    }
+    return false;
+}
+
+RawPreview* RawPreview::_instance = NULL;
+pthread_mutex_t RawPreview::_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+RawPreview* RawPreview::getInstance(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        _instance = new RawPreview();
+
+    return _instance;
+}
+
+void RawPreview::release(){
+    pthread_mutex_lock(&_instance_lock);
+    RawPreview *preview = _instance;
+    _instance = NULL;
+    pthread_mutex_unlock(&_instance_lock);
+
+    if(preview != NULL)
+        delete preview;
+}
+
+RawPreview::RawPreview(){
+    this->_directory = CaptureSpool::getInstance()->directory() + "/preview";
+    if(mkdir(this->_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        Logger::getInstance()->log(CCA_LOG_ERROR, "preview", "op=mkdir directory=%s errno=%d", this->_directory.c_str(), errno);
+
+    this->_hits = 0;
+    this->_extracted = 0;
+    this->_not_found = 0;
+    this->_raw_bytes = 0;
+    this->_jpeg_bytes = 0;
+    this->_find_us = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+}
+
+RawPreview::~RawPreview(){
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Looks for the largest embedded JPEG: the JPEGInterchangeFormat of any
+ * IFD (NEF and ARW, and the thumbnails of all of them) or a single JPEG
+ * strip (the full size preview in IFD0 of a CR2). IFD0, the IFDs chained
+ * to it, their SubIFDs and the EXIF IFD are searched.
+ */
+bool RawPreview::find(const unsigned char *data, size_t size, size_t &offset, size_t &length){
+    tiff_reader tiff;
+    if(!tiff.open(data, size))
+        return false;
+
+    vector<unsigned long> pending(1, tiff.u32(4));
+    set<unsigned long> seen;
+    length = 0;
+
+    while(!pending.empty() && seen.size() < CCA_TIFF_MAX_IFDS){
+        unsigned long ifd = pending.back();
+        pending.pop_back();
+        if(ifd == 0 || !seen.insert(ifd).second || !tiff.inside(ifd, 2))
+            continue;
+
+        unsigned int entries = tiff.u16(ifd);
+        if(entries > CCA_TIFF_MAX_ENTRIES || !tiff.inside(ifd + 2, entries * 12 + 4))
+            continue;
+
+        unsigned long compression = 0, strip_offset = 0, strip_bytes = 0, jpeg_offset = 0, jpeg_length = 0;
+        bool single_strip = false;
+        for(unsigned int i = 0; i < entries; i++){
+            size_t entry = ifd + 2 + i * 12;
+            unsigned int tag = tiff.u16(entry);
+            unsigned long count = tiff.u32(entry + 4);
+            switch(tag){
+                case CCA_TIFF_COMPRESSION:
+                    compression = tiff.value(entry, 0);
+                    break;
+                case CCA_TIFF_STRIP_OFFSETS:
+                    strip_offset = tiff.value(entry, 0);
+                    single_strip = (count == 1);
+                    break;
+                case CCA_TIFF_STRIP_BYTES:
+                    strip_bytes = tiff.value(entry, 0);
+                    break;
+                case CCA_TIFF_JPEG_OFFSET:
+                    jpeg_offset = tiff.value(entry, 0);
+                    break;
+                case CCA_TIFF_JPEG_LENGTH:
+                    jpeg_length = tiff.value(entry, 0);
+                    break;
+                case CCA_TIFF_SUB_IFDS:
+                    for(unsigned long n = 0; n < count && n < CCA_TIFF_MAX_IFDS; n++)
+                        pending.push_back(tiff.value(entry, n));
+                    break;
+                case CCA_TIFF_EXIF_IFD:
+                    pending.push_back(tiff.value(entry, 0));
+                    break;
+            }
+        }
+        pending.push_back(tiff.u32(ifd + 2 + entries * 12));
+
+        // 6 is old style JPEG, 7 is JPEG
+        if(single_strip && (compression == 6 || compression == 7) && strip_bytes > length &&
+           tiff.inside(strip_offset, strip_bytes) && baseline_jpeg(data + strip_offset, strip_bytes)){
+            offset = strip_offset;
+            length = strip_bytes;
+        }
+        if(jpeg_length > length && tiff.inside(jpeg_offset, jpeg_length) && baseline_jpeg(data + jpeg_offset, jpeg_length)){
+            offset = jpeg_offset;
+            length = jpeg_length;
+        }
+    }
+    return length > 0;
+}
+
+/*
+ * Make, model, capture time and exposure from IFD0 and the EXIF IFD of a
+ * TIFF based RAW, or of the APP1 segment of a JPEG.
+ */
+bool RawPreview::exif(const unsigned char *data, size_t size, ExifBasics &info){
+    info.orientation = 0;
+    info.iso = 0;
+    info.exposure = 0.0;
+    info.fnumber = 0.0;
+    info.focal_length = 0.0;
+
+    if(size >= 4 && data[0] == 0xFF && data[1] == 0xD8){
+        size_t pos = 2;
+        const unsigned char *tiff_data = NULL;
+        size_t tiff_size = 0;
+        while(pos + 4 <= size && data[pos] == 0xFF && data[pos + 1] != 0xDA){
+            size_t length = (data[pos + 2] << 8) | data[pos + 3];
+            if(data[pos + 1] == 0xE1 && length >= 8 && pos + 2 + length <= size && memcmp(data + pos + 4, "Exif\0\0", 6) == 0){
+                tiff_data = data + pos + 10;
+                tiff_size = length - 8;
+                break;
+            }
+            pos += 2 + length;
+        }
+        if(tiff_data == NULL)
+            return false;
+        data = tiff_data;
+        size = tiff_size;
+    }
+
+    tiff_reader tiff;
+    if(!tiff.open(data, size))
+        return false;
+
+    unsigned long ifds[2] = {tiff.u32(4), 0};
+    string date_time;
+    for(int n = 0; n < 2 && ifds[n] != 0; n++){
+        unsigned long ifd = ifds[n];
+        if(!tiff.inside(ifd, 2))
+            break;
+        unsigned int entries = tiff.u16(ifd);
+        if(entries > CCA_TIFF_MAX_ENTRIES || !tiff.inside(ifd + 2, entries * 12))
+            break;
+
+        for(unsigned int i = 0; i < entries; i++){
+            size_t entry = ifd + 2 + i * 12;
+            switch(tiff.u16(entry)){
+                case CCA_TIFF_MAKE:
+                    info.make = tiff.ascii(entry);
+                    break;
+                case CCA_TIFF_MODEL:
+                    info.model = tiff.ascii(entry);
+                    break;
+                case CCA_TIFF_ORIENTATION:
+                    info.orientation = tiff.value(entry, 0);
+                    break;
+                case CCA_TIFF_DATE_TIME:
+                    date_time = tiff.ascii(entry);
+                    break;
+                case CCA_TIFF_EXIF_IFD:
+                    if(n == 0 && tiff.value(entry, 0) != ifd)
+                        ifds[1] = tiff.value(entry, 0);
+                    break;
+                case CCA_EXIF_EXPOSURE_TIME:
+                    info.exposure = tiff.rational(entry);
+                    break;
+                case CCA_EXIF_FNUMBER:
+                    info.fnumber = tiff.rational(entry);
+                    break;
+                case CCA_EXIF_ISO:
+                    info.iso = tiff.value(entry, 0);
+                    break;
+                case CCA_EXIF_DATE_ORIGINAL:
+                    info.taken = tiff.ascii(entry);
+                    break;
+                case CCA_EXIF_FOCAL_LENGTH:
+                    info.focal_length = tiff.rational(entry);
+                    break;
+            }
+        }
+    }
+    if(info.taken.empty())
+        info.taken = date_time;
+    return true;
+}
+
+string RawPreview::_cache_path(const string &name, unsigned long size){
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%lu.jpg", size);
+    return this->_directory + "/" + name + suffix;
+}
+
+void RawPreview::_count(bool found, unsigned long raw, unsigned long jpeg, double us){
+    ScopedLock lock(&this->_lock);
+    if(found){
+        this->_extracted++;
+        this->_raw_bytes += raw;
+        this->_jpeg_bytes += jpeg;
+    } else {
+        this->_not_found++;
+    }
+    this->_find_us += us;
+}
+
+/*
+ * The preview extracted earlier from the RAW name of the given size.
+ */
+bool RawPreview::cached(const string &name, unsigned long size, string &jpeg){
+    FILE *fd = fopen(this->_cache_path(name, size).c_str(), "rb");
+    if(fd == NULL)
+        return false;
+
+    struct stat st;
+    bool ok = (fstat(fileno(fd), &st) == 0 && st.st_size > 0);
+    if(ok){
+        jpeg.resize(st.st_size);
+        ok = (fread(&jpeg[0], 1, st.st_size, fd) == (size_t)st.st_size);
+    }
+    fclose(fd);
+    if(ok){
+        ScopedLock lock(&this->_lock);
+        this->_hits++;
+    }
+    return ok;
+}
+
+/*
+ * Finds the preview in the RAW in memory and keeps it in the cache. A file
+ * which is a JPEG already is its own preview.
+ */
+bool RawPreview::extract(const string &name, const char *data, unsigned long size, string &jpeg){
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t offset = 0, length = 0;
+    Stopwatch watch;
+    bool found;
+    if(size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xD8){
+        offset = 0;
+        length = size;
+        found = true;
+    } else {
+        found = RawPreview::find(bytes, size, offset, length);
+    }
+    this->_count(found, size, length, watch.elapsed_ms() * 1000);
+    if(!found)
+        return false;
+
+    jpeg.assign(data + offset, length);
+    string path = this->_cache_path(name, size);
+    string tmp = path + ".part";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if(fd != NULL){
+        bool written = (fwrite(jpeg.data(), 1, jpeg.size(), fd) == jpeg.size());
+        if(fclose(fd) == 0 && written)
+            rename(tmp.c_str(), path.c_str());
+        else
+            remove(tmp.c_str());
+    }
+    return true;
+}
+
+/*
+ * The same for a RAW on the disk (e.g. in the spool). It is mapped, only
+ * the pages with the IFDs and the preview are read.
+ */
+bool RawPreview::extract_file(const string &name, const string &path, string &jpeg){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    bool ok = this->extract(name, (const char *)map, st.st_size, jpeg);
+    munmap(map, st.st_size);
+    return ok;
+}
+
+// the RAW is gone from the spool, its preview goes as well
+void RawPreview::forget(const string &name, unsigned long size){
+    remove(this->_cache_path(name, size).c_str());
+}
+
+void RawPreview::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("hits",       this->_hits);
+    tree.put("extracted",  this->_extracted);
+    tree.put("not_found",  this->_not_found);
+    tree.put("raw_bytes",  this->_raw_bytes);
+    tree.put("jpeg_bytes", this->_jpeg_bytes);
+    tree.put("find_us",    this->_extracted + this->_not_found > 0 ? this->_find_us / (this->_extracted + this->_not_found) : 0.0);
+}
@@ -0,0 +1,79 @@
+//
+//  RawPreview.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__RawPreview__
+#define __CameraControllerApi__RawPreview__
+
+#include <iostream>
+#include <string>
+#include <stddef.h>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    // the EXIF fields a gallery shows, empty or 0 where the file has none
+    struct ExifBasics {
+        string make;
+        string model;
+        string taken;
+        unsigned int orientation;
+        unsigned int iso;
+        double exposure;
+        double fnumber;
+        double focal_length;
+    };
+
+    /*
+     * The JPEG a camera embeds in its RAW files (CR2, NEF, ARW and other
+     * TIFF based formats). find() walks the IFDs of the TIFF structure and
+     * takes the largest baseline JPEG it points to, the RAW data itself is
+     * never decoded.
+     *
+     * Extracted previews are kept in the preview directory of the spool,
+     * named after the RAW and its size, so the next request for the same
+     * file is answered from the disk.
+     */
+    class RawPreview {
+
+        static RawPreview *_instance;
+        static pthread_mutex_t _instance_lock;
+    public:
+        static RawPreview* getInstance();
+        static void release();
+
+        static bool find(const unsigned char *data, size_t size, size_t &offset, size_t &length);
+        static bool exif(const unsigned char *data, size_t size, ExifBasics &info);
+
+        bool cached(const string &name, unsigned long size, string &jpeg);
+        bool extract(const string &name, const char *data, unsigned long size, string &jpeg);
+        bool extract_file(const string &name, const string &path, string &jpeg);
+        void forget(const string &name, unsigned long size);
+        void stats(ptree &tree);
+
+    private:
+        RawPreview();
+        ~RawPreview();
+
+        string _directory;
+        pthread_mutex_t _lock;
+        unsigned long _hits;
+        unsigned long _extracted;
+        unsigned long _not_found;
+        unsigned long _raw_bytes;
+        unsigned long _jpeg_bytes;
+        double _find_us;
+
+        string _cache_path(const string &name, unsigned long size);
+        void _count(bool found, unsigned long raw, unsigned long jpeg, double us);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__RawPreview__) */
@@ -0,0 +1,38 @@
+//
+//  ScopedLock.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__ScopedLock__
+#define __CameraControllerApi__ScopedLock__
+
+#include <pthread.h>
+
+namespace CameraControllerApi {
+
+    /*
+     * Holds a pthread mutex for the lifetime of the object, so functions with
+     * many early returns can not forget to unlock.
+     */
+    class ScopedLock {
+    public:
+        ScopedLock(pthread_mutex_t *mutex){
+            this->_mutex = mutex;
+            pthread_mutex_lock(this->_mutex);
+        }
+
+        ~ScopedLock(){
+            pthread_mutex_unlock(this->_mutex);
+        }
+
+    private:
+        pthread_mutex_t *_mutex;
+
+        ScopedLock(const ScopedLock &);
+        ScopedLock& operator=(const ScopedLock &);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__ScopedLock__) */
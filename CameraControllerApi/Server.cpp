@@ -7,10 +7,28 @@
 //
 
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include "Server.h"
 #include <map>
 #include <string>
 #include "Command.h"
+#include "Settings.h"
+#include "Compress.h"
+#include "Logger.h"
+#include "Stopwatch.h"
+#include "JobQueue.h"
+#include "Spool.h"
+#include "CardIngest.h"
+#include "ThumbnailIndex.h"
+#include "SpoolRetention.h"
+#include "RawPreview.h"
+#include "WebSocketHub.h"
+#include "Tracer.h"
 
 using std::map;
 using std::string;
@@ -18,10 +36,41 @@ using namespace CameraControllerApi;
 
 #define PAGE "<html><head><title>Error</title></head><body></body></html>"
 
+// marks a GET between the first and the second call of url_handler
+static int aptr;
+
+/*
+ * The body of a POST, collected over the calls of url_handler until MHD has
+ * read all of it. More than server.max_body_bytes is read and dropped.
+ */
+struct post_body {
+    string data;
+    bool too_large;
+};
+
 
 Server::Server(int port){
     this->_port = port;
-    this->_shoulNotExit = 1;
+    this->_wakeup = eventfd(0, EFD_CLOEXEC);
+    this->_draining = false;
+    this->_in_flight = 0;
+    pthread_mutex_init(&this->_flight_lock, NULL);
+    pthread_cond_init(&this->_flight_cond, NULL);
+    
+    string min_bytes, level, threads, drain, websocket, body;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("server.threads", threads);
+    sett->get_value("server.drain_ms", drain);
+    sett->get_value("server.compress_min_bytes", min_bytes);
+    sett->get_value("server.compress_level", level);
+    sett->get_value("websocket.enabled", websocket);
+    sett->get_value("server.max_body_bytes", body);
+    this->_compress_min_bytes = strtoul(min_bytes.c_str(), NULL, 10);
+    this->_compress_level = level.empty() ? 6 : atoi(level.c_str());
+    this->_threads = atoi(threads.c_str()) > 0 ? atoi(threads.c_str()) : 1;
+    this->_drain_ms = drain.empty() ? 10000 : atoi(drain.c_str());
+    this->_websocket = websocket == "true";
+    this->_max_body_bytes = strtoul(body.c_str(), NULL, 10) > 0 ? strtoul(body.c_str(), NULL, 10) : 65536;
     
     pthread_t tServer;
     if (0 != pthread_create(&tServer, NULL, Server::initial, this)) {
@@ -31,11 +80,29 @@ Server::Server(int port){
     pthread_join(tServer, NULL);
 }
 
+Server::~Server(){
+    if(this->_wakeup >= 0)
+        close(this->_wakeup);
+    pthread_cond_destroy(&this->_flight_cond);
+    pthread_mutex_destroy(&this->_flight_lock);
+}
+
 void *Server::initial(void *context){
     Server *s = (Server *)context;
+    // before the camera, so with trace.enabled its connect is traced too
+    Tracer::getInstance();
     CameraController *cc = CameraController::getInstance();
     
     if(cc->is_initialized()){
+        // indexes what came into the spool while the server was down
+        ThumbnailIndex::getInstance();
+        SpoolRetention::getInstance();
+        // created before the pool threads can race to it
+        JobQueue::getInstance();
+        CardIngest::getInstance();
+        RawPreview::getInstance();
+        if(s->_websocket)
+            WebSocketHub::getInstance();
         s->api = new Api(cc);
         s->cmd = new Command(s->api);
         s->http();
@@ -44,10 +111,27 @@ void *Server::initial(void *context){
     return 0;
 }
 
+/*
+ * SIGTERM and SIGINT are taken from a signalfd by http(). Blocked here, in
+ * the main thread before any other thread is started, so every thread
+ * inherits the mask and none of them is interrupted by the signal.
+ */
+void Server::block_signals(){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/*
+ * Asks http() to shut down. Only writes the eventfd, so it is safe from
+ * any thread and from a signal handler.
+ */
 void Server::terminate(int sig){
-    this->_shoulNotExit = 0;
-    CameraController *cc = CameraController::getInstance();
-    cc->release();
+    uint64_t one = 1;
+    if(write(this->_wakeup, &one, sizeof(one)) != sizeof(one))
+        return;
 }
 
 int Server::send_bad_response( struct MHD_Connection *connection)
@@ -68,6 +152,84 @@ int Server::send_bad_response( struct MHD_Connection *connection)
 }
 
 
+int Server::send_unavailable( struct MHD_Connection *connection)
+{
+    static char *unavailable = (char *)PAGE;
+    struct MHD_Response *response = MHD_create_response_from_buffer(strlen(unavailable), unavailable, MHD_RESPMEM_PERSISTENT);
+    if (response == 0){
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Retry-After", "1");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONNECTION, "close");
+    int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+/*
+ * Answers the handshake of /ws with 101, MHD then hands the socket to
+ * upgraded(). A plain GET on /ws gets 426 with the version we speak.
+ */
+int Server::send_upgrade(struct MHD_Connection *connection, Server *s){
+    pthread_mutex_lock(&s->_flight_lock);
+    bool draining = s->_draining;
+    pthread_mutex_unlock(&s->_flight_lock);
+    if(draining)
+        return Server::send_unavailable(connection);
+    
+    const char *upgrade = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+    const char *key = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Sec-WebSocket-Key");
+    const char *version = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Sec-WebSocket-Version");
+    struct MHD_Response *response;
+    if(upgrade == NULL || strcasecmp(upgrade, "websocket") != 0 || key == NULL || version == NULL || strcmp(version, "13") != 0){
+        static char *bad_request = (char *)PAGE;
+        response = MHD_create_response_from_buffer(strlen(bad_request), bad_request, MHD_RESPMEM_PERSISTENT);
+        if(response == 0)
+            return MHD_NO;
+        MHD_add_response_header(response, "Sec-WebSocket-Version", "13");
+        int ret = MHD_queue_response(connection, 426, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+    
+    response = MHD_create_response_for_upgrade(Server::upgraded, s);
+    if(response == 0)
+        return MHD_NO;
+    // MHD adds Connection: Upgrade itself
+    MHD_add_response_header(response, MHD_HTTP_HEADER_UPGRADE, "websocket");
+    MHD_add_response_header(response, "Sec-WebSocket-Accept", WebSocketHub::accept_key(key).c_str());
+    int ret = MHD_queue_response(connection, MHD_HTTP_SWITCHING_PROTOCOLS, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+void Server::upgraded(void *cls, struct MHD_Connection *connection, void *con_cls,
+                      const char *extra_in, size_t extra_in_size, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh){
+    Server *s = (Server *)cls;
+    WebSocketHub::open(s->cmd, sock, urh, extra_in, extra_in_size);
+}
+
+int Server::send_too_large( struct MHD_Connection *connection)
+{
+    static char *too_large = (char *)PAGE;
+    struct MHD_Response *response = MHD_create_response_from_buffer(strlen(too_large), too_large, MHD_RESPMEM_PERSISTENT);
+    if (response == 0){
+        return MHD_NO;
+    }
+    int ret = MHD_queue_response(connection, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+/*
+ * A connection closed in the middle of a POST leaves its body behind.
+ */
+void Server::request_completed(void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe){
+    if(*con_cls != NULL && *con_cls != &aptr)
+        delete (post_body *)*con_cls;
+    *con_cls = NULL;
+}
+
 int Server::get_url_args(void *cls, MHD_ValueKind kind, const char *key , const char* value){
     map<string, string> *args = static_cast<map<string,string>*>(cls);
     if(args->find(key) == args->end()){
@@ -87,80 +249,283 @@ int Server::url_handler (void *cls,
                         const char *method,
                         const char *version,
                         const char *upload_data, size_t *upload_data_size, void **ptr){
-    printf("connection received %s", method);
     int ret;
     map<string, string> url_args;
     map<string, string>::iterator  it;
 
     string respdata;
     
-    static int aptr;
-    char *me;
     const char *typexml = "xml";
     const char *typejson = "json";
+    const char *typemsgpack = "msgpack";
     const char *type = typejson;
     
     
     struct MHD_Response *response;
     
-    if (0 != strcmp(method, "GET")) {
+    Server *s = (Server *)cls;  
+    bool post = strcmp(method, "POST") == 0;
+    if (0 != strcmp(method, "GET") && !post) {
         return MHD_NO;
     }
     
-    if(&aptr != *ptr){
+    if(post){
+        post_body *body = (post_body *)*ptr;
+        if(body == NULL){
+            body = new post_body();
+            body->too_large = false;
+            *ptr = body;
+            return MHD_YES;
+        }
+        if(*upload_data_size != 0){
+            if(body->data.size() + *upload_data_size <= s->_max_body_bytes)
+                body->data.append(upload_data, *upload_data_size);
+            else
+                body->too_large = true;
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+    } else if(&aptr != *ptr){
         *ptr = &aptr;
         return MHD_YES;
     }
     
+    HttpExchange exchange;
+    bool too_large = false;
+    if(post){
+        post_body *body = (post_body *)*ptr;
+        too_large = body->too_large;
+        exchange.request_body.swap(body->data);
+        delete body;
+    }
+    // request_completed() must not see the body again
+    *ptr = 0;
+    if(too_large)
+        return Server::send_too_large(connection);
+    TraceSpan span("http", "url_handler", url);
+    
+    if(!post && s->_websocket && strcmp(url, "/ws") == 0)
+        return Server::send_upgrade(connection, s);
+    
     if(MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, Server::get_url_args, &url_args) < 0){
         return Server::send_bad_response(connection);
     }
     
-    Server s = *(Server *)cls;  
-    s.cmd->execute(url, url_args, respdata);
+    const char *if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+    if(if_none_match != NULL)
+        exchange.request_headers["If-None-Match"] = if_none_match;
     
-    *ptr = 0;
-    me = (char *)malloc(respdata.size() + 1);
-    if(me == 0)
-        return MHD_NO;
-    strncpy(me, respdata.c_str(), respdata.size() + 1);    
-
-    response = MHD_create_response_from_buffer(strlen(me), (void *)me, MHD_RESPMEM_MUST_COPY);
+    const char *accept_encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+    if(accept_encoding != NULL)
+        exchange.encoding = negotiate_encoding(accept_encoding);
+    
+    Stopwatch watch;
+    pthread_mutex_lock(&s->_flight_lock);
+    bool draining = s->_draining;
+    if(!draining)
+        s->_in_flight++;
+    pthread_mutex_unlock(&s->_flight_lock);
+    
+    // keep-alive connections outlive the listening socket
+    if(draining){
+        return Server::send_unavailable(connection);
+    }
+    
+    s->cmd->execute(url, url_args, exchange, respdata);
+    
+    pthread_mutex_lock(&s->_flight_lock);
+    if(--s->_in_flight == 0)
+        pthread_cond_broadcast(&s->_flight_cond);
+    pthread_mutex_unlock(&s->_flight_lock);
+    
+    unsigned int status = exchange.status != 0 ? exchange.status : MHD_HTTP_OK;
+    if(status == MHD_HTTP_NOT_MODIFIED)
+        respdata.clear();
+    
+    // images do not get smaller, everything else is text or msgpack
+    it = exchange.response_headers.find("Content-Type");
+    bool image = it != exchange.response_headers.end() && it->second.compare(0, 6, "image/") == 0;
+    if(exchange.stream == NULL && !image){
+        exchange.response_headers["Vary"] = "Accept-Encoding";
+        if(exchange.encoding != CCA_ENCODING_IDENTITY &&
+           exchange.response_headers.find("Content-Encoding") == exchange.response_headers.end() &&
+           respdata.size() >= s->_compress_min_bytes){
+            string compressed;
+            TraceSpan compress("http", "compress");
+            if(compress_body(respdata, exchange.encoding, s->_compress_level, compressed)){
+                respdata.swap(compressed);
+                exchange.response_headers["Content-Encoding"] = encoding_name(exchange.encoding);
+            }
+        }
+    }
+    
+    if(exchange.stream != NULL){
+        // sent with chunked encoding as the blocks come from the camera, the
+        // response owns the stream from here on
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, CCA_STREAM_BLOCK_SIZE,
+                                                     DownloadStream::read_callback, exchange.stream, DownloadStream::free_callback);
+        if(response == 0)
+            exchange.stream->release();
+    } else {
+        // msgpack bodies contain zero bytes, the size is taken from the string
+        response = MHD_create_response_from_buffer(respdata.size(), (void *)respdata.data(), MHD_RESPMEM_MUST_COPY);
+    }
     
     if(response == 0){
-        free(me);
         return MHD_NO;
     }
     
-    it = url_args.find("type");
-    if (it != url_args.end() && strcasecmp(it->second.c_str(), "xml")) {
-        type = typexml;
+    for(it = exchange.response_headers.begin(); it != exchange.response_headers.end(); it++){
+        MHD_add_response_header(response, it->first.c_str(), it->second.c_str());
     }
     
-    if(type == typejson)
-        MHD_add_response_header(response, "Content-Type", "application/json");
-    else {        
-        MHD_add_response_header(response, "Content-Type", "application/xml");
+    // an image is shown in the browser, only api documents are saved
+    if(status != MHD_HTTP_NOT_MODIFIED && !image && exchange.response_headers.find("Content-Disposition") == exchange.response_headers.end()){
+        it = url_args.find("type");
+        if (it != url_args.end() && strcasecmp(it->second.c_str(), "xml") == 0) {
+            type = typexml;
+        } else if (it != url_args.end() && strcasecmp(it->second.c_str(), "msgpack") == 0) {
+            type = typemsgpack;
+        }
+        
+        if(type == typejson)
+            MHD_add_response_header(response, "Content-Disposition", "attachment;filename=\"cca.json\"");
+        else if(type == typexml)
+            MHD_add_response_header(response, "Content-Disposition", "attachment;filename=\"cca.xml\"");
+        else
+            MHD_add_response_header(response, "Content-Disposition", "attachment;filename=\"cca.msgpack\"");
     }
-    MHD_add_response_header(response, "Content-Disposition", "attachment;filename=\"cca.json\"");
-    ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+    ret = MHD_queue_response (connection, status, response);
     MHD_destroy_response(response);
+    
+    Logger *logger = Logger::getInstance();
+    if(logger->enabled(CCA_LOG_INFO)){
+        map<string, string>::iterator action = url_args.find("action");
+        map<string, string>::iterator encoding = exchange.response_headers.find("Content-Encoding");
+        // the connection state after the request, a failed call shows a lost camera
+        logger->log(CCA_LOG_INFO, "http", "method=%s url=%s action=%s status=%u bytes=%lu stream=%d encoding=%s camera=%s ms=%.2f",
+                    method, url, action != url_args.end() ? action->second.c_str() : "-", status, (unsigned long)respdata.size(), exchange.stream != NULL,
+                    encoding != exchange.response_headers.end() ? encoding->second.c_str() : "identity", CameraController::getInstance()->state(), watch.elapsed_ms());
+    }
     return ret;
 }
 
 void *Server::http(){
     struct MHD_Daemon *d;
-    d = MHD_start_daemon(MHD_USE_DEBUG|MHD_USE_SELECT_INTERNALLY|MHD_USE_POLL, this->_port,
-                         0, 0, Server::url_handler, (void*)this ,MHD_OPTION_END);
+    // a long poll on /jobs holds its thread, the others keep serving
+    // the pipe lets _shutdown() stop the listening socket first
+    d = MHD_start_daemon(MHD_USE_DEBUG|MHD_USE_SELECT_INTERNALLY|MHD_USE_POLL|MHD_USE_PIPE_FOR_SHUTDOWN|MHD_ALLOW_UPGRADE, this->_port,
+                         0, 0, Server::url_handler, (void*)this,
+                         MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)this->_threads,
+                         MHD_OPTION_NOTIFY_COMPLETED, Server::request_completed, (void*)this,
+                         MHD_OPTION_END);
     if(d==0){
+        Logger::getInstance()->log(CCA_LOG_ERROR, "http", "op=listen port=%d error=start", this->_port);
         return 0;
     }
+    Logger::getInstance()->log(CCA_LOG_INFO, "http", "op=listen port=%d", this->_port);
+    
+    this->_wait_for_shutdown();
+    this->_shutdown(d);
+    return 0;
+}
+
+/*
+ * Sleeps until SIGTERM or SIGINT arrives (see block_signals) or somebody
+ * calls terminate().
+ */
+void Server::_wait_for_shutdown(){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    int sfd = signalfd(-1, &set, SFD_CLOEXEC);
+    
+    struct pollfd fds[2];
+    fds[0].fd = sfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = this->_wakeup;
+    fds[1].events = POLLIN;
     
-    while (this->_shoulNotExit) {
-        sleep(1);
+    int sig = 0;
+    while(true){
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[0].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if(read(sfd, &info, sizeof(info)) == sizeof(info))
+                sig = info.ssi_signo;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
     }
+    if(sfd >= 0)
+        close(sfd);
+    Logger::getInstance()->log(CCA_LOG_INFO, "http", "op=shutdown signal=%d", sig);
+}
 
+/*
+ * Stops taking connections, lets the liveview, the running requests and the
+ * queued jobs finish within server.drain_ms, then writes the spool to disk
+ * and closes the camera. Requests still running after the deadline (and the
+ * job on the camera worker) are waited for, so no capture is cut off; queued
+ * jobs which have not started are cancelled.
+ */
+void Server::_shutdown(struct MHD_Daemon *d){
+    Stopwatch watch;
+    pthread_mutex_lock(&this->_flight_lock);
+    this->_draining = true;
+    pthread_mutex_unlock(&this->_flight_lock);
+    MHD_socket listener = MHD_quiesce_daemon(d);
+    if(listener != MHD_INVALID_SOCKET)
+        close(listener);
+    // WebSocket commands count as requests, the sockets go back to MHD here
+    WebSocketHub::release();
     
-    MHD_stop_daemon(d);    
-    return 0;
+    CameraController *cc = CameraController::getInstance();
+    bool liveview = cc->liveview_drain(this->_drain_ms);
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    int remaining = this->_drain_ms - (int)watch.elapsed_ms();
+    remaining = remaining > 0 ? remaining : 0;
+    deadline.tv_sec += remaining / 1000;
+    deadline.tv_nsec += (remaining % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    pthread_mutex_lock(&this->_flight_lock);
+    while(this->_in_flight > 0){
+        if(pthread_cond_timedwait(&this->_flight_cond, &this->_flight_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    int in_flight = this->_in_flight;
+    pthread_mutex_unlock(&this->_flight_lock);
+    
+    remaining = this->_drain_ms - (int)watch.elapsed_ms();
+    bool jobs = JobQueue::getInstance()->drain(remaining > 0 ? remaining : 0);
+    
+    MHD_stop_daemon(d);
+    JobQueue::release();
+    // an ingest stops after the file it is on, the manifest has the rest
+    CardIngest::release();
+    SpoolRetention::release();
+    ThumbnailIndex::release();
+    RawPreview::release();
+    bool spool = CaptureSpool::getInstance()->flush();
+    CameraController::release();
+    
+    delete this->cmd;
+    delete this->api;
+    this->cmd = NULL;
+    this->api = NULL;
+    
+    Logger::getInstance()->log(CCA_LOG_INFO, "http", "op=stopped ms=%.0f liveview_drained=%d requests_left=%d jobs_drained=%d spool_flushed=%d",
+                               watch.elapsed_ms(), liveview, in_flight, jobs, spool);
 }
@@ -10,6 +10,7 @@
 #define __CameraControllerApi__Server__
 
 #include <iostream>
+#include <pthread.h>
 #include "microhttpd.h"
 #include "Api.h"
 #include "CameraController.h"
@@ -20,20 +21,28 @@ namespace CameraControllerApi {
         
         static int get_url_args(void *cls, MHD_ValueKind kind, const char *key , const char* value);
         static int send_bad_response( struct MHD_Connection *connection);
+        static int send_unavailable( struct MHD_Connection *connection);
+        static int send_too_large( struct MHD_Connection *connection);
+        static int send_upgrade(struct MHD_Connection *connection, Server *s);
+        static void upgraded(void *cls, struct MHD_Connection *connection, void *con_cls,
+                             const char *extra_in, size_t extra_in_size, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh);
         
     public:
         Server(int port);
+        ~Server();
         Api *api;
         CameraController *cc;
         Command *cmd;
         
         static void* initial(void*);
+        static void block_signals();
         
         void terminate(int sig);
         void *http();
         
         
     private:
+        static void request_completed(void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe);
         static int url_handler (void *cls,
                                 struct MHD_Connection *connection,
                                 const char *url,
@@ -42,8 +51,21 @@ namespace CameraControllerApi {
                                 const char *upload_data, size_t *upload_data_size, void **ptr);
                 
         
+        void _wait_for_shutdown();
+        void _shutdown(struct MHD_Daemon *d);
+        
         int _port;
-        int _shoulNotExit;
+        int _wakeup;
+        bool _draining;
+        int _in_flight;
+        pthread_mutex_t _flight_lock;
+        pthread_cond_t _flight_cond;
+        unsigned long _compress_min_bytes;
+        int _compress_level;
+        int _threads;
+        int _drain_ms;
+        bool _websocket;
+        unsigned long _max_body_bytes;
         
     };
 }
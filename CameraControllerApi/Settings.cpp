@@ -7,6 +7,7 @@
 //
 
 #include "Settings.h"
+#include "Logger.h"
 
 using namespace CameraControllerApi;
 
@@ -37,7 +38,19 @@ bool Settings::get_value(string key, string &res){
         res = _pt.get<string>("CCA_SETTINGS."+key);
         return true;
     } catch (std::exception const &e) {
-        std::cout<<"Error: " << e.what();
+        Logger::getInstance()->log(CCA_LOG_WARN, "settings", "key=%s error=\"%s\"", key.c_str(), e.what());
     }
     return false;
 }
+
+/*
+ * Like get_value, but a missing key is not worth a log line.
+ */
+bool Settings::lookup(string key, string &res){
+    boost::optional<string> value = _pt.get_optional<string>("CCA_SETTINGS."+key);
+    if(!value)
+        return false;
+    
+    res = *value;
+    return true;
+}
@@ -28,6 +28,7 @@ namespace CameraControllerApi {
         static Settings* getInstance();
         static void release();
         bool get_value(string key, string &res);
+        bool lookup(string key, string &res);
         
     private:
         Settings();
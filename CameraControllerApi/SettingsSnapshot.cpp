@@ -0,0 +1,97 @@
+//
+//  SettingsSnapshot.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "SettingsSnapshot.h"
+#include "FrameHash.h"
+#include "ScopedLock.h"
+#include "Compress.h"
+#include <sstream>
+#include <stdio.h>
+#include <boost/property_tree/json_parser.hpp>
+
+using namespace CameraControllerApi;
+
+SettingsSnapshot::SettingsSnapshot(const ptree &tree, unsigned long version){
+    this->_tree = tree;
+    this->_version = version;
+    pthread_mutex_init(&this->_lock, NULL);
+    
+    std::stringstream ss;
+    boost::property_tree::write_json(ss, this->_tree, false);
+    string content = ss.str();
+    
+    char hash[24];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)frame_hash(content.data(), content.size()));
+    this->_hash = hash;
+}
+
+SettingsSnapshot::~SettingsSnapshot(){
+    pthread_mutex_destroy(&this->_lock);
+}
+
+const ptree& SettingsSnapshot::tree() const {
+    return this->_tree;
+}
+
+unsigned long SettingsSnapshot::version() const {
+    return this->_version;
+}
+
+/*
+ * Strong etags have to differ per content encoding, so gzip and deflate get
+ * their name appended inside the quotes.
+ */
+string SettingsSnapshot::etag(int encoding) const {
+    if(encoding == CCA_ENCODING_IDENTITY)
+        return "\"" + this->_hash + "\"";
+    return "\"" + this->_hash + "-" + encoding_name((CCA_CONTENT_ENCODING)encoding) + "\"";
+}
+
+/*
+ * If-None-Match carries "*" or a comma separated list of etags, weak ones
+ * prefixed with W/.
+ */
+bool SettingsSnapshot::matches(const string &if_none_match) const {
+    if(if_none_match.empty())
+        return false;
+    
+    size_t start = 0;
+    while(start < if_none_match.size()){
+        size_t end = if_none_match.find(',', start);
+        if(end == string::npos)
+            end = if_none_match.size();
+        
+        string tag = if_none_match.substr(start, end - start);
+        size_t first = tag.find_first_not_of(" \t");
+        size_t last = tag.find_last_not_of(" \t");
+        if(first != string::npos){
+            tag = tag.substr(first, last - first + 1);
+            if(tag.compare(0, 2, "W/") == 0)
+                tag = tag.substr(2);
+            if(tag == "*" || tag == this->etag(CCA_ENCODING_IDENTITY) ||
+               tag == this->etag(CCA_ENCODING_GZIP) || tag == this->etag(CCA_ENCODING_DEFLATE))
+                return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+bool SettingsSnapshot::body(int type, int encoding, string &output){
+    ScopedLock lock(&this->_lock);
+    map<std::pair<int, int>, string>::iterator it = this->_bodies.find(std::make_pair(type, encoding));
+    if(it == this->_bodies.end())
+        return false;
+    
+    output = it->second;
+    return true;
+}
+
+void SettingsSnapshot::store_body(int type, int encoding, const string &output){
+    ScopedLock lock(&this->_lock);
+    this->_bodies[std::make_pair(type, encoding)] = output;
+}
@@ -0,0 +1,59 @@
+//
+//  SettingsSnapshot.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__SettingsSnapshot__
+#define __CameraControllerApi__SettingsSnapshot__
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::map;
+using std::string;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * An immutable copy of the camera settings tree. The version counts the
+     * changes since startup, the etag is a hash of the content, so a client
+     * can ask with If-None-Match whether anything changed without the tree
+     * being read from the camera or serialized again. A compressed body gets
+     * the encoding appended to its etag, any of them matches the content.
+     *
+     * The serialized responses are kept per output type and content encoding
+     * the first time they are built, so a repeated request is neither
+     * serialized nor compressed again.
+     */
+    class SettingsSnapshot {
+    public:
+        SettingsSnapshot(const ptree &tree, unsigned long version);
+        ~SettingsSnapshot();
+
+        const ptree& tree() const;
+        unsigned long version() const;
+        string etag(int encoding) const;
+        bool matches(const string &if_none_match) const;
+
+        bool body(int type, int encoding, string &output);
+        void store_body(int type, int encoding, const string &output);
+
+    private:
+        ptree _tree;
+        unsigned long _version;
+        string _hash;
+        pthread_mutex_t _lock;
+        map<std::pair<int, int>, string> _bodies;
+
+        SettingsSnapshot(const SettingsSnapshot &);
+        SettingsSnapshot& operator=(const SettingsSnapshot &);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__SettingsSnapshot__) */
@@ -0,0 +1,206 @@
+//
+//  Spool.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "Spool.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include "FrameHash.h"
+#include "ThumbnailIndex.h"
+#include "SpoolRetention.h"
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace CameraControllerApi;
+
+CaptureSpool* CaptureSpool::_instance = NULL;
+
+CaptureSpool* CaptureSpool::getInstance(){
+    if(_instance == NULL)
+        _instance = new CaptureSpool();
+    
+    return _instance;
+}
+
+void CaptureSpool::release(){
+    if(_instance != NULL)
+        delete _instance;
+    
+    _instance = NULL;
+}
+
+CaptureSpool::CaptureSpool(){
+    Settings *sett = Settings::getInstance();
+    if(!sett->get_value("spool.directory", this->_directory) || this->_directory.empty())
+        this->_directory = "spool";
+    
+    if(mkdir(this->_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        Logger::getInstance()->log(CCA_LOG_ERROR, "spool", "op=mkdir directory=%s errno=%d", this->_directory.c_str(), errno);
+}
+
+const string& CaptureSpool::directory(){
+    return this->_directory;
+}
+
+// IMG_0001.JPG in /store_00010001/DCIM/100CANON is 100CANON_IMG_0001.JPG in the spool
+string CaptureSpool::card_name(const string &folder, const string &name){
+    size_t slash = folder.rfind('/');
+    string dir = slash == string::npos ? folder : folder.substr(slash + 1);
+    return dir.empty() ? name : dir + "_" + name;
+}
+
+/*
+ * Writes the spooled files out to the disk, for shutdown. write() leaves
+ * that to the kernel, so a capture is not slowed down by an fsync.
+ */
+bool CaptureSpool::flush(){
+    int fd = open(this->_directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        return false;
+    
+    bool ok = (syncfs(fd) == 0);
+    if(!ok)
+        Logger::getInstance()->log(CCA_LOG_ERROR, "spool", "op=flush directory=%s errno=%d", this->_directory.c_str(), errno);
+    close(fd);
+    return ok;
+}
+
+// sets errno to the first error, ENOSPC tells a full disk
+static bool write_file(const string &path, const char *data, unsigned long size){
+    FILE *fd = fopen(path.c_str(), "wb");
+    if(fd == NULL)
+        return false;
+    
+    size_t written = fwrite(data, 1, size, fd);
+    int error = errno;
+    bool closed = (fclose(fd) == 0);
+    if(written == size && closed)
+        return true;
+    if(written == size)
+        error = errno;
+    remove(path.c_str());
+    errno = error;
+    return false;
+}
+
+bool CaptureSpool::write(const string &name, const char *data, unsigned long size, string &path){
+    path = this->_directory + "/" + name;
+    string tmp = path + ".part";
+    
+    if(!write_file(tmp, data, size)){
+        // retention fell behind, the capture makes room itself and tries once more
+        if(errno != ENOSPC || !SpoolRetention::reclaim(size) || !write_file(tmp, data, size))
+            return false;
+    }
+    
+    if(rename(tmp.c_str(), path.c_str()) != 0)
+        return false;
+    ThumbnailIndex::spooled(name);
+    SpoolRetention::spooled(name, size);
+    return true;
+}
+
+SpoolWriter::SpoolWriter(CaptureSpool *spool, unsigned int max_pending){
+    this->_spool = spool;
+    this->_max_pending = max_pending > 0 ? max_pending : 1;
+    this->_running = true;
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+    this->_started = (0 == pthread_create(&this->_thread, NULL, SpoolWriter::_worker, this));
+}
+
+SpoolWriter::~SpoolWriter(){
+    vector<SpoolResult> ignored;
+    this->finish(ignored);
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+void SpoolWriter::submit(const string &name, CameraFile *file){
+    Job job;
+    job.name = name;
+    job.file = file;
+    
+    if(!this->_started){
+        // no thread, write in place
+        this->_results.push_back(this->_write(job));
+        return;
+    }
+    
+    pthread_mutex_lock(&this->_lock);
+    while(this->_jobs.size() >= this->_max_pending)
+        pthread_cond_wait(&this->_cond, &this->_lock);
+    this->_jobs.push_back(job);
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+}
+
+void SpoolWriter::collect(vector<SpoolResult> &results){
+    ScopedLock lock(&this->_lock);
+    results.insert(results.end(), this->_results.begin(), this->_results.end());
+    this->_results.clear();
+}
+
+void SpoolWriter::finish(vector<SpoolResult> &results){
+    if(this->_started){
+        pthread_mutex_lock(&this->_lock);
+        this->_running = false;
+        pthread_cond_broadcast(&this->_cond);
+        pthread_mutex_unlock(&this->_lock);
+        pthread_join(this->_thread, NULL);
+        this->_started = false;
+    }
+    
+    results.insert(results.end(), this->_results.begin(), this->_results.end());
+    this->_results.clear();
+}
+
+SpoolResult SpoolWriter::_write(const Job &job){
+    const char *data = NULL;
+    unsigned long size = 0;
+    SpoolResult result;
+    Stopwatch watch;
+    
+    gp_file_get_data_and_size(job.file, &data, &size);
+    result.name = job.name;
+    result.size = size;
+    result.checksum = frame_hash(data, size);
+    result.ok = this->_spool->write(job.name, data, size, result.path);
+    result.write_ms = watch.elapsed_ms();
+    gp_file_unref(job.file);
+    return result;
+}
+
+void* SpoolWriter::_worker(void *context){
+    SpoolWriter *sw = (SpoolWriter *)context;
+    
+    pthread_mutex_lock(&sw->_lock);
+    while(true){
+        if(sw->_jobs.empty()){
+            if(!sw->_running)
+                break;
+            pthread_cond_wait(&sw->_cond, &sw->_lock);
+            continue;
+        }
+        
+        Job job = sw->_jobs.front();
+        sw->_jobs.pop_front();
+        pthread_cond_broadcast(&sw->_cond);
+        pthread_mutex_unlock(&sw->_lock);
+        
+        SpoolResult result = sw->_write(job);
+        
+        pthread_mutex_lock(&sw->_lock);
+        sw->_results.push_back(result);
+    }
+    pthread_mutex_unlock(&sw->_lock);
+    return NULL;
+}
@@ -0,0 +1,94 @@
+//
+//  Spool.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__Spool__
+#define __CameraControllerApi__Spool__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include <gphoto2/gphoto2-camera.h>
+
+using std::string;
+using std::vector;
+using std::deque;
+
+namespace CameraControllerApi {
+
+    struct SpoolResult {
+        string name;
+        string path;
+        unsigned long size;
+        uint64_t checksum;
+        double write_ms;
+        bool ok;
+    };
+
+    /*
+     * The directory captured files are written to (spool.directory in the
+     * settings.xml). Files are written under a temporary name and renamed,
+     * so nobody ever sees half a file.
+     */
+    class CaptureSpool {
+
+        static CaptureSpool *_instance;
+    public:
+        static CaptureSpool* getInstance();
+        static void release();
+
+        const string& directory();
+        static string card_name(const string &folder, const string &name);
+        bool write(const string &name, const char *data, unsigned long size, string &path);
+        bool flush();
+
+    private:
+        CaptureSpool();
+        ~CaptureSpool(){};
+        string _directory;
+    };
+
+    /*
+     * Writes downloaded files to the spool on its own thread, so the camera
+     * can go on with the next shot while the last one goes to disk. submit()
+     * takes over the CameraFile and only blocks if max_pending files are
+     * still waiting. collect() hands out the files written so far, finish()
+     * waits for the rest.
+     */
+    class SpoolWriter {
+    public:
+        SpoolWriter(CaptureSpool *spool, unsigned int max_pending);
+        ~SpoolWriter();
+
+        void submit(const string &name, CameraFile *file);
+        void collect(vector<SpoolResult> &results);
+        void finish(vector<SpoolResult> &results);
+
+    private:
+        struct Job {
+            string name;
+            CameraFile *file;
+        };
+
+        CaptureSpool *_spool;
+        unsigned int _max_pending;
+        bool _running;
+        bool _started;
+        pthread_t _thread;
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        deque<Job> _jobs;
+        vector<SpoolResult> _results;
+
+        SpoolResult _write(const Job &job);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__Spool__) */
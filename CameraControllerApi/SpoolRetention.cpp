@@ -0,0 +1,362 @@
+//
+//  SpoolRetention.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "SpoolRetention.h"
+#include "Spool.h"
+#include "ThumbnailIndex.h"
+#include "RawPreview.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+using namespace CameraControllerApi;
+
+// last use in microseconds, files written in the same second still have an order
+static int64_t now_us(){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+SpoolRetention* SpoolRetention::_instance = NULL;
+
+SpoolRetention* SpoolRetention::getInstance(){
+    if(_instance == NULL)
+        _instance = new SpoolRetention();
+
+    return _instance;
+}
+
+void SpoolRetention::release(){
+    if(_instance != NULL)
+        delete _instance;
+
+    _instance = NULL;
+}
+
+// for the spool and the recorder, like ThumbnailIndex::spooled()
+void SpoolRetention::spooled(const string &name, unsigned long size){
+    if(_instance == NULL || !_instance->_enabled)
+        return;
+
+    ScopedLock lock(&_instance->_lock);
+    _instance->_add(name, size, now_us());
+    _instance->_spooled_bytes += size;
+    if(_instance->_over_limit()){
+        _instance->_wakeup = true;
+        pthread_cond_signal(&_instance->_cond);
+    }
+}
+
+// a spool file was read, it is the last one to be evicted now
+void SpoolRetention::touched(const string &name){
+    if(_instance == NULL || !_instance->_enabled)
+        return;
+
+    ScopedLock lock(&_instance->_lock);
+    map<string, Entry>::iterator file = _instance->_files.find(name);
+    if(file != _instance->_files.end())
+        _instance->_add(name, file->second.size, now_us());
+}
+
+SpoolRetention::SpoolRetention(){
+    string enabled, max_bytes, max_files, max_age, min_free, target_free, interval, thumbs_index, thumbs_data, manifest;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("retention.enabled", enabled);
+    sett->get_value("retention.max_bytes", max_bytes);
+    sett->get_value("retention.max_files", max_files);
+    sett->get_value("retention.max_age_s", max_age);
+    sett->get_value("retention.min_free_mb", min_free);
+    sett->get_value("retention.target_free_mb", target_free);
+    sett->get_value("retention.interval_ms", interval);
+    sett->get_value("thumbs.index", thumbs_index);
+    sett->get_value("thumbs.data", thumbs_data);
+    sett->get_value("ingest.manifest", manifest);
+
+    this->_enabled = (enabled == "true");
+    this->_directory = CaptureSpool::getInstance()->directory();
+    // the files the server keeps about the spool are never evicted
+    this->_internal.insert(thumbs_index.empty() ? "thumbs.index" : thumbs_index);
+    this->_internal.insert(thumbs_data.empty() ? "thumbs.data" : thumbs_data);
+    this->_internal.insert(manifest.empty() ? "ingest.manifest" : manifest);
+
+    this->_max_bytes = strtoull(max_bytes.c_str(), NULL, 10);
+    this->_max_files = strtoul(max_files.c_str(), NULL, 10);
+    this->_max_age_s = strtoll(max_age.c_str(), NULL, 10);
+    this->_min_free = strtoull(min_free.c_str(), NULL, 10) * 1048576ULL;
+    this->_target_free = strtoull(target_free.c_str(), NULL, 10) * 1048576ULL;
+    if(this->_target_free < this->_min_free)
+        this->_target_free = this->_min_free;
+    this->_interval_ms = atoi(interval.c_str()) > 0 ? atoi(interval.c_str()) : 1000;
+
+    this->_bytes = 0;
+    this->_free_bytes = 0;
+    this->_spooled_bytes = 0;
+    this->_passes = 0;
+    this->_evicted = 0;
+    this->_evicted_bytes = 0;
+    this->_by_age = 0;
+    this->_by_count = 0;
+    this->_by_quota = 0;
+    this->_by_space = 0;
+    this->_reclaims = 0;
+    this->_errors = 0;
+    this->_pass_ms = 0;
+    this->_max_pass_ms = 0;
+    this->_running = true;
+    this->_wakeup = false;
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+
+    this->_started = false;
+    if(!this->_enabled)
+        return;
+
+    Stopwatch watch;
+    this->_scan();
+    Logger::getInstance()->log(CCA_LOG_INFO, "retention", "op=scan files=%lu bytes=%llu ms=%.1f",
+                               (unsigned long)this->_files.size(), this->_bytes, watch.elapsed_ms());
+    this->_started = (0 == pthread_create(&this->_thread, NULL, SpoolRetention::_worker, this));
+}
+
+SpoolRetention::~SpoolRetention(){
+    pthread_mutex_lock(&this->_lock);
+    this->_running = false;
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    if(this->_started)
+        pthread_join(this->_thread, NULL);
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * The only directory scan, at start. Files which are there already count
+ * as used when they were last written.
+ */
+void SpoolRetention::_scan(){
+    DIR *dir = opendir(this->_directory.c_str());
+    if(dir == NULL)
+        return;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+        string name = entry->d_name;
+        struct stat st;
+        if(stat((this->_directory + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            this->_add(name, st.st_size, (int64_t)st.st_mtime * 1000000);
+    }
+    closedir(dir);
+}
+
+// with the lock held; a file which is there already moves to its new place
+void SpoolRetention::_add(const string &name, unsigned long size, int64_t used){
+    if(name.empty() || name[0] == '.' || this->_internal.count(name) > 0 ||
+       (name.size() >= 5 && name.compare(name.size() - 5, 5, ".part") == 0))
+        return;
+
+    map<string, Entry>::iterator file = this->_files.find(name);
+    if(file != this->_files.end()){
+        this->_lru.erase(std::make_pair(file->second.used, name));
+        this->_bytes -= file->second.size;
+    }
+
+    Entry &added = this->_files[name];
+    added.size = size;
+    added.used = used;
+    this->_lru.insert(std::make_pair(used, name));
+    this->_bytes += size;
+}
+
+// with the lock held; the least recently used file
+void SpoolRetention::_take(vector<Victim> &victims, unsigned long &counter){
+    set<pair<int64_t, string> >::iterator oldest = this->_lru.begin();
+    map<string, Entry>::iterator file = this->_files.find(oldest->second);
+
+    Victim victim;
+    victim.name = oldest->second;
+    victim.size = file->second.size;
+    victims.push_back(victim);
+
+    this->_bytes -= file->second.size;
+    this->_files.erase(file);
+    this->_lru.erase(oldest);
+    counter++;
+}
+
+// the free space is estimated from the last pass, a capture does not ask the disk
+bool SpoolRetention::_over_limit(){
+    return (this->_max_bytes > 0 && this->_bytes > this->_max_bytes) ||
+           (this->_max_files > 0 && this->_files.size() > this->_max_files) ||
+           (this->_min_free > 0 && this->_free_bytes < this->_min_free + this->_spooled_bytes);
+}
+
+unsigned long long SpoolRetention::_disk_free(){
+    struct statvfs fs;
+    if(statvfs(this->_directory.c_str(), &fs) != 0)
+        return 0;
+    return (unsigned long long)fs.f_bavail * fs.f_frsize;
+}
+
+/*
+ * One pass: the victims are taken from the index under the lock, the files
+ * are removed without it.
+ */
+void SpoolRetention::_evict(){
+    Stopwatch watch;
+    vector<Victim> victims;
+    unsigned long long free_bytes = this->_disk_free();
+    unsigned long long freed = 0;
+    int64_t now = now_us();
+
+    pthread_mutex_lock(&this->_lock);
+    this->_spooled_bytes = 0;
+    while(this->_max_age_s > 0 && !this->_lru.empty() && this->_lru.begin()->first < now - this->_max_age_s * 1000000)
+        this->_take(victims, this->_by_age);
+    while(this->_max_files > 0 && this->_files.size() > this->_max_files)
+        this->_take(victims, this->_by_count);
+    while(this->_max_bytes > 0 && this->_bytes > this->_max_bytes)
+        this->_take(victims, this->_by_quota);
+
+    for(size_t i = 0; i < victims.size(); i++)
+        freed += victims[i].size;
+    // the space of the files above is free once they are removed
+    if(this->_min_free > 0 && free_bytes + freed < this->_min_free){
+        while(free_bytes + freed < this->_target_free && !this->_lru.empty()){
+            this->_take(victims, this->_by_space);
+            freed += victims.back().size;
+        }
+    }
+    pthread_mutex_unlock(&this->_lock);
+
+    this->_remove(victims);
+
+    double ms = watch.elapsed_ms();
+    ScopedLock lock(&this->_lock);
+    this->_free_bytes = this->_disk_free();
+    this->_passes++;
+    this->_pass_ms = ms;
+    if(ms > this->_max_pass_ms)
+        this->_max_pass_ms = ms;
+    if(!victims.empty())
+        Logger::getInstance()->log(CCA_LOG_INFO, "retention", "op=evict files=%lu bytes=%llu free_bytes=%llu ms=%.1f",
+                                   (unsigned long)victims.size(), freed, this->_free_bytes, ms);
+}
+
+// the thumbnail and the cached RAW preview of a file go with it
+void SpoolRetention::_remove(const vector<Victim> &victims){
+    unsigned long errors = 0;
+    unsigned long long bytes = 0;
+    for(size_t i = 0; i < victims.size(); i++){
+        string path = this->_directory + "/" + victims[i].name;
+        if(unlink(path.c_str()) != 0 && errno != ENOENT){
+            Logger::getInstance()->log(CCA_LOG_ERROR, "retention", "op=unlink file=%s errno=%d", victims[i].name.c_str(), errno);
+            errors++;
+            continue;
+        }
+        ThumbnailIndex::deleted(victims[i].name);
+        RawPreview::getInstance()->forget(victims[i].name, victims[i].size);
+        bytes += victims[i].size;
+    }
+
+    ScopedLock lock(&this->_lock);
+    this->_evicted += victims.size() - errors;
+    this->_evicted_bytes += bytes;
+    this->_errors += errors;
+}
+
+/*
+ * For a write which found the disk full although the spool is watched: it
+ * evicts at least bytes right away, on the capturing thread. False if the
+ * index has nothing left to evict or retention is off.
+ */
+bool SpoolRetention::reclaim(unsigned long bytes){
+    if(_instance == NULL || !_instance->_enabled)
+        return false;
+    return _instance->_reclaim(bytes);
+}
+
+bool SpoolRetention::_reclaim(unsigned long bytes){
+    vector<Victim> victims;
+    unsigned long long freed = 0;
+
+    pthread_mutex_lock(&this->_lock);
+    while(freed < bytes && !this->_lru.empty()){
+        this->_take(victims, this->_by_space);
+        freed += victims.back().size;
+    }
+    this->_reclaims++;
+    pthread_mutex_unlock(&this->_lock);
+
+    Logger::getInstance()->log(CCA_LOG_WARN, "retention", "op=reclaim needed=%lu files=%lu bytes=%llu",
+                               bytes, (unsigned long)victims.size(), freed);
+    this->_remove(victims);
+    return !victims.empty();
+}
+
+void SpoolRetention::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("enabled",           this->_enabled);
+    tree.put("files",             this->_files.size());
+    tree.put("bytes",             this->_bytes);
+    tree.put("free_bytes",        this->_free_bytes);
+    tree.put("max_bytes",         this->_max_bytes);
+    tree.put("max_files",         this->_max_files);
+    tree.put("oldest_s",          this->_lru.empty() ? 0 : (now_us() - this->_lru.begin()->first) / 1000000);
+    tree.put("passes",            this->_passes);
+    tree.put("pass_ms",           this->_pass_ms);
+    tree.put("max_pass_ms",       this->_max_pass_ms);
+    tree.put("evicted.files",     this->_evicted);
+    tree.put("evicted.bytes",     this->_evicted_bytes);
+    tree.put("evicted.age",       this->_by_age);
+    tree.put("evicted.count",     this->_by_count);
+    tree.put("evicted.quota",     this->_by_quota);
+    tree.put("evicted.space",     this->_by_space);
+    tree.put("evicted.reclaims",  this->_reclaims);
+    tree.put("errors",            this->_errors);
+}
+
+void* SpoolRetention::_worker(void *context){
+    SpoolRetention *sr = (SpoolRetention *)context;
+
+    pthread_mutex_lock(&sr->_lock);
+    while(sr->_running){
+        sr->_wakeup = false;
+        pthread_mutex_unlock(&sr->_lock);
+
+        sr->_evict();
+
+        pthread_mutex_lock(&sr->_lock);
+        if(!sr->_running || sr->_wakeup)
+            continue;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sr->_interval_ms / 1000;
+        deadline.tv_nsec += (sr->_interval_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(sr->_running && !sr->_wakeup)
+            if(pthread_cond_timedwait(&sr->_cond, &sr->_lock, &deadline) != 0)
+                break;
+    }
+    pthread_mutex_unlock(&sr->_lock);
+    return NULL;
+}
@@ -0,0 +1,117 @@
+//
+//  SpoolRetention.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__SpoolRetention__
+#define __CameraControllerApi__SpoolRetention__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using std::vector;
+using std::set;
+using std::map;
+using std::pair;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Keeps the spool within its limits when retention.enabled is set:
+     * retention.max_bytes and retention.max_files, files not used for
+     * retention.max_age_s, and free space on the disk. Below
+     * retention.min_free_mb files are evicted until retention.target_free_mb
+     * is free again.
+     *
+     * The files are known from an index ordered by last use, built by one
+     * scan at start and kept up to date by the spool, the recorder and the
+     * requests which read spool files. The least recently used files go
+     * first. Eviction runs on its own thread every retention.interval_ms,
+     * or at once when a file takes the spool over a limit, so a capture only
+     * adds its file to the index. Only if the disk is full all the same a
+     * write evicts what it needs itself (see reclaim()).
+     */
+    class SpoolRetention {
+
+        static SpoolRetention *_instance;
+    public:
+        static SpoolRetention* getInstance();
+        static void release();
+        static void spooled(const string &name, unsigned long size);
+        static void touched(const string &name);
+        static bool reclaim(unsigned long bytes);
+
+        void stats(ptree &tree);
+
+    private:
+        SpoolRetention();
+        ~SpoolRetention();
+
+        struct Entry {
+            unsigned long size;
+            int64_t used;
+        };
+
+        struct Victim {
+            string name;
+            unsigned long size;
+        };
+
+        bool _enabled;
+        string _directory;
+        set<string> _internal;
+        unsigned long long _max_bytes;
+        unsigned long _max_files;
+        int64_t _max_age_s;
+        unsigned long long _min_free;
+        unsigned long long _target_free;
+        int _interval_ms;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        pthread_t _thread;
+        bool _started;
+        bool _running;
+        bool _wakeup;
+
+        map<string, Entry> _files;
+        set<pair<int64_t, string> > _lru;
+        unsigned long long _bytes;
+
+        unsigned long long _free_bytes;
+        unsigned long long _spooled_bytes;
+        unsigned long _passes;
+        unsigned long _evicted;
+        unsigned long long _evicted_bytes;
+        unsigned long _by_age;
+        unsigned long _by_count;
+        unsigned long _by_quota;
+        unsigned long _by_space;
+        unsigned long _reclaims;
+        unsigned long _errors;
+        double _pass_ms;
+        double _max_pass_ms;
+
+        void _scan();
+        void _add(const string &name, unsigned long size, int64_t used);
+        void _take(vector<Victim> &victims, unsigned long &counter);
+        bool _over_limit();
+        unsigned long long _disk_free();
+        void _evict();
+        bool _reclaim(unsigned long bytes);
+        void _remove(const vector<Victim> &victims);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__SpoolRetention__) */
@@ -0,0 +1,45 @@
+//
+//  Stopwatch.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__Stopwatch__
+#define __CameraControllerApi__Stopwatch__
+
+#include <time.h>
+
+namespace CameraControllerApi {
+
+    /*
+     * Milliseconds on the monotonic clock, for step timings in reports.
+     */
+    class Stopwatch {
+    public:
+        Stopwatch(){
+            this->restart();
+        }
+
+        void restart(){
+            clock_gettime(CLOCK_MONOTONIC, &this->_start);
+        }
+
+        double elapsed_ms() const {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return (now.tv_sec - this->_start.tv_sec) * 1000.0 + (now.tv_nsec - this->_start.tv_nsec) / 1000000.0;
+        }
+
+        double lap_ms(){
+            double ms = this->elapsed_ms();
+            this->restart();
+            return ms;
+        }
+
+    private:
+        struct timespec _start;
+    };
+}
+
+#endif /* defined(__CameraControllerApi__Stopwatch__) */
@@ -0,0 +1,691 @@
+//
+//  ThumbnailIndex.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "ThumbnailIndex.h"
+#include "RawPreview.h"
+#include "Spool.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+
+using namespace CameraControllerApi;
+
+struct thumb_jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+// libjpeg exits the process on errors by default, a broken file must not do that
+static void thumb_error_exit(j_common_ptr cinfo){
+    thumb_jpeg_error *err = (thumb_jpeg_error *)cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+/*
+ * Decodes the JPEG with the largest DCT scaling (1/8 down to none) which
+ * leaves the long side at min_size or more, and compresses it again one
+ * scanline at a time, so the scaled image is never held as a whole.
+ */
+static bool scale_jpeg(const unsigned char *data, size_t size, int min_size, int quality, string &thumb, ThumbnailRecord &record){
+    struct jpeg_decompress_struct in;
+    struct jpeg_compress_struct out;
+    thumb_jpeg_error err;
+    unsigned char *buffer = NULL;
+    unsigned long length = 0;
+
+    in.err = jpeg_std_error(&err.mgr);
+    out.err = &err.mgr;
+    err.mgr.error_exit = thumb_error_exit;
+    jpeg_create_decompress(&in);
+    jpeg_create_compress(&out);
+    if(setjmp(err.jump)){
+        jpeg_destroy_compress(&out);
+        jpeg_destroy_decompress(&in);
+        free(buffer);
+        return false;
+    }
+
+    jpeg_mem_src(&in, (unsigned char *)data, size);
+    if(jpeg_read_header(&in, TRUE) != JPEG_HEADER_OK){
+        jpeg_destroy_compress(&out);
+        jpeg_destroy_decompress(&in);
+        return false;
+    }
+
+    unsigned int side = in.image_width > in.image_height ? in.image_width : in.image_height;
+    unsigned int scale = 8;
+    while(scale > 1 && side / scale < (unsigned int)min_size)
+        scale /= 2;
+    in.scale_num = 1;
+    in.scale_denom = scale;
+    in.out_color_space = JCS_RGB;
+    in.dct_method = JDCT_IFAST;
+    in.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&in);
+
+    out.image_width = in.output_width;
+    out.image_height = in.output_height;
+    out.input_components = 3;
+    out.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&out);
+    jpeg_set_quality(&out, quality, TRUE);
+    out.dct_method = JDCT_IFAST;
+    jpeg_mem_dest(&out, &buffer, &length);
+    jpeg_start_compress(&out, TRUE);
+
+    JSAMPARRAY row = (*in.mem->alloc_sarray)((j_common_ptr)&in, JPOOL_IMAGE, in.output_width * in.output_components, 1);
+    while(in.output_scanline < in.output_height){
+        jpeg_read_scanlines(&in, row, 1);
+        jpeg_write_scanlines(&out, row, 1);
+    }
+    jpeg_finish_compress(&out);
+    jpeg_finish_decompress(&in);
+
+    thumb.assign((const char *)buffer, length);
+    record.width = in.image_width;
+    record.height = in.image_height;
+    record.thumb_width = in.output_width;
+    record.thumb_height = in.output_height;
+
+    jpeg_destroy_compress(&out);
+    jpeg_destroy_decompress(&in);
+    free(buffer);
+    return true;
+}
+
+static void copy_text(char *dest, size_t size, const string &text){
+    strncpy(dest, text.c_str(), size - 1);
+    dest[size - 1] = '\0';
+}
+
+// a plain file name which fits into a record
+static bool indexable(const string &name){
+    return !name.empty() && name[0] != '.' && name.find('/') == string::npos &&
+           name.size() < sizeof(((ThumbnailRecord *)0)->name) &&
+           (name.size() < 5 || name.compare(name.size() - 5, 5, ".part") != 0);
+}
+
+ThumbnailIndex* ThumbnailIndex::_instance = NULL;
+
+ThumbnailIndex* ThumbnailIndex::getInstance(){
+    if(_instance == NULL)
+        _instance = new ThumbnailIndex();
+
+    return _instance;
+}
+
+void ThumbnailIndex::release(){
+    if(_instance != NULL)
+        delete _instance;
+
+    _instance = NULL;
+}
+
+// for the spool, which must not start the index on its own
+void ThumbnailIndex::spooled(const string &name){
+    if(_instance != NULL)
+        _instance->submit(name);
+}
+
+void ThumbnailIndex::deleted(const string &name){
+    if(_instance != NULL)
+        _instance->remove(name);
+}
+
+ThumbnailIndex::ThumbnailIndex(){
+    string index, data, workers, min_size, quality;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("thumbs.index", index);
+    sett->get_value("thumbs.data", data);
+    sett->get_value("thumbs.workers", workers);
+    sett->get_value("thumbs.min_size", min_size);
+    sett->get_value("thumbs.quality", quality);
+
+    this->_directory = CaptureSpool::getInstance()->directory();
+    this->_index_path = this->_directory + "/" + (index.empty() ? "thumbs.index" : index);
+    this->_data_path = this->_directory + "/" + (data.empty() ? "thumbs.data" : data);
+    this->_min_size = atoi(min_size.c_str()) > 0 ? atoi(min_size.c_str()) : 160;
+    this->_quality = (atoi(quality.c_str()) > 0 && atoi(quality.c_str()) <= 100) ? atoi(quality.c_str()) : 75;
+
+    this->_index_fd = -1;
+    this->_data_fd = -1;
+    this->_generation = 0;
+    this->_map = NULL;
+    this->_mapped = 0;
+    this->_records = 0;
+    this->_data_bytes = 0;
+    this->_running = true;
+    this->_busy = 0;
+    this->_generated = 0;
+    this->_no_thumbnail = 0;
+    this->_skipped = 0;
+    this->_failed = 0;
+    this->_compacted = 0;
+    this->_generate_ms = 0;
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+
+    Stopwatch watch;
+    if(!this->_open()){
+        Logger::getInstance()->log(CCA_LOG_ERROR, "thumbs", "op=open index=%s errno=%d", this->_index_path.c_str(), errno);
+        return;
+    }
+    this->_scan();
+    Logger::getInstance()->log(CCA_LOG_INFO, "thumbs", "op=open records=%lu files=%lu queued=%lu ms=%.1f",
+                               this->_records, (unsigned long)this->_names.size(), (unsigned long)this->_queue.size(), watch.elapsed_ms());
+
+    int count = atoi(workers.c_str()) > 0 ? atoi(workers.c_str()) : 2;
+    for(int i = 0; i < count; i++){
+        pthread_t t;
+        if(0 == pthread_create(&t, NULL, ThumbnailIndex::_worker, this))
+            this->_workers.push_back(t);
+    }
+}
+
+/*
+ * A thumbnail which is being made is finished, the queue is dropped. The
+ * files are found again by the scan of the next start.
+ */
+ThumbnailIndex::~ThumbnailIndex(){
+    pthread_mutex_lock(&this->_lock);
+    this->_running = false;
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    for(size_t i = 0; i < this->_workers.size(); i++)
+        pthread_join(this->_workers[i], NULL);
+
+    this->_close();
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+bool ThumbnailIndex::_open(){
+    for(int pass = 0; pass < 2; pass++){
+        this->_index_fd = open(this->_index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        this->_data_fd = open(this->_data_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        unsigned long dead = 0;
+        if(this->_index_fd < 0 || this->_data_fd < 0 || !this->_load(dead)){
+            this->_close();
+            return false;
+        }
+
+        if(pass == 0 && dead > this->_names.size() && this->_compact()){
+            this->_close();
+            continue;
+        }
+        break;
+    }
+    return true;
+}
+
+/*
+ * Maps the index and checks the records. The first one which is not
+ * complete (the server died while it was appended) ends the index. Files
+ * which do not match the layout or each other are started again.
+ */
+bool ThumbnailIndex::_load(unsigned long &dead){
+    struct stat index_st, data_st;
+    ThumbnailHeader header;
+    ThumbnailDataHeader data_header;
+    if(fstat(this->_index_fd, &index_st) != 0 || fstat(this->_data_fd, &data_st) != 0)
+        return false;
+
+    bool valid = (size_t)index_st.st_size >= sizeof(header) && (size_t)data_st.st_size >= sizeof(data_header) &&
+                 pread(this->_index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 pread(this->_data_fd, &data_header, sizeof(data_header), 0) == (ssize_t)sizeof(data_header) &&
+                 memcmp(header.magic, CCA_THUMBS_MAGIC, sizeof(header.magic)) == 0 &&
+                 memcmp(data_header.magic, CCA_THUMBS_DATA_MAGIC, sizeof(data_header.magic)) == 0 &&
+                 header.version == CCA_THUMBS_VERSION && header.record_bytes == sizeof(ThumbnailRecord) &&
+                 header.generation == data_header.generation;
+    if(!valid){
+        if(index_st.st_size > 0)
+            Logger::getInstance()->log(CCA_LOG_INFO, "thumbs", "op=reset index=%s", this->_index_path.c_str());
+        return this->_reset();
+    }
+
+    this->_generation = header.generation;
+    this->_data_bytes = data_st.st_size;
+    unsigned long records = (index_st.st_size - sizeof(header)) / sizeof(ThumbnailRecord);
+    if(!this->_remap(sizeof(header) + records * sizeof(ThumbnailRecord)))
+        return false;
+
+    this->_records = 0;
+    this->_names.clear();
+    dead = 0;
+    for(unsigned long i = 0; i < records; i++){
+        ThumbnailRecord *record = this->_record(i);
+        if((record->flags & CCA_THUMB_VALID) == 0 || record->name[sizeof(record->name) - 1] != '\0' ||
+           (record->thumb_size > 0 && record->thumb_offset < sizeof(data_header)) ||
+           record->thumb_offset + record->thumb_size > this->_data_bytes)
+            break;
+
+        this->_records++;
+        if((record->flags & CCA_THUMB_REMOVED) != 0){
+            dead++;
+            continue;
+        }
+        map<string, unsigned long>::iterator known = this->_names.find(record->name);
+        if(known != this->_names.end()){
+            this->_set_flags(known->second, this->_record(known->second)->flags | CCA_THUMB_REMOVED);
+            dead++;
+        }
+        this->_names[record->name] = i;
+    }
+
+    off_t used = sizeof(header) + this->_records * sizeof(ThumbnailRecord);
+    if(used != index_st.st_size && ftruncate(this->_index_fd, used) != 0)
+        return false;
+    return true;
+}
+
+bool ThumbnailIndex::_reset(){
+    ThumbnailHeader header;
+    ThumbnailDataHeader data_header;
+    memset(&header, 0, sizeof(header));
+    memset(&data_header, 0, sizeof(data_header));
+    memcpy(header.magic, CCA_THUMBS_MAGIC, sizeof(header.magic));
+    memcpy(data_header.magic, CCA_THUMBS_DATA_MAGIC, sizeof(data_header.magic));
+    header.version = CCA_THUMBS_VERSION;
+    header.record_bytes = sizeof(ThumbnailRecord);
+    header.generation = this->_generation + 1;
+    data_header.generation = header.generation;
+
+    if(ftruncate(this->_index_fd, 0) != 0 || ftruncate(this->_data_fd, 0) != 0 ||
+       pwrite(this->_data_fd, &data_header, sizeof(data_header), 0) != (ssize_t)sizeof(data_header) ||
+       pwrite(this->_index_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        return false;
+
+    this->_generation = header.generation;
+    this->_data_bytes = sizeof(data_header);
+    this->_records = 0;
+    this->_names.clear();
+    return this->_remap(sizeof(header));
+}
+
+void ThumbnailIndex::_close(){
+    if(this->_map != NULL)
+        munmap(this->_map, this->_mapped);
+    if(this->_index_fd >= 0)
+        close(this->_index_fd);
+    if(this->_data_fd >= 0)
+        close(this->_data_fd);
+    this->_map = NULL;
+    this->_mapped = 0;
+    this->_index_fd = -1;
+    this->_data_fd = -1;
+    this->_records = 0;
+    this->_names.clear();
+}
+
+/*
+ * The mapping is larger than the file and doubled when the records reach
+ * its end, so appending does not map the index again every time. Only the
+ * records which are written are ever read.
+ */
+bool ThumbnailIndex::_remap(size_t needed){
+    if(this->_map != NULL && needed <= this->_mapped)
+        return true;
+
+    size_t capacity = this->_mapped > 0 ? this->_mapped : 1048576;
+    while(capacity < needed)
+        capacity *= 2;
+
+    void *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, this->_index_fd, 0);
+    if(map == MAP_FAILED)
+        return false;
+    if(this->_map != NULL)
+        munmap(this->_map, this->_mapped);
+    this->_map = (char *)map;
+    this->_mapped = capacity;
+    return true;
+}
+
+/*
+ * Writes the live records and their thumbnails to new files. The data file
+ * is renamed first: if the server dies before the index follows, the
+ * generations do not match and the index is made again.
+ */
+bool ThumbnailIndex::_compact(){
+    string index_tmp = this->_index_path + ".part";
+    string data_tmp = this->_data_path + ".part";
+    int index_fd = open(index_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int data_fd = open(data_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    ThumbnailHeader header;
+    ThumbnailDataHeader data_header;
+    memset(&header, 0, sizeof(header));
+    memset(&data_header, 0, sizeof(data_header));
+    memcpy(header.magic, CCA_THUMBS_MAGIC, sizeof(header.magic));
+    memcpy(data_header.magic, CCA_THUMBS_DATA_MAGIC, sizeof(data_header.magic));
+    header.version = CCA_THUMBS_VERSION;
+    header.record_bytes = sizeof(ThumbnailRecord);
+    header.generation = this->_generation + 1;
+    data_header.generation = header.generation;
+
+    bool ok = index_fd >= 0 && data_fd >= 0 &&
+              pwrite(data_fd, &data_header, sizeof(data_header), 0) == (ssize_t)sizeof(data_header) &&
+              pwrite(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+
+    uint64_t data_bytes = sizeof(data_header);
+    off_t at = sizeof(header);
+    unsigned long kept = 0;
+    string thumb;
+    for(unsigned long i = 0; ok && i < this->_records; i++){
+        ThumbnailRecord record = *this->_record(i);
+        if((record.flags & CCA_THUMB_REMOVED) != 0)
+            continue;
+
+        if(record.thumb_size > 0){
+            thumb.resize(record.thumb_size);
+            ok = pread(this->_data_fd, &thumb[0], record.thumb_size, record.thumb_offset) == (ssize_t)record.thumb_size &&
+                 pwrite(data_fd, thumb.data(), thumb.size(), data_bytes) == (ssize_t)thumb.size();
+            record.thumb_offset = data_bytes;
+            data_bytes += record.thumb_size;
+        }
+        ok = ok && pwrite(index_fd, &record, sizeof(record), at) == (ssize_t)sizeof(record);
+        at += sizeof(record);
+        kept++;
+    }
+
+    if(index_fd >= 0)
+        close(index_fd);
+    if(data_fd >= 0)
+        close(data_fd);
+    ok = ok && rename(data_tmp.c_str(), this->_data_path.c_str()) == 0 && rename(index_tmp.c_str(), this->_index_path.c_str()) == 0;
+    if(!ok){
+        Logger::getInstance()->log(CCA_LOG_ERROR, "thumbs", "op=compact index=%s errno=%d", this->_index_path.c_str(), errno);
+        ::remove(index_tmp.c_str());
+        ::remove(data_tmp.c_str());
+        return false;
+    }
+
+    Logger::getInstance()->log(CCA_LOG_INFO, "thumbs", "op=compact records=%lu kept=%lu data_bytes=%llu",
+                               this->_records, kept, (unsigned long long)data_bytes);
+    this->_compacted += this->_records - kept;
+    return true;
+}
+
+/*
+ * Queues the files of the spool which are new or were written again since
+ * they were indexed and drops the records of files which are gone.
+ */
+void ThumbnailIndex::_scan(){
+    DIR *dir = opendir(this->_directory.c_str());
+    if(dir == NULL)
+        return;
+
+    set<string> present;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+        string name = entry->d_name;
+        string path = this->_directory + "/" + name;
+        struct stat st;
+        if(!indexable(name) || path == this->_index_path || path == this->_data_path ||
+           stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        present.insert(name);
+        map<string, unsigned long>::iterator known = this->_names.find(name);
+        if(known == this->_names.end() || this->_record(known->second)->size != (uint64_t)st.st_size ||
+           this->_record(known->second)->mtime != (int64_t)st.st_mtime)
+            this->submit(name);
+    }
+    closedir(dir);
+
+    for(map<string, unsigned long>::iterator it = this->_names.begin(); it != this->_names.end();){
+        if(present.count(it->first) == 0){
+            this->_set_flags(it->second, this->_record(it->second)->flags | CCA_THUMB_REMOVED);
+            this->_names.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+ThumbnailRecord* ThumbnailIndex::_record(unsigned long index){
+    return (ThumbnailRecord *)(this->_map + sizeof(ThumbnailHeader) + index * sizeof(ThumbnailRecord));
+}
+
+void ThumbnailIndex::_set_flags(unsigned long index, uint16_t flags){
+    off_t at = sizeof(ThumbnailHeader) + index * sizeof(ThumbnailRecord) + offsetof(ThumbnailRecord, flags);
+    if(pwrite(this->_index_fd, &flags, sizeof(flags), at) != (ssize_t)sizeof(flags))
+        Logger::getInstance()->log(CCA_LOG_ERROR, "thumbs", "op=flags record=%lu errno=%d", index, errno);
+}
+
+// with the lock held; the thumbnail is written before the record which points to it
+bool ThumbnailIndex::_append(ThumbnailRecord &record, const string &jpeg){
+    if(this->_index_fd < 0)
+        return false;
+
+    record.thumb_offset = jpeg.empty() ? 0 : this->_data_bytes;
+    record.thumb_size = jpeg.size();
+    if(!jpeg.empty() && pwrite(this->_data_fd, jpeg.data(), jpeg.size(), this->_data_bytes) != (ssize_t)jpeg.size())
+        return false;
+
+    off_t at = sizeof(ThumbnailHeader) + this->_records * sizeof(ThumbnailRecord);
+    if(!this->_remap(at + sizeof(ThumbnailRecord)) ||
+       pwrite(this->_index_fd, &record, sizeof(record), at) != (ssize_t)sizeof(record))
+        return false;
+    this->_data_bytes += jpeg.size();
+
+    map<string, unsigned long>::iterator known = this->_names.find(record.name);
+    if(known != this->_names.end())
+        this->_set_flags(known->second, this->_record(known->second)->flags | CCA_THUMB_REMOVED);
+    this->_names[record.name] = this->_records++;
+    return true;
+}
+
+/*
+ * Makes the record of one spool file. Files which are neither a JPEG nor a
+ * TIFF based RAW (recordings, the manifest) are left out of the index.
+ */
+void ThumbnailIndex::_generate(const string &name){
+    Stopwatch watch;
+    string path = this->_directory + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 4){
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return;
+
+    const unsigned char *bytes = (const unsigned char *)map;
+    const unsigned char *jpeg = NULL;
+    size_t jpeg_size = 0;
+    bool image = true;
+    if(bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF){
+        jpeg = bytes;
+        jpeg_size = st.st_size;
+    } else if((bytes[0] == 'I' && bytes[1] == 'I' && bytes[2] == 42 && bytes[3] == 0) ||
+              (bytes[0] == 'M' && bytes[1] == 'M' && bytes[2] == 0 && bytes[3] == 42)){
+        size_t offset = 0;
+        if(RawPreview::find(bytes, st.st_size, offset, jpeg_size))
+            jpeg = bytes + offset;
+    } else {
+        image = false;
+    }
+
+    ThumbnailRecord record;
+    ExifBasics exif;
+    string thumb;
+    bool ok = false;
+    memset(&record, 0, sizeof(record));
+    if(image){
+        copy_text(record.name, sizeof(record.name), name);
+        record.size = st.st_size;
+        record.mtime = st.st_mtime;
+        if(RawPreview::exif(bytes, st.st_size, exif)){
+            copy_text(record.taken, sizeof(record.taken), exif.taken);
+            copy_text(record.make, sizeof(record.make), exif.make);
+            copy_text(record.model, sizeof(record.model), exif.model);
+            record.exposure = exif.exposure;
+            record.fnumber = exif.fnumber;
+            record.focal_length = exif.focal_length;
+            record.iso = exif.iso;
+            record.orientation = exif.orientation;
+        }
+        ok = (jpeg != NULL && scale_jpeg(jpeg, jpeg_size, this->_min_size, this->_quality, thumb, record));
+        record.flags = CCA_THUMB_VALID | (ok ? 0 : CCA_THUMB_NONE);
+    }
+    munmap(map, st.st_size);
+
+    ScopedLock lock(&this->_lock);
+    if(!image){
+        this->_skipped++;
+    } else if(!this->_append(record, thumb)){
+        this->_failed++;
+        Logger::getInstance()->log(CCA_LOG_ERROR, "thumbs", "op=append file=%s errno=%d", name.c_str(), errno);
+    } else if(ok){
+        this->_generated++;
+        this->_generate_ms += watch.elapsed_ms();
+    } else {
+        this->_no_thumbnail++;
+    }
+}
+
+void* ThumbnailIndex::_worker(void *context){
+    ThumbnailIndex *ti = (ThumbnailIndex *)context;
+
+    pthread_mutex_lock(&ti->_lock);
+    while(ti->_running){
+        if(ti->_queue.empty()){
+            pthread_cond_wait(&ti->_cond, &ti->_lock);
+            continue;
+        }
+
+        string name = ti->_queue.front();
+        ti->_queue.pop_front();
+        ti->_queued.erase(name);
+        ti->_busy++;
+        pthread_mutex_unlock(&ti->_lock);
+
+        ti->_generate(name);
+
+        pthread_mutex_lock(&ti->_lock);
+        ti->_busy--;
+    }
+    pthread_mutex_unlock(&ti->_lock);
+    return NULL;
+}
+
+void ThumbnailIndex::submit(const string &name){
+    if(!indexable(name))
+        return;
+
+    ScopedLock lock(&this->_lock);
+    if(this->_index_fd < 0 || !this->_running)
+        return;
+    if(this->_queued.insert(name).second){
+        this->_queue.push_back(name);
+        pthread_cond_signal(&this->_cond);
+    }
+}
+
+void ThumbnailIndex::remove(const string &name){
+    ScopedLock lock(&this->_lock);
+    map<string, unsigned long>::iterator known = this->_names.find(name);
+    if(known == this->_names.end())
+        return;
+    this->_set_flags(known->second, this->_record(known->second)->flags | CCA_THUMB_REMOVED);
+    this->_names.erase(known);
+}
+
+/*
+ * The files from offset on, at most limit of them (0 is all), in the order
+ * they were indexed. Returns the number of files in the index.
+ */
+unsigned long ThumbnailIndex::list(ptree &files, unsigned long offset, unsigned long limit){
+    ScopedLock lock(&this->_lock);
+    unsigned long live = 0;
+    for(unsigned long i = 0; i < this->_records; i++){
+        const ThumbnailRecord *record = this->_record(i);
+        if((record->flags & CCA_THUMB_REMOVED) != 0)
+            continue;
+
+        if(live >= offset && (limit == 0 || live < offset + limit)){
+            ptree file;
+            file.put("name", string(record->name));
+            file.put("size", record->size);
+            file.put("mtime", record->mtime);
+            file.put("taken", string(record->taken));
+            file.put("width", record->width);
+            file.put("height", record->height);
+            file.put("make", string(record->make));
+            file.put("model", string(record->model));
+            file.put("exposure", record->exposure);
+            file.put("fnumber", record->fnumber);
+            file.put("focal_length", record->focal_length);
+            file.put("iso", record->iso);
+            file.put("orientation", record->orientation);
+            if(record->thumb_size > 0){
+                file.put("thumbnail.width", record->thumb_width);
+                file.put("thumbnail.height", record->thumb_height);
+                file.put("thumbnail.bytes", record->thumb_size);
+            }
+            files.push_back(std::make_pair("", file));
+        }
+        live++;
+    }
+    return live;
+}
+
+bool ThumbnailIndex::thumbnail(const string &name, string &jpeg){
+    uint64_t offset;
+    uint32_t size;
+    int fd;
+    {
+        ScopedLock lock(&this->_lock);
+        map<string, unsigned long>::iterator known = this->_names.find(name);
+        if(known == this->_names.end() || this->_record(known->second)->thumb_size == 0)
+            return false;
+        offset = this->_record(known->second)->thumb_offset;
+        size = this->_record(known->second)->thumb_size;
+        fd = this->_data_fd;
+    }
+
+    // the data file is only replaced when the server starts, reading it needs no lock
+    jpeg.resize(size);
+    return pread(fd, &jpeg[0], size, offset) == (ssize_t)size;
+}
+
+void ThumbnailIndex::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("files",        this->_names.size());
+    tree.put("records",      this->_records);
+    tree.put("queued",       this->_queue.size());
+    tree.put("busy",         this->_busy);
+    tree.put("workers",      this->_workers.size());
+    tree.put("generated",    this->_generated);
+    tree.put("no_thumbnail", this->_no_thumbnail);
+    tree.put("skipped",      this->_skipped);
+    tree.put("failed",       this->_failed);
+    tree.put("compacted",    this->_compacted);
+    tree.put("generate_ms",  this->_generated > 0 ? this->_generate_ms / this->_generated : 0.0);
+    tree.put("index_bytes",  sizeof(ThumbnailHeader) + this->_records * sizeof(ThumbnailRecord));
+    tree.put("data_bytes",   this->_data_bytes);
+}
@@ -0,0 +1,159 @@
+//
+//  ThumbnailIndex.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__ThumbnailIndex__
+#define __CameraControllerApi__ThumbnailIndex__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/property_tree/ptree.hpp>
+
+#define CCA_THUMBS_MAGIC "CCATHMB1"
+#define CCA_THUMBS_DATA_MAGIC "CCATHMBD"
+#define CCA_THUMBS_VERSION 1
+
+#define CCA_THUMB_VALID 1
+#define CCA_THUMB_REMOVED 2
+// an image without a decodable JPEG, kept so it is not tried again
+#define CCA_THUMB_NONE 4
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::set;
+using std::map;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * The layout of the index file: the header and one record of 256 bytes
+     * per spool file. thumb_offset and thumb_size point into the data file
+     * with the thumbnail JPEGs, which starts with a ThumbnailDataHeader of
+     * the same generation. A record is only appended or has its flags
+     * changed, a file which is written again gets a new record and the old
+     * one is marked removed.
+     */
+    struct ThumbnailHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_bytes;
+        uint32_t generation;
+        uint32_t reserved[11];
+    };
+
+    struct ThumbnailDataHeader {
+        char magic[8];
+        uint32_t generation;
+        uint32_t reserved;
+    };
+
+    struct ThumbnailRecord {
+        char name[96];
+        uint64_t size;
+        int64_t mtime;
+        uint64_t thumb_offset;
+        uint32_t thumb_size;
+        uint16_t thumb_width;
+        uint16_t thumb_height;
+        uint32_t width;
+        uint32_t height;
+        double exposure;
+        double fnumber;
+        double focal_length;
+        char taken[20];
+        char make[24];
+        char model[32];
+        uint32_t iso;
+        uint16_t orientation;
+        uint16_t flags;
+        uint32_t reserved[3];
+    };
+
+    /*
+     * Thumbnails and EXIF basics of the images in the spool, for galleries.
+     * Worker threads (thumbs.workers) decode the JPEG of a file, or the one
+     * embedded in a RAW, with DCT scaling at up to 1/8 and write it again
+     * with thumbs.quality. Files are queued when the spool writes them and,
+     * at start, for every image the index does not know yet.
+     *
+     * The index file is mapped read only, a listing is one pass over the
+     * records and does not touch the images. Records of removed files are
+     * dropped, with their thumbnails, when the server starts and more than
+     * half of the records are dead.
+     */
+    class ThumbnailIndex {
+
+        static ThumbnailIndex *_instance;
+    public:
+        static ThumbnailIndex* getInstance();
+        static void release();
+        static void spooled(const string &name);
+        static void deleted(const string &name);
+
+        void submit(const string &name);
+        void remove(const string &name);
+        unsigned long list(ptree &files, unsigned long offset, unsigned long limit);
+        bool thumbnail(const string &name, string &jpeg);
+        void stats(ptree &tree);
+
+    private:
+        ThumbnailIndex();
+        ~ThumbnailIndex();
+
+        string _directory;
+        string _index_path;
+        string _data_path;
+        int _min_size;
+        int _quality;
+
+        int _index_fd;
+        int _data_fd;
+        uint32_t _generation;
+        char *_map;
+        size_t _mapped;
+        unsigned long _records;
+        uint64_t _data_bytes;
+        map<string, unsigned long> _names;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        bool _running;
+        vector<pthread_t> _workers;
+        deque<string> _queue;
+        set<string> _queued;
+        unsigned long _busy;
+
+        unsigned long _generated;
+        unsigned long _no_thumbnail;
+        unsigned long _skipped;
+        unsigned long _failed;
+        unsigned long _compacted;
+        double _generate_ms;
+
+        bool _open();
+        bool _load(unsigned long &dead);
+        bool _reset();
+        void _close();
+        bool _remap(size_t needed);
+        bool _compact();
+        void _scan();
+        ThumbnailRecord* _record(unsigned long index);
+        void _set_flags(unsigned long index, uint16_t flags);
+        bool _append(ThumbnailRecord &record, const string &jpeg);
+        void _generate(const string &name);
+        static void* _worker(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__ThumbnailIndex__) */
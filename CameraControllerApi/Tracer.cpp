@@ -0,0 +1,279 @@
+//
+//  Tracer.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "Tracer.h"
+#include "Settings.h"
+#include "ScopedLock.h"
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+using std::vector;
+using namespace CameraControllerApi;
+
+Tracer* Tracer::_instance = NULL;
+pthread_mutex_t Tracer::_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile bool Tracer::_enabled = false;
+
+static void json_escape(const char *in, string &out){
+    for(; *in != '\0'; in++){
+        unsigned char c = *in;
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        } else if(c < 0x20){
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+        } else {
+            out += c;
+        }
+    }
+}
+
+Tracer* Tracer::getInstance(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        _instance = new Tracer();
+
+    return _instance;
+}
+
+/*
+ * After the server has stopped, no span may be open any more.
+ */
+void Tracer::release(){
+    pthread_mutex_lock(&_instance_lock);
+    Tracer *tracer = _instance;
+    _instance = NULL;
+    _enabled = false;
+    pthread_mutex_unlock(&_instance_lock);
+
+    if(tracer != NULL)
+        delete tracer;
+}
+
+bool Tracer::enabled(){
+    return _enabled;
+}
+
+Tracer::Tracer(){
+    string enabled, events;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("trace.enabled", enabled);
+    sett->get_value("trace.buffer_events", events);
+    this->_buffer_events = strtoul(events.c_str(), NULL, 10) > 0 ? strtoul(events.c_str(), NULL, 10) : 4096;
+    this->_exited = 0;
+    this->_epoch_ns = Tracer::_now_ns();
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_key_create(&this->_key, Tracer::_thread_exit);
+    _enabled = enabled == "true";
+}
+
+Tracer::~Tracer(){
+    // no _thread_exit from here on
+    pthread_key_delete(this->_key);
+    for(list<Buffer *>::iterator it = this->_buffers.begin(); it != this->_buffers.end(); it++){
+        pthread_mutex_destroy(&(*it)->lock);
+        delete[] (*it)->events;
+        delete *it;
+    }
+    pthread_mutex_destroy(&this->_lock);
+}
+
+void Tracer::start(){
+    _enabled = true;
+}
+
+/*
+ * Spans still open record themselves when they end.
+ */
+void Tracer::stop(){
+    _enabled = false;
+}
+
+void Tracer::clear(){
+    ScopedLock lock(&this->_lock);
+    list<Buffer *>::iterator it = this->_buffers.begin();
+    while(it != this->_buffers.end()){
+        Buffer *buffer = *it;
+        if(buffer->exited){
+            pthread_mutex_destroy(&buffer->lock);
+            delete[] buffer->events;
+            delete buffer;
+            it = this->_buffers.erase(it);
+            continue;
+        }
+        pthread_mutex_lock(&buffer->lock);
+        buffer->written = 0;
+        pthread_mutex_unlock(&buffer->lock);
+        it++;
+    }
+    this->_exited = 0;
+}
+
+/*
+ * Complete events ("ph":"X") with the times in microseconds since the
+ * tracer started, one track per thread. A ring is copied under its lock
+ * and written out after, so its thread waits for a copy only.
+ */
+void Tracer::dump(string &json){
+    int pid = getpid();
+    char line[256];
+    bool first = true;
+    vector<Event> events;
+
+    json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    ScopedLock lock(&this->_lock);
+    for(list<Buffer *>::iterator it = this->_buffers.begin(); it != this->_buffers.end(); it++){
+        Buffer *buffer = *it;
+        pthread_mutex_lock(&buffer->lock);
+        const char *thread = buffer->thread;
+        unsigned long count = buffer->written < this->_buffer_events ? buffer->written : this->_buffer_events;
+        events.resize(count);
+        for(unsigned long i = 0; i < count; i++)
+            events[i] = buffer->events[(buffer->written - count + i) % this->_buffer_events];
+        pthread_mutex_unlock(&buffer->lock);
+
+        if(count == 0)
+            continue;
+        if(thread != NULL){
+            snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",", pid, (int)buffer->tid, thread);
+            json += line;
+            first = false;
+        }
+        for(unsigned long i = 0; i < count; i++){
+            const Event &event = events[i];
+            snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     first ? "" : ",", event.name, event.category, pid, (int)buffer->tid,
+                     event.start_ns / 1000.0, event.duration_ns / 1000.0);
+            json += line;
+            first = false;
+            if(event.arg[0] != '\0'){
+                json += ",\"args\":{\"arg\":\"";
+                json_escape(event.arg, json);
+                json += "\"}";
+            }
+            json += "}";
+        }
+    }
+    json += "]}";
+}
+
+void Tracer::stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    unsigned long spans = 0, overwritten = 0;
+    for(list<Buffer *>::iterator it = this->_buffers.begin(); it != this->_buffers.end(); it++){
+        pthread_mutex_lock(&(*it)->lock);
+        unsigned long written = (*it)->written;
+        pthread_mutex_unlock(&(*it)->lock);
+        spans += written < this->_buffer_events ? written : this->_buffer_events;
+        overwritten += written > this->_buffer_events ? written - this->_buffer_events : 0;
+    }
+    tree.put("enabled",       (bool)_enabled);
+    tree.put("threads",       (unsigned long)this->_buffers.size());
+    tree.put("buffer_events", this->_buffer_events);
+    tree.put("spans",         spans);
+    tree.put("overwritten",   overwritten);
+}
+
+/*
+ * The ring of the calling thread, made on its first span.
+ */
+Tracer::Buffer* Tracer::_buffer(){
+    Buffer *buffer = (Buffer *)pthread_getspecific(this->_key);
+    if(buffer != NULL)
+        return buffer;
+
+    buffer = new Buffer();
+    buffer->tracer = this;
+    pthread_mutex_init(&buffer->lock, NULL);
+    buffer->tid = (pid_t)syscall(SYS_gettid);
+    buffer->thread = NULL;
+    buffer->events = new Event[this->_buffer_events];
+    buffer->written = 0;
+    buffer->depth = 0;
+    buffer->exited = false;
+    pthread_setspecific(this->_key, buffer);
+
+    ScopedLock lock(&this->_lock);
+    this->_buffers.push_back(buffer);
+    return buffer;
+}
+
+void Tracer::_record(Buffer *buffer, const Event &event){
+    ScopedLock lock(&buffer->lock);
+    buffer->events[buffer->written % this->_buffer_events] = event;
+    buffer->written++;
+    if(buffer->depth == 0 && buffer->thread == NULL)
+        buffer->thread = event.category;
+}
+
+/*
+ * A WebSocket connection has its own reader thread, so threads come and go.
+ * The spans of an ended thread stay for the next dump, up to
+ * CCA_TRACE_EXITED_THREADS of them.
+ */
+void Tracer::_thread_exit(void *context){
+    Buffer *buffer = (Buffer *)context;
+    Tracer *tracer = buffer->tracer;
+    ScopedLock lock(&tracer->_lock);
+    buffer->exited = true;
+    tracer->_exited++;
+    list<Buffer *>::iterator it = tracer->_buffers.begin();
+    while(tracer->_exited > CCA_TRACE_EXITED_THREADS && it != tracer->_buffers.end()){
+        if(!(*it)->exited){
+            it++;
+            continue;
+        }
+        pthread_mutex_destroy(&(*it)->lock);
+        delete[] (*it)->events;
+        delete *it;
+        it = tracer->_buffers.erase(it);
+        tracer->_exited--;
+    }
+}
+
+uint64_t Tracer::_now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+TraceSpan::TraceSpan(const char *category, const char *name, const char *arg){
+    this->_buffer = NULL;
+    if(!Tracer::_enabled)
+        return;
+
+    // the constructor turns tracing on before getInstance() stores it
+    Tracer *tracer = Tracer::_instance;
+    if(tracer == NULL)
+        return;
+    this->_buffer = tracer->_buffer();
+    this->_buffer->depth++;
+    this->_event.category = category;
+    this->_event.name = name;
+    this->_event.arg[0] = '\0';
+    if(arg != NULL)
+        snprintf(this->_event.arg, sizeof(this->_event.arg), "%s", arg);
+    this->_event.start_ns = Tracer::_now_ns() - tracer->_epoch_ns;
+}
+
+TraceSpan::~TraceSpan(){
+    if(this->_buffer == NULL)
+        return;
+
+    Tracer *tracer = this->_buffer->tracer;
+    this->_event.duration_ns = Tracer::_now_ns() - tracer->_epoch_ns - this->_event.start_ns;
+    this->_buffer->depth--;
+    tracer->_record(this->_buffer, this->_event);
+}
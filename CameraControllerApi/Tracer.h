@@ -0,0 +1,117 @@
+//
+//  Tracer.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__Tracer__
+#define __CameraControllerApi__Tracer__
+
+#include <iostream>
+#include <string>
+#include <list>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <boost/property_tree/ptree.hpp>
+
+#define CCA_TRACE_ARG 48
+// an ended thread keeps its spans until this many more threads have ended
+#define CCA_TRACE_EXITED_THREADS 16
+
+using std::string;
+using std::list;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    /*
+     * Span tracing, for where a slow request spends its time. A TraceSpan
+     * records its category, name and duration when it goes out of scope,
+     * into a ring of the thread it runs on (trace.buffer_events per thread,
+     * the oldest spans are overwritten). A thread only takes the lock of its
+     * own ring, which dump() takes too. Spans nest by time: the request in
+     * url_handler, then Command::execute, the Api method and the gphoto2
+     * calls of the camera.
+     *
+     * dump() writes the Chrome trace event format, for chrome://tracing or
+     * Perfetto. While tracing is off (trace.enabled, /trace?action=start) a
+     * span costs the test of a flag.
+     */
+    class Tracer {
+
+        static Tracer *_instance;
+        static pthread_mutex_t _instance_lock;
+        static volatile bool _enabled;
+    public:
+        static Tracer* getInstance();
+        static void release();
+        static bool enabled();
+
+        void start();
+        void stop();
+        void clear();
+        void dump(string &json);
+        void stats(ptree &tree);
+
+    private:
+        friend class TraceSpan;
+
+        struct Event {
+            const char *category;
+            const char *name;
+            char arg[CCA_TRACE_ARG];
+            uint64_t start_ns;
+            uint64_t duration_ns;
+        };
+
+        struct Buffer {
+            Tracer *tracer;
+            pthread_mutex_t lock;
+            pid_t tid;
+            // the category of the first outermost span, e.g. "http" or "job"
+            const char *thread;
+            Event *events;
+            unsigned long written;
+            // only touched by the thread itself
+            int depth;
+            bool exited;
+        };
+
+        Tracer();
+        ~Tracer();
+
+        pthread_key_t _key;
+        pthread_mutex_t _lock;
+        list<Buffer *> _buffers;
+        unsigned long _buffer_events;
+        unsigned int _exited;
+        uint64_t _epoch_ns;
+
+        Buffer* _buffer();
+        void _record(Buffer *buffer, const Event &event);
+        static void _thread_exit(void *context);
+        static uint64_t _now_ns();
+    };
+
+    /*
+     * One span, from the constructor to the destructor. category and name
+     * have to be literals, they are kept as pointers; arg (a url, a file
+     * name) is copied and cut at CCA_TRACE_ARG - 1 bytes.
+     */
+    class TraceSpan {
+    public:
+        TraceSpan(const char *category, const char *name, const char *arg = NULL);
+        ~TraceSpan();
+
+    private:
+        Tracer::Buffer *_buffer;
+        Tracer::Event _event;
+
+        TraceSpan(const TraceSpan &);
+        TraceSpan& operator=(const TraceSpan &);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__Tracer__) */
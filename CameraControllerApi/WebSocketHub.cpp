@@ -0,0 +1,844 @@
+//
+//  WebSocketHub.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "WebSocketHub.h"
+#include <sstream>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <boost/property_tree/json_parser.hpp>
+#include "Command.h"
+#include "DownloadStream.h"
+#include "Settings.h"
+#include "Logger.h"
+#include "ScopedLock.h"
+#include "Stopwatch.h"
+#include "Base64.h"
+#include "Tracer.h"
+
+using std::map;
+using namespace CameraControllerApi;
+
+#define CCA_WS_CLOSE_UNSUPPORTED 1003
+#define CCA_WS_CLOSE_TRY_AGAIN 1013
+#define CCA_WS_READ_BYTES 65536
+
+static uint32_t sha1_rotate(uint32_t value, int bits){
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// only for the handshake, the key is 24 characters
+static void sha1(const string &input, unsigned char digest[20]){
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    string data = input;
+    uint64_t bits = (uint64_t)input.size() * 8;
+    data += (char)0x80;
+    while(data.size() % 64 != 56)
+        data += (char)0;
+    for(int i = 7; i >= 0; i--)
+        data += (char)((bits >> (i * 8)) & 0xff);
+
+    for(size_t chunk = 0; chunk < data.size(); chunk += 64){
+        const unsigned char *p = (const unsigned char *)data.data() + chunk;
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++)
+            w[i] = (p[i * 4] << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+        for(int i = 16; i < 80; i++)
+            w[i] = sha1_rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++){
+            uint32_t f, k;
+            if(i < 20){
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if(i < 40){
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(i < 60){
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = sha1_rotate(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = sha1_rotate(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for(int i = 0; i < 5; i++){
+        digest[i * 4]     = (h[i] >> 24) & 0xff;
+        digest[i * 4 + 1] = (h[i] >> 16) & 0xff;
+        digest[i * 4 + 2] = (h[i] >> 8) & 0xff;
+        digest[i * 4 + 3] = h[i] & 0xff;
+    }
+}
+
+static void put_be(string &out, uint64_t value, int bytes){
+    for(int i = bytes - 1; i >= 0; i--)
+        out += (char)((value >> (i * 8)) & 0xff);
+}
+
+/*
+ * Appends the header of an unmasked, unfragmented server message. The
+ * payload is appended by the caller, so it is copied only once.
+ */
+static void ws_header(string &out, int opcode, uint64_t size){
+    out += (char)(0x80 | opcode);
+    if(size < 126){
+        out += (char)size;
+    } else if(size <= 0xffff){
+        out += (char)126;
+        put_be(out, size, 2);
+    } else {
+        out += (char)127;
+        put_be(out, size, 8);
+    }
+}
+
+static void ws_message(string &out, int opcode, const string &payload){
+    ws_header(out, opcode, payload.size());
+    out += payload;
+}
+
+static void json_escape(const string &in, string &out){
+    for(size_t i = 0; i < in.size(); i++){
+        unsigned char c = in[i];
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        } else if(c < 0x20){
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+        } else {
+            out += c;
+        }
+    }
+}
+
+static bool send_all(MHD_socket sock, const char *data, size_t size){
+    while(size > 0){
+        ssize_t sent = send(sock, data, size, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+WebSocketHub* WebSocketHub::_instance = NULL;
+pthread_mutex_t WebSocketHub::_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+WebSocketHub* WebSocketHub::getInstance(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        _instance = new WebSocketHub();
+
+    return _instance;
+}
+
+/*
+ * Closes every connection with 1001 and waits until their running commands
+ * are answered. Has to happen before the MHD daemon stops, it owns the
+ * sockets.
+ */
+void WebSocketHub::release(){
+    pthread_mutex_lock(&_instance_lock);
+    WebSocketHub *hub = _instance;
+    _instance = NULL;
+    pthread_mutex_unlock(&_instance_lock);
+
+    if(hub != NULL)
+        delete hub;
+}
+
+string WebSocketHub::accept_key(const string &key){
+    unsigned char digest[20];
+    char encoded[64];
+    sha1(key + CCA_WS_GUID, digest);
+    int size = base64_encode(encoded, (char *)digest, sizeof(digest));
+    return string(encoded, size);
+}
+
+/*
+ * Called by MHD once the 101 response is sent. Takes the socket over, or
+ * closes it if the server is shutting down.
+ */
+bool WebSocketHub::open(Command *cmd, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh, const char *extra, size_t extra_size){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL){
+        MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+        return false;
+    }
+    return _instance->_open(cmd, sock, urh, extra, extra_size);
+}
+
+void WebSocketHub::changed(const char *name, const char *value){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        return;
+
+    ptree event;
+    event.put("event", "setting");
+    event.put("name", name);
+    event.put("value", value);
+    _instance->_publish(event);
+}
+
+void WebSocketHub::camera(bool connected){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        return;
+
+    ptree event;
+    event.put("event", "camera");
+    event.put("connected", connected);
+    _instance->_publish(event);
+}
+
+void WebSocketHub::frame(const PreviewFrame *frame){
+    ScopedLock lock(&_instance_lock);
+    if(_instance != NULL)
+        _instance->_frame(frame);
+}
+
+/*
+ * Whether a connection has subscribed to the liveview, which then runs
+ * without a TCP client.
+ */
+bool WebSocketHub::watching(){
+    ScopedLock lock(&_instance_lock);
+    if(_instance == NULL)
+        return false;
+
+    ScopedLock hub_lock(&_instance->_lock);
+    return _instance->_watchers > 0;
+}
+
+WebSocketHub::WebSocketHub(){
+    string max_sessions, max_message, max_events;
+    Settings *sett = Settings::getInstance();
+    sett->get_value("websocket.max_sessions", max_sessions);
+    sett->get_value("websocket.max_message_bytes", max_message);
+    sett->get_value("websocket.max_events", max_events);
+    this->_max_sessions = atoi(max_sessions.c_str()) > 0 ? atoi(max_sessions.c_str()) : 8;
+    this->_max_message_bytes = strtoul(max_message.c_str(), NULL, 10) > 0 ? strtoul(max_message.c_str(), NULL, 10) : 1048576;
+    this->_max_events = atoi(max_events.c_str()) > 0 ? atoi(max_events.c_str()) : 256;
+
+    pthread_mutex_init(&this->_lock, NULL);
+    pthread_cond_init(&this->_cond, NULL);
+    this->_closing = false;
+    this->_watchers = 0;
+    this->_event_sequence = 0;
+
+    this->_opened = 0;
+    this->_refused = 0;
+    this->_commands = 0;
+    this->_command_ms = 0;
+    this->_max_command_ms = 0;
+    this->_events = 0;
+    this->_events_dropped = 0;
+    this->_frames = 0;
+    this->_frames_dropped = 0;
+    this->_bytes_out = 0;
+    this->_protocol_errors = 0;
+}
+
+WebSocketHub::~WebSocketHub(){
+    pthread_mutex_lock(&this->_lock);
+    this->_closing = true;
+    for(list<Session *>::iterator it = this->_sessions.begin(); it != this->_sessions.end(); it++)
+        this->_close(*it, CCA_WS_CLOSE_GOING_AWAY);
+    while(!this->_sessions.empty())
+        pthread_cond_wait(&this->_cond, &this->_lock);
+    pthread_mutex_unlock(&this->_lock);
+
+    pthread_cond_destroy(&this->_cond);
+    pthread_mutex_destroy(&this->_lock);
+}
+
+/*
+ * Zeros while the hub is off (websocket.enabled) or already released, so
+ * /health does not bring it back.
+ */
+void WebSocketHub::stats(ptree &tree){
+    ScopedLock lock(&_instance_lock);
+    if(_instance != NULL){
+        _instance->_stats(tree);
+        return;
+    }
+
+    const char *counters[] = {"sessions", "watchers", "opened", "refused", "commands", "command_ms", "max_command_ms",
+                              "events", "events_dropped", "frames", "frames_dropped", "bytes_out", "protocol_errors"};
+    for(size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+        tree.put(counters[i], 0);
+}
+
+void WebSocketHub::_stats(ptree &tree){
+    ScopedLock lock(&this->_lock);
+    tree.put("sessions",        (unsigned long)this->_sessions.size());
+    tree.put("watchers",        this->_watchers);
+    tree.put("opened",          this->_opened);
+    tree.put("refused",         this->_refused);
+    tree.put("commands",        this->_commands);
+    tree.put("command_ms",      this->_commands > 0 ? this->_command_ms / this->_commands : 0.0);
+    tree.put("max_command_ms",  this->_max_command_ms);
+    tree.put("events",          this->_events);
+    tree.put("events_dropped",  this->_events_dropped);
+    tree.put("frames",          this->_frames);
+    tree.put("frames_dropped",  this->_frames_dropped);
+    tree.put("bytes_out",       this->_bytes_out);
+    tree.put("protocol_errors", this->_protocol_errors);
+}
+
+bool WebSocketHub::_open(Command *cmd, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh, const char *extra, size_t extra_size){
+    pthread_mutex_lock(&this->_lock);
+    if(this->_closing || this->_sessions.size() >= this->_max_sessions){
+        this->_refused++;
+        unsigned long sessions = this->_sessions.size();
+        pthread_mutex_unlock(&this->_lock);
+        string refusal, code;
+        put_be(code, this->_closing ? CCA_WS_CLOSE_GOING_AWAY : CCA_WS_CLOSE_TRY_AGAIN, 2);
+        ws_message(refusal, CCA_WS_CLOSE, code);
+        send_all(sock, refusal.data(), refusal.size());
+        MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+        Logger::getInstance()->log(CCA_LOG_WARN, "websocket", "op=refuse sessions=%lu", sessions);
+        return false;
+    }
+
+    // MHD hands the socket over non blocking, every session has its own threads
+    int flags = fcntl(sock, F_GETFL);
+    if(flags >= 0)
+        fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    Session *session = new Session();
+    session->hub = this;
+    session->cmd = cmd;
+    session->sock = sock;
+    session->urh = urh;
+    session->input.assign(extra != NULL ? extra : "", extra != NULL ? extra_size : 0);
+    session->message_opcode = -1;
+    session->closing = false;
+    session->liveview = false;
+    session->events = false;
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+
+    bool started = false;
+    if(pthread_create(&session->writer, NULL, WebSocketHub::_writer, session) == 0){
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t reader;
+        this->_sessions.push_back(session);
+        started = pthread_create(&reader, &attr, WebSocketHub::_reader, session) == 0;
+        pthread_attr_destroy(&attr);
+        if(!started){
+            this->_sessions.pop_back();
+            pthread_mutex_lock(&session->lock);
+            session->closing = true;
+            pthread_cond_signal(&session->cond);
+            pthread_mutex_unlock(&session->lock);
+            pthread_join(session->writer, NULL);
+        }
+    }
+    if(started)
+        this->_opened++;
+    unsigned long sessions = this->_sessions.size();
+    pthread_mutex_unlock(&this->_lock);
+
+    if(!started){
+        pthread_cond_destroy(&session->cond);
+        pthread_mutex_destroy(&session->lock);
+        delete session;
+        MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+        Logger::getInstance()->log(CCA_LOG_ERROR, "websocket", "op=open error=thread");
+        return false;
+    }
+    Logger::getInstance()->log(CCA_LOG_INFO, "websocket", "op=open sessions=%lu", sessions);
+    return true;
+}
+
+/*
+ * Numbers the event and hands the same encoded message to every
+ * connection which subscribed to events. A connection which is more than
+ * websocket.max_events behind loses the oldest; the numbers show the gap.
+ */
+void WebSocketHub::_publish(ptree &event){
+    ScopedLock lock(&this->_lock);
+    event.put("seq", ++this->_event_sequence);
+    std::stringstream ss;
+    boost::property_tree::write_json(ss, event, false);
+    string json = ss.str();
+    if(!json.empty() && json[json.size() - 1] == '\n')
+        json.erase(json.size() - 1);
+
+    boost::shared_ptr<string> message(new string());
+    ws_message(*message, CCA_WS_TEXT, json);
+
+    for(list<Session *>::iterator it = this->_sessions.begin(); it != this->_sessions.end(); it++){
+        Session *session = *it;
+        pthread_mutex_lock(&session->lock);
+        if(session->events && !session->closing){
+            if(session->pending_events.size() >= this->_max_events){
+                session->pending_events.pop_front();
+                this->_events_dropped++;
+            }
+            session->pending_events.push_back(message);
+            this->_events++;
+            pthread_cond_signal(&session->cond);
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+}
+
+/*
+ * Encodes the frame once (tag, sequence and capture time in microseconds,
+ * both 8 bytes big endian, then the JPEG) and replaces whatever frame a
+ * connection has not sent yet.
+ */
+void WebSocketHub::_frame(const PreviewFrame *frame){
+    pthread_mutex_lock(&this->_lock);
+    bool wanted = this->_watchers > 0;
+    pthread_mutex_unlock(&this->_lock);
+    if(!wanted)
+        return;
+
+    boost::shared_ptr<string> message(new string());
+    message->reserve(frame->size + 40);
+    ws_header(*message, CCA_WS_BINARY, frame->size + 20);
+    message->append(CCA_WS_TAG_FRAME, 4);
+    put_be(*message, frame->sequence, 8);
+    put_be(*message, frame->captured.tv_sec * (int64_t)1000000 + frame->captured.tv_usec, 8);
+    message->append(frame->data, frame->size);
+
+    ScopedLock lock(&this->_lock);
+    for(list<Session *>::iterator it = this->_sessions.begin(); it != this->_sessions.end(); it++){
+        Session *session = *it;
+        pthread_mutex_lock(&session->lock);
+        if(session->liveview && !session->closing){
+            if(session->pending_frame)
+                this->_frames_dropped++;
+            session->pending_frame = message;
+            pthread_cond_signal(&session->cond);
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+}
+
+/*
+ * Reads until a whole message or a control frame is there. Fragmented
+ * messages are put together, control frames may come between their
+ * fragments. Returns false at the end of the stream or on a protocol
+ * error, which has already been answered with a close frame.
+ */
+bool WebSocketHub::_next_message(Session *session, int &opcode, string &payload){
+    while(true){
+        const unsigned char *p = (const unsigned char *)session->input.data();
+        size_t available = session->input.size();
+        size_t header = 2;
+        uint64_t size = 0;
+        int code = 0;
+
+        if(available >= 2){
+            int frame_opcode = p[0] & 0x0f;
+            bool fin = (p[0] & 0x80) != 0;
+            bool control = (frame_opcode & 0x08) != 0;
+            size = p[1] & 0x7f;
+            if(size == 126)
+                header += 2;
+            else if(size == 127)
+                header += 8;
+            header += 4;
+
+            // clients have to mask, extensions are not negotiated
+            if((p[0] & 0x70) != 0 || (p[1] & 0x80) == 0 || (control && (!fin || size > 125)))
+                code = CCA_WS_CLOSE_PROTOCOL;
+
+            if(code == 0 && available >= header){
+                if(size == 126){
+                    size = (p[2] << 8) | p[3];
+                } else if(size == 127){
+                    size = 0;
+                    for(int i = 0; i < 8; i++)
+                        size = (size << 8) | p[2 + i];
+                    // RFC 6455 5.2, the most significant bit is 0
+                    if(size >> 63)
+                        code = CCA_WS_CLOSE_PROTOCOL;
+                }
+                // message never holds more than the limit, so this can not wrap
+                if(code == 0 && !control && size > this->_max_message_bytes - session->message.size())
+                    code = CCA_WS_CLOSE_TOO_BIG;
+            }
+
+            if(code == 0 && available >= header && available - header >= size){
+                const unsigned char *mask = p + header - 4;
+                string data(session->input, header, (size_t)size);
+                for(size_t i = 0; i < data.size(); i++)
+                    data[i] ^= mask[i & 3];
+                session->input.erase(0, header + (size_t)size);
+
+                if(control){
+                    opcode = frame_opcode;
+                    payload.swap(data);
+                    return true;
+                }
+
+                if(frame_opcode == CCA_WS_CONTINUATION){
+                    if(session->message_opcode < 0)
+                        code = CCA_WS_CLOSE_PROTOCOL;
+                    else
+                        session->message += data;
+                } else if(session->message_opcode >= 0){
+                    code = CCA_WS_CLOSE_PROTOCOL;
+                } else {
+                    session->message_opcode = frame_opcode;
+                    session->message.swap(data);
+                }
+
+                if(code == 0 && fin){
+                    opcode = session->message_opcode;
+                    payload.clear();
+                    payload.swap(session->message);
+                    session->message_opcode = -1;
+                    return true;
+                }
+                if(code == 0)
+                    continue;
+            }
+        }
+
+        if(code != 0){
+            pthread_mutex_lock(&this->_lock);
+            this->_protocol_errors++;
+            pthread_mutex_unlock(&this->_lock);
+            Logger::getInstance()->log(CCA_LOG_WARN, "websocket", "op=protocol_error code=%d", code);
+            this->_close(session, code);
+            return false;
+        }
+
+        char buffer[CCA_WS_READ_BYTES];
+        ssize_t received = recv(session->sock, buffer, sizeof(buffer), 0);
+        if(received < 0 && errno == EINTR)
+            continue;
+        if(received <= 0)
+            return false;
+        session->input.append(buffer, received);
+    }
+}
+
+/*
+ * One text message from the client:
+ *   {"id":"7","url":"/settings","params":{"action":"iso","value":"200"}}
+ *   {"id":"8","url":"/script","body":{"steps":[{"op":"capture"}]}}
+ *   {"id":"9","subscribe":"liveview"}, {"id":"10","unsubscribe":"events"}
+ * Returns false if the message is not JSON.
+ */
+bool WebSocketHub::_handle(Session *session, const string &text){
+    ptree message;
+    std::istringstream ss(text);
+    try {
+        boost::property_tree::read_json(ss, message);
+    } catch(std::exception &e){
+        this->_queue(session, "{\"id\":\"\",\"status\":400,\"error\":\"no json\"}");
+        return false;
+    }
+
+    string id = message.get<string>("id", "");
+    string escaped;
+    json_escape(id, escaped);
+
+    boost::optional<string> topic = message.get_optional<string>("subscribe");
+    bool on = true;
+    if(!topic){
+        topic = message.get_optional<string>("unsubscribe");
+        on = false;
+    }
+    if(topic){
+        this->_subscribe(session, *topic, on);
+        if(*topic == "liveview" || *topic == "events")
+            this->_queue(session, "{\"id\":\"" + escaped + "\",\"status\":200}");
+        else
+            this->_queue(session, "{\"id\":\"" + escaped + "\",\"status\":404,\"error\":\"unknown topic\"}");
+        return true;
+    }
+
+    string url = message.get<string>("url", "");
+    if(url.empty()){
+        this->_queue(session, "{\"id\":\"" + escaped + "\",\"status\":400,\"error\":\"no url\"}");
+        return true;
+    }
+
+    // the body of a POST, as JSON or as a string
+    string body;
+    boost::optional<ptree &> content = message.get_child_optional("body");
+    if(content && content->empty()){
+        body = content->data();
+    } else if(content){
+        std::stringstream json;
+        boost::property_tree::write_json(json, *content, false);
+        body = json.str();
+    }
+    
+    boost::optional<ptree &> params = message.get_child_optional("params");
+    this->_run(session, escaped, url, params ? *params : ptree(), body);
+    return true;
+}
+
+/*
+ * Runs a command like the HTTP handler would and queues the answer. JSON
+ * bodies are sent inside the answer, anything else (images, downloads,
+ * msgpack) as a binary message right after it.
+ */
+void WebSocketHub::_run(Session *session, const string &id, const string &url, const ptree &params, const string &body){
+    TraceSpan span("ws", "command", url.c_str());
+    Stopwatch watch;
+    map<string, string> args;
+    for(ptree::const_iterator it = params.begin(); it != params.end(); it++)
+        args[it->first] = it->second.data();
+
+    HttpExchange exchange;
+    exchange.request_body = body;
+    string output;
+    session->cmd->execute(url, args, exchange, output);
+    unsigned int status = exchange.status != 0 ? exchange.status : 200;
+
+    if(exchange.stream != NULL){
+        // the download arrives in blocks, the client gets it in one message
+        char block[CCA_WS_READ_BYTES];
+        while(true){
+            ssize_t got = DownloadStream::read_callback(exchange.stream, output.size(), block, sizeof(block));
+            if(got == MHD_CONTENT_READER_END_OF_STREAM)
+                break;
+            if(got < 0){
+                status = 502;
+                output.clear();
+                break;
+            }
+            output.append(block, got);
+        }
+        DownloadStream::free_callback(exchange.stream);
+    }
+    double ms = watch.elapsed_ms();
+
+    map<string, string>::iterator type = exchange.response_headers.find("Content-Type");
+    bool json = type == exchange.response_headers.end() || type->second == "application/json";
+    char head[128];
+    snprintf(head, sizeof(head), "\",\"status\":%u,\"ms\":%.3f", status, ms);
+
+    string answer, data;
+    if(json){
+        ws_message(answer, CCA_WS_TEXT, "{\"id\":\"" + id + head + ",\"response\":" + output + "}");
+    } else {
+        string content_type;
+        json_escape(type->second, content_type);
+        snprintf(head + strlen(head), sizeof(head) - strlen(head), ",\"bytes\":%lu", (unsigned long)output.size());
+        ws_message(answer, CCA_WS_TEXT, "{\"id\":\"" + id + head + ",\"content_type\":\"" + content_type + "\"}");
+        ws_header(answer, CCA_WS_BINARY, output.size() + 4);
+        answer.append(CCA_WS_TAG_RESPONSE, 4);
+        answer += output;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    if(!session->closing){
+        session->outgoing.push_back(string());
+        session->outgoing.back().swap(answer);
+        pthread_cond_signal(&session->cond);
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    pthread_mutex_lock(&this->_lock);
+    this->_commands++;
+    this->_command_ms += ms;
+    if(ms > this->_max_command_ms)
+        this->_max_command_ms = ms;
+    pthread_mutex_unlock(&this->_lock);
+
+    Logger *logger = Logger::getInstance();
+    if(logger->enabled(CCA_LOG_DEBUG)){
+        map<string, string>::iterator action = args.find("action");
+        logger->log(CCA_LOG_DEBUG, "websocket", "url=%s action=%s status=%u bytes=%lu ms=%.3f", url.c_str(),
+                    action != args.end() ? action->second.c_str() : "-", status, (unsigned long)output.size(), ms);
+    }
+}
+
+void WebSocketHub::_subscribe(Session *session, const string &topic, bool on){
+    ScopedLock lock(&this->_lock);
+    ScopedLock session_lock(&session->lock);
+    if(topic == "liveview"){
+        if(session->liveview != on)
+            this->_watchers += on ? 1 : -1;
+        session->liveview = on;
+        if(!on)
+            session->pending_frame.reset();
+    } else if(topic == "events"){
+        session->events = on;
+        if(!on)
+            session->pending_events.clear();
+    }
+}
+
+void WebSocketHub::_queue(Session *session, const string &data){
+    ScopedLock lock(&session->lock);
+    if(session->closing)
+        return;
+    session->outgoing.push_back(string());
+    ws_message(session->outgoing.back(), CCA_WS_TEXT, data);
+    pthread_cond_signal(&session->cond);
+}
+
+/*
+ * Queues a close frame after the answers already queued and lets the
+ * writer end once they are sent. Events and frames not sent are dropped,
+ * so are answers to commands still running. The reader sees the end of the
+ * stream once it is back from its command. Done under the session lock: the
+ * socket is open until the reader has set closing itself.
+ */
+void WebSocketHub::_close(Session *session, int code){
+    ScopedLock lock(&session->lock);
+    if(session->closing)
+        return;
+
+    string payload;
+    put_be(payload, code, 2);
+    session->outgoing.push_back(string());
+    ws_message(session->outgoing.back(), CCA_WS_CLOSE, payload);
+    session->closing = true;
+    shutdown(session->sock, SHUT_RD);
+    pthread_cond_signal(&session->cond);
+}
+
+void WebSocketHub::_read(Session *session){
+    int opcode;
+    string payload;
+    while(this->_next_message(session, opcode, payload)){
+        if(opcode == CCA_WS_TEXT){
+            this->_handle(session, payload);
+        } else if(opcode == CCA_WS_PING){
+            string pong;
+            ws_message(pong, CCA_WS_PONG, payload);
+            ScopedLock lock(&session->lock);
+            if(!session->closing){
+                session->outgoing.push_back(pong);
+                pthread_cond_signal(&session->cond);
+            }
+        } else if(opcode == CCA_WS_CLOSE){
+            int code = payload.size() >= 2 ? ((unsigned char)payload[0] << 8) | (unsigned char)payload[1] : CCA_WS_CLOSE_NORMAL;
+            this->_close(session, code);
+            break;
+        } else if(opcode == CCA_WS_BINARY){
+            this->_close(session, CCA_WS_CLOSE_UNSUPPORTED);
+            break;
+        }
+    }
+}
+
+void WebSocketHub::_write(Session *session){
+    while(true){
+        string data;
+        boost::shared_ptr<const string> shared;
+        bool frame = false;
+
+        pthread_mutex_lock(&session->lock);
+        while(!session->closing && session->outgoing.empty() && session->pending_events.empty() && !session->pending_frame)
+            pthread_cond_wait(&session->cond, &session->lock);
+
+        if(!session->outgoing.empty()){
+            data.swap(session->outgoing.front());
+            session->outgoing.pop_front();
+        } else if(session->closing){
+            pthread_mutex_unlock(&session->lock);
+            break;
+        } else if(!session->pending_events.empty()){
+            shared = session->pending_events.front();
+            session->pending_events.pop_front();
+        } else {
+            shared.swap(session->pending_frame);
+            frame = true;
+        }
+        pthread_mutex_unlock(&session->lock);
+
+        const string &message = shared ? *shared : data;
+        if(!send_all(session->sock, message.data(), message.size())){
+            pthread_mutex_lock(&session->lock);
+            session->closing = true;
+            pthread_mutex_unlock(&session->lock);
+            // wakes the reader, the client is gone
+            shutdown(session->sock, SHUT_RDWR);
+            break;
+        }
+
+        pthread_mutex_lock(&this->_lock);
+        this->_bytes_out += message.size();
+        if(frame)
+            this->_frames++;
+        pthread_mutex_unlock(&this->_lock);
+    }
+}
+
+/*
+ * The reader is done: waits for the writer, gives the socket back to MHD
+ * and leaves the hub. The hub may be gone right after the unlock.
+ */
+void WebSocketHub::_finish(Session *session){
+    pthread_mutex_lock(&session->lock);
+    session->closing = true;
+    pthread_cond_signal(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    pthread_join(session->writer, NULL);
+
+    MHD_upgrade_action(session->urh, MHD_UPGRADE_ACTION_CLOSE);
+
+    pthread_mutex_lock(&this->_lock);
+    this->_sessions.remove(session);
+    if(session->liveview)
+        this->_watchers--;
+    unsigned long sessions = this->_sessions.size();
+    Logger::getInstance()->log(CCA_LOG_INFO, "websocket", "op=close sessions=%lu", sessions);
+    pthread_cond_broadcast(&this->_cond);
+    pthread_mutex_unlock(&this->_lock);
+
+    pthread_cond_destroy(&session->cond);
+    pthread_mutex_destroy(&session->lock);
+    delete session;
+}
+
+void* WebSocketHub::_reader(void *context){
+    Session *session = (Session *)context;
+    session->hub->_read(session);
+    session->hub->_finish(session);
+    return NULL;
+}
+
+void* WebSocketHub::_writer(void *context){
+    Session *session = (Session *)context;
+    session->hub->_write(session);
+    return NULL;
+}
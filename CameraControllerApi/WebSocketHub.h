@@ -0,0 +1,144 @@
+//
+//  WebSocketHub.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__WebSocketHub__
+#define __CameraControllerApi__WebSocketHub__
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <list>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "microhttpd.h"
+#include "PreviewPool.h"
+
+#define CCA_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define CCA_WS_CONTINUATION 0x0
+#define CCA_WS_TEXT 0x1
+#define CCA_WS_BINARY 0x2
+#define CCA_WS_CLOSE 0x8
+#define CCA_WS_PING 0x9
+#define CCA_WS_PONG 0xA
+
+#define CCA_WS_CLOSE_NORMAL 1000
+#define CCA_WS_CLOSE_GOING_AWAY 1001
+#define CCA_WS_CLOSE_PROTOCOL 1002
+#define CCA_WS_CLOSE_TOO_BIG 1009
+
+// the first bytes of a binary message: a liveview frame or a response body
+#define CCA_WS_TAG_FRAME "CCAF"
+#define CCA_WS_TAG_RESPONSE "CCAR"
+
+using std::string;
+using std::deque;
+using std::list;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    class Command;
+
+    /*
+     * The WebSocket endpoint /ws (websocket.enabled). A client sends its
+     * commands as text messages with an id, the url and the parameters of
+     * the GET request and may send the next one before the answer to the
+     * last. The answers come back in order, tagged with the id. On the same
+     * connection the client can subscribe to setting and camera events and
+     * to the liveview frames, which come as binary messages.
+     *
+     * Every connection has a reader thread, which parses the messages and
+     * runs the commands, and a writer thread. The writer sends answers
+     * first, then events, then the latest liveview frame; a client which
+     * reads too slowly misses frames (and beyond websocket.max_events,
+     * events), never answers. The liveview loop encodes a frame once for all
+     * connections and does not wait for any of them.
+     */
+    class WebSocketHub {
+
+        static WebSocketHub *_instance;
+        static pthread_mutex_t _instance_lock;
+    public:
+        static WebSocketHub* getInstance();
+        static void release();
+        static string accept_key(const string &key);
+        static bool open(Command *cmd, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh, const char *extra, size_t extra_size);
+        static void changed(const char *name, const char *value);
+        static void camera(bool connected);
+        static void frame(const PreviewFrame *frame);
+        static bool watching();
+        static void stats(ptree &tree);
+
+    private:
+        WebSocketHub();
+        ~WebSocketHub();
+
+        struct Session {
+            WebSocketHub *hub;
+            Command *cmd;
+            MHD_socket sock;
+            struct MHD_UpgradeResponseHandle *urh;
+            string input;
+            string message;
+            int message_opcode;
+
+            pthread_mutex_t lock;
+            pthread_cond_t cond;
+            pthread_t writer;
+            bool closing;
+            bool liveview;
+            bool events;
+            deque<string> outgoing;
+            deque<boost::shared_ptr<const string> > pending_events;
+            boost::shared_ptr<const string> pending_frame;
+        };
+
+        unsigned int _max_sessions;
+        unsigned long _max_message_bytes;
+        unsigned int _max_events;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _cond;
+        bool _closing;
+        list<Session *> _sessions;
+        unsigned int _watchers;
+        unsigned long _event_sequence;
+
+        unsigned long _opened;
+        unsigned long _refused;
+        unsigned long _commands;
+        double _command_ms;
+        double _max_command_ms;
+        unsigned long _events;
+        unsigned long _events_dropped;
+        unsigned long _frames;
+        unsigned long _frames_dropped;
+        unsigned long long _bytes_out;
+        unsigned long _protocol_errors;
+
+        void _stats(ptree &tree);
+        bool _open(Command *cmd, MHD_socket sock, struct MHD_UpgradeResponseHandle *urh, const char *extra, size_t extra_size);
+        void _publish(ptree &event);
+        void _frame(const PreviewFrame *frame);
+        bool _next_message(Session *session, int &opcode, string &payload);
+        bool _handle(Session *session, const string &text);
+        void _run(Session *session, const string &id, const string &url, const ptree &params, const string &body);
+        void _subscribe(Session *session, const string &topic, bool on);
+        void _queue(Session *session, const string &data);
+        void _close(Session *session, int code);
+        void _read(Session *session);
+        void _write(Session *session);
+        void _finish(Session *session);
+        static void* _reader(void *context);
+        static void* _writer(void *context);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__WebSocketHub__) */
@@ -0,0 +1,199 @@
+//
+//  WidgetIndex.cpp
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#include "WidgetIndex.h"
+#include "Tracer.h"
+#include <stdlib.h>
+#include <boost/lexical_cast.hpp>
+
+using namespace CameraControllerApi;
+
+struct widget_alias {
+    const char *logical;
+    const char *names[4];
+};
+
+// first match wins, so the preferred widget of a vendor goes first
+static const widget_alias aliases[] = {
+    {"iso",             {"iso", "isospeed", NULL, NULL}},
+    {"aperture",        {"aperture", "f-number", "fnumber", NULL}},
+    {"speed",           {"shutterspeed", "shutterspeed2", "exposuretime", NULL}},
+    {"whitebalance",    {"whitebalance", NULL, NULL, NULL}},
+    {"focus_point",     {"d108", "focusarea", NULL, NULL}},
+    {"focus_mode",      {"focusmode", "focusmode2", NULL, NULL}},
+    {"manualfocus",     {"manualfocusdrive", NULL, NULL, NULL}},
+    {"autofocus",       {"autofocusdrive", NULL, NULL, NULL}},
+    {"remoterelease",   {"eosremoterelease", NULL, NULL, NULL}},
+    {"bulb",            {"bulb", NULL, NULL, NULL}}
+};
+
+bool WidgetEntry::accepts(const string &val) const {
+    switch (this->type) {
+        case GP_WIDGET_RADIO:
+        case GP_WIDGET_MENU:
+            return this->choice_index.find(val) != this->choice_index.end();
+        case GP_WIDGET_TOGGLE:
+            return val == "0" || val == "1";
+        case GP_WIDGET_RANGE: {
+            char *end = NULL;
+            double v = strtod(val.c_str(), &end);
+            return end != val.c_str() && *end == '\0' && v >= this->min && v <= this->max;
+        }
+        case GP_WIDGET_TEXT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Type, value, range and choices of the widget into entry, the choices
+ * replace what the entry had.
+ */
+static void read_widget(CameraWidget *w, WidgetEntry &entry){
+    entry.min = entry.max = entry.step = 0;
+    entry.choices.clear();
+    entry.choice_index.clear();
+    gp_widget_get_type(w, &entry.type);
+    
+    switch (entry.type) {
+        case GP_WIDGET_TEXT:
+        case GP_WIDGET_RADIO:
+        case GP_WIDGET_MENU: {
+            const char *value = NULL;
+            gp_widget_get_value(w, &value);
+            entry.value = value != NULL ? value : "";
+            break;
+        }
+        case GP_WIDGET_TOGGLE: {
+            int value = 0;
+            gp_widget_get_value(w, &value);
+            entry.value = boost::lexical_cast<string>(value);
+            break;
+        }
+        case GP_WIDGET_RANGE: {
+            float value = 0;
+            gp_widget_get_value(w, &value);
+            gp_widget_get_range(w, &entry.min, &entry.max, &entry.step);
+            entry.value = boost::lexical_cast<string>(value);
+            break;
+        }
+        default:
+            break;
+    }
+    
+    int count = gp_widget_count_choices(w);
+    for(int i = 0; i < count; i++){
+        const char *choice;
+        if(gp_widget_get_choice(w, i, &choice) < GP_OK)
+            continue;
+        entry.choice_index[choice] = (int)entry.choices.size();
+        entry.choices.push_back(choice);
+    }
+}
+
+void WidgetIndex::_collect(CameraWidget *w, boost::unordered_map<string, CameraWidget *> &widgets){
+    int items = gp_widget_count_children(w);
+    if(items > 0){
+        for(int i = 0; i < items; i++){
+            CameraWidget *child;
+            if(gp_widget_get_child(w, i, &child) >= GP_OK)
+                this->_collect(child, widgets);
+        }
+        return;
+    }
+    
+    const char *name;
+    if(gp_widget_get_name(w, &name) >= GP_OK)
+        widgets[name] = w;
+}
+
+int WidgetIndex::build(Camera *camera, GPContext *ctx){
+    CameraWidget *config;
+    boost::unordered_map<string, CameraWidget *> widgets;
+    
+    this->_entries.clear();
+    int ret;
+    {
+        TraceSpan span("gphoto", "gp_camera_get_config");
+        ret = gp_camera_get_config(camera, &config, ctx);
+    }
+    if(ret < GP_OK)
+        return ret;
+    
+    this->_collect(config, widgets);
+    
+    for(size_t a = 0; a < sizeof(aliases) / sizeof(aliases[0]); a++){
+        for(int n = 0; n < 4 && aliases[a].names[n] != NULL; n++){
+            boost::unordered_map<string, CameraWidget *>::iterator it = widgets.find(aliases[a].names[n]);
+            if(it == widgets.end())
+                continue;
+            
+            CameraWidget *w = it->second;
+            WidgetEntry entry;
+            entry.logical = aliases[a].logical;
+            entry.name = it->first;
+            read_widget(w, entry);
+            this->_entries[entry.logical] = entry;
+            break;
+        }
+    }
+    
+    gp_widget_free(config);
+    return GP_OK;
+}
+
+const WidgetEntry* WidgetIndex::find(const string &logical) const {
+    boost::unordered_map<string, WidgetEntry>::const_iterator it = this->_entries.find(logical);
+    if(it == this->_entries.end())
+        return NULL;
+    return &it->second;
+}
+
+/*
+ * The entry a widget of the body was resolved to, for reporting a change
+ * made by widget name under its logical name. Only a handful of entries.
+ */
+const WidgetEntry* WidgetIndex::find_widget(const string &name) const {
+    for(boost::unordered_map<string, WidgetEntry>::const_iterator it = this->_entries.begin(); it != this->_entries.end(); it++){
+        if(it->second.name == name)
+            return &it->second;
+    }
+    return NULL;
+}
+
+void WidgetIndex::update(const string &logical, const string &value){
+    boost::unordered_map<string, WidgetEntry>::iterator it = this->_entries.find(logical);
+    if(it != this->_entries.end())
+        it->second.value = value;
+}
+
+/*
+ * The choices of aperture and speed change with the lens, the zoom and the
+ * exposure mode, the entry is read again from a widget just fetched.
+ */
+void WidgetIndex::refresh(const string &logical, CameraWidget *w){
+    boost::unordered_map<string, WidgetEntry>::iterator it = this->_entries.find(logical);
+    if(it != this->_entries.end())
+        read_widget(w, it->second);
+}
+
+void WidgetIndex::to_ptree(ptree &tree) const {
+    boost::unordered_map<string, WidgetEntry>::const_iterator it;
+    for(it = this->_entries.begin(); it != this->_entries.end(); ++it){
+        ptree entry, choices;
+        entry.put("widget", it->second.name);
+        entry.put("value",  it->second.value);
+        for(size_t i = 0; i < it->second.choices.size(); i++){
+            ptree choice;
+            choice.put_value(it->second.choices[i]);
+            choices.push_back(std::make_pair("", choice));
+        }
+        entry.put_child("choices", choices);
+        tree.put_child(it->first, entry);
+    }
+}
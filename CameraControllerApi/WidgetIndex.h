@@ -0,0 +1,63 @@
+//
+//  WidgetIndex.h
+//  CameraControllerApi
+//
+//  Copyright (c) 2013 scheck-media. All rights reserved.
+//
+
+#ifndef __CameraControllerApi__WidgetIndex__
+#define __CameraControllerApi__WidgetIndex__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <gphoto2/gphoto2-camera.h>
+#include <boost/unordered_map.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+using std::string;
+using std::vector;
+using boost::property_tree::ptree;
+
+namespace CameraControllerApi {
+
+    struct WidgetEntry {
+        string logical;
+        string name;
+        CameraWidgetType type;
+        string value;
+        float min;
+        float max;
+        float step;
+        vector<string> choices;
+        boost::unordered_map<string, int> choice_index;
+
+        bool accepts(const string &val) const;
+    };
+
+    /*
+     * Maps the logical settings of the api (iso, aperture, speed, ...) to the
+     * widget of the connected body. The vendors name the same setting
+     * differently ("shutterspeed" on Canon, "shutterspeed2" or "f-number" on
+     * Nikon), the aliases are resolved once when the camera connects. The
+     * entries keep type, range and choices, so a value can be checked without
+     * asking the camera; refresh() reads an entry again when they may have
+     * changed.
+     */
+    class WidgetIndex {
+    public:
+        int build(Camera *camera, GPContext *ctx);
+        const WidgetEntry* find(const string &logical) const;
+        const WidgetEntry* find_widget(const string &name) const;
+        void update(const string &logical, const string &value);
+        void refresh(const string &logical, CameraWidget *w);
+        void to_ptree(ptree &tree) const;
+
+    private:
+        boost::unordered_map<string, WidgetEntry> _entries;
+
+        void _collect(CameraWidget *w, boost::unordered_map<string, CameraWidget *> &widgets);
+    };
+}
+
+#endif /* defined(__CameraControllerApi__WidgetIndex__) */
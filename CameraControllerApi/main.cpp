@@ -10,6 +10,8 @@
 #include <signal.h>
 #include <stdlib.h>
 #include "Settings.h"
+#include "Logger.h"
+#include "Tracer.h"
 #include "Server.h"
 #include "CameraController.h"
 #include "Api.h"
@@ -17,29 +19,35 @@
 using namespace CameraControllerApi;
 Server *srv;
 
-void sighandler(int sig){
-    if(srv != NULL)
-        srv->terminate(sig);
-}
-
 int main(int argc, const char * argv[])
 {
-
+    // before the first thread (the logger's) is started
+    Server::block_signals();
+    int status = EXIT_SUCCESS;
+    
     try {
+        Logger::getInstance();
         string port;
         Settings *cfg = Settings::getInstance();
         bool ret = cfg->get_value("server.port", port);
         
         if(ret){
             int http_port = atoi(port.c_str());
+            // returns once the server has been shut down and drained
             srv = new Server(http_port);
-            signal(SIGTERM, sighandler);
+            delete srv;
+            srv = NULL;
+        } else {
+            status = EXIT_FAILURE;
         }
     } catch (std::exception const &e) {
-        std::cout<<"Error: " << e.what();
+        Logger::getInstance()->log(CCA_LOG_ERROR, "main", "error=\"%s\"", e.what());
+        status = EXIT_FAILURE;
     }
     
-    
-    return 0;
+    Tracer::release();
+    // flushes what is still buffered
+    Logger::release();
+    return status;
 }
 
@@ -140,7 +140,18 @@ public class ExampleCameraControllerClient {
 							available = bis.read(size);						
 							int buffersize = ((size[3] & 0xFF) << 24)|((size[2] & 0xFF) << 16)|((size[1] & 0xFF) << 8)|(size[0] & 0xFF);						
 							
-							if(buffersize <= 0) continue;
+							if(buffersize < 0){
+								// analysis metadata (preview.analysis.metadata), json this client does not show
+								byte[] meta = new byte[-buffersize];
+								int read = 0;
+								while(read < meta.length && available != -1){
+									available = bis.read(meta, read, meta.length - read);
+									if(available > 0) read += available;
+								}
+								continue;
+							}
+							// a keepalive, the frame did not change
+							if(buffersize == 0) continue;
 							
 							while((bis.available() <= (buffersize + available)) && liveViewRunning == true){
 								System.out.println("not enough data... buffering");								